@@ -0,0 +1,536 @@
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+// Support code for the sd_bench executable (built with SD_BENCH): latency
+// statistics, process memory and allocation counters, and tiny synthetic
+// MNN models so the harness runs on any host without real weights.
+
+#include <MNN/expr/Expr.hpp>
+#include <MNN/expr/ExprCreator.hpp>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "LaplacianBlend.hpp"
+#include "Quantize.hpp"
+#include "WorkerPool.hpp"
+#include "json.hpp"
+
+namespace bench {
+
+// Heap allocations made by the process so far, or -1 when the C library
+// cannot be interposed. On glibc malloc/calloc/realloc are replaced below;
+// operator new and the xtensor allocators both go through them.
+inline std::atomic<long long> g_allocations{0};
+
+#if defined(__GLIBC__)
+inline constexpr bool kCountsAllocations = true;
+#else
+inline constexpr bool kCountsAllocations = false;
+#endif
+
+inline long long allocationCount() {
+  return kCountsAllocations ? g_allocations.load(std::memory_order_relaxed)
+                            : -1;
+}
+
+// Peak resident set size of the process in KiB (high-water mark).
+inline long peakRssKb() {
+  struct rusage usage {};
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return -1;
+#if defined(__APPLE__)
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+}
+
+// Latency samples for one benchmark configuration, keyed by stage name.
+class StageStats {
+ public:
+  void add(const std::string &stage, double ms) {
+    samples_[stage].push_back(ms);
+  }
+
+  // Nearest-rank percentile, p in [0, 100].
+  static double percentile(std::vector<double> values, double p) {
+    if (values.empty()) return 0.0;
+    std::sort(values.begin(), values.end());
+    size_t rank = (size_t)std::ceil(p / 100.0 * values.size());
+    return values[std::min(values.size(), std::max<size_t>(rank, 1)) - 1];
+  }
+
+  nlohmann::json toJson() const {
+    nlohmann::json out = nlohmann::json::object();
+    for (const auto &[stage, values] : samples_) {
+      double sum = 0.0;
+      for (double v : values) sum += v;
+      out[stage] = {{"count", values.size()},
+                    {"mean", sum / values.size()},
+                    {"p50", percentile(values, 50)},
+                    {"p95", percentile(values, 95)},
+                    {"p99", percentile(values, 99)},
+                    {"max", *std::max_element(values.begin(), values.end())}};
+    }
+    return out;
+  }
+
+ private:
+  std::map<std::string, std::vector<double>> samples_;
+};
+
+// --- Quantization kernels ---
+// Times quant::quantize/dequantize against the scalar reference over the
+// tensor sizes the QNN graphs move per call, and counts results that differ
+// from the reference (expected 0). Inputs include values at rounding ties
+// and outside the encoding range.
+
+template <typename T>
+inline nlohmann::json benchQuantKernel(const char *name, size_t count,
+                                       int iterations, std::mt19937 &rng) {
+  const quant::Params<T> params(0.0007f, -30000 / (int)sizeof(T));
+  const float lo = (float)params.encoding_min;
+  const float hi = (float)(params.encoding_min + params.encoding_range);
+  std::uniform_real_distribution<float> dist(lo - 1.0f, hi + 1.0f);
+  std::vector<float> src(count);
+  for (size_t i = 0; i < count; ++i)
+    src[i] = i % 7 == 0 ? ((float)(i % 300) + 0.5f + params.offset) *
+                              params.scale
+                        : dist(rng);
+  std::vector<T> q_ref(count), q(count);
+  std::vector<float> f_ref(count), f(count);
+
+  auto time = [&](auto &&fn) {
+    fn();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) fn();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() /
+           ((double)iterations * count);
+  };
+  const double quant_ref_ns = time([&] {
+    quant::quantizeReference(src.data(), q_ref.data(), count, params);
+  });
+  const double quant_ns =
+      time([&] { quant::quantize(src.data(), q.data(), count, params); });
+  const double dequant_ref_ns = time([&] {
+    quant::dequantizeReference(q_ref.data(), f_ref.data(), count, params);
+  });
+  const double dequant_ns =
+      time([&] { quant::dequantize(q_ref.data(), f.data(), count, params); });
+
+  size_t mismatches = 0;
+  for (size_t i = 0; i < count; ++i) {
+    mismatches += q[i] != q_ref[i];
+    mismatches += std::memcmp(&f[i], &f_ref[i], sizeof(float)) != 0;
+  }
+  return {{"kernel", name},
+          {"elements", count},
+          {"quantize_ns_per_element", quant_ns},
+          {"quantize_reference_ns_per_element", quant_ref_ns},
+          {"dequantize_ns_per_element", dequant_ns},
+          {"dequantize_reference_ns_per_element", dequant_ref_ns},
+          {"mismatches", mismatches}};
+}
+
+inline nlohmann::json benchQuantKernels(int iterations) {
+  std::mt19937 rng(42);
+  // Text embedding, 64x64 latent batch, 512x512 image.
+  const size_t sizes[] = {77 * 768, 2 * 4 * 64 * 64, 3 * 512 * 512};
+  nlohmann::json results = nlohmann::json::array();
+  for (size_t count : sizes) {
+    results.push_back(
+        benchQuantKernel<uint16_t>("ufixed16", count, iterations, rng));
+    results.push_back(
+        benchQuantKernel<uint8_t>("ufixed8", count, iterations, rng));
+  }
+  return results;
+}
+
+// --- Laplacian blend ---
+// Times laplacianPyramidBlend against the direct 5x5 pyramid code it
+// replaced, kept here as the reference, and reports the largest difference
+// between the two outputs. The separable passes only reorder float sums, so
+// it must stay within kBlendTolerance.
+
+inline constexpr float kBlendTolerance = 1e-4f;
+
+inline std::vector<float> referencePyrDown(const std::vector<float> &img,
+                                           int h, int w) {
+  const float kernel[5] = {1.0f / 16, 4.0f / 16, 6.0f / 16, 4.0f / 16,
+                           1.0f / 16};
+  const int new_h = h / 2, new_w = w / 2;
+  std::vector<float> result((size_t)new_h * new_w);
+  for (int y = 0; y < new_h; ++y) {
+    for (int x = 0; x < new_w; ++x) {
+      float val = 0.0f;
+      for (int ky = -2; ky <= 2; ++ky) {
+        for (int kx = -2; kx <= 2; ++kx) {
+          int src_y = std::min(std::max(y * 2 + ky, 0), h - 1);
+          int src_x = std::min(std::max(x * 2 + kx, 0), w - 1);
+          val += img[(size_t)src_y * w + src_x] * kernel[ky + 2] *
+                 kernel[kx + 2];
+        }
+      }
+      result[(size_t)y * new_w + x] = val;
+    }
+  }
+  return result;
+}
+
+inline std::vector<float> referencePyrUp(const std::vector<float> &img,
+                                         int h, int w, int target_h,
+                                         int target_w) {
+  const float kernel[5] = {1.0f / 16, 4.0f / 16, 6.0f / 16, 4.0f / 16,
+                           1.0f / 16};
+  std::vector<float> result((size_t)target_h * target_w);
+  for (int y = 0; y < target_h; ++y) {
+    for (int x = 0; x < target_w; ++x) {
+      float val = 0.0f;
+      for (int ky = -2; ky <= 2; ++ky) {
+        for (int kx = -2; kx <= 2; ++kx) {
+          int src_y = (y - ky) / 2;
+          int src_x = (x - kx) / 2;
+          if ((y - ky) % 2 == 0 && (x - kx) % 2 == 0 && src_y >= 0 &&
+              src_y < h && src_x >= 0 && src_x < w)
+            val += img[(size_t)src_y * w + src_x] * kernel[ky + 2] *
+                   kernel[kx + 2] * 4.0f;
+        }
+      }
+      result[(size_t)y * target_w + x] = val;
+    }
+  }
+  return result;
+}
+
+// One channel: img1 where mask is 0, img2 where it is 1.
+inline std::vector<float> referenceBlendPlane(const float *img1,
+                                              const float *img2,
+                                              const float *mask, int h,
+                                              int w) {
+  const int levels = laplacian_detail::levelCount(h, w);
+  const size_t plane = (size_t)h * w;
+  std::vector<std::vector<float>> g1{{img1, img1 + plane}},
+      g2{{img2, img2 + plane}}, gm{{mask, mask + plane}};
+  std::vector<int> hs{h}, ws{w};
+  for (int i = 1; i < levels; ++i) {
+    g1.push_back(referencePyrDown(g1[i - 1], hs[i - 1], ws[i - 1]));
+    g2.push_back(referencePyrDown(g2[i - 1], hs[i - 1], ws[i - 1]));
+    gm.push_back(referencePyrDown(gm[i - 1], hs[i - 1], ws[i - 1]));
+    hs.push_back(hs[i - 1] / 2);
+    ws.push_back(ws[i - 1] / 2);
+  }
+
+  std::vector<std::vector<float>> blended(levels);
+  for (int i = 0; i < levels; ++i) {
+    std::vector<float> l1 = g1[i], l2 = g2[i];
+    if (i + 1 < levels) {
+      auto up1 = referencePyrUp(g1[i + 1], hs[i + 1], ws[i + 1], hs[i], ws[i]);
+      auto up2 = referencePyrUp(g2[i + 1], hs[i + 1], ws[i + 1], hs[i], ws[i]);
+      for (size_t j = 0; j < l1.size(); ++j) {
+        l1[j] -= up1[j];
+        l2[j] -= up2[j];
+      }
+    }
+    blended[i].resize(l1.size());
+    for (size_t j = 0; j < l1.size(); ++j)
+      blended[i][j] = l1[j] * (1.0f - gm[i][j]) + l2[j] * gm[i][j];
+  }
+
+  std::vector<float> result = blended[levels - 1];
+  for (int i = levels - 2; i >= 0; --i) {
+    result = referencePyrUp(result, hs[i + 1], ws[i + 1], hs[i], ws[i]);
+    for (size_t j = 0; j < result.size(); ++j) result[j] += blended[i][j];
+  }
+  return result;
+}
+
+inline nlohmann::json benchLaplacianBlend(int width, int height,
+                                          int iterations,
+                                          threading::WorkerPool &workers) {
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+  const size_t plane = (size_t)width * height;
+  xt::xarray<float> img1 = xt::empty<float>(std::vector<int>{3, height, width});
+  xt::xarray<float> img2 = xt::empty<float>(std::vector<int>{3, height, width});
+  xt::xarray<float> mask = xt::empty<float>(std::vector<int>{1, height, width});
+  for (size_t i = 0; i < 3 * plane; ++i) {
+    img1.data()[i] = dist(rng);
+    img2.data()[i] = dist(rng);
+  }
+  // Soft-edged disc, as a dilated and feathered inpainting mask.
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      const float r = std::hypot(x - width / 2.0f, y - height / 2.0f) /
+                      (std::min(width, height) / 3.0f);
+      mask.data()[(size_t)y * width + x] =
+          std::min(1.0f, std::max(0.0f, (1.2f - r) * 4.0f));
+    }
+  }
+
+  auto time = [&](auto &&fn) {
+    fn();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) fn();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count() /
+           iterations;
+  };
+  LaplacianBlendScratch scratch;
+  xt::xarray<float> blended;
+  const double blend_ms = time([&] {
+    blended =
+        laplacianPyramidBlend(img1, img2, mask, scratch, &workers, 3);
+  });
+  std::vector<float> reference(3 * plane);
+  const double reference_ms = time([&] {
+    for (int c = 0; c < 3; ++c) {
+      std::vector<float> out =
+          referenceBlendPlane(img1.data() + c * plane, img2.data() + c * plane,
+                              mask.data(), height, width);
+      std::copy(out.begin(), out.end(), reference.begin() + c * plane);
+    }
+  });
+
+  float max_difference = 0.0f;
+  for (size_t i = 0; i < 3 * plane; ++i)
+    max_difference =
+        std::max(max_difference, std::abs(blended.data()[i] - reference[i]));
+  return {{"width", width},
+          {"height", height},
+          {"blend_ms", blend_ms},
+          {"reference_ms", reference_ms},
+          {"max_abs_difference", max_difference},
+          {"within_tolerance", max_difference <= kBlendTolerance}};
+}
+
+inline nlohmann::json benchLaplacianBlends(int iterations) {
+  threading::WorkerPool workers;
+  // Square and landscape outputs, and odd sizes for the edge handling.
+  const int sizes[][2] = {{512, 512}, {768, 512}, {333, 257}};
+  nlohmann::json results = nlohmann::json::array();
+  for (const auto &size : sizes)
+    results.push_back(
+        benchLaplacianBlend(size[0], size[1], iterations, workers));
+  return results;
+}
+
+// --- Synthetic models ---
+// Stand-ins with the same input/output names and shapes as the exported SD
+// graphs. The numbers are meaningless; the cost scales with unet_layers so
+// the pipeline around the models can be profiled without real weights.
+
+inline std::vector<float> randomWeights(std::mt19937 &rng, size_t count,
+                                        float scale) {
+  std::uniform_real_distribution<float> dist(-scale, scale);
+  std::vector<float> weights(count);
+  for (float &w : weights) w = dist(rng);
+  return weights;
+}
+
+inline MNN::Express::VARP conv3x3(std::mt19937 &rng, MNN::Express::VARP x,
+                                  int in_channels, int out_channels) {
+  using namespace MNN::Express;
+  return _Conv(randomWeights(rng, (size_t)out_channels * in_channels * 9,
+                             0.1f),
+               randomWeights(rng, out_channels, 0.01f), x,
+               {in_channels, out_channels}, {3, 3}, SAME);
+}
+
+inline void saveModel(const std::vector<MNN::Express::VARP> &outputs,
+                      const std::filesystem::path &path) {
+  MNN::Express::Variable::save(outputs, path.string().c_str());
+  if (!std::filesystem::exists(path))
+    throw std::runtime_error("Failed to write synthetic model: " +
+                             path.string());
+}
+
+inline void writeSyntheticClip(const std::filesystem::path &path, int dim,
+                               std::mt19937 &rng) {
+  using namespace MNN::Express;
+  VARP ids = _Input({1, 77}, NCHW, halide_type_of<int>());
+  ids->setName("input_ids");
+  VARP scaled = _Cast<float>(ids) * _Scalar<float>(1.0f / 49408.0f);
+  std::vector<float> table = randomWeights(rng, dim, 1.0f);
+  VARP weights =
+      _Const(table.data(), {1, 1, dim}, NCHW, halide_type_of<float>());
+  VARP hidden = _Unsqueeze(scaled, {2}) * weights;
+  hidden->setName("last_hidden_state");
+  saveModel({hidden}, path);
+}
+
+inline void writeSyntheticUnet(const std::filesystem::path &path, int dim,
+                               int layers, std::mt19937 &rng) {
+  using namespace MNN::Express;
+  VARP sample = _Input({2, 4, 64, 64}, NCHW);
+  sample->setName("sample");
+  VARP timestep = _Input({1}, NCHW, halide_type_of<int>());
+  timestep->setName("timestep");
+  VARP hidden = _Input({2, 77, dim}, NCHW);
+  hidden->setName("encoder_hidden_states");
+
+  VARP x = _Convert(sample, NC4HW4);
+  for (int i = 0; i < layers; ++i) x = conv3x3(rng, x, 4, 4);
+  x = _Convert(x, NCHW);
+  // [N, 77, dim] -> [N, 1, 1, 1], broadcast over the latent.
+  VARP cond = _Unsqueeze(_ReduceMean(hidden, {1, 2}, true), {3});
+  VARP t = _Cast<float>(timestep) * _Scalar<float>(1e-4f);
+  VARP out = x + cond * _Scalar<float>(0.01f) + t;
+  out->setName("out_sample");
+  saveModel({out}, path);
+}
+
+// DeepCache graphs for the synthetic UNet: the full one also outputs the
+// features its layers compute, the shallow one runs a single layer on them.
+inline void writeSyntheticDeepCache(const std::filesystem::path &full,
+                                    const std::filesystem::path &shallow,
+                                    int dim, int layers, std::mt19937 &rng) {
+  using namespace MNN::Express;
+  auto inputs = [dim] {
+    VARP sample = _Input({2, 4, 64, 64}, NCHW);
+    sample->setName("sample");
+    VARP timestep = _Input({1}, NCHW, halide_type_of<int>());
+    timestep->setName("timestep");
+    VARP hidden = _Input({2, 77, dim}, NCHW);
+    hidden->setName("encoder_hidden_states");
+    VARP cond = _Unsqueeze(_ReduceMean(hidden, {1, 2}, true), {3});
+    VARP t = _Cast<float>(timestep) * _Scalar<float>(1e-4f);
+    return std::make_pair(sample, cond * _Scalar<float>(0.01f) + t);
+  };
+
+  auto [sample, bias] = inputs();
+  VARP x = _Convert(sample, NC4HW4);
+  for (int i = 0; i < layers; ++i) x = conv3x3(rng, x, 4, 4);
+  VARP features = _Convert(x, NCHW);
+  features->setName("deep_features");
+  VARP out = _Convert(conv3x3(rng, x, 4, 4), NCHW) + bias;
+  out->setName("out_sample");
+  saveModel({out, features}, full);
+
+  auto [shallow_sample, shallow_bias] = inputs();
+  VARP cached = _Input({2, 4, 64, 64}, NCHW);
+  cached->setName("deep_features");
+  VARP mixed = cached + shallow_sample * _Scalar<float>(0.01f);
+  VARP shallow_out =
+      _Convert(conv3x3(rng, _Convert(mixed, NC4HW4), 4, 4), NCHW) +
+      shallow_bias;
+  shallow_out->setName("out_sample");
+  saveModel({shallow_out}, shallow);
+}
+
+inline void writeSyntheticVaeDecoder(const std::filesystem::path &path,
+                                     std::mt19937 &rng) {
+  using namespace MNN::Express;
+  VARP latent = _Input({1, 4, 64, 64}, NCHW);
+  latent->setName("latent_sample");
+  VARP x = conv3x3(rng, _Convert(latent, NC4HW4), 4, 3);
+  x = _Interp({x}, 8.0f, 8.0f, 0, 0, 2, false);
+  VARP pixels = _Tanh(_Convert(x, NCHW));
+  pixels->setName("sample");
+  saveModel({pixels}, path);
+}
+
+inline void writeSyntheticVaeEncoder(const std::filesystem::path &path,
+                                     std::mt19937 &rng) {
+  using namespace MNN::Express;
+  VARP image = _Input({1, 3, 512, 512}, NCHW);
+  image->setName("input");
+  VARP x = _AvePool(_Convert(image, NC4HW4), {8, 8}, {8, 8});
+  VARP mean = _Convert(conv3x3(rng, x, 3, 4), NCHW);
+  mean->setName("mean");
+  VARP std_dev =
+      _Abs(_Convert(conv3x3(rng, x, 3, 4), NCHW)) * _Scalar<float>(0.1f);
+  std_dev->setName("std");
+  saveModel({mean, std_dev}, path);
+}
+
+// A word-level tokenizer covering the benchmark prompts.
+inline void writeSyntheticTokenizer(const std::filesystem::path &path) {
+  const std::vector<std::string> words = {
+      "<unk>", "a",  "photo", "of",     "cat", "dog",     "in", "the",
+      "city",  "at", "night", "blurry", "low", "quality", ","};
+  nlohmann::json vocab = nlohmann::json::object();
+  int id = 0;
+  for (const auto &word : words) vocab[word] = id++;
+  nlohmann::json tokenizer = {
+      {"version", "1.0"},
+      {"truncation", nullptr},
+      {"padding", nullptr},
+      {"added_tokens", nlohmann::json::array()},
+      {"normalizer", {{"type", "Lowercase"}}},
+      {"pre_tokenizer", {{"type", "Whitespace"}}},
+      {"post_processor", nullptr},
+      {"decoder", nullptr},
+      {"model",
+       {{"type", "WordLevel"}, {"vocab", vocab}, {"unk_token", "<unk>"}}}};
+  std::ofstream(path) << tokenizer.dump();
+}
+
+// Writes clip.mnn, unet.mnn, vae_decoder.mnn, vae_encoder.mnn,
+// tokenizer.json and the DeepCache graphs with their deepcache.json into
+// dir, skipping files that already exist.
+inline void writeSyntheticModels(const std::filesystem::path &dir,
+                                 int text_dim, int unet_layers) {
+  std::filesystem::create_directories(dir);
+  std::mt19937 rng(42);
+  if (!std::filesystem::exists(dir / "clip.mnn"))
+    writeSyntheticClip(dir / "clip.mnn", text_dim, rng);
+  if (!std::filesystem::exists(dir / "unet.mnn"))
+    writeSyntheticUnet(dir / "unet.mnn", text_dim, unet_layers, rng);
+  if (!std::filesystem::exists(dir / "vae_decoder.mnn"))
+    writeSyntheticVaeDecoder(dir / "vae_decoder.mnn", rng);
+  if (!std::filesystem::exists(dir / "vae_encoder.mnn"))
+    writeSyntheticVaeEncoder(dir / "vae_encoder.mnn", rng);
+  if (!std::filesystem::exists(dir / "tokenizer.json"))
+    writeSyntheticTokenizer(dir / "tokenizer.json");
+  if (!std::filesystem::exists(dir / "deepcache.json")) {
+    writeSyntheticDeepCache(dir / "unet_full.mnn", dir / "unet_shallow.mnn",
+                            text_dim, unet_layers, rng);
+    std::ofstream(dir / "deepcache.json")
+        << nlohmann::json{{"full", "unet_full.mnn"},
+                          {"shallow", "unet_shallow.mnn"}}
+               .dump();
+  }
+}
+
+}  // namespace bench
+
+#if defined(__GLIBC__)
+// Count every heap allocation by interposing the C allocator. Only sd_bench
+// includes this header, so the server keeps the stock allocator.
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) noexcept {
+  bench::g_allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) noexcept {
+  bench::g_allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) noexcept {
+  bench::g_allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+}
+#endif
+
+#endif  // BENCH_HPP
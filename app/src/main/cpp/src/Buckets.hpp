@@ -0,0 +1,77 @@
+#ifndef BUCKETS_HPP
+#define BUCKETS_HPP
+
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Output sizes the server is prepared for (--buckets). Their sessions are
+// resized and their OpenCL tuning caches written ahead of the first
+// request, and a request for any other size is snapped to the nearest
+// bucket, so no request pays for a shape it is the first to use.
+struct Resolution {
+  int width = 0;
+  int height = 0;
+
+  bool operator==(const Resolution &other) const {
+    return width == other.width && height == other.height;
+  }
+};
+
+class ResolutionBuckets {
+ public:
+  // Comma-separated WxH items, e.g. "512x512,512x768,768x512". Sides must
+  // be multiples of 64 so that the UNet's latent halves three times.
+  void parse(const std::string &spec) {
+    std::vector<Resolution> buckets;
+    size_t pos = 0;
+    while (pos < spec.size()) {
+      size_t end = spec.find(',', pos);
+      if (end == std::string::npos) end = spec.size();
+      const std::string item = spec.substr(pos, end - pos);
+      pos = end + 1;
+      if (item.empty()) continue;
+      Resolution size;
+      char extra;
+      if (sscanf(item.c_str(), "%dx%d%c", &size.width, &size.height,
+                 &extra) != 2 ||
+          size.width <= 0 || size.height <= 0 || size.width % 64 != 0 ||
+          size.height % 64 != 0)
+        throw std::invalid_argument("Invalid bucket: " + item);
+      buckets.push_back(size);
+    }
+    buckets_ = std::move(buckets);
+  }
+
+  bool empty() const { return buckets_.empty(); }
+  const std::vector<Resolution> &sizes() const { return buckets_; }
+
+  // The bucket closest in shape to width x height: a difference in aspect
+  // ratio counts twice as much as the same factor in pixel count, so a
+  // portrait request stays portrait. Without buckets every size is taken
+  // as is.
+  Resolution snap(int width, int height) const {
+    Resolution best{width, height};
+    double best_cost = 0.0;
+    const double aspect = std::log((double)width / height);
+    const double area = std::log((double)width * height);
+    for (const Resolution &bucket : buckets_) {
+      const double cost =
+          2.0 * std::fabs(std::log((double)bucket.width / bucket.height) -
+                          aspect) +
+          std::fabs(std::log((double)bucket.width * bucket.height) - area);
+      if (&bucket == &buckets_.front() || cost < best_cost) {
+        best = bucket;
+        best_cost = cost;
+      }
+    }
+    return best;
+  }
+
+ private:
+  std::vector<Resolution> buckets_;
+};
+
+#endif  // BUCKETS_HPP
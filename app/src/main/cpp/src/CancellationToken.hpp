@@ -0,0 +1,64 @@
+#ifndef CANCELLATION_TOKEN_HPP
+#define CANCELLATION_TOKEN_HPP
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+// Thrown out of the generation pipeline once its token has been cancelled.
+struct GenerationCancelled : public std::runtime_error {
+  GenerationCancelled() : std::runtime_error("Generation cancelled") {}
+};
+
+// Cooperative cancellation flag. Any thread may cancel; the pipeline polls it
+// at stage boundaries (UNet steps, VAE tiles) and unwinds by throwing, so the
+// usual RAII guards release lowram models and MNN sessions.
+class CancellationToken {
+ public:
+  void cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+  bool isCancelled() const {
+    return cancelled_.load(std::memory_order_relaxed);
+  }
+  void throwIfCancelled() const {
+    if (isCancelled()) throw GenerationCancelled();
+  }
+
+ private:
+  std::atomic<bool> cancelled_{false};
+};
+
+// The tokens of the requests accepted and not yet finished, by request id,
+// whether their generation runs or still waits to start, so a cancel reaches
+// either.
+class CancellationRegistry {
+ public:
+  std::shared_ptr<CancellationToken> add(const std::string &id) {
+    auto token = std::make_shared<CancellationToken>();
+    std::lock_guard<std::mutex> lock(mutex_);
+    tokens_[id] = token;
+    return token;
+  }
+
+  void remove(const std::string &id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tokens_.erase(id);
+  }
+
+  // Cancels the request with this id; false if there is none.
+  bool cancel(const std::string &id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = tokens_.find(id);
+    if (it == tokens_.end()) return false;
+    it->second->cancel();
+    return true;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::map<std::string, std::shared_ptr<CancellationToken>> tokens_;
+};
+
+#endif  // CANCELLATION_TOKEN_HPP
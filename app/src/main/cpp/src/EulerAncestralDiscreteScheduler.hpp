@@ -204,9 +204,7 @@ class EulerAncestralDiscreteScheduler : public Scheduler {
     xt::xarray<float> prev_sample = sample + derivative * dt;
 
     // Add noise (ancestral sampling) - always add noise like PyTorch version
-    xt::xarray<float> noise =
-        xt::random::randn<float>(model_output.shape(), 0.0f, 1.0f,
-                                 xt::random::get_default_random_engine());
+    xt::xarray<float> noise = sample_noise(model_output.shape());
     prev_sample = prev_sample + noise * sigma_up;
 
     step_index_ = step_index_.value() + 1;
@@ -0,0 +1,300 @@
+#ifndef GRAPH_IO_HPP
+#define GRAPH_IO_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "FloatConversion.hpp"
+#include "Quantize.hpp"
+#include "Trace.hpp"
+
+// Moves data between caller buffers and the client buffers of a compiled
+// graph. Tensors are described once when the graph is bound, with their
+// quantization parameters precomputed, so a call quantizes straight into
+// the graph's input buffers and dequantizes straight into the caller's
+// output buffers: no per-call allocation and no intermediate copy. Nothing
+// here depends on the QNN SDK; QnnModel describes its tensors, and any host
+// buffers can stand in for them.
+namespace graphio {
+
+enum class Encoding {
+  kFloat32,
+  kFloat16,
+  kUfixed8,   // (q + offset) * scale
+  kUfixed16,  // (q + offset) * scale
+  kInt32,
+  kUnsupported
+};
+
+struct TensorInfo {
+  std::string name;
+  Encoding encoding = Encoding::kUnsupported;
+  float scale = 1.0f;
+  int32_t offset = 0;
+  size_t elements = 0;
+  void *data = nullptr;  // client buffer, owned by the graph
+};
+
+// A caller buffer for one graph tensor. The tensor is looked up by name and
+// falls back to index when the graph does not carry that name, so callers
+// keep working with converters that rename tensors.
+struct Input {
+  const char *name;
+  int index;
+  const void *data;
+  bool int32 = false;  // data holds int32_t instead of float
+  // data does not change while a resident scope is open (see
+  // GraphIO::beginResident), so it is converted once and reused.
+  bool resident = false;
+};
+
+struct Output {
+  const char *name;
+  int index;
+  float *data;
+};
+
+inline Input in(const char *name, int index, const float *data) {
+  return {name, index, data, false};
+}
+
+inline Input in(const char *name, int index, const int32_t *data) {
+  return {name, index, data, true};
+}
+
+inline Input resident(const char *name, int index, const float *data) {
+  return {name, index, data, false, true};
+}
+
+inline Output out(const char *name, int index, float *data) {
+  return {name, index, data};
+}
+
+class GraphIO {
+ public:
+  bool bound() const { return !inputs_.empty() || !outputs_.empty(); }
+
+  void bind(const std::vector<TensorInfo> &inputs,
+            const std::vector<TensorInfo> &outputs) {
+    endResident();
+    inputs_ = std::vector<Tensor>(inputs.begin(), inputs.end());
+    written_.assign(inputs_.size(), false);
+    outputs_ = std::vector<Tensor>(outputs.begin(), outputs.end());
+  }
+
+  // Between beginResident and endResident, resident inputs are converted the
+  // first time each caller buffer is seen and kept in graph encoding. Later
+  // writes of the same buffer copy the cached bytes, or skip the copy when
+  // the graph buffer still holds them; a UNet with classifier-free guidance
+  // alternates two prompt embeddings, so both stay cached. Outside a scope
+  // resident inputs are converted on every call like any other input.
+  void beginResident() {
+    endResident();
+    resident_scope_ = true;
+  }
+
+  void endResident() {
+    resident_scope_ = false;
+    cache_.clear();
+    for (Tensor &tensor : inputs_) tensor.holds = nullptr;
+  }
+
+  // Fills every graph input. Returns false and sets error if a binding
+  // does not resolve, a tensor encoding is not supported, or a graph input
+  // is left without a binding, which would execute it on stale data.
+  bool writeInputs(const std::vector<Input> &inputs, std::string *error) {
+    written_.assign(inputs_.size(), false);
+    for (const Input &input : inputs) {
+      Tensor *tensor = find(inputs_, input.name, input.index);
+      if (!tensor) return fail(error, "no graph input", input.name);
+      bool written = resident_scope_ && input.resident
+                         ? writeResident(*tensor, input)
+                         : write(*tensor, input);
+      if (!written)
+        return fail(error, "unsupported encoding for input", input.name);
+      written_[tensor - inputs_.data()] = true;
+    }
+    for (size_t i = 0; i < inputs_.size(); ++i) {
+      if (!written_[i])
+        return fail(error, "no binding for graph input",
+                    inputs_[i].name.c_str());
+    }
+    return true;
+  }
+
+  // Converts graph outputs into the caller's float buffers, which must hold
+  // the tensor's element count.
+  bool readOutputs(const std::vector<Output> &outputs, std::string *error) {
+    for (const Output &output : outputs) {
+      Tensor *tensor = find(outputs_, output.name, output.index);
+      if (!tensor) return fail(error, "no graph output", output.name);
+      if (!read(*tensor, output.data))
+        return fail(error, "unsupported encoding for output", output.name);
+    }
+    return true;
+  }
+
+ private:
+  struct Tensor : TensorInfo {
+    quant::Params<uint8_t> u8;
+    quant::Params<uint16_t> u16;
+
+    // Resident caller buffer currently in data, if any.
+    const void *holds = nullptr;
+
+    explicit Tensor(const TensorInfo &info)
+        : TensorInfo(info), u8(scale, offset), u16(scale, offset) {}
+
+    size_t bytes() const {
+      switch (encoding) {
+        case Encoding::kFloat16:
+        case Encoding::kUfixed16:
+          return elements * 2;
+        case Encoding::kUfixed8:
+          return elements;
+        default:
+          return elements * 4;
+      }
+    }
+  };
+
+  // A resident input already converted to its tensor's encoding.
+  struct Cached {
+    const Tensor *tensor;
+    const void *source;
+    std::vector<uint8_t> bytes;
+  };
+
+  static Tensor *find(std::vector<Tensor> &tensors, const char *name,
+                      int index) {
+    if (name) {
+      for (Tensor &tensor : tensors)
+        if (tensor.name == name) return &tensor;
+    }
+    if (index >= 0 && index < (int)tensors.size()) return &tensors[index];
+    return nullptr;
+  }
+
+  static bool fail(std::string *error, const char *what, const char *name) {
+    if (error) *error = std::string(what) + " '" + (name ? name : "") + "'";
+    return false;
+  }
+
+  bool writeResident(Tensor &t, const Input &input) {
+    if (t.holds == input.data) return true;
+    for (const Cached &cached : cache_) {
+      if (cached.tensor == &t && cached.source == input.data) {
+        TRACE_SCOPE("memcpy", "qnn");
+        memcpy(t.data, cached.bytes.data(), cached.bytes.size());
+        t.holds = input.data;
+        return true;
+      }
+    }
+    if (!write(t, input)) return false;
+    const uint8_t *converted = static_cast<const uint8_t *>(t.data);
+    cache_.push_back(
+        {&t, input.data,
+         std::vector<uint8_t>(converted, converted + t.bytes())});
+    t.holds = input.data;
+    return true;
+  }
+
+  static bool write(Tensor &t, const Input &input) {
+    t.holds = nullptr;
+    if (input.int32) {
+      TRACE_SCOPE("memcpy", "qnn");
+      const int32_t *src = static_cast<const int32_t *>(input.data);
+      if (t.encoding == Encoding::kInt32) {
+        memcpy(t.data, src, t.elements * sizeof(int32_t));
+      } else if (t.encoding == Encoding::kFloat32) {
+        float *dst = static_cast<float *>(t.data);
+        for (size_t i = 0; i < t.elements; ++i) dst[i] = (float)src[i];
+      } else {
+        return false;
+      }
+      return true;
+    }
+
+    const float *src = static_cast<const float *>(input.data);
+    switch (t.encoding) {
+      case Encoding::kFloat32: {
+        TRACE_SCOPE("memcpy", "qnn");
+        memcpy(t.data, src, t.elements * sizeof(float));
+        return true;
+      }
+      case Encoding::kFloat16: {
+        TRACE_SCOPE("quantize", "qnn");
+        uint16_t *dst = static_cast<uint16_t *>(t.data);
+        for (size_t i = 0; i < t.elements; ++i) dst[i] = fp32_to_fp16(src[i]);
+        return true;
+      }
+      case Encoding::kUfixed8: {
+        TRACE_SCOPE("quantize", "qnn");
+        quant::quantize(src, static_cast<uint8_t *>(t.data), t.elements, t.u8);
+        return true;
+      }
+      case Encoding::kUfixed16: {
+        TRACE_SCOPE("quantize", "qnn");
+        quant::quantize(src, static_cast<uint16_t *>(t.data), t.elements,
+                        t.u16);
+        return true;
+      }
+      case Encoding::kInt32: {
+        TRACE_SCOPE("memcpy", "qnn");
+        int32_t *dst = static_cast<int32_t *>(t.data);
+        for (size_t i = 0; i < t.elements; ++i) dst[i] = (int32_t)src[i];
+        return true;
+      }
+      default:
+        return false;
+    }
+  }
+
+  static bool read(const Tensor &t, float *dst) {
+    switch (t.encoding) {
+      case Encoding::kFloat32: {
+        TRACE_SCOPE("memcpy", "qnn");
+        memcpy(dst, t.data, t.elements * sizeof(float));
+        return true;
+      }
+      case Encoding::kFloat16: {
+        TRACE_SCOPE("dequantize", "qnn");
+        const uint16_t *src = static_cast<const uint16_t *>(t.data);
+        for (size_t i = 0; i < t.elements; ++i) dst[i] = fp16_to_fp32(src[i]);
+        return true;
+      }
+      case Encoding::kUfixed8: {
+        TRACE_SCOPE("dequantize", "qnn");
+        quant::dequantize(static_cast<const uint8_t *>(t.data), dst, t.elements,
+                          t.u8);
+        return true;
+      }
+      case Encoding::kUfixed16: {
+        TRACE_SCOPE("dequantize", "qnn");
+        quant::dequantize(static_cast<const uint16_t *>(t.data), dst,
+                          t.elements, t.u16);
+        return true;
+      }
+      case Encoding::kInt32: {
+        TRACE_SCOPE("memcpy", "qnn");
+        const int32_t *src = static_cast<const int32_t *>(t.data);
+        for (size_t i = 0; i < t.elements; ++i) dst[i] = (float)src[i];
+        return true;
+      }
+      default:
+        return false;
+    }
+  }
+
+  std::vector<Tensor> inputs_;
+  std::vector<Tensor> outputs_;
+  std::vector<bool> written_;  // per input, during writeInputs
+  bool resident_scope_ = false;
+  std::vector<Cached> cache_;
+};
+
+}  // namespace graphio
+
+#endif  // GRAPH_IO_HPP
@@ -0,0 +1,98 @@
+#ifndef INFERENCE_BACKEND_HPP
+#define INFERENCE_BACKEND_HPP
+
+#include <cstdint>
+
+namespace threading {
+class ThreadConfig;
+}
+
+// Runs the model graphs of the diffusion pipeline. generateImage keeps the
+// control flow (CFG, scheduling, batching, tiling); a backend only executes
+// the text encoder, UNet and VAE on flat float32 NCHW buffers and throws
+// std::runtime_error on failure.
+class InferenceBackend {
+ public:
+  // One UNet evaluation over 2 * batch rows: the unconditional rows first,
+  // then the conditional ones.
+  struct UnetStep {
+    const float *latents;  // [2 * batch, 4, h / 8, w / 8]
+    float *noise_pred;     // same layout as latents
+    int batch;
+    int timestep;
+    // cfg == 1: only the conditional half of noise_pred is read afterwards.
+    bool skip_uncond;
+    // Conditioning; the buffers and their contents stay the same for every
+    // step between beginUnet and endUnet, so backends may convert and
+    // upload them once per request.
+    // [2, 77, dim]: negative prompt, then positive prompt.
+    const float *hidden_states;
+    // SDXL only, nullptr otherwise: pooled [2, 1280] and time ids [2, 6].
+    const float *text_embeds;
+    const float *time_ids;
+    // DeepCache: the deep UNet features of the last full evaluation may be
+    // reused, so only the shallow blocks run. Backends without cached
+    // features run the whole UNet.
+    bool reuse_features = false;
+  };
+
+  // Settings of one request. A backend applies them to that request's calls
+  // only, never to the backend itself, and ignores the ones it does not
+  // support.
+  struct RequestOptions {
+    bool use_opencl = false;  // MNN: OpenCL instead of the CPU
+    bool deep_cache = false;  // MNN: the DeepCache graphs, when set
+    // Thread counts and core affinity; nullptr for the backend's default.
+    const threading::ThreadConfig *threads = nullptr;
+  };
+
+  virtual ~InferenceBackend() = default;
+
+  virtual const char *name() const = 0;
+
+  // Encodes count 77-token prompts into out [count, 77, dim]. ids holds the
+  // token ids and token_embeddings the matching [count, 77, 768] input
+  // embeddings; each graph reads whichever it was exported with.
+  virtual void encodeText(const int32_t *ids, const float *token_embeddings,
+                          int count, float *out,
+                          const RequestOptions &options) = 0;
+
+  // Bracket the denoising loop of one request at width x height pixels.
+  virtual void beginUnet(int rows, int width, int height,
+                         const RequestOptions &options) {}
+  virtual void runUnet(const UnetStep &step) = 0;
+  virtual void endUnet() {}
+
+  // image [1, 3, height, width] -> latent mean and std [1, 4, h / 8, w / 8].
+  virtual void encodeImage(const float *image, int width, int height,
+                           float *mean, float *std_dev,
+                           const RequestOptions &options) = 0;
+
+  // Bracket the VAE decodes of one request; decodeLatents may also be called
+  // for tiles smaller than width x height.
+  virtual void beginDecode(int width, int height,
+                           const RequestOptions &options) {}
+  virtual void decodeLatents(const float *latents, int width, int height,
+                             float *pixels) = 0;
+  virtual void endDecode() {}
+
+  // Hints that beginUnet or beginDecode follows soon, so a backend that
+  // loads its models on demand can start reading them in the background.
+  virtual void prefetchUnet() {}
+  virtual void prefetchDecoder() {}
+
+  // Largest image edge the VAE graphs take in one call. Larger images are
+  // split into tiles of this size by the caller; 0 means no limit.
+  virtual int vaeTileSize() const { return 0; }
+
+  // Size in pixels of a UNet graph that takes only one size; 0 x 0 when it
+  // takes any. Larger images are denoised in overlapping windows of this
+  // size by the caller.
+  struct GraphSize {
+    int width = 0;
+    int height = 0;
+  };
+  virtual GraphSize unetTileSize() { return {}; }
+};
+
+#endif  // INFERENCE_BACKEND_HPP
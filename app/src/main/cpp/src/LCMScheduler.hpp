@@ -182,9 +182,7 @@ class LCMScheduler : public Scheduler {
     // Noise is not used on the final timestep of the timestep schedule.
     xt::xarray<float> prev_sample;
     if (step_index_.value() != int(timesteps_.size()) - 1) {
-      xt::xarray<float> noise =
-          xt::random::randn<float>(model_output.shape(), 0.0f, 1.0f,
-                                   xt::random::get_default_random_engine());
+      xt::xarray<float> noise = sample_noise(model_output.shape());
       prev_sample = std::sqrt(alpha_prod_t_prev) * denoised +
                     std::sqrt(beta_prod_t_prev) * noise;
     } else {
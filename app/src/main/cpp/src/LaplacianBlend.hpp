@@ -8,34 +8,250 @@
 #include <xtensor/xarray.hpp>
 #include <xtensor/xview.hpp>
 
+#include "WorkerPool.hpp"
+
+// Gaussian/Laplacian pyramids with the 5-tap binomial kernel
+// {1, 4, 6, 4, 1} / 16. Both resampling steps are separable: a horizontal
+// pass into a row buffer, then a vertical pass whose inner loop runs over
+// contiguous x. pyrUp is polyphase, so each output only visits the taps that
+// land on source samples (3 for even positions, 2 for odd ones).
+namespace laplacian_detail {
+
+inline int clampIndex(int i, int n) { return std::min(std::max(i, 0), n - 1); }
+
+// src (h x w) -> dst (h/2 x w/2), edges clamped. tmp holds h * (w/2) floats.
+inline void pyrDownPlane(const float *src, int h, int w, float *dst,
+                         float *tmp) {
+  const int new_h = h / 2;
+  const int new_w = w / 2;
+  const float k0 = 1.0f / 16, k1 = 4.0f / 16, k2 = 6.0f / 16;
+
+  // Columns whose taps 2x-2 .. 2x+2 are all inside the row.
+  const int x_begin = std::min(1, new_w);
+  const int x_end = std::max(x_begin, std::min(new_w, (w - 3) / 2 + 1));
+
+  for (int y = 0; y < h; ++y) {
+    const float *s = src + (size_t)y * w;
+    float *t = tmp + (size_t)y * new_w;
+    for (int x = 0; x < x_begin; ++x) {
+      const int c = 2 * x;
+      t[x] = k0 * s[clampIndex(c - 2, w)] + k1 * s[clampIndex(c - 1, w)] +
+             k2 * s[c] + k1 * s[clampIndex(c + 1, w)] +
+             k0 * s[clampIndex(c + 2, w)];
+    }
+    for (int x = x_begin; x < x_end; ++x) {
+      const float *p = s + 2 * x;
+      t[x] = k0 * (p[-2] + p[2]) + k1 * (p[-1] + p[1]) + k2 * p[0];
+    }
+    for (int x = x_end; x < new_w; ++x) {
+      const int c = 2 * x;
+      t[x] = k0 * s[clampIndex(c - 2, w)] + k1 * s[clampIndex(c - 1, w)] +
+             k2 * s[c] + k1 * s[clampIndex(c + 1, w)] +
+             k0 * s[clampIndex(c + 2, w)];
+    }
+  }
+
+  for (int y = 0; y < new_h; ++y) {
+    const int c = 2 * y;
+    const float *r0 = tmp + (size_t)clampIndex(c - 2, h) * new_w;
+    const float *r1 = tmp + (size_t)clampIndex(c - 1, h) * new_w;
+    const float *r2 = tmp + (size_t)c * new_w;
+    const float *r3 = tmp + (size_t)clampIndex(c + 1, h) * new_w;
+    const float *r4 = tmp + (size_t)clampIndex(c + 2, h) * new_w;
+    float *d = dst + (size_t)y * new_w;
+    for (int x = 0; x < new_w; ++x) {
+      d[x] = k0 * (r0[x] + r4[x]) + k1 * (r1[x] + r3[x]) + k2 * r2[x];
+    }
+  }
+}
+
+// src (h x w) -> dst (target_h x target_w), zero outside the source.
+// tmp holds (h + 1) * target_w floats; the extra row is the zero padding.
+// With accumulate, dst += result.
+inline void pyrUpPlane(const float *src, int h, int w, float *dst,
+                       int target_h, int target_w, float *tmp,
+                       bool accumulate) {
+  // 4 * k[ky] * k[kx] splits into (2 * k) per axis.
+  const float even_side = 2.0f / 16, even_mid = 12.0f / 16;
+  const float odd_tap = 8.0f / 16;
+
+  auto at = [w](const float *s, int i) {
+    return i >= 0 && i < w ? s[i] : 0.0f;
+  };
+
+  // Output columns 2m / 2m+1 whose source taps m-1 .. m+1 are in range.
+  const int m_begin = std::min(1, w);
+  const int m_end = std::max(m_begin, std::min(w - 1, (target_w - 1) / 2 + 1));
+
+  for (int y = 0; y < h; ++y) {
+    const float *s = src + (size_t)y * w;
+    float *t = tmp + (size_t)y * target_w;
+    for (int x = 0; x < std::min(2 * m_begin, target_w); ++x) {
+      const int m = x / 2;
+      t[x] = (x & 1) ? odd_tap * (at(s, m) + at(s, m + 1))
+                     : even_side * (at(s, m - 1) + at(s, m + 1)) +
+                           even_mid * at(s, m);
+    }
+    for (int m = m_begin; m < m_end; ++m) {
+      const float *p = s + m;
+      t[2 * m] = even_side * (p[-1] + p[1]) + even_mid * p[0];
+      if (2 * m + 1 < target_w) t[2 * m + 1] = odd_tap * (p[0] + p[1]);
+    }
+    for (int x = 2 * m_end; x < target_w; ++x) {
+      const int m = x / 2;
+      t[x] = (x & 1) ? odd_tap * (at(s, m) + at(s, m + 1))
+                     : even_side * (at(s, m - 1) + at(s, m + 1)) +
+                           even_mid * at(s, m);
+    }
+  }
+
+  float *zero_row = tmp + (size_t)h * target_w;
+  std::fill(zero_row, zero_row + target_w, 0.0f);
+  auto row = [&](int i) -> const float * {
+    return i >= 0 && i < h ? tmp + (size_t)i * target_w : zero_row;
+  };
+
+  for (int y = 0; y < target_h; ++y) {
+    const int m = y / 2;
+    float *d = dst + (size_t)y * target_w;
+    if (y & 1) {
+      const float *a = row(m);
+      const float *b = row(m + 1);
+      if (accumulate) {
+        for (int x = 0; x < target_w; ++x) d[x] += odd_tap * (a[x] + b[x]);
+      } else {
+        for (int x = 0; x < target_w; ++x) d[x] = odd_tap * (a[x] + b[x]);
+      }
+    } else {
+      const float *a = row(m - 1);
+      const float *b = row(m);
+      const float *c = row(m + 1);
+      if (accumulate) {
+        for (int x = 0; x < target_w; ++x)
+          d[x] += even_side * (a[x] + c[x]) + even_mid * b[x];
+      } else {
+        for (int x = 0; x < target_w; ++x)
+          d[x] = even_side * (a[x] + c[x]) + even_mid * b[x];
+      }
+    }
+  }
+}
+
+// Pyramid levels for an h x w image: about log2(min side) - 3, with the
+// coarsest level at least 4 pixels on its short side.
+inline int levelCount(int h, int w) {
+  int min_size = std::min(h, w);
+  int num_levels = std::floor(std::log2(min_size)) - 3;
+  num_levels = std::max(num_levels, 2);
+
+  while ((min_size >> num_levels) < 4) {
+    num_levels--;
+  }
+  return std::max(num_levels, 1);
+}
+
+// Level sizes and offsets of a single-plane pyramid stored contiguously.
+struct PyramidLayout {
+  std::vector<int> heights, widths;
+  std::vector<size_t> offsets;
+  size_t total = 0;
+
+  PyramidLayout(int h, int w, int levels) {
+    for (int i = 0; i < levels; ++i) {
+      heights.push_back(h);
+      widths.push_back(w);
+      offsets.push_back(total);
+      total += (size_t)h * w;
+      h /= 2;
+      w /= 2;
+    }
+  }
+};
+
+// Per-channel buffers.
+struct PlaneScratch {
+  std::vector<float> pyr1, pyr2, tmp;
+};
+
+inline void buildGaussian(float *pyr, const PyramidLayout &l, float *tmp) {
+  for (size_t i = 1; i < l.offsets.size(); ++i) {
+    pyrDownPlane(pyr + l.offsets[i - 1], l.heights[i - 1], l.widths[i - 1],
+                 pyr + l.offsets[i], tmp);
+  }
+}
+
+// Turns a Gaussian pyramid into a Laplacian one in place: level i becomes
+// G[i] - pyrUp(G[i + 1]), and the coarsest level is kept as is.
+inline void gaussianToLaplacian(float *pyr, const PyramidLayout &l,
+                                float *tmp, float *up) {
+  for (size_t i = 0; i + 1 < l.offsets.size(); ++i) {
+    const int h = l.heights[i], w = l.widths[i];
+    pyrUpPlane(pyr + l.offsets[i + 1], l.heights[i + 1], l.widths[i + 1], up,
+               h, w, tmp, false);
+    float *g = pyr + l.offsets[i];
+    const size_t n = (size_t)h * w;
+    for (size_t j = 0; j < n; ++j) g[j] -= up[j];
+  }
+}
+
+inline void blendPlane(const float *img1, const float *img2,
+                       const float *mask_pyr, const PyramidLayout &l,
+                       PlaneScratch &s, float *out) {
+  const size_t plane = (size_t)l.heights[0] * l.widths[0];
+  s.pyr1.resize(l.total);
+  s.pyr2.resize(l.total);
+  // One plane bounds every separable intermediate (levels have h >= 4);
+  // a second one holds the pyrUp output.
+  s.tmp.resize(2 * plane);
+  float *tmp = s.tmp.data();
+  float *up = s.tmp.data() + plane;
+
+  std::copy(img1, img1 + plane, s.pyr1.begin());
+  std::copy(img2, img2 + plane, s.pyr2.begin());
+  buildGaussian(s.pyr1.data(), l, tmp);
+  buildGaussian(s.pyr2.data(), l, tmp);
+  gaussianToLaplacian(s.pyr1.data(), l, tmp, up);
+  gaussianToLaplacian(s.pyr2.data(), l, tmp, up);
+
+  // Blend into pyr1.
+  for (size_t j = 0; j < l.total; ++j) {
+    s.pyr1[j] = s.pyr1[j] * (1.0f - mask_pyr[j]) + s.pyr2[j] * mask_pyr[j];
+  }
+
+  // Collapse from the coarsest level, accumulating into the finer one.
+  for (int i = (int)l.offsets.size() - 2; i >= 0; --i) {
+    pyrUpPlane(s.pyr1.data() + l.offsets[i + 1], l.heights[i + 1],
+               l.widths[i + 1], s.pyr1.data() + l.offsets[i], l.heights[i],
+               l.widths[i], tmp, true);
+  }
+  std::copy(s.pyr1.begin(), s.pyr1.begin() + plane, out);
+}
+
+}  // namespace laplacian_detail
+
+// Buffers for laplacianPyramidBlend, owned by the caller. Blends of one size
+// through the same scratch allocate nothing but their result; the memory is
+// freed with the scratch, e.g. at the end of the request.
+struct LaplacianBlendScratch {
+  std::vector<float> mask_pyr, mask_tmp;
+  std::vector<laplacian_detail::PlaneScratch> planes;
+};
+
 inline xt::xarray<float> pyrDown(const xt::xarray<float> &img) {
   auto shape = img.shape();
+  int channels = shape[0];
   int h = shape[1];
   int w = shape[2];
   int new_h = h / 2;
   int new_w = w / 2;
 
-  std::vector<float> kernel = {1.0f / 16, 4.0f / 16, 6.0f / 16, 4.0f / 16,
-                               1.0f / 16};
-
-  int channels = shape[0];
   std::vector<int> result_shape = {channels, new_h, new_w};
   xt::xarray<float> result = xt::zeros<float>(result_shape);
-
+  std::vector<float> tmp((size_t)h * new_w);
   for (int c = 0; c < channels; ++c) {
-    for (int y = 0; y < new_h; ++y) {
-      for (int x = 0; x < new_w; ++x) {
-        float val = 0.0f;
-        for (int ky = -2; ky <= 2; ++ky) {
-          for (int kx = -2; kx <= 2; ++kx) {
-            int src_y = std::min(std::max(y * 2 + ky, 0), h - 1);
-            int src_x = std::min(std::max(x * 2 + kx, 0), w - 1);
-            val += img(c, src_y, src_x) * kernel[ky + 2] * kernel[kx + 2];
-          }
-        }
-        result(c, y, x) = val;
-      }
-    }
+    laplacian_detail::pyrDownPlane(img.data() + (size_t)c * h * w, h, w,
+                                   result.data() + (size_t)c * new_h * new_w,
+                                   tmp.data());
   }
   return result;
 }
@@ -43,96 +259,56 @@ inline xt::xarray<float> pyrDown(const xt::xarray<float> &img) {
 inline xt::xarray<float> pyrUp(const xt::xarray<float> &img, int target_h,
                                int target_w) {
   auto shape = img.shape();
+  int channels = shape[0];
   int h = shape[1];
   int w = shape[2];
 
-  std::vector<float> kernel = {1.0f / 16, 4.0f / 16, 6.0f / 16, 4.0f / 16,
-                               1.0f / 16};
-
-  int channels = shape[0];
   std::vector<int> result_shape = {channels, target_h, target_w};
   xt::xarray<float> result = xt::zeros<float>(result_shape);
-
+  std::vector<float> tmp((size_t)(h + 1) * target_w);
   for (int c = 0; c < channels; ++c) {
-    for (int y = 0; y < target_h; ++y) {
-      for (int x = 0; x < target_w; ++x) {
-        float val = 0.0f;
-        for (int ky = -2; ky <= 2; ++ky) {
-          for (int kx = -2; kx <= 2; ++kx) {
-            int src_y = (y - ky) / 2;
-            int src_x = (x - kx) / 2;
-
-            if ((y - ky) % 2 == 0 && (x - kx) % 2 == 0 && src_y >= 0 &&
-                src_y < h && src_x >= 0 && src_x < w) {
-              val +=
-                  img(c, src_y, src_x) * kernel[ky + 2] * kernel[kx + 2] * 4.0f;
-            }
-          }
-        }
-        result(c, y, x) = val;
-      }
-    }
+    laplacian_detail::pyrUpPlane(
+        img.data() + (size_t)c * h * w, h, w,
+        result.data() + (size_t)c * target_h * target_w, target_h, target_w,
+        tmp.data(), false);
   }
   return result;
 }
 
-inline xt::xarray<float> laplacianPyramidBlend(const xt::xarray<float> &img1,
-                                               const xt::xarray<float> &img2,
-                                               const xt::xarray<float> &mask) {
+// img1, img2: (C, H, W); mask: (1, H, W), broadcast over channels. With
+// workers, channels are blended on up to threads threads of the pool.
+inline xt::xarray<float> laplacianPyramidBlend(
+    const xt::xarray<float> &img1, const xt::xarray<float> &img2,
+    const xt::xarray<float> &mask, LaplacianBlendScratch &scratch,
+    threading::WorkerPool *workers = nullptr, int threads = 1) {
+  using namespace laplacian_detail;
   auto shape = img1.shape();
+  int channels = shape[0];
   int height = shape[1];
   int width = shape[2];
 
-  int min_size = std::min(height, width);
-  int num_levels = std::floor(std::log2(min_size)) - 3;
-  num_levels = std::max(num_levels, 2);
+  PyramidLayout layout(height, width, levelCount(height, width));
+  const size_t plane = (size_t)height * width;
 
-  while ((min_size >> num_levels) < 4) {
-    num_levels--;
-  }
-  num_levels = std::max(num_levels, 1);
-
-  std::vector<xt::xarray<float>> gauss_pyr1, gauss_pyr2, gauss_pyr_mask;
-
-  gauss_pyr1.push_back(img1);
-  gauss_pyr2.push_back(img2);
-  gauss_pyr_mask.push_back(mask);
-
-  for (int i = 1; i < num_levels; ++i) {
-    gauss_pyr1.push_back(pyrDown(gauss_pyr1[i - 1]));
-    gauss_pyr2.push_back(pyrDown(gauss_pyr2[i - 1]));
-    gauss_pyr_mask.push_back(pyrDown(gauss_pyr_mask[i - 1]));
-  }
+  scratch.mask_pyr.resize(layout.total);
+  scratch.mask_tmp.resize(plane);
+  std::copy(mask.data(), mask.data() + plane, scratch.mask_pyr.begin());
+  buildGaussian(scratch.mask_pyr.data(), layout, scratch.mask_tmp.data());
 
-  std::vector<xt::xarray<float>> laplace_pyr1, laplace_pyr2;
+  std::vector<int> result_shape = {channels, height, width};
+  xt::xarray<float> result = xt::empty<float>(result_shape);
+  if ((int)scratch.planes.size() < channels) scratch.planes.resize(channels);
 
-  for (int i = 0; i < num_levels - 1; ++i) {
-    auto up = pyrUp(gauss_pyr1[i + 1], gauss_pyr1[i].shape()[1],
-                    gauss_pyr1[i].shape()[2]);
-    laplace_pyr1.push_back(gauss_pyr1[i] - up);
-
-    up = pyrUp(gauss_pyr2[i + 1], gauss_pyr2[i].shape()[1],
-               gauss_pyr2[i].shape()[2]);
-    laplace_pyr2.push_back(gauss_pyr2[i] - up);
-  }
-  laplace_pyr1.push_back(gauss_pyr1[num_levels - 1]);
-  laplace_pyr2.push_back(gauss_pyr2[num_levels - 1]);
-
-  std::vector<xt::xarray<float>> blended_pyr;
-  for (int i = 0; i < num_levels; ++i) {
-    auto mask_expanded =
-        xt::broadcast(gauss_pyr_mask[i], laplace_pyr1[i].shape());
-    blended_pyr.push_back(laplace_pyr1[i] * (1.0f - mask_expanded) +
-                          laplace_pyr2[i] * mask_expanded);
+  auto run_channel = [&](int c) {
+    blendPlane(img1.data() + c * plane, img2.data() + c * plane,
+               scratch.mask_pyr.data(), layout, scratch.planes[c],
+               result.data() + c * plane);
+  };
+  if (workers) {
+    workers->run(channels, threads, run_channel);
+  } else {
+    for (int c = 0; c < channels; ++c) run_channel(c);
   }
-
-  xt::xarray<float> result = blended_pyr[num_levels - 1];
-  for (int i = num_levels - 2; i >= 0; --i) {
-    result =
-        pyrUp(result, blended_pyr[i].shape()[1], blended_pyr[i].shape()[2]) +
-        blended_pyr[i];
-  }
-
   return result;
 }
 
@@ -0,0 +1,19 @@
+#ifndef LOG_HPP
+#define LOG_HPP
+
+// Logging macros used across the server. Builds with the QNN SDK use the
+// SampleApp logger; host builds without it print the same messages to stderr.
+#ifdef SD_WITH_QNN
+#include "Logger.hpp"
+#else
+#include <cstdio>
+
+#define SD_LOG_(level, fmt, ...) \
+  std::fprintf(stderr, "[" level "] " fmt "\n", ##__VA_ARGS__)
+#define QNN_ERROR(fmt, ...) SD_LOG_("ERROR", fmt, ##__VA_ARGS__)
+#define QNN_WARN(fmt, ...) SD_LOG_("WARN", fmt, ##__VA_ARGS__)
+#define QNN_INFO(fmt, ...) SD_LOG_("INFO", fmt, ##__VA_ARGS__)
+#define QNN_DEBUG(fmt, ...) ((void)0)
+#endif
+
+#endif  // LOG_HPP
@@ -0,0 +1,114 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+// A whole file mapped into memory. Its pages belong to the page cache
+// rather than the heap: they are read on first touch, and the kernel can
+// drop clean ones under pressure and read them again later.
+class MappedFile {
+ public:
+  // Maps path read-only. Throws std::runtime_error when it cannot.
+  explicit MappedFile(const std::string &path) : path_(path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) fail("open");
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      ::close(fd);
+      fail("stat");
+    }
+    size_ = (uint64_t)st.st_size;
+    map(fd, PROT_READ, MAP_PRIVATE);
+  }
+
+  // Creates path (replacing any file there) with size bytes and maps it
+  // writable; writes reach the file by sync() or destruction. The blocks
+  // are allocated up front, so a full disk throws here instead of raising
+  // SIGBUS when a page is first written; the file is removed then.
+  MappedFile(const std::string &path, uint64_t size)
+      : path_(path), size_(size), writable_(true) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) fail("create");
+    if (size > 0) {
+      // Returns the error instead of setting errno.
+      const int err = posix_fallocate(fd, 0, (off_t)size);
+      if (err != 0) {
+        ::close(fd);
+        ::unlink(path.c_str());
+        errno = err;
+        fail("allocate");
+      }
+    }
+    map(fd, PROT_READ | PROT_WRITE, MAP_SHARED);
+  }
+
+  MappedFile(MappedFile &&other) noexcept
+      : path_(std::move(other.path_)),
+        data_(std::exchange(other.data_, nullptr)),
+        size_(std::exchange(other.size_, 0)),
+        writable_(other.writable_) {}
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  MappedFile &operator=(MappedFile &&) = delete;
+
+  ~MappedFile() {
+    if (data_) munmap(data_, size_);
+  }
+
+  const uint8_t *data() const { return data_; }
+  uint8_t *mutableData() { return writable_ ? data_ : nullptr; }
+  uint64_t size() const { return size_; }
+  const std::string &path() const { return path_; }
+
+  // madvise over [offset, offset + length), or to the end for length 0.
+  // Only a hint: failures are ignored.
+  void advise(int advice, uint64_t offset = 0, uint64_t length = 0) const {
+    if (!data_ || offset >= size_) return;
+    const uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    const uint64_t begin = offset / page * page;
+    const uint64_t end =
+        length == 0 || offset + length > size_ ? size_ : offset + length;
+    madvise(data_ + begin, end - begin, advice);
+  }
+
+  // Writes the pages of a writable mapping back to the file.
+  void sync() const {
+    if (data_ && writable_ && msync(data_, size_, MS_SYNC) != 0) fail("sync");
+  }
+
+ private:
+  void map(int fd, int prot, int flags) {
+    if (size_ > 0) {
+      void *data = mmap(nullptr, size_, prot, flags, fd, 0);
+      if (data == MAP_FAILED) {
+        ::close(fd);
+        fail("map");
+      }
+      data_ = static_cast<uint8_t *>(data);
+    }
+    ::close(fd);  // the mapping keeps the file open
+  }
+
+  [[noreturn]] void fail(const char *what) const {
+    throw std::runtime_error(std::string("Failed to ") + what + " " + path_ +
+                             ": " + std::strerror(errno));
+  }
+
+  std::string path_;
+  uint8_t *data_ = nullptr;
+  uint64_t size_ = 0;
+  bool writable_ = false;
+};
+
+#endif  // MAPPED_FILE_HPP
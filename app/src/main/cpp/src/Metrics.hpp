@@ -0,0 +1,253 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+// Prometheus metrics served on /metrics. Recording is a relaxed atomic add
+// on one of kShards cache-line-sized shards and never takes a lock; a scrape
+// sums the shards.
+namespace metrics {
+
+constexpr int kShards = 8;
+
+// Threads get shards round-robin on first use. httplib's pool alone has at
+// least eight threads, besides the generation and preview threads, so some
+// threads share a shard and may still contend on its cache line, just less
+// often than on a single counter.
+inline int shardIndex() {
+  static std::atomic<int> next{0};
+  thread_local int index =
+      next.fetch_add(1, std::memory_order_relaxed) % kShards;
+  return index;
+}
+
+class Counter {
+ public:
+  void inc(uint64_t n = 1) {
+    shards_[shardIndex()].value.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  uint64_t value() const {
+    uint64_t total = 0;
+    for (const auto &shard : shards_)
+      total += shard.value.load(std::memory_order_relaxed);
+    return total;
+  }
+
+ private:
+  struct alignas(64) Shard {
+    std::atomic<uint64_t> value{0};
+  };
+  Shard shards_[kShards];
+};
+
+// Point-in-time value; written rarely, so a single atomic is enough.
+class Gauge {
+ public:
+  void set(int64_t v) { value_.store(v, std::memory_order_relaxed); }
+  void add(int64_t v) { value_.fetch_add(v, std::memory_order_relaxed); }
+  int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int64_t> value_{0};
+};
+
+// Latency histogram with fixed bucket bounds in seconds.
+class Histogram {
+ public:
+  static constexpr double kBounds[] = {0.001, 0.005, 0.01, 0.025, 0.05,
+                                       0.1,   0.25,  0.5,  1.0,   2.5,
+                                       5.0,   10.0,  30.0};
+  static constexpr int kBuckets = sizeof(kBounds) / sizeof(kBounds[0]);
+
+  void observe(double seconds) {
+    int bucket = 0;
+    while (bucket < kBuckets && seconds > kBounds[bucket]) ++bucket;
+    Shard &shard = shards_[shardIndex()];
+    shard.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    shard.sum_ns.fetch_add((uint64_t)(seconds * 1e9),
+                           std::memory_order_relaxed);
+  }
+
+  // Appends the _bucket/_sum/_count series. labels is either empty or a
+  // "key=\"value\"" list without braces.
+  void render(std::string &out, const char *name,
+              const std::string &labels) const {
+    uint64_t counts[kBuckets + 1] = {};
+    uint64_t sum_ns = 0;
+    for (const auto &shard : shards_) {
+      for (int b = 0; b <= kBuckets; ++b)
+        counts[b] += shard.buckets[b].load(std::memory_order_relaxed);
+      sum_ns += shard.sum_ns.load(std::memory_order_relaxed);
+    }
+    const std::string sep = labels.empty() ? "" : ",";
+    char line[256];
+    uint64_t cumulative = 0;
+    for (int b = 0; b <= kBuckets; ++b) {
+      cumulative += counts[b];
+      if (b < kBuckets)
+        snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"%g\"} %llu\n", name,
+                 labels.c_str(), sep.c_str(), kBounds[b],
+                 (unsigned long long)cumulative);
+      else
+        snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"+Inf\"} %llu\n",
+                 name, labels.c_str(), sep.c_str(),
+                 (unsigned long long)cumulative);
+      out += line;
+    }
+    const std::string braced = labels.empty() ? "" : "{" + labels + "}";
+    snprintf(line, sizeof(line), "%s_sum%s %.9f\n%s_count%s %llu\n", name,
+             braced.c_str(), sum_ns / 1e9, name, braced.c_str(),
+             (unsigned long long)cumulative);
+    out += line;
+  }
+
+ private:
+  struct alignas(64) Shard {
+    std::atomic<uint64_t> buckets[kBuckets + 1] = {};
+    std::atomic<uint64_t> sum_ns{0};
+  };
+  Shard shards_[kShards];
+};
+
+// Resident set size of the process from /proc, or 0 if unavailable.
+inline int64_t residentMemoryBytes() {
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (!statm) return 0;
+  long pages = 0, resident = 0;
+  int read = fscanf(statm, "%ld %ld", &pages, &resident);
+  fclose(statm);
+  return read == 2 ? (int64_t)resident * sysconf(_SC_PAGESIZE) : 0;
+}
+
+// Everything the server exports.
+struct ServerMetrics {
+  static constexpr const char *kStages[] = {
+      "clip",         "unet_step",    "vae_encode", "vae_decode",
+      "safety_check", "image_encode", "sse_send"};
+  static constexpr int kStageCount = sizeof(kStages) / sizeof(kStages[0]);
+  // Models loaded and released on demand under a memory budget.
+  enum Model { kClip, kUnet, kVaeDecoder, kVaeEncoder, kModelCount };
+  static constexpr const char *kModels[] = {"clip", "unet", "vae_decoder",
+                                            "vae_encoder"};
+
+  Histogram stage_seconds[kStageCount];
+  Counter clip_cache_hits;
+  Counter clip_cache_misses;
+  Counter generations_completed;
+  Counter generations_failed;
+  Counter generations_cancelled;
+  Gauge queue_depth;
+  Counter model_loads[kModelCount];
+  Counter model_releases[kModelCount];
+  Gauge model_resident_bytes[kModelCount];
+
+  // Stages outside kStages are ignored.
+  void observeStage(const char *stage, double ms) {
+    for (int i = 0; i < kStageCount; ++i) {
+      if (std::strcmp(stage, kStages[i]) == 0) {
+        stage_seconds[i].observe(ms / 1000.0);
+        return;
+      }
+    }
+  }
+
+  void modelLoaded(Model model, int64_t bytes) {
+    model_loads[model].inc();
+    model_resident_bytes[model].set(bytes);
+  }
+
+  void modelReleased(Model model) {
+    model_releases[model].inc();
+    model_resident_bytes[model].set(0);
+  }
+
+  // Prometheus text exposition format, version 0.0.4.
+  std::string render() const {
+    std::string out;
+    out.reserve(16384);
+    out +=
+        "# HELP sd_stage_duration_seconds Duration of generation pipeline "
+        "stages.\n"
+        "# TYPE sd_stage_duration_seconds histogram\n";
+    for (int i = 0; i < kStageCount; ++i)
+      stage_seconds[i].render(out, "sd_stage_duration_seconds",
+                              std::string("stage=\"") + kStages[i] + "\"");
+
+    out +=
+        "# HELP sd_clip_cache_total Text encoder cache lookups.\n"
+        "# TYPE sd_clip_cache_total counter\n";
+    appendValue(out, "sd_clip_cache_total{result=\"hit\"}",
+                clip_cache_hits.value());
+    appendValue(out, "sd_clip_cache_total{result=\"miss\"}",
+                clip_cache_misses.value());
+
+    out +=
+        "# HELP sd_generations_total Finished generation requests.\n"
+        "# TYPE sd_generations_total counter\n";
+    appendValue(out, "sd_generations_total{result=\"completed\"}",
+                generations_completed.value());
+    appendValue(out, "sd_generations_total{result=\"failed\"}",
+                generations_failed.value());
+    appendValue(out, "sd_generations_total{result=\"cancelled\"}",
+                generations_cancelled.value());
+
+    out +=
+        "# HELP sd_queue_depth Generate requests accepted and not yet "
+        "finished.\n"
+        "# TYPE sd_queue_depth gauge\n";
+    appendValue(out, "sd_queue_depth", queue_depth.value());
+
+    out +=
+        "# HELP sd_model_events_total Model loads and releases.\n"
+        "# TYPE sd_model_events_total counter\n";
+    for (int m = 0; m < kModelCount; ++m) {
+      const std::string model = kModels[m];
+      appendValue(out,
+                  "sd_model_events_total{model=\"" + model +
+                      "\",event=\"load\"}",
+                  model_loads[m].value());
+      appendValue(out,
+                  "sd_model_events_total{model=\"" + model +
+                      "\",event=\"release\"}",
+                  model_releases[m].value());
+    }
+
+    out +=
+        "# HELP sd_model_resident_bytes Size of the models currently "
+        "loaded.\n"
+        "# TYPE sd_model_resident_bytes gauge\n";
+    for (int m = 0; m < kModelCount; ++m)
+      appendValue(
+          out,
+          std::string("sd_model_resident_bytes{model=\"") + kModels[m] + "\"}",
+          model_resident_bytes[m].value());
+
+    out +=
+        "# HELP process_resident_memory_bytes Resident memory size in "
+        "bytes.\n"
+        "# TYPE process_resident_memory_bytes gauge\n";
+    appendValue(out, "process_resident_memory_bytes", residentMemoryBytes());
+    return out;
+  }
+
+ private:
+  template <typename T>
+  static void appendValue(std::string &out, const std::string &series,
+                          T value) {
+    out += series;
+    out += ' ';
+    out += std::to_string(value);
+    out += '\n';
+  }
+};
+
+}  // namespace metrics
+
+#endif  // METRICS_HPP
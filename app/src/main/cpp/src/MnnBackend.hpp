@@ -0,0 +1,874 @@
+#ifndef MNN_BACKEND_HPP
+#define MNN_BACKEND_HPP
+
+#include <MNN/MNNDefine.h>
+
+#include <MNN/Interpreter.hpp>
+#include <cstring>
+#include <filesystem>
+#include <future>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Config.hpp"
+#include "InferenceBackend.hpp"
+#include "Residency.hpp"
+#include "ThreadConfig.hpp"
+
+// MNN implementation (CPU, or OpenCL per request). Models are loaded for the
+// duration of a stage and released right after, which keeps the resident
+// set small on phones; the text encoder can instead stay resident when the
+// server owns a persistent session for it (hybrid QNN + MNN CLIP mode), and
+// every stage model can stay loaded between requests within a memory budget
+// (setResidency). A UNet exported in parts can be streamed through memory a
+// few parts at a time (setUnetParts), and one exported for DeepCache can
+// skip its deep blocks on most steps (setDeepCache).
+class MnnBackend : public InferenceBackend {
+ public:
+  struct Paths {
+    std::string clip;
+    std::string unet;
+    std::string vae_decoder;
+    std::string vae_encoder;
+    std::string model_dir;  // where OpenCL tuning caches are written
+  };
+
+  MnnBackend(Paths paths, bool clip_v2)
+      : paths_(std::move(paths)), clip_v2_(clip_v2) {}
+
+  ~MnnBackend() override {
+    endUnet();
+    endDecode();
+    if (residency_)
+      for (const Loaded &loaded : loaded_) residency_->evict(loaded.id);
+    for (const UnetPart &part : unet_parts_) evictExtra(*part.model);
+    if (deep_full_) evictExtra(*deep_full_);
+    if (deep_shallow_) evictExtra(*deep_shallow_);
+  }
+
+  const char *name() const override { return "mnn"; }
+
+  // Thread counts and core affinity of requests that do not bring their
+  // own. Call before the first request.
+  void setThreadConfig(const threading::ThreadConfig &threads) {
+    threads_ = threads;
+  }
+
+  // Registers the stage models with residency, which then decides when they
+  // are released; without it each stage loads its model and releases it
+  // when done. Call once, before the first request and before setUnetParts
+  // and setDeepCache, whose models register with it too.
+  void setResidency(ResidencyManager *residency) {
+    residency_ = residency;
+    for (int i = 0; i < kSlotCount; ++i) {
+      const Slot slot = (Slot)i;
+      std::error_code ec;
+      auto bytes = std::filesystem::file_size(paths_.*info(slot).path, ec);
+      loaded_[slot].id = residency->add(
+          std::string("MNN ") + info(slot).what, ec ? 0 : (int64_t)bytes,
+          [this, slot] {
+            const Loaded &loaded = loaded_[slot];
+            stage(slot) = createStage(slot, loaded.use_opencl, loaded.shape,
+                                      loaded.config);
+          },
+          [this, slot] { stage(slot) = Stage(); },
+          {paths_.*info(slot).path});
+    }
+  }
+
+  void prefetchUnet() override {
+    if (residency_) residency_->prefetch(loaded_[kUnetSlot].id);
+  }
+
+  void prefetchDecoder() override {
+    if (residency_) residency_->prefetch(loaded_[kDecoderSlot].id);
+  }
+
+  // Runs the CPU UNet from sequential part files (down blocks, mid block, up
+  // blocks, ...) instead of the whole model, so that only a few parts are
+  // resident at a time: the next part loads on a worker thread while one
+  // runs. The leading parts that fit in keep_bytes stay held for the whole
+  // request; the others are released once they ran, and the residency
+  // budget decides whether they stay loaded until their next use. Without
+  // a residency manager the parts get one of their own, with room for the
+  // kept parts and the two largest others. Each part takes its inputs by
+  // name from sample, timestep, encoder_hidden_states and the outputs of
+  // the parts before it; the last one produces out_sample. OpenCL requests
+  // keep using the whole UNet.
+  void setUnetParts(std::vector<std::string> files, int64_t keep_bytes) {
+    endUnet();
+    for (const UnetPart &part : unet_parts_) evictExtra(*part.model);
+    unet_parts_.clear();
+    int64_t kept = 0;
+    bool keeping = true;
+    int64_t largest[2] = {0, 0};  // of the parts not kept
+    for (std::string &file : files) {
+      std::error_code ec;
+      auto bytes = std::filesystem::file_size(file, ec);
+      UnetPart part;
+      part.model = std::make_shared<ExtraModel>();
+      part.model->path = std::move(file);
+      part.model->what = "UNET part";
+      keeping = keeping && !ec && kept + (int64_t)bytes <= keep_bytes;
+      part.keep = keeping;
+      if (keeping) {
+        kept += bytes;
+      } else if (!ec && (int64_t)bytes > largest[1]) {
+        largest[1] = bytes;
+        if (largest[1] > largest[0]) std::swap(largest[0], largest[1]);
+      }
+      unet_parts_.push_back(std::move(part));
+    }
+    ResidencyManager *residency = residency_;
+    if (!residency) {
+      parts_residency_ = std::make_unique<ResidencyManager>(
+          kept + largest[0] + largest[1]);
+      residency = parts_residency_.get();
+    }
+    for (UnetPart &part : unet_parts_) registerExtra(part.model, residency);
+  }
+
+  // DeepCache: the UNet exported as two graphs taking sample, timestep and
+  // encoder_hidden_states. The full one computes out_sample and also outputs
+  // the high-level features entering its up blocks; the shallow one takes
+  // those features as inputs by name and runs only the outer down and up
+  // blocks around them. Steps with reuse_features run the shallow graph on
+  // the features of the last full step. Both graphs are held from beginUnet
+  // to endUnet; like the UNet slot they stay loaded between requests under
+  // a residency manager and are loaded per request without one.
+  void setDeepCache(std::string full, std::string shallow) {
+    endUnet();
+    if (deep_full_) evictExtra(*deep_full_);
+    if (deep_shallow_) evictExtra(*deep_shallow_);
+    deep_full_ = std::make_shared<ExtraModel>();
+    deep_full_->path = std::move(full);
+    deep_full_->what = "UNET DeepCache";
+    deep_shallow_ = std::make_shared<ExtraModel>();
+    deep_shallow_->path = std::move(shallow);
+    deep_shallow_->what = "UNET DeepCache";
+    if (residency_) {
+      registerExtra(deep_full_, residency_);
+      registerExtra(deep_shallow_, residency_);
+    }
+  }
+
+  bool hasDeepCache() const { return deep_full_ != nullptr; }
+
+  // Runs the text encoder on an already created session instead of loading
+  // it per request. The session stays owned by the caller.
+  void setTextEncoderSession(MNN::Interpreter *interpreter,
+                             MNN::Session *session) {
+    clip_interpreter_ = interpreter;
+    clip_session_ = session;
+  }
+
+  void encodeText(const int32_t *ids, const float *token_embeddings,
+                  int count, float *out,
+                  const RequestOptions &options) override {
+    const threading::ThreadConfig &threads = threadsOf(options);
+    MNN::Interpreter *interpreter = clip_interpreter_;
+    MNN::Session *session = clip_session_;
+    std::unique_ptr<Held> held;
+    if (!interpreter || !session) {
+      // The text encoder always runs on CPU.
+      Stage &clip = acquireStage(kClipSlot, false, "", threads);
+      held.reset(new Held(this, kClipSlot));
+      interpreter = clip.interpreter.get();
+      session = clip.session;
+    }
+
+    const char *input_name = clip_v2_ ? "input_embedding" : "input_ids";
+    auto input = interpreter->getSessionInput(session, input_name);
+    if (clip_v2_) {
+      interpreter->resizeTensor(input, {1, 77, 768});
+    } else {
+      interpreter->resizeTensor(input, {1, 77});
+    }
+    interpreter->resizeSession(session);
+    if (held) interpreter->releaseModel();
+
+    const size_t out_size = 77 * text_embedding_size;
+    threading::AffinityScope pin(threads.cores(threading::kClip));
+    for (int i = 0; i < count; ++i) {
+      if (clip_v2_) {
+        memcpy(input->host<float>(), token_embeddings + i * 77 * 768,
+               77 * 768 * sizeof(float));
+      } else {
+        memcpy(input->host<int>(), ids + i * 77, 77 * sizeof(int32_t));
+      }
+      interpreter->runSession(session);
+      auto output = interpreter->getSessionOutput(session, "last_hidden_state");
+      memcpy(out + i * out_size, output->host<float>(),
+             out_size * sizeof(float));
+    }
+  }
+
+  void beginUnet(int rows, int width, int height,
+                 const RequestOptions &options) override {
+    endUnet();
+    unet_threads_ = threadsOf(options);
+    if (options.deep_cache && hasDeepCache() && !options.use_opencl) {
+      deep_caching_ = true;
+      unet_shape_ = {rows, 4, height / 8, width / 8};
+      acquireExtra(*deep_full_);
+      acquireExtra(*deep_shallow_);
+      return;
+    }
+    if (!unet_parts_.empty() && !options.use_opencl) {
+      streaming_unet_ = true;
+      unet_shape_ = {rows, 4, height / 8, width / 8};
+      acquireUnetPartAsync(0);
+      return;
+    }
+    acquireStage(kUnetSlot, options.use_opencl, shapeKey(width, height, rows),
+                 unet_threads_);
+    if (resizeInputs(unet_, unetInputs(rows, width, height))) {
+      if (options.use_opencl)
+        unet_.interpreter->updateCacheFile(unet_.session);
+      unet_.interpreter->releaseModel();
+    }
+  }
+
+  void runUnet(const UnetStep &step) override {
+    if (streaming_unet_) return runStreamedUnet(step);
+    if (deep_caching_) return runDeepCache(step);
+    if (!unet_.session) throw std::runtime_error("MNN UNET not started");
+    auto *interpreter = unet_.interpreter.get();
+    auto samp = interpreter->getSessionInput(unet_.session, "sample");
+    auto ts = interpreter->getSessionInput(unet_.session, "timestep");
+    auto enc =
+        interpreter->getSessionInput(unet_.session, "encoder_hidden_states");
+
+    const size_t latent_size = samp->elementSize();
+    std::unique_ptr<MNN::Tensor> samp_host(
+        new MNN::Tensor(samp, MNN::Tensor::CAFFE));
+    std::unique_ptr<MNN::Tensor> ts_host(
+        new MNN::Tensor(ts, MNN::Tensor::CAFFE));
+
+    memcpy(samp_host->host<float>(), step.latents,
+           latent_size * sizeof(float));
+    int timestep = step.timestep;
+    memcpy(ts_host->host<int>(), &timestep, sizeof(int));
+    samp->copyFromHostTensor(samp_host.get());
+    ts->copyFromHostTensor(ts_host.get());
+
+    // The conditioning is the same for every step of a request; the session
+    // input keeps it between runs, so it is filled and uploaded once.
+    if (unet_hidden_states_ != step.hidden_states) {
+      // MNN runs the whole batch in one graph call, so each prompt embedding
+      // is repeated once per image to line up with the latent rows.
+      const size_t embed_size = 77 * text_embedding_size;
+      std::unique_ptr<MNN::Tensor> enc_host(
+          new MNN::Tensor(enc, MNN::Tensor::CAFFE));
+      float *enc_ptr = enc_host->host<float>();
+      for (int half = 0; half < 2; ++half) {
+        for (int b = 0; b < step.batch; ++b) {
+          memcpy(enc_ptr, step.hidden_states + half * embed_size,
+                 embed_size * sizeof(float));
+          enc_ptr += embed_size;
+        }
+      }
+      enc->copyFromHostTensor(enc_host.get());
+      unet_hidden_states_ = step.hidden_states;
+    }
+
+    {
+      threading::AffinityScope pin(unet_threads_.cores(threading::kUnet));
+      interpreter->runSession(unet_.session);
+    }
+
+    auto output = interpreter->getSessionOutput(unet_.session, "out_sample");
+    output->copyToHostTensor(samp_host.get());
+    memcpy(step.noise_pred, samp_host->host<float>(),
+           latent_size * sizeof(float));
+  }
+
+  void endUnet() override {
+    releaseStage(kUnetSlot);
+    unet_hidden_states_ = nullptr;
+    for (UnetPart &part : unet_parts_) {
+      if (part.loading.valid()) {
+        try {
+          part.loading.get();
+        } catch (const std::exception &) {
+          // The request is over; a failed prefetch no longer matters.
+          part.held = false;
+        }
+      }
+      if (part.held) releaseExtra(*part.model);
+      part.held = false;
+    }
+    unet_values_.clear();
+    streaming_unet_ = false;
+    if (deep_caching_) {
+      releaseExtra(*deep_full_);
+      releaseExtra(*deep_shallow_);
+    }
+    deep_caching_ = false;
+    deep_features_ = false;
+  }
+
+  void encodeImage(const float *image, int width, int height, float *mean,
+                   float *std_dev, const RequestOptions &options) override {
+    const threading::ThreadConfig &threads = threadsOf(options);
+    Stage &stage = acquireStage(kEncoderSlot, options.use_opencl,
+                                shapeKey(width, height), threads);
+    Held held(this, kEncoderSlot);
+    auto *interpreter = stage.interpreter.get();
+    if (resizeInputs(stage, encoderInputs(width, height))) {
+      if (options.use_opencl) interpreter->updateCacheFile(stage.session);
+      interpreter->releaseModel();
+    }
+    auto input = interpreter->getSessionInput(stage.session, "input");
+
+    auto mean_t = interpreter->getSessionOutput(stage.session, "mean");
+    auto std_t = interpreter->getSessionOutput(stage.session, "std");
+    std::unique_ptr<MNN::Tensor> input_host(
+        new MNN::Tensor(input, MNN::Tensor::CAFFE));
+    std::unique_ptr<MNN::Tensor> mean_host(
+        new MNN::Tensor(mean_t, MNN::Tensor::CAFFE));
+    std::unique_ptr<MNN::Tensor> std_host(
+        new MNN::Tensor(std_t, MNN::Tensor::CAFFE));
+
+    memcpy(input_host->host<float>(), image,
+           (size_t)3 * width * height * sizeof(float));
+    input->copyFromHostTensor(input_host.get());
+    {
+      threading::AffinityScope pin(threads.cores(threading::kVaeEncoder));
+      interpreter->runSession(stage.session);
+    }
+
+    const size_t latent_size = (size_t)4 * (width / 8) * (height / 8);
+    mean_t->copyToHostTensor(mean_host.get());
+    std_t->copyToHostTensor(std_host.get());
+    memcpy(mean, mean_host->host<float>(), latent_size * sizeof(float));
+    memcpy(std_dev, std_host->host<float>(), latent_size * sizeof(float));
+  }
+
+  void beginDecode(int width, int height,
+                   const RequestOptions &options) override {
+    endDecode();
+    decoder_threads_ = threadsOf(options);
+    acquireStage(kDecoderSlot, options.use_opencl, shapeKey(width, height),
+                 decoder_threads_);
+    if (resizeInputs(decoder_, decoderInputs(width, height))) {
+      if (options.use_opencl)
+        decoder_.interpreter->updateCacheFile(decoder_.session);
+      decoder_.interpreter->releaseModel();
+    }
+  }
+
+  void decodeLatents(const float *latents, int width, int height,
+                     float *pixels) override {
+    if (!decoder_.session) throw std::runtime_error("MNN VAE Dec not started");
+    resizeInputs(decoder_, decoderInputs(width, height));
+
+    auto *interpreter = decoder_.interpreter.get();
+    auto input =
+        interpreter->getSessionInput(decoder_.session, "latent_sample");
+    auto output = interpreter->getSessionOutput(decoder_.session, "sample");
+    std::unique_ptr<MNN::Tensor> input_host(
+        new MNN::Tensor(input, MNN::Tensor::CAFFE));
+    std::unique_ptr<MNN::Tensor> output_host(
+        new MNN::Tensor(output, MNN::Tensor::CAFFE));
+
+    memcpy(input_host->host<float>(), latents,
+           (size_t)4 * (width / 8) * (height / 8) * sizeof(float));
+    input->copyFromHostTensor(input_host.get());
+
+    {
+      threading::AffinityScope pin(
+          decoder_threads_.cores(threading::kVaeDecoder));
+      interpreter->runSession(decoder_.session);
+    }
+
+    output->copyToHostTensor(output_host.get());
+    memcpy(pixels, output_host->host<float>(),
+           (size_t)3 * width * height * sizeof(float));
+  }
+
+  void endDecode() override { releaseStage(kDecoderSlot); }
+
+  // Writes the OpenCL tuning caches of the UNet (rows latents per step) and
+  // the VAE at width x height that do not exist yet, so that the first
+  // OpenCL request of that shape finds its kernels tuned. Each missing
+  // cache costs a session and a tuning pass.
+  void tuneOpenCL(int rows, int width, int height) {
+    tuneCache(kUnetSlot, shapeKey(width, height, rows),
+              unetInputs(rows, width, height));
+    tuneCache(kDecoderSlot, shapeKey(width, height),
+              decoderInputs(width, height));
+    if (!paths_.vae_encoder.empty())
+      tuneCache(kEncoderSlot, shapeKey(width, height),
+                encoderInputs(width, height));
+  }
+
+ private:
+  struct InterpreterDeleter {
+    void operator()(MNN::Interpreter *interpreter) const { delete interpreter; }
+  };
+
+  // A temporary interpreter and its session, released together.
+  struct Stage {
+    std::unique_ptr<MNN::Interpreter, InterpreterDeleter> interpreter;
+    MNN::Session *session = nullptr;
+    // Input dimensions the session was last resized to, all inputs in a
+    // row; empty until the first resize.
+    std::vector<int> input_dims;
+
+    Stage() = default;
+    Stage(Stage &&other) noexcept
+        : interpreter(std::move(other.interpreter)),
+          session(other.session),
+          input_dims(std::move(other.input_dims)) {
+      other.session = nullptr;
+    }
+    Stage &operator=(Stage &&other) noexcept {
+      if (this != &other) {
+        release();
+        interpreter = std::move(other.interpreter);
+        session = other.session;
+        input_dims = std::move(other.input_dims);
+        other.session = nullptr;
+      }
+      return *this;
+    }
+    ~Stage() { release(); }
+
+    void release() {
+      if (interpreter && session) interpreter->releaseSession(session);
+      session = nullptr;
+      interpreter.reset();
+      input_dims.clear();
+    }
+  };
+
+  using InputShapes = std::vector<std::pair<const char *, std::vector<int>>>;
+
+  static InputShapes unetInputs(int rows, int width, int height) {
+    return {{"sample", {rows, 4, height / 8, width / 8}},
+            {"timestep", {1}},
+            {"encoder_hidden_states", {rows, 77, text_embedding_size}}};
+  }
+
+  static InputShapes decoderInputs(int width, int height) {
+    return {{"latent_sample", {1, 4, height / 8, width / 8}}};
+  }
+
+  static InputShapes encoderInputs(int width, int height) {
+    return {{"input", {1, 3, height, width}}};
+  }
+
+  // Names a session shape in OpenCL cache files: "512x768", or with rows
+  // "512x768x2".
+  static std::string shapeKey(int width, int height, int rows = 0) {
+    std::string key = std::to_string(width) + "x" + std::to_string(height);
+    if (rows > 0) key += "x" + std::to_string(rows);
+    return key;
+  }
+
+  // Resizes the session's inputs unless they already have these shapes; a
+  // session kept between requests of the same size skips the resize and
+  // its memory planning. Returns whether it resized.
+  static bool resizeInputs(Stage &stage, const InputShapes &inputs) {
+    std::vector<int> dims;
+    for (const auto &[name, shape] : inputs)
+      dims.insert(dims.end(), shape.begin(), shape.end());
+    if (dims == stage.input_dims) return false;
+    for (const auto &[name, shape] : inputs)
+      stage.interpreter->resizeTensor(
+          stage.interpreter->getSessionInput(stage.session, name), shape);
+    stage.interpreter->resizeSession(stage.session);
+    stage.input_dims = std::move(dims);
+    return true;
+  }
+
+  enum Slot { kClipSlot, kUnetSlot, kEncoderSlot, kDecoderSlot, kSlotCount };
+
+  struct SlotInfo {
+    std::string Paths::*path;
+    const char *what;
+    threading::Stage threads;
+    const char *cache_prefix;  // OpenCL tuning cache, keyed by shape
+  };
+
+  static const SlotInfo &info(Slot slot) {
+    static const SlotInfo kInfo[kSlotCount] = {
+        {&Paths::clip, "CLIP", threading::kClip, nullptr},
+        {&Paths::unet, "UNET", threading::kUnet, "unet_cache"},
+        {&Paths::vae_encoder, "VAE Encoder", threading::kVaeEncoder,
+         "vae_enc_cache"},
+        {&Paths::vae_decoder, "VAE Decoder", threading::kVaeDecoder,
+         "vae_dec_cache"}};
+    return kInfo[slot];
+  }
+
+  // Settings the slot's session was created with, and its residency state.
+  struct Loaded {
+    int id = -1;
+    bool pinned = false;
+    bool use_opencl = false;
+    std::string shape;  // shapeKey() of an OpenCL session
+    threading::ThreadConfig config;  // read by the load callback
+  };
+
+  // Releases a slot acquired for the length of one call.
+  struct Held {
+    MnnBackend *backend;
+    Slot slot;
+    Held(MnnBackend *backend, Slot slot) : backend(backend), slot(slot) {}
+    ~Held() { backend->releaseStage(slot); }
+  };
+
+  Stage &stage(Slot slot) {
+    switch (slot) {
+      case kClipSlot:
+        return clip_;
+      case kUnetSlot:
+        return unet_;
+      case kEncoderSlot:
+        return encoder_;
+      default:
+        return decoder_;
+    }
+  }
+
+  const threading::ThreadConfig &threadsOf(
+      const RequestOptions &options) const {
+    return options.threads ? *options.threads : threads_;
+  }
+
+  // Whether a session of stage created with a runs as one created with b
+  // would: same thread count, cores and power mode.
+  static bool sameThreads(const threading::ThreadConfig &a,
+                          const threading::ThreadConfig &b,
+                          threading::Stage stage) {
+    return a.threads(stage, 4) == b.threads(stage, 4) &&
+           a.stages[stage].cores == b.stages[stage].cores &&
+           a.powerMode(stage) == b.powerMode(stage);
+  }
+
+  // Loads the slot's model, or with a residency manager keeps the loaded
+  // one when its session was created with the same settings.
+  Stage &acquireStage(Slot slot, bool use_opencl, const std::string &shape,
+                      const threading::ThreadConfig &config) {
+    if (!residency_) {
+      stage(slot) = createStage(slot, use_opencl, shape, config);
+      return stage(slot);
+    }
+    Loaded &loaded = loaded_[slot];
+    if (loaded.use_opencl != use_opencl ||
+        !sameThreads(loaded.config, config, info(slot).threads) ||
+        (use_opencl && loaded.shape != shape))
+      residency_->evict(loaded.id);
+    loaded.use_opencl = use_opencl;  // read by the load callback
+    loaded.shape = shape;
+    loaded.config = config;
+    residency_->acquire(loaded.id);
+    loaded.pinned = true;
+    return stage(slot);
+  }
+
+  void releaseStage(Slot slot) {
+    if (!residency_) {
+      stage(slot) = Stage();
+      return;
+    }
+    Loaded &loaded = loaded_[slot];
+    if (!loaded.pinned) return;
+    loaded.pinned = false;
+    residency_->release(loaded.id);
+  }
+
+  // The session takes its CPU threads and power mode from the slot's
+  // thread settings.
+  Stage createStage(Slot slot, bool use_opencl, const std::string &shape,
+                    const threading::ThreadConfig &config) {
+    return createSession(paths_.*info(slot).path, info(slot).what,
+                         info(slot).threads, info(slot).cache_prefix,
+                         use_opencl, shape, config);
+  }
+
+  std::string cacheFile(const char *prefix, const std::string &shape) const {
+    return paths_.model_dir + "/" + prefix + ".mnnc." + shape;
+  }
+
+  void tuneCache(Slot slot, const std::string &shape,
+                 const InputShapes &inputs) {
+    if (std::filesystem::exists(cacheFile(info(slot).cache_prefix, shape)))
+      return;
+    Stage stage = createStage(slot, true, shape, threads_);
+    resizeInputs(stage, inputs);
+    stage.interpreter->updateCacheFile(stage.session);
+  }
+
+  Stage createSession(const std::string &path, const char *what,
+                      threading::Stage thread_stage, const char *cache_prefix,
+                      bool use_opencl, const std::string &shape,
+                      const threading::ThreadConfig &config) {
+    Stage stage;
+    stage.interpreter.reset(MNN::Interpreter::createFromFile(path.c_str()));
+    if (!stage.interpreter)
+      throw std::runtime_error(std::string("Failed to create MNN ") + what +
+                               " interpreter!");
+
+    MNN::ScheduleConfig cfg;
+    MNN::BackendConfig bk_cfg;
+    if (use_opencl) {
+      auto cache_file = cacheFile(cache_prefix, shape);
+      stage.interpreter->setCacheFile(cache_file.c_str());
+      cfg.type = MNN_FORWARD_OPENCL;
+      cfg.mode = MNN_GPU_MEMORY_BUFFER | MNN_GPU_TUNING_FAST;
+      bk_cfg.precision = MNN::BackendConfig::Precision_Low;
+    } else {
+      cfg.type = MNN_FORWARD_CPU;
+      bk_cfg.memory = MNN::BackendConfig::Memory_Low;
+    }
+    config.apply(thread_stage, 4, cfg, bk_cfg);
+    cfg.backendConfig = &bk_cfg;
+
+    {
+      // The CPU backend starts its workers here; they inherit the mask.
+      threading::AffinityScope pin(config.cores(thread_stage));
+      stage.session = stage.interpreter->createSession(cfg);
+    }
+    if (!stage.session)
+      throw std::runtime_error(std::string("Failed to create MNN ") + what +
+                               " session!");
+    return stage;
+  }
+
+  // A CPU UNet model outside the slots: a part or a DeepCache graph. With
+  // residency set, its session is loaded and released by the manager;
+  // otherwise acquireExtra loads it and releaseExtra releases it. Shared
+  // with the manager's callbacks, which may outlive a replaced model.
+  struct ExtraModel {
+    std::string path;
+    const char *what = "";
+    ResidencyManager *residency = nullptr;
+    int id = -1;
+    threading::ThreadConfig config;  // read by the load callback
+    Stage stage;
+  };
+
+  void registerExtra(const std::shared_ptr<ExtraModel> &model,
+                     ResidencyManager *residency) {
+    std::error_code ec;
+    auto bytes = std::filesystem::file_size(model->path, ec);
+    model->residency = residency;
+    model->id = residency->add(
+        std::string("MNN ") + model->what + " " +
+            std::filesystem::path(model->path).filename().string(),
+        ec ? 0 : (int64_t)bytes,
+        [this, model] {
+          model->stage =
+              createSession(model->path, model->what, threading::kUnet,
+                            nullptr, false, "", model->config);
+        },
+        [model] { model->stage = Stage(); }, {model->path});
+  }
+
+  // Loads the model unless it is loaded with the request's thread settings.
+  // May run on a worker thread for a part that loads ahead.
+  Stage &acquireExtra(ExtraModel &model) {
+    if (!model.residency) {
+      model.stage = createSession(model.path, model.what, threading::kUnet,
+                                  nullptr, false, "", unet_threads_);
+      return model.stage;
+    }
+    if (!sameThreads(model.config, unet_threads_, threading::kUnet))
+      model.residency->evict(model.id);
+    model.config = unet_threads_;
+    model.residency->acquire(model.id);
+    return model.stage;
+  }
+
+  void releaseExtra(ExtraModel &model) {
+    if (model.residency)
+      model.residency->release(model.id);
+    else
+      model.stage = Stage();
+  }
+
+  void evictExtra(ExtraModel &model) {
+    if (model.residency) model.residency->evict(model.id);
+  }
+
+  // One file of a UNet exported in parts.
+  struct UnetPart {
+    std::shared_ptr<ExtraModel> model;
+    bool keep = false;  // held until endUnet, not released after each run
+    bool held = false;  // acquired (or being acquired) and not released
+    std::future<void> loading;
+  };
+
+  void acquireUnetPartAsync(size_t index) {
+    UnetPart &part = unet_parts_[index];
+    if (part.held) return;
+    part.held = true;
+    part.loading = std::async(std::launch::async, [this, model = part.model] {
+      acquireExtra(*model);
+    });
+  }
+
+  Stage &unetPartStage(size_t index) {
+    UnetPart &part = unet_parts_[index];
+    if (part.loading.valid()) {
+      try {
+        part.loading.get();
+      } catch (...) {
+        part.held = false;
+        throw;
+      }
+    } else if (!part.held) {
+      acquireExtra(*part.model);
+      part.held = true;
+    }
+    return part.model->stage;
+  }
+
+  // Sets a named UNet graph input to a copy of data.
+  template <typename T>
+  void setUnetValue(const std::string &name, const std::vector<int> &shape,
+                    const T *data) {
+    std::unique_ptr<MNN::Tensor> &value = unet_values_[name];
+    value.reset(MNN::Tensor::create<T>(shape, nullptr, MNN::Tensor::CAFFE));
+    memcpy(value->host<T>(), data, value->elementSize() * sizeof(T));
+  }
+
+  // Stores a step's graph inputs among the named values.
+  void setUnetInputs(const UnetStep &step) {
+    const std::vector<int> &shape = unet_shape_;
+    const int rows = shape[0];
+    setUnetValue("sample", shape, step.latents);
+    const int timestep = step.timestep;
+    setUnetValue("timestep", {1}, &timestep);
+    if (unet_hidden_states_ != step.hidden_states) {
+      // Each prompt embedding repeated once per image, as in runUnet().
+      const size_t embed_size = 77 * text_embedding_size;
+      std::vector<float> hidden((size_t)rows * embed_size);
+      float *hidden_ptr = hidden.data();
+      for (int half = 0; half < 2; ++half) {
+        for (int b = 0; b < step.batch; ++b) {
+          memcpy(hidden_ptr, step.hidden_states + half * embed_size,
+                 embed_size * sizeof(float));
+          hidden_ptr += embed_size;
+        }
+      }
+      setUnetValue("encoder_hidden_states", {rows, 77, text_embedding_size},
+                   hidden.data());
+      unet_hidden_states_ = step.hidden_states;
+    }
+  }
+
+  // Copies the named out_sample into the step's noise prediction.
+  void takeUnetOutput(const UnetStep &step, const char *what) {
+    auto output = unet_values_.find("out_sample");
+    if (output == unet_values_.end())
+      throw std::runtime_error(std::string("MNN ") + what +
+                               " did not produce out_sample");
+    memcpy(step.noise_pred, output->second->host<float>(),
+           output->second->elementSize() * sizeof(float));
+  }
+
+  void runStreamedUnet(const UnetStep &step) {
+    setUnetInputs(step);
+    for (size_t i = 0; i < unet_parts_.size(); ++i) {
+      UnetPart &part = unet_parts_[i];
+      Stage &stage = unetPartStage(i);
+      // The part after this one, or the first part for the next step.
+      acquireUnetPartAsync((i + 1) % unet_parts_.size());
+      runUnetPart(stage, part.model->path);
+      if (!part.keep) {
+        releaseExtra(*part.model);
+        part.held = false;
+      }
+    }
+    takeUnetOutput(step, "UNET parts");
+  }
+
+  // The full graph leaves its features among the named values, where the
+  // shallow graph finds them until the next full step replaces them.
+  void runDeepCache(const UnetStep &step) {
+    setUnetInputs(step);
+    if (step.reuse_features && deep_features_) {
+      runUnetPart(deep_shallow_->stage, deep_shallow_->path);
+    } else {
+      runUnetPart(deep_full_->stage, deep_full_->path);
+      deep_features_ = true;
+    }
+    takeUnetOutput(step, "UNET DeepCache");
+  }
+
+  // Feeds a part the values it takes, runs it and keeps all its outputs for
+  // the parts after it.
+  void runUnetPart(Stage &stage, const std::string &path) {
+    MNN::Interpreter *interpreter = stage.interpreter.get();
+    const auto &inputs = interpreter->getSessionInputAll(stage.session);
+    bool resized = false;
+    for (const auto &[name, input] : inputs) {
+      auto value = unet_values_.find(name);
+      if (value == unet_values_.end())
+        throw std::runtime_error("MNN UNET part " + path + " takes " + name +
+                                 ", which no earlier part produces");
+      if (input->shape() != value->second->shape()) {
+        interpreter->resizeTensor(input, value->second->shape());
+        resized = true;
+      }
+    }
+    if (resized) {
+      interpreter->resizeSession(stage.session);
+      interpreter->releaseModel();
+    }
+    for (const auto &[name, input] : inputs)
+      input->copyFromHostTensor(unet_values_.at(name).get());
+    {
+      threading::AffinityScope pin(unet_threads_.cores(threading::kUnet));
+      if (interpreter->runSession(stage.session) != 0)
+        throw std::runtime_error("MNN UNET part " + path + " failed");
+    }
+    for (const auto &[name, output] :
+         interpreter->getSessionOutputAll(stage.session)) {
+      std::unique_ptr<MNN::Tensor> host(
+          new MNN::Tensor(output, MNN::Tensor::CAFFE));
+      output->copyToHostTensor(host.get());
+      unet_values_[name] = std::move(host);
+    }
+  }
+
+  Paths paths_;
+  bool clip_v2_;
+  threading::ThreadConfig threads_;
+  // The thread settings of the request between beginUnet and endUnet, and
+  // between beginDecode and endDecode.
+  threading::ThreadConfig unet_threads_;
+  threading::ThreadConfig decoder_threads_;
+  ResidencyManager *residency_ = nullptr;
+  Loaded loaded_[kSlotCount];
+  MNN::Interpreter *clip_interpreter_ = nullptr;
+  MNN::Session *clip_session_ = nullptr;
+  Stage clip_;
+  Stage encoder_;
+  Stage unet_;
+  // Conditioning currently uploaded to the UNet session.
+  const float *unet_hidden_states_ = nullptr;
+  std::vector<UnetPart> unet_parts_;
+  // Holds the parts when no residency manager is set.
+  std::unique_ptr<ResidencyManager> parts_residency_;
+  bool streaming_unet_ = false;  // this request runs unet_parts_
+  std::vector<int> unet_shape_;
+  // Graph inputs and outputs of the streamed or DeepCache UNet, by tensor
+  // name.
+  std::map<std::string, std::unique_ptr<MNN::Tensor>> unet_values_;
+  std::shared_ptr<ExtraModel> deep_full_;
+  std::shared_ptr<ExtraModel> deep_shallow_;
+  bool deep_caching_ = false;   // this request holds the DeepCache graphs
+  bool deep_features_ = false;  // a full step left its features
+  Stage decoder_;
+};
+
+#endif  // MNN_BACKEND_HPP
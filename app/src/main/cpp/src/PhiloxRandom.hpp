@@ -0,0 +1,105 @@
+#ifndef PHILOX_RANDOM_HPP
+#define PHILOX_RANDOM_HPP
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+#include <xtensor/xarray.hpp>
+
+#include "Philox.hpp"
+
+// Counter-based Philox4x32-10 generator with Box-Muller normal sampling.
+// Each instance owns its own key and counter, so generations never share
+// state: the same seed yields the same noise regardless of what else runs
+// in the process or in which order tensors are drawn from other streams.
+class PhiloxRandom {
+ public:
+  explicit PhiloxRandom(uint64_t seed, uint64_t stream = 0)
+      : key0_(static_cast<uint32_t>(seed)),
+        key1_(static_cast<uint32_t>(seed >> 32)),
+        stream_(stream) {}
+
+  // Fills out[0..n) with samples from N(0, 1). Draws whole Philox blocks,
+  // so a trailing partial block is discarded rather than carried over.
+  void normal(float *out, size_t n) {
+    constexpr size_t kChunk = 256;  // normals per pass, multiple of 4
+    uint32_t bits[kChunk];
+    float radius[kChunk / 2];
+    float angle[kChunk / 2];
+
+    while (n > 0) {
+      const size_t count = n < kChunk ? n : kChunk;
+      const size_t blocks = (count + 3) / 4;
+      for (size_t b = 0; b < blocks; ++b) nextBlock(bits + 4 * b);
+
+      // Box-Muller runs in its own passes over the chunk, after the Philox
+      // draws. std::log, std::sin and std::cos are scalar libm calls, so
+      // these loops are not vectorized.
+      const size_t pairs = blocks * 2;
+      for (size_t i = 0; i < pairs; ++i) {
+        // u1 in (0, 1] keeps log() finite; u2 in [0, 1).
+        float u1 = ((bits[2 * i] >> 8) + 1) * kInv24;
+        float u2 = (bits[2 * i + 1] >> 8) * kInv24;
+        radius[i] = std::sqrt(-2.0f * std::log(u1));
+        angle[i] = kTwoPi * u2;
+      }
+      if (count == pairs * 2) {
+        for (size_t i = 0; i < pairs; ++i) {
+          out[2 * i] = radius[i] * std::cos(angle[i]);
+          out[2 * i + 1] = radius[i] * std::sin(angle[i]);
+        }
+      } else {
+        for (size_t i = 0; i < count; ++i) {
+          out[i] = (i & 1) ? radius[i / 2] * std::sin(angle[i / 2])
+                           : radius[i / 2] * std::cos(angle[i / 2]);
+        }
+      }
+
+      out += count;
+      n -= count;
+    }
+  }
+
+  xt::xarray<float> randn(const std::vector<size_t> &shape) {
+    xt::xarray<float> result = xt::xarray<float>::from_shape(shape);
+    normal(result.data(), result.size());
+    return result;
+  }
+
+ private:
+  static constexpr float kInv24 = 1.0f / 16777216.0f;
+  static constexpr float kTwoPi = 6.28318530717958647692f;
+
+  // One Philox4x32-10 block for the current counter, then advance it.
+  void nextBlock(uint32_t out[4]) {
+    const uint32_t counter[4] = {static_cast<uint32_t>(offset_),
+                                 static_cast<uint32_t>(offset_ >> 32),
+                                 static_cast<uint32_t>(stream_),
+                                 static_cast<uint32_t>(stream_ >> 32)};
+    const uint32_t key[2] = {key0_, key1_};
+    philox::block(counter, key, out);
+    ++offset_;
+  }
+
+  uint32_t key0_;
+  uint32_t key1_;
+  uint64_t stream_;
+  uint64_t offset_ = 0;
+};
+
+// Draws a batched tensor whose row b comes from generators[b], so every
+// image of a batch consumes its own stream independently of the batch size.
+inline xt::xarray<float> batchedRandn(std::vector<PhiloxRandom> &generators,
+                                      const std::vector<size_t> &shape) {
+  if (shape.empty() || shape[0] != generators.size())
+    throw std::invalid_argument("batchedRandn: batch size mismatch");
+  xt::xarray<float> result = xt::xarray<float>::from_shape(shape);
+  const size_t row_size = result.size() / shape[0];
+  for (size_t b = 0; b < generators.size(); ++b)
+    generators[b].normal(result.data() + b * row_size, row_size);
+  return result;
+}
+
+#endif  // PHILOX_RANDOM_HPP
@@ -0,0 +1,170 @@
+#ifndef PREFETCH_HPP
+#define PREFETCH_HPP
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Log.hpp"
+
+// Reads model files into the page cache on a background thread, so that a
+// model loaded on demand finds its file in memory instead of stalling the
+// pipeline on storage. Prefetched bytes count against a ceiling until the
+// model is loaded (claim()); a file larger than the room left is read only
+// up to the ceiling, and the load reads the rest from storage. The kernel
+// may still drop the pages under memory pressure, which only costs the
+// read again.
+class ModelPrefetcher {
+ public:
+  explicit ModelPrefetcher(int64_t ceiling_bytes = 0)
+      : ceiling_(ceiling_bytes) {}
+
+  ~ModelPrefetcher() { stop(); }
+
+  ModelPrefetcher(const ModelPrefetcher &) = delete;
+  ModelPrefetcher &operator=(const ModelPrefetcher &) = delete;
+
+  // 0 disables prefetching.
+  void setCeiling(int64_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ceiling_ = bytes;
+  }
+
+  // Queues files that are not queued or being read already. Returns the
+  // number of bytes queued.
+  int64_t prefetch(const std::vector<std::string> &files) {
+    int64_t queued = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stopping_) return 0;
+      for (const std::string &path : files) {
+        auto it = pending_.find(path);
+        if (it != pending_.end()) {
+          // Read before and not loaded since: touch the pages again in
+          // case they were dropped, within the bytes already counted.
+          if (it->second.state != kDone) continue;
+          it->second.state = kQueued;
+          queue_.push_back(path);
+          continue;
+        }
+        std::error_code ec;
+        const int64_t size = (int64_t)std::filesystem::file_size(path, ec);
+        const int64_t room = ceiling_ - pendingBytes();
+        if (ec || size <= 0 || room <= 0) continue;
+        pending_[path] = {std::min(size, room), kQueued};
+        queue_.push_back(path);
+        queued += std::min(size, room);
+      }
+      if (queue_.empty()) return queued;
+      if (!thread_.joinable())
+        thread_ = std::thread(&ModelPrefetcher::run, this);
+    }
+    cv_.notify_one();
+    return queued;
+  }
+
+  // The files were loaded, or are about to be: their bytes no longer count
+  // against the ceiling and a read in progress stops at its next chunk.
+  void claim(const std::vector<std::string> &files) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const std::string &path : files) {
+      pending_.erase(path);
+      queue_.erase(std::remove(queue_.begin(), queue_.end(), path),
+                   queue_.end());
+    }
+  }
+
+  // Abandons queued reads and waits for the one in progress.
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+      queue_.clear();
+    }
+    cv_.notify_one();
+    if (thread_.joinable()) thread_.join();
+  }
+
+ private:
+  enum State { kQueued, kReading, kDone };
+
+  struct Pending {
+    int64_t bytes;  // counted against the ceiling; read at most this much
+    State state;
+  };
+
+  static constexpr size_t kChunkBytes = 4 << 20;
+
+  int64_t pendingBytes() const {
+    int64_t total = 0;
+    for (const auto &[path, pending] : pending_) total += pending.bytes;
+    return total;
+  }
+
+  void run() {
+    std::vector<char> buffer(kChunkBytes);
+    while (true) {
+      std::string path;
+      int64_t bytes;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+        if (stopping_) return;
+        path = queue_.front();
+        queue_.pop_front();
+        Pending &pending = pending_.at(path);
+        pending.state = kReading;
+        bytes = pending.bytes;
+      }
+      const int64_t read = readFile(path, bytes, buffer);
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = pending_.find(path);
+      if (it != pending_.end()) it->second.state = kDone;
+      QNN_INFO("Prefetched %lld MB of %s", (long long)(read >> 20),
+               path.c_str());
+    }
+  }
+
+  // Reads the first bytes of path and drops them; the page cache keeps
+  // them. Stops early once the file is claimed or the prefetcher stops.
+  int64_t readFile(const std::string &path, int64_t bytes,
+                   std::vector<char> &buffer) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    posix_fadvise(fd, 0, bytes, POSIX_FADV_SEQUENTIAL);
+    int64_t offset = 0;
+    while (offset < bytes) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_ || !pending_.count(path)) break;
+      }
+      const size_t chunk =
+          (size_t)std::min<int64_t>(buffer.size(), bytes - offset);
+      ssize_t n = pread(fd, buffer.data(), chunk, offset);
+      if (n <= 0) break;
+      offset += n;
+    }
+    close(fd);
+    return offset;
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  int64_t ceiling_;
+  std::map<std::string, Pending> pending_;  // not yet claimed
+  std::deque<std::string> queue_;
+  bool stopping_ = false;
+  std::thread thread_;
+};
+
+#endif  // PREFETCH_HPP
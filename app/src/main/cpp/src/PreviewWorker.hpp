@@ -0,0 +1,134 @@
+#ifndef PREVIEW_WORKER_HPP
+#define PREVIEW_WORKER_HPP
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <xtensor/xarray.hpp>
+
+// Background emitter for per-step progress events during denoising.
+// The UNet loop posts its latest state and moves on; a single worker thread
+// renders previews and writes them to the client. Only the newest pending
+// state is kept, so a slow decoder or client drops stale previews instead of
+// stalling generation.
+class PreviewWorker {
+ public:
+  using RenderFn = std::function<std::string(const xt::xarray<float> &)>;
+  using EmitFn = std::function<void(int step, int total_steps,
+                                    const std::string &image_data)>;
+
+  PreviewWorker(RenderFn render, EmitFn emit)
+      : render_(std::move(render)), emit_(std::move(emit)) {
+    thread_ = std::thread(&PreviewWorker::run, this);
+  }
+
+  // Unlike stop(), emits nothing more: the generation is being abandoned.
+  ~PreviewWorker() { shutdown(false); }
+
+  PreviewWorker(const PreviewWorker &) = delete;
+  PreviewWorker &operator=(const PreviewWorker &) = delete;
+
+  // Plain progress tick. A preview that is still pending is kept, since it
+  // is still the freshest image available.
+  void post(int step, int total_steps) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_.step = step;
+      pending_.total_steps = total_steps;
+      has_pending_ = true;
+    }
+    cv_.notify_one();
+  }
+
+  // Progress tick carrying latents to preview. Replaces any pending preview.
+  void post(int step, int total_steps, xt::xarray<float> latents) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (pending_.has_latents) dropped_++;
+      pending_.step = step;
+      pending_.total_steps = total_steps;
+      pending_.latents = std::move(latents);
+      pending_.has_latents = true;
+      has_pending_ = true;
+    }
+    cv_.notify_one();
+  }
+
+  // Discards a preview not yet rendered and waits for the in-flight event,
+  // then emits the pending progress tick, without its image, on the calling
+  // thread, so a slow client still sees the last steps. Must be called
+  // before the caller reuses the preview decoder.
+  void stop() { shutdown(true); }
+
+  int dropped() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return dropped_;
+  }
+
+ private:
+  struct Pending {
+    int step = 0;
+    int total_steps = 0;
+    bool has_latents = false;
+    xt::xarray<float> latents;
+  };
+
+  void shutdown(bool flush) {
+    Pending last;
+    bool has_last = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stopping_) return;
+      stopping_ = true;
+      if (pending_.has_latents) dropped_++;
+      has_last = has_pending_;
+      last = std::move(pending_);
+      pending_ = Pending();
+      has_pending_ = false;
+    }
+    cv_.notify_one();
+    if (thread_.joinable()) thread_.join();
+    if (!flush || !has_last) return;
+    try {
+      emit_(last.step, last.total_steps, std::string());
+    } catch (...) {
+      // As in run(): progress never takes down the generation.
+    }
+  }
+
+  void run() {
+    while (true) {
+      Pending job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return stopping_ || has_pending_; });
+        if (stopping_) return;
+        job = std::move(pending_);
+        pending_ = Pending();
+        has_pending_ = false;
+      }
+      try {
+        std::string image;
+        if (job.has_latents) image = render_(job.latents);
+        emit_(job.step, job.total_steps, image);
+      } catch (...) {
+        // A failed preview must never take down the generation.
+      }
+    }
+  }
+
+  RenderFn render_;
+  EmitFn emit_;
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  Pending pending_;
+  bool has_pending_ = false;
+  bool stopping_ = false;
+  int dropped_ = 0;
+  std::thread thread_;
+};
+
+#endif  // PREVIEW_WORKER_HPP
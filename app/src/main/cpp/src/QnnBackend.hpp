@@ -0,0 +1,214 @@
+#ifndef QNN_BACKEND_HPP
+#define QNN_BACKEND_HPP
+
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Config.hpp"
+#include "InferenceBackend.hpp"
+#include "QnnModel.hpp"
+
+// QNN HTP implementation. Graphs are compiled for one image per call, so a
+// UNet step runs each latent row separately, and for one size, so larger
+// SD1.5 images are denoised in windows of the UNet graph's size (512x512
+// unless --patch loads another) and decoded in 512x512 tiles. The models stay
+// owned by the server's global slots; optional hooks load and release them
+// around each stage (models loaded on demand under a memory budget).
+class QnnBackend : public InferenceBackend {
+ public:
+  struct Models {
+    std::unique_ptr<QnnModel> &clip;
+    std::unique_ptr<QnnModel> &unet;
+    std::unique_ptr<QnnModel> &vae_decoder;
+    std::unique_ptr<QnnModel> &vae_encoder;
+  };
+
+  struct StageHooks {
+    std::function<void()> acquire_clip, release_clip;
+    std::function<void()> acquire_unet, release_unet;
+    std::function<void()> acquire_vae_decoder, release_vae_decoder;
+    std::function<void()> acquire_vae_encoder, release_vae_encoder;
+    std::function<void()> prefetch_unet, prefetch_vae_decoder;
+  };
+
+  QnnBackend(Models models, bool sdxl, StageHooks hooks = StageHooks())
+      : models_(models), sdxl_(sdxl), hooks_(std::move(hooks)) {}
+
+  const char *name() const override { return "qnn"; }
+
+  void encodeText(const int32_t *ids, const float *, int count, float *out,
+                  const RequestOptions &) override {
+    StageLease lease(hooks_.acquire_clip, hooks_.release_clip);
+    QnnModel &clip = require(models_.clip, "CLIP");
+    StatusCode status = StatusCode::SUCCESS;
+    for (int i = 0; i < count && status == StatusCode::SUCCESS; ++i)
+      status = clip.executeClipGraphs(const_cast<int32_t *>(ids + i * 77),
+                                      out + i * 77 * text_embedding_size);
+    if (StatusCode::SUCCESS != status)
+      throw std::runtime_error("QNN CLIP exec failed");
+  }
+
+  void beginUnet(int, int width, int height,
+                 const RequestOptions &) override {
+    latent_size_ = (size_t)4 * (width / 8) * (height / 8);
+    call(hooks_.acquire_unet);
+    if (models_.unet) models_.unet->beginResidentInputs();
+  }
+
+  void runUnet(const UnetStep &step) override {
+    QnnModel &unet = require(models_.unet, "UNET");
+    // Graph I/O moves as many elements as the graph's static shape holds.
+    const size_t graph_size = elementCount(unet.inputDims("sample", 0));
+    if (latent_size_ != graph_size)
+      throw std::runtime_error(
+          "QNN UNET sample holds " + std::to_string(graph_size) +
+          " elements per image, not " + std::to_string(latent_size_));
+    const size_t latent_size = latent_size_;
+    const size_t cond_offset = (size_t)step.batch * latent_size;
+    float *latents = const_cast<float *>(step.latents);
+    float *hidden = const_cast<float *>(step.hidden_states);
+    float *text_embeds = const_cast<float *>(step.text_embeds);
+    float *time_ids = const_cast<float *>(step.time_ids);
+
+    for (int b = 0; b < step.batch; ++b) {
+      float *in = latents + b * latent_size;
+      float *out = step.noise_pred + b * latent_size;
+      if (sdxl_) {
+        const int hidden_stride =
+            77 * (text_embedding_size + text_embedding_size_2);
+        if (!step.skip_uncond &&
+            StatusCode::SUCCESS !=
+                unet.executeUnetGraphsSDXL(in, step.timestep, hidden,
+                                           text_embeds, time_ids, out))
+          throw std::runtime_error("QNN UNET SDXL exec failed (uncond)");
+        if (StatusCode::SUCCESS !=
+            unet.executeUnetGraphsSDXL(
+                in + cond_offset, step.timestep, hidden + hidden_stride,
+                text_embeds + text_embedding_size_2, time_ids + 6,
+                out + cond_offset))
+          throw std::runtime_error("QNN UNET SDXL exec failed (cond)");
+      } else {
+        if (!step.skip_uncond &&
+            StatusCode::SUCCESS !=
+                unet.executeUnetGraphs(in, step.timestep, hidden, out))
+          throw std::runtime_error("QNN UNET exec failed (uncond)");
+        if (StatusCode::SUCCESS !=
+            unet.executeUnetGraphs(in + cond_offset, step.timestep,
+                                   hidden + 77 * text_embedding_size,
+                                   out + cond_offset))
+          throw std::runtime_error("QNN UNET exec failed (cond)");
+      }
+    }
+  }
+
+  void endUnet() override {
+    if (models_.unet) models_.unet->endResidentInputs();
+    call(hooks_.release_unet);
+  }
+
+  // The encoder graph takes its size from the global output/sample shape,
+  // which callers set to the tile size while tiling.
+  void encodeImage(const float *image, int, int, float *mean, float *std_dev,
+                   const RequestOptions &) override {
+    StageLease lease(hooks_.acquire_vae_encoder, hooks_.release_vae_encoder);
+    QnnModel &encoder = require(models_.vae_encoder, "VAE Encoder");
+    float *pixels = const_cast<float *>(image);
+    StatusCode status =
+        sdxl_ ? encoder.executeVaeEncoderGraphsSDXL(pixels, mean, std_dev)
+              : encoder.executeVaeEncoderGraphs(pixels, mean, std_dev);
+    if (StatusCode::SUCCESS != status)
+      throw std::runtime_error("QNN VAE enc exec failed");
+  }
+
+  void beginDecode(int, int, const RequestOptions &) override {
+    call(hooks_.acquire_vae_decoder);
+  }
+
+  // Safe to call from the preview thread: decoder buffers are sized from the
+  // graph, not from the global shape.
+  void decodeLatents(const float *latents, int, int, float *pixels) override {
+    QnnModel &decoder = require(models_.vae_decoder, "VAE Decoder");
+    float *in = const_cast<float *>(latents);
+    StatusCode status =
+        sdxl_ ? decoder.executeVaeDecoderGraphsSDXL(in, pixels)
+              : decoder.executeVaeDecoderGraphs(in, pixels);
+    if (StatusCode::SUCCESS != status)
+      throw std::runtime_error("QNN VAE dec exec failed");
+  }
+
+  void endDecode() override { call(hooks_.release_vae_decoder); }
+
+  void prefetchUnet() override { call(hooks_.prefetch_unet); }
+  void prefetchDecoder() override { call(hooks_.prefetch_vae_decoder); }
+
+  // SD1.5 VAE graphs are compiled for 512x512; SDXL graphs run at full
+  // size.
+  int vaeTileSize() const override { return sdxl_ ? 0 : 512; }
+
+  // The SD1.5 UNet's size comes from its sample input, [1, 4, h, w] or
+  // [1, h, w, 4]. It is read once, loading the model if it is not loaded.
+  GraphSize unetTileSize() override {
+    if (sdxl_) return {};
+    if (unet_size_.width == 0) {
+      std::vector<uint32_t> dims;
+      {
+        StageLease lease(hooks_.acquire_unet, hooks_.release_unet);
+        if (models_.unet) dims = models_.unet->inputDims("sample", 0);
+      }
+      if (dims.size() != 4 || (dims[1] != 4 && dims[3] != 4))
+        throw std::runtime_error("QNN UNET sample is not a 4-channel latent");
+      const bool nchw = dims[1] == 4;
+      unet_size_.height = (int)(nchw ? dims[2] : dims[1]) * 8;
+      unet_size_.width = (int)(nchw ? dims[3] : dims[2]) * 8;
+    }
+    return unet_size_;
+  }
+
+ private:
+  static QnnModel &require(const std::unique_ptr<QnnModel> &model,
+                           const char *what) {
+    if (!model)
+      throw std::runtime_error(std::string("QNN ") + what +
+                               " not initialized!");
+    return *model;
+  }
+
+  static void call(const std::function<void()> &hook) {
+    if (hook) hook();
+  }
+
+  // Holds a model for one call: runs acquire now and release on scope exit,
+  // so a call that throws still releases it, as main.cpp's ModelLease does.
+  class StageLease {
+   public:
+    StageLease(const std::function<void()> &acquire,
+               const std::function<void()> &release)
+        : release_(release) {
+      call(acquire);
+    }
+    ~StageLease() { call(release_); }
+    StageLease(const StageLease &) = delete;
+    StageLease &operator=(const StageLease &) = delete;
+
+   private:
+    const std::function<void()> &release_;
+  };
+
+  static size_t elementCount(const std::vector<uint32_t> &dims) {
+    if (dims.empty()) return 0;
+    size_t count = 1;
+    for (uint32_t dim : dims) count *= dim;
+    return count;
+  }
+
+  Models models_;
+  bool sdxl_;
+  StageHooks hooks_;
+  size_t latent_size_ = 0;  // per image, from beginUnet
+  GraphSize unet_size_;      // SD1.5 UNet graph, read on first use
+};
+
+#endif  // QNN_BACKEND_HPP
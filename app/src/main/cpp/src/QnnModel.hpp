@@ -11,10 +11,17 @@
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <utility>
+#include <vector>
 
 #include "DataUtil.hpp"
+#include "GraphIO.hpp"
 #include "Logger.hpp"
+#include "MappedFile.hpp"
+#include "QnnResources.hpp"
 #include "SDUtils.hpp"
+#include "Trace.hpp"
 
 using namespace qnn::tools::sample_app;
 
@@ -36,7 +43,8 @@ class QnnModel : public QnnSampleApp {
       : QnnSampleApp(qnnFunctionPointers, inputListPaths, opPackagePaths,
                      backendHandle, outputPath, debug, outputDataType,
                      inputDataType, profilingLevel, dumpOutputs,
-                     cachedBinaryPath, saveBinaryName) {}
+                     cachedBinaryPath, saveBinaryName),
+        m_binaryPath(cachedBinaryPath) {}
 
   ~QnnModel() {
     // Tear down per-graph input/output tensors first (allocated lazily by
@@ -51,18 +59,98 @@ class QnnModel : public QnnSampleApp {
     inputs = nullptr;
     outputs = nullptr;
 
-    // freeContext() is not idempotent — only call when graphs are still alive.
-    if (m_graphsInfo != nullptr) {
-      freeContext();
+    if (m_resources.shared()) {
+      // The context, then the binary mapped for it, then the backend and
+      // device, which the last model sharing them frees.
+      if (!m_resources.release(m_qnnFunctionPointers.qnnInterface, m_context,
+                               m_profileBackendHandle))
+        QNN_ERROR("Could not free context");
+      m_isContextCreated = false;
+      m_deviceHandle = nullptr;
+      m_backendHandle = nullptr;
+    } else {
+      // freeContext() is not idempotent — only call when graphs are still
+      // alive.
+      if (m_graphsInfo != nullptr) {
+        freeContext();
+      }
+      freeDevice();
+      terminateBackend();
     }
-    freeDevice();
-    terminateBackend();
     if (m_modelHandle != nullptr) {
       dlclose(m_modelHandle);
       m_modelHandle = nullptr;
     }
   }
 
+  // Element count of a graph tensor, taken from its static dimensions rather
+  // than the global sample/output size so callers on other threads (preview
+  // decode) do not depend on shared state.
+  static size_t tensorElementCount(const Qnn_Tensor_t &tensor) {
+    size_t count = 1;
+    for (uint32_t i = 0; i < QNN_TENSOR_GET_RANK(tensor); ++i) {
+      count *= QNN_TENSOR_GET_DIMENSIONS(tensor)[i];
+    }
+    return count;
+  }
+
+  // Static dimensions of graph 0's input called name, or of the input at
+  // index when none has that name (as graph I/O resolves them); empty when
+  // no graph is loaded or there is no such input.
+  std::vector<uint32_t> inputDims(const char *name, size_t index) const {
+    if (m_graphsInfo == nullptr || m_graphsCount == 0) return {};
+    const auto &graphInfo = (*m_graphsInfo)[0];
+    const Qnn_Tensor_t *tensor = nullptr;
+    for (uint32_t i = 0; i < graphInfo.numInputTensors && !tensor; ++i) {
+      const char *tensorName = QNN_TENSOR_GET_NAME(graphInfo.inputTensors[i]);
+      if (tensorName && strcmp(tensorName, name) == 0)
+        tensor = &graphInfo.inputTensors[i];
+    }
+    if (!tensor && index < graphInfo.numInputTensors)
+      tensor = &graphInfo.inputTensors[index];
+    if (!tensor) return {};
+    const uint32_t *dims = QNN_TENSOR_GET_DIMENSIONS(*tensor);
+    return std::vector<uint32_t>(dims, dims + QNN_TENSOR_GET_RANK(*tensor));
+  }
+
+  // initializeBackend() and createDevice(), shared by every model: the
+  // first model to initialize creates the backend and device, later models
+  // adopt them for as long as any model holding them is alive.
+  StatusCode initializeSharedBackend() {
+    using Shared = Resources::Shared;
+    const bool attached =
+        m_resources.attach([this]() -> std::shared_ptr<Shared> {
+          if (StatusCode::SUCCESS != initializeBackend()) {
+            QNN_ERROR("Backend initialization failed");
+            return nullptr;
+          }
+          if (StatusCode::FAILURE != isDevicePropertySupported() &&
+              StatusCode::SUCCESS != createDevice()) {
+            QNN_ERROR("Device creation failed");
+            terminateBackend();
+            return nullptr;
+          }
+          // The backend logs through the handle it was created with.
+          return std::make_shared<Shared>(m_qnnFunctionPointers.qnnInterface,
+                                          std::exchange(m_logHandle, nullptr),
+                                          m_backendHandle, m_deviceHandle);
+        });
+    if (!attached) return StatusCode::FAILURE;
+    // The shared backend frees them, not the QnnSampleApp destructor.
+    m_isBackendInitialized = false;
+    m_backendHandle = m_resources.shared()->backend();
+    m_deviceHandle = m_resources.shared()->device();
+    return StatusCode::SUCCESS;
+  }
+
+  // enablePerformaceMode() once per shared backend.
+  StatusCode enableSharedPerformanceMode() {
+    if (!m_resources.shared()) return enablePerformaceMode();
+    const bool enabled = m_resources.shared()->enableOnce(
+        [this] { return StatusCode::SUCCESS == enablePerformaceMode(); });
+    return enabled ? StatusCode::SUCCESS : StatusCode::FAILURE;
+  }
+
   StatusCode enablePerformaceMode() {
     uint32_t powerConfigId;
     uint32_t deviceId = 0;
@@ -161,585 +249,88 @@ class QnnModel : public QnnSampleApp {
     return StatusCode::SUCCESS;
   }
 
+  // Graph I/O bindings. Tensors are resolved by their exported name and fall
+  // back to the position the graph was converted with.
   StatusCode executeClipGraphs(int32_t *input_ids, float *text_embedding) {
-    auto returnStatus = StatusCode::SUCCESS;
-
-    size_t graphIdx = 0;
-    QNN_DEBUG("Starting clip execution for graphIdx: %d", graphIdx);
-
-    // set input/output tensor
-    if (inputs == nullptr || outputs == nullptr) {
-      if (qnn::tools::iotensor::StatusCode::SUCCESS !=
-          m_ioTensor.setupInputAndOutputTensors(&inputs, &outputs,
-                                                (*m_graphsInfo)[graphIdx])) {
-        QNN_ERROR(
-            "Error in setting up Input and output Tensors for graphIdx: %d",
-            graphIdx);
-        returnStatus = StatusCode::FAILURE;
-        return returnStatus;
-      }
-    }
-    auto graphInfo = (*m_graphsInfo)[graphIdx];
-
-    // check input/output tensors
-    if (graphInfo.numInputTensors != 1 || graphInfo.numOutputTensors != 1) {
-      QNN_ERROR(
-          "Expecting 1 input and 1 output tensor, got %d inputs and %d "
-          "outputs",
-          graphInfo.numInputTensors, graphInfo.numOutputTensors);
-      returnStatus = StatusCode::FAILURE;
-      return returnStatus;
-    }
-
-    // input_ids
-    {
-      uint32_t elementCount = 1 * 77;
-      memcpy(QNN_TENSOR_GET_CLIENT_BUF(inputs[0]).data, input_ids,
-             elementCount * sizeof(int32_t));
-    }
-
-    // execute graph
-    QNN_DEBUG("Executing clip graph: %d", graphIdx);
-    auto start_time = std::chrono::high_resolution_clock::now();
-
-    auto executeStatus = m_qnnFunctionPointers.qnnInterface.graphExecute(
-        graphInfo.graph, inputs, graphInfo.numInputTensors, outputs,
-        graphInfo.numOutputTensors, m_profileBackendHandle, nullptr);
-
-    auto end_time = std::chrono::high_resolution_clock::now();
-    int duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-                       end_time - start_time)
-                       .count();
-    QNN_INFO("clip graph execution time: %d ms", duration);
-
-    if (QNN_GRAPH_NO_ERROR != executeStatus) {
-      returnStatus = StatusCode::FAILURE;
-      QNN_ERROR("clip graph execution failed!");
-    }
-
-    // get output
-    if (StatusCode::SUCCESS == returnStatus) {
-      float *tmp = nullptr;
-      if (qnn::tools::iotensor::StatusCode::SUCCESS !=
-          m_ioTensor.convertToFloat(&tmp, &outputs[0])) {
-        returnStatus = StatusCode::FAILURE;
-        return returnStatus;
-      }
-
-      uint32_t elementCount = 1 * 77 * text_embedding_size;
-      memcpy(text_embedding, tmp, elementCount * sizeof(float));
-      free(tmp);
-    }
-
-    return returnStatus;
+    return executeGraph("clip", {graphio::in("input_ids", 0, input_ids)},
+                        {graphio::out("last_hidden_state", 0, text_embedding)});
   }
 
   StatusCode executeUnetGraphs(float *latents, int timestep,
                                float *text_embedding, float *latents_pred) {
-    auto returnStatus = StatusCode::SUCCESS;
-
-    size_t graphIdx = 0;
-    QNN_DEBUG("Starting unet execution for graphIdx: %d", graphIdx);
-
-    // set input/output tensor
-    if (inputs == nullptr || outputs == nullptr) {
-      if (qnn::tools::iotensor::StatusCode::SUCCESS !=
-          m_ioTensor.setupInputAndOutputTensors(&inputs, &outputs,
-                                                (*m_graphsInfo)[graphIdx])) {
-        QNN_ERROR(
-            "Error in setting up Input and output Tensors for graphIdx: %d",
-            graphIdx);
-        returnStatus = StatusCode::FAILURE;
-        return returnStatus;
-      }
-    }
-    auto graphInfo = (*m_graphsInfo)[graphIdx];
-
-    if (graphInfo.numInputTensors != 3) {
-      QNN_ERROR("Expecting 3 input tensors, got %d", graphInfo.numInputTensors);
-      returnStatus = StatusCode::FAILURE;
-      return returnStatus;
-    }
-
-    // latents
-    {
-      uint16_t *latents_uint16 =
-          static_cast<uint16_t *>(QNN_TENSOR_GET_CLIENT_BUF(inputs[0]).data);
-      int elementCount = 1 * 4 * sample_width * sample_height;
-      qnn::tools::datautil::floatToTfN(
-          latents_uint16, latents,
-          inputs[0].v1.quantizeParams.scaleOffsetEncoding.offset,
-          inputs[0].v1.quantizeParams.scaleOffsetEncoding.scale, elementCount);
-    }
-
-    // position/timestep
-    {
-      int32_t *positionData =
-          static_cast<int32_t *>(QNN_TENSOR_GET_CLIENT_BUF(inputs[1]).data);
-      positionData[0] = timestep;
-    }
-
-    // text_embedding
-    {
-      uint16_t *text_embedding_uint16 =
-          static_cast<uint16_t *>(QNN_TENSOR_GET_CLIENT_BUF(inputs[2]).data);
-      int elementCount = 1 * 77 * text_embedding_size;
-      qnn::tools::datautil::floatToTfN(
-          text_embedding_uint16, text_embedding,
-          inputs[2].v1.quantizeParams.scaleOffsetEncoding.offset,
-          inputs[2].v1.quantizeParams.scaleOffsetEncoding.scale, elementCount);
-    }
-
-    // execute graph
-    QNN_DEBUG("Executing unet graph: %d", graphIdx);
-    auto start_time = std::chrono::high_resolution_clock::now();
-
-    auto executeStatus = m_qnnFunctionPointers.qnnInterface.graphExecute(
-        graphInfo.graph, inputs, graphInfo.numInputTensors, outputs,
-        graphInfo.numOutputTensors, m_profileBackendHandle, nullptr);
-
-    auto end_time = std::chrono::high_resolution_clock::now();
-    int duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-                       end_time - start_time)
-                       .count();
-    QNN_INFO("unet graph execution time: %d ms", duration);
-
-    if (QNN_GRAPH_NO_ERROR != executeStatus) {
-      returnStatus = StatusCode::FAILURE;
-      QNN_ERROR("unet graph execution failed!");
-    }
-
-    // get output
-    if (StatusCode::SUCCESS == returnStatus) {
-      float *tmp = nullptr;
-      if (qnn::tools::iotensor::StatusCode::SUCCESS !=
-          m_ioTensor.convertToFloat(&tmp, &outputs[0])) {
-        returnStatus = StatusCode::FAILURE;
-        return returnStatus;
-      }
-
-      int elementCount = 1 * 4 * sample_width * sample_height;
-      memcpy(latents_pred, tmp, elementCount * sizeof(float));
-      free(tmp);
-    }
-
-    return returnStatus;
+    const int32_t ts = timestep;
+    return executeGraph(
+        "unet",
+        {graphio::in("sample", 0, latents), graphio::in("timestep", 1, &ts),
+         graphio::resident("encoder_hidden_states", 2, text_embedding)},
+        {graphio::out("out_sample", 0, latents_pred)});
   }
 
   StatusCode executeVaeEncoderGraphs(float *pixel_values, float *mean,
                                      float *std) {
-    auto returnStatus = StatusCode::SUCCESS;
-
-    size_t graphIdx = 0;
-    QNN_DEBUG("Starting vae encoder execution for graphIdx: %d", graphIdx);
-
-    // set input/output tensor
-    if (inputs == nullptr || outputs == nullptr) {
-      if (qnn::tools::iotensor::StatusCode::SUCCESS !=
-          m_ioTensor.setupInputAndOutputTensors(&inputs, &outputs,
-                                                (*m_graphsInfo)[graphIdx])) {
-        QNN_ERROR(
-            "Error in setting up Input and output Tensors for graphIdx: %d",
-            graphIdx);
-        returnStatus = StatusCode::FAILURE;
-        return returnStatus;
-      }
-    }
-    auto graphInfo = (*m_graphsInfo)[graphIdx];
-
-    if (graphInfo.numInputTensors != 1) {
-      QNN_ERROR("Expecting 1 input tensors, got %d", graphInfo.numInputTensors);
-      returnStatus = StatusCode::FAILURE;
-      return returnStatus;
-    }
-
-    // pixel_values
-    {
-      uint16_t *pixel_values_uint16 =
-          static_cast<uint16_t *>(QNN_TENSOR_GET_CLIENT_BUF(inputs[0]).data);
-      int elementCount = 1 * 3 * output_width * output_height;
-      qnn::tools::datautil::floatToTfN(
-          pixel_values_uint16, pixel_values,
-          inputs[0].v1.quantizeParams.scaleOffsetEncoding.offset,
-          inputs[0].v1.quantizeParams.scaleOffsetEncoding.scale, elementCount);
-    }
-
-    // execute graph
-    QNN_DEBUG("Executing vae encoder graph: %d", graphIdx);
-    auto start_time = std::chrono::high_resolution_clock::now();
-
-    auto executeStatus = m_qnnFunctionPointers.qnnInterface.graphExecute(
-        graphInfo.graph, inputs, graphInfo.numInputTensors, outputs,
-        graphInfo.numOutputTensors, m_profileBackendHandle, nullptr);
-
-    auto end_time = std::chrono::high_resolution_clock::now();
-    int duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-                       end_time - start_time)
-                       .count();
-    QNN_INFO("vae encoder graph execution time: %d ms", duration);
-
-    if (QNN_GRAPH_NO_ERROR != executeStatus) {
-      returnStatus = StatusCode::FAILURE;
-      QNN_ERROR("vae encoder graph execution failed!");
-    }
-
-    // get output
-    if (StatusCode::SUCCESS == returnStatus) {
-      {
-        float *tmp = nullptr;
-        int elementCount = 1 * 4 * sample_width * sample_height;
-        if (qnn::tools::iotensor::StatusCode::SUCCESS !=
-            m_ioTensor.convertToFloat(&tmp, &outputs[0])) {
-          returnStatus = StatusCode::FAILURE;
-          return returnStatus;
-        }
-        memcpy(mean, tmp, elementCount * sizeof(float));
-        free(tmp);
-      }
-      {
-        float *tmp = nullptr;
-        int elementCount = 1 * 4 * sample_width * sample_height;
-        if (qnn::tools::iotensor::StatusCode::SUCCESS !=
-            m_ioTensor.convertToFloat(&tmp, &outputs[1])) {
-          returnStatus = StatusCode::FAILURE;
-          return returnStatus;
-        }
-        memcpy(std, tmp, elementCount * sizeof(float));
-        free(tmp);
-      }
-    }
-    return returnStatus;
+    return executeGraph(
+        "vae encoder", {graphio::in("input", 0, pixel_values)},
+        {graphio::out("mean", 0, mean), graphio::out("std", 1, std)});
   }
 
   StatusCode executeVaeDecoderGraphs(float *latents, float *pixel_values) {
-    auto returnStatus = StatusCode::SUCCESS;
-
-    size_t graphIdx = 0;
-    QNN_DEBUG("Starting vae decoder execution for graphIdx: %d", graphIdx);
-
-    // set input/output tensor
-    if (inputs == nullptr || outputs == nullptr) {
-      if (qnn::tools::iotensor::StatusCode::SUCCESS !=
-          m_ioTensor.setupInputAndOutputTensors(&inputs, &outputs,
-                                                (*m_graphsInfo)[graphIdx])) {
-        QNN_ERROR(
-            "Error in setting up Input and output Tensors for graphIdx: %d",
-            graphIdx);
-        returnStatus = StatusCode::FAILURE;
-        return returnStatus;
-      }
-    }
-    auto graphInfo = (*m_graphsInfo)[graphIdx];
-
-    if (graphInfo.numInputTensors != 1) {
-      QNN_ERROR("Expecting 1 input tensors, got %d", graphInfo.numInputTensors);
-      returnStatus = StatusCode::FAILURE;
-      return returnStatus;
-    }
-
-    // latents
-    {
-      uint16_t *latents_uint16 =
-          static_cast<uint16_t *>(QNN_TENSOR_GET_CLIENT_BUF(inputs[0]).data);
-      int elementCount = 1 * 4 * sample_width * sample_height;
-      qnn::tools::datautil::floatToTfN(
-          latents_uint16, latents,
-          inputs[0].v1.quantizeParams.scaleOffsetEncoding.offset,
-          inputs[0].v1.quantizeParams.scaleOffsetEncoding.scale, elementCount);
-    }
-
-    // execute graph
-    QNN_DEBUG("Executing vae decoder graph: %d", graphIdx);
-    auto start_time = std::chrono::high_resolution_clock::now();
-
-    auto executeStatus = m_qnnFunctionPointers.qnnInterface.graphExecute(
-        graphInfo.graph, inputs, graphInfo.numInputTensors, outputs,
-        graphInfo.numOutputTensors, m_profileBackendHandle, nullptr);
-
-    auto end_time = std::chrono::high_resolution_clock::now();
-    int duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-                       end_time - start_time)
-                       .count();
-    QNN_INFO("vae decoder graph execution time: %d ms", duration);
-
-    if (QNN_GRAPH_NO_ERROR != executeStatus) {
-      returnStatus = StatusCode::FAILURE;
-      QNN_ERROR("vae decoder graph execution failed!");
-    }
-
-    // get output
-    if (StatusCode::SUCCESS == returnStatus) {
-      float *tmp = nullptr;
-      int elementCount = 1 * 3 * output_width * output_height;
-      if (qnn::tools::iotensor::StatusCode::SUCCESS !=
-          m_ioTensor.convertToFloat(&tmp, &outputs[0])) {
-        returnStatus = StatusCode::FAILURE;
-        return returnStatus;
-      }
-      memcpy(pixel_values, tmp, elementCount * sizeof(float));
-      free(tmp);
-    }
-    return returnStatus;
+    return executeGraph("vae decoder",
+                        {graphio::in("latent_sample", 0, latents)},
+                        {graphio::out("sample", 0, pixel_values)});
   }
 
   StatusCode executeUnetGraphsSDXL(float *sample, int timestep,
                                    float *encoder_hidden_states,
                                    float *text_embeds, float *time_ids,
                                    float *out_sample) {
-    auto returnStatus = StatusCode::SUCCESS;
-
-    size_t graphIdx = 0;
-    QNN_DEBUG("Starting sdxl unet execution for graphIdx: %d", graphIdx);
-
-    if (inputs == nullptr || outputs == nullptr) {
-      if (qnn::tools::iotensor::StatusCode::SUCCESS !=
-          m_ioTensor.setupInputAndOutputTensors(&inputs, &outputs,
-                                                (*m_graphsInfo)[graphIdx])) {
-        QNN_ERROR(
-            "Error in setting up Input and output Tensors for graphIdx: %d",
-            graphIdx);
-        returnStatus = StatusCode::FAILURE;
-        return returnStatus;
-      }
-    }
-    auto graphInfo = (*m_graphsInfo)[graphIdx];
-
-    if (graphInfo.numInputTensors != 5) {
-      QNN_ERROR("Expecting 5 input tensors for sdxl unet, got %d",
-                graphInfo.numInputTensors);
-      returnStatus = StatusCode::FAILURE;
-      return returnStatus;
-    }
-
-    // sample (fp32, 1x4xHxW)
-    {
-      int elementCount = 1 * 4 * sample_width * sample_height;
-      memcpy(static_cast<float *>(QNN_TENSOR_GET_CLIENT_BUF(inputs[0]).data),
-             sample, elementCount * sizeof(float));
-    }
-
-    // timestep (int32, 1)
-    {
-      int32_t *ts =
-          static_cast<int32_t *>(QNN_TENSOR_GET_CLIENT_BUF(inputs[2]).data);
-      ts[0] = timestep;
-    }
-
-    // encoder_hidden_states (fp32, 1x77x2048)
-    {
-      int elementCount = 1 * 77 * (text_embedding_size + text_embedding_size_2);
-      memcpy(static_cast<float *>(QNN_TENSOR_GET_CLIENT_BUF(inputs[1]).data),
-             encoder_hidden_states, elementCount * sizeof(float));
-    }
-
-    // text_embeds (fp32, 1x1280)
-    {
-      int elementCount = 1 * text_embedding_size_2;
-      memcpy(static_cast<float *>(QNN_TENSOR_GET_CLIENT_BUF(inputs[4]).data),
-             text_embeds, elementCount * sizeof(float));
-    }
-
-    // time_ids (fp32, 1x6)
-    {
-      int elementCount = 1 * 6;
-      memcpy(static_cast<float *>(QNN_TENSOR_GET_CLIENT_BUF(inputs[3]).data),
-             time_ids, elementCount * sizeof(float));
-    }
-
-    QNN_DEBUG("Executing sdxl unet graph: %d", graphIdx);
-    auto start_time = std::chrono::high_resolution_clock::now();
-
-    auto executeStatus = m_qnnFunctionPointers.qnnInterface.graphExecute(
-        graphInfo.graph, inputs, graphInfo.numInputTensors, outputs,
-        graphInfo.numOutputTensors, m_profileBackendHandle, nullptr);
-
-    auto end_time = std::chrono::high_resolution_clock::now();
-    int duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-                       end_time - start_time)
-                       .count();
-    QNN_INFO("sdxl unet graph execution time: %d ms", duration);
-
-    if (QNN_GRAPH_NO_ERROR != executeStatus) {
-      returnStatus = StatusCode::FAILURE;
-      QNN_ERROR("sdxl unet graph execution failed!");
-      return returnStatus;
-    }
-
-    // out_sample (fp32, 1x4xHxW)
-    int elementCount = 1 * 4 * sample_width * sample_height;
-    memcpy(out_sample,
-           static_cast<float *>(QNN_TENSOR_GET_CLIENT_BUF(outputs[0]).data),
-           elementCount * sizeof(float));
-
-    return returnStatus;
+    const int32_t ts = timestep;
+    return executeGraph(
+        "sdxl unet",
+        {graphio::in("sample", 0, sample),
+         graphio::resident("encoder_hidden_states", 1, encoder_hidden_states),
+         graphio::in("timestep", 2, &ts),
+         graphio::resident("time_ids", 3, time_ids),
+         graphio::resident("text_embeds", 4, text_embeds)},
+        {graphio::out("out_sample", 0, out_sample)});
   }
 
   StatusCode executeVaeEncoderGraphsSDXL(float *pixel_values, float *mean,
                                          float *std) {
-    auto returnStatus = StatusCode::SUCCESS;
-
-    size_t graphIdx = 0;
-    QNN_DEBUG("Starting sdxl vae encoder execution for graphIdx: %d", graphIdx);
-
-    if (inputs == nullptr || outputs == nullptr) {
-      if (qnn::tools::iotensor::StatusCode::SUCCESS !=
-          m_ioTensor.setupInputAndOutputTensors(&inputs, &outputs,
-                                                (*m_graphsInfo)[graphIdx])) {
-        QNN_ERROR(
-            "Error in setting up Input and output Tensors for graphIdx: %d",
-            graphIdx);
-        returnStatus = StatusCode::FAILURE;
-        return returnStatus;
-      }
-    }
-    auto graphInfo = (*m_graphsInfo)[graphIdx];
-
-    if (graphInfo.numInputTensors != 1) {
-      QNN_ERROR("Expecting 1 input tensor for sdxl vae encoder, got %d",
-                graphInfo.numInputTensors);
-      returnStatus = StatusCode::FAILURE;
-      return returnStatus;
-    }
-
-    // pixel_values (fp32, 1x3xHxW)
-    {
-      int elementCount = 1 * 3 * output_width * output_height;
-      memcpy(static_cast<float *>(QNN_TENSOR_GET_CLIENT_BUF(inputs[0]).data),
-             pixel_values, elementCount * sizeof(float));
-    }
-
-    QNN_DEBUG("Executing sdxl vae encoder graph: %d", graphIdx);
-    auto start_time = std::chrono::high_resolution_clock::now();
-
-    auto executeStatus = m_qnnFunctionPointers.qnnInterface.graphExecute(
-        graphInfo.graph, inputs, graphInfo.numInputTensors, outputs,
-        graphInfo.numOutputTensors, m_profileBackendHandle, nullptr);
-
-    auto end_time = std::chrono::high_resolution_clock::now();
-    int duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-                       end_time - start_time)
-                       .count();
-    QNN_INFO("sdxl vae encoder graph execution time: %d ms", duration);
-
-    if (QNN_GRAPH_NO_ERROR != executeStatus) {
-      returnStatus = StatusCode::FAILURE;
-      QNN_ERROR("sdxl vae encoder graph execution failed!");
-      return returnStatus;
-    }
-
-    int elementCount = 1 * 4 * sample_width * sample_height;
-    memcpy(mean,
-           static_cast<float *>(QNN_TENSOR_GET_CLIENT_BUF(outputs[0]).data),
-           elementCount * sizeof(float));
-    memcpy(std,
-           static_cast<float *>(QNN_TENSOR_GET_CLIENT_BUF(outputs[1]).data),
-           elementCount * sizeof(float));
-
-    return returnStatus;
+    return executeVaeEncoderGraphs(pixel_values, mean, std);
   }
 
   StatusCode executeVaeDecoderGraphsSDXL(float *latents, float *pixel_values) {
-    auto returnStatus = StatusCode::SUCCESS;
-
-    size_t graphIdx = 0;
-    QNN_DEBUG("Starting sdxl vae decoder execution for graphIdx: %d", graphIdx);
-
-    if (inputs == nullptr || outputs == nullptr) {
-      if (qnn::tools::iotensor::StatusCode::SUCCESS !=
-          m_ioTensor.setupInputAndOutputTensors(&inputs, &outputs,
-                                                (*m_graphsInfo)[graphIdx])) {
-        QNN_ERROR(
-            "Error in setting up Input and output Tensors for graphIdx: %d",
-            graphIdx);
-        returnStatus = StatusCode::FAILURE;
-        return returnStatus;
-      }
-    }
-    auto graphInfo = (*m_graphsInfo)[graphIdx];
-
-    if (graphInfo.numInputTensors != 1) {
-      QNN_ERROR("Expecting 1 input tensor for sdxl vae decoder, got %d",
-                graphInfo.numInputTensors);
-      returnStatus = StatusCode::FAILURE;
-      return returnStatus;
-    }
-
-    // latents (fp32, 1x4xHxW)
-    {
-      int elementCount = 1 * 4 * sample_width * sample_height;
-      memcpy(static_cast<float *>(QNN_TENSOR_GET_CLIENT_BUF(inputs[0]).data),
-             latents, elementCount * sizeof(float));
-    }
-
-    QNN_DEBUG("Executing sdxl vae decoder graph: %d", graphIdx);
-    auto start_time = std::chrono::high_resolution_clock::now();
-
-    auto executeStatus = m_qnnFunctionPointers.qnnInterface.graphExecute(
-        graphInfo.graph, inputs, graphInfo.numInputTensors, outputs,
-        graphInfo.numOutputTensors, m_profileBackendHandle, nullptr);
-
-    auto end_time = std::chrono::high_resolution_clock::now();
-    int duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-                       end_time - start_time)
-                       .count();
-    QNN_INFO("sdxl vae decoder graph execution time: %d ms", duration);
-
-    if (QNN_GRAPH_NO_ERROR != executeStatus) {
-      returnStatus = StatusCode::FAILURE;
-      QNN_ERROR("sdxl vae decoder graph execution failed!");
-      return returnStatus;
-    }
-
-    int elementCount = 1 * 3 * output_width * output_height;
-    memcpy(pixel_values,
-           static_cast<float *>(QNN_TENSOR_GET_CLIENT_BUF(outputs[0]).data),
-           elementCount * sizeof(float));
-
-    return returnStatus;
+    return executeVaeDecoderGraphs(latents, pixel_values);
   }
 
   StatusCode executeUpscalerGraphs(float *input_image, float *output_image) {
-    auto returnStatus = StatusCode::SUCCESS;
+    return executeGraph("upscaler", {graphio::in("input", 0, input_image)},
+                        {graphio::out("output", 0, output_image)});
+  }
 
+  // Brackets calls whose resident inputs (the UNet conditioning) keep the
+  // same buffers and contents, so they are quantized only on first use.
+  void beginResidentInputs() { m_graphIO.beginResident(); }
+  void endResidentInputs() { m_graphIO.endResident(); }
+
+  // Writes the inputs, runs graph 0 and reads the outputs. Element counts
+  // come from the graph's static shapes, so caller buffers must match them.
+  StatusCode executeGraph(const char *what,
+                          const std::vector<graphio::Input> &graphInputs,
+                          const std::vector<graphio::Output> &graphOutputs) {
+    TRACE_SCOPE("executeGraph", "qnn");
     size_t graphIdx = 0;
-    QNN_DEBUG("Starting upscaler execution for graphIdx: %d", graphIdx);
-
-    // set input/output tensor
-    if (inputs == nullptr || outputs == nullptr) {
-      if (qnn::tools::iotensor::StatusCode::SUCCESS !=
-          m_ioTensor.setupInputAndOutputTensors(&inputs, &outputs,
-                                                (*m_graphsInfo)[graphIdx])) {
-        QNN_ERROR(
-            "Error in setting up Input and output Tensors for graphIdx: %d",
-            graphIdx);
-        returnStatus = StatusCode::FAILURE;
-        return returnStatus;
-      }
-    }
-    auto graphInfo = (*m_graphsInfo)[graphIdx];
-
-    if (graphInfo.numInputTensors != 1) {
-      QNN_ERROR("Expecting 1 input tensors, got %d", graphInfo.numInputTensors);
-      returnStatus = StatusCode::FAILURE;
-      return returnStatus;
-    }
+    if (StatusCode::SUCCESS != bindGraphIO(graphIdx))
+      return StatusCode::FAILURE;
+    const auto &graphInfo = (*m_graphsInfo)[graphIdx];
 
-    // input_image (quantized to uint8, 1x3x192x192)
-    {
-      // uint8_t *input_uint8 =
-      //     static_cast<uint8_t *>(QNN_TENSOR_GET_CLIENT_BUF(inputs[0]).data);
-      // int elementCount = 1 * 3 * 192 * 192;
-      // qnn::tools::datautil::floatToTfN(
-      //     input_uint8, input_image,
-      //     inputs[0].v1.quantizeParams.scaleOffsetEncoding.offset,
-      //     inputs[0].v1.quantizeParams.scaleOffsetEncoding.scale,
-      //     elementCount);
-      memcpy(static_cast<float *>(QNN_TENSOR_GET_CLIENT_BUF(inputs[0]).data),
-             input_image, 1 * 3 * 192 * 192 * sizeof(float));
+    std::string error;
+    if (!m_graphIO.writeInputs(graphInputs, &error)) {
+      QNN_ERROR("%s graph: %s", what, error.c_str());
+      return StatusCode::FAILURE;
     }
 
-    // execute graph
-    QNN_DEBUG("Executing upscaler graph: %d", graphIdx);
+    QNN_DEBUG("Executing %s graph: %d", what, graphIdx);
     auto start_time = std::chrono::high_resolution_clock::now();
 
     auto executeStatus = m_qnnFunctionPointers.qnnInterface.graphExecute(
@@ -747,32 +338,22 @@ class QnnModel : public QnnSampleApp {
         graphInfo.numOutputTensors, m_profileBackendHandle, nullptr);
 
     auto end_time = std::chrono::high_resolution_clock::now();
+    trace::complete("graphExecute", "qnn", start_time, end_time);
     int duration = std::chrono::duration_cast<std::chrono::milliseconds>(
                        end_time - start_time)
                        .count();
-    QNN_INFO("upscaler graph execution time: %d ms", duration);
+    QNN_INFO("%s graph execution time: %d ms", what, duration);
 
     if (QNN_GRAPH_NO_ERROR != executeStatus) {
-      returnStatus = StatusCode::FAILURE;
-      QNN_ERROR("upscaler graph execution failed!");
+      QNN_ERROR("%s graph execution failed!", what);
+      return StatusCode::FAILURE;
     }
 
-    // get output
-    // if (StatusCode::SUCCESS == returnStatus) {
-    //   float *tmp = nullptr;
-    //   int elementCount = 1 * 3 * 768 * 768;
-    //   if (qnn::tools::iotensor::StatusCode::SUCCESS !=
-    //       m_ioTensor.convertToFloat(&tmp, &outputs[0])) {
-    //     returnStatus = StatusCode::FAILURE;
-    //     return returnStatus;
-    //   }
-    //   memcpy(output_image, tmp, elementCount * sizeof(float));
-    //   free(tmp);
-    // }
-    memcpy(output_image,
-           static_cast<float *>(QNN_TENSOR_GET_CLIENT_BUF(outputs[0]).data),
-           1 * 3 * 768 * 768 * sizeof(float));
-    return returnStatus;
+    if (!m_graphIO.readOutputs(graphOutputs, &error)) {
+      QNN_ERROR("%s graph: %s", what, error.c_str());
+      return StatusCode::FAILURE;
+    }
+    return StatusCode::SUCCESS;
   }
 
   StatusCode createFromBuffer(const uint8_t *buffer, uint64_t bufferSize) {
@@ -830,9 +411,14 @@ class QnnModel : public QnnSampleApp {
       returnStatus = StatusCode::FAILURE;
     }
 
+    if (StatusCode::SUCCESS == returnStatus && !m_resources.shared()) {
+      QNN_ERROR("Create the context after initializeSharedBackend().");
+      returnStatus = StatusCode::FAILURE;
+    }
+
     if (StatusCode::SUCCESS == returnStatus &&
-        m_qnnFunctionPointers.qnnInterface.contextCreateFromBinary(
-            m_backendHandle, m_deviceHandle,
+        m_resources.createContext(
+            m_qnnFunctionPointers.qnnInterface,
             (const QnnContext_Config_t **)m_contextConfig, nonConstBuffer,
             bufferSize, &m_context, m_profileBackendHandle)) {
       QNN_ERROR("Could not create context from binary.");
@@ -869,6 +455,106 @@ class QnnModel : public QnnSampleApp {
 
     return returnStatus;
   }
+
+  // createFromBuffer() on a buffer the caller shares, which the model keeps
+  // until its context is freed.
+  StatusCode createFromSharedBuffer(std::shared_ptr<const uint8_t> buffer,
+                                    uint64_t bufferSize) {
+    StatusCode status = createFromBuffer(buffer.get(), bufferSize);
+    if (m_context != nullptr) m_resources.hold(std::move(buffer));
+    return status;
+  }
+
+  // createFromBinary() without reading the context binary into a heap
+  // buffer: the file is mapped read-only and handed to createFromBuffer().
+  // The backend may keep reading the buffer a context was created from, so
+  // the mapping is kept until the context is freed; its pages are clean and
+  // file-backed, so once loaded they are left reclaimable.
+  StatusCode createFromMappedBinary() {
+    if (m_binaryPath.empty()) return createFromBinary();
+    const MappedFile *binary = nullptr;
+    try {
+      binary = &m_resources.map(m_binaryPath);
+    } catch (const std::exception &e) {
+      QNN_WARN("%s; reading the binary instead", e.what());
+      return createFromBinary();
+    }
+    binary->advise(MADV_SEQUENTIAL);
+    binary->advise(MADV_WILLNEED);
+    StatusCode status = createFromBuffer(binary->data(), binary->size());
+    binary->advise(MADV_DONTNEED);
+    if (m_context == nullptr) m_resources.unmap();
+    return status;
+  }
+
+ private:
+  // Sets up the graph's client tensors on first use and describes them to
+  // m_graphIO; later calls reuse both.
+  StatusCode bindGraphIO(size_t graphIdx) {
+    if (m_graphIO.bound()) return StatusCode::SUCCESS;
+    if (m_graphsInfo == nullptr || m_graphsCount <= graphIdx) {
+      QNN_ERROR("Graph %d is not available", graphIdx);
+      return StatusCode::FAILURE;
+    }
+    const auto &graphInfo = (*m_graphsInfo)[graphIdx];
+    if (inputs == nullptr || outputs == nullptr) {
+      if (qnn::tools::iotensor::StatusCode::SUCCESS !=
+          m_ioTensor.setupInputAndOutputTensors(&inputs, &outputs,
+                                                graphInfo)) {
+        QNN_ERROR(
+            "Error in setting up Input and output Tensors for graphIdx: %d",
+            graphIdx);
+        return StatusCode::FAILURE;
+      }
+    }
+
+    std::vector<graphio::TensorInfo> inputInfos, outputInfos;
+    for (uint32_t i = 0; i < graphInfo.numInputTensors; ++i)
+      inputInfos.push_back(describeTensor(inputs[i]));
+    for (uint32_t i = 0; i < graphInfo.numOutputTensors; ++i)
+      outputInfos.push_back(describeTensor(outputs[i]));
+    m_graphIO.bind(inputInfos, outputInfos);
+    return StatusCode::SUCCESS;
+  }
+
+  static graphio::TensorInfo describeTensor(const Qnn_Tensor_t &tensor) {
+    graphio::TensorInfo info;
+    const char *name = QNN_TENSOR_GET_NAME(tensor);
+    info.name = name ? name : "";
+    info.elements = tensorElementCount(tensor);
+    info.data = QNN_TENSOR_GET_CLIENT_BUF(tensor).data;
+    info.scale = tensor.v1.quantizeParams.scaleOffsetEncoding.scale;
+    info.offset = tensor.v1.quantizeParams.scaleOffsetEncoding.offset;
+    switch (QNN_TENSOR_GET_DATA_TYPE(tensor)) {
+      case QNN_DATATYPE_FLOAT_32:
+        info.encoding = graphio::Encoding::kFloat32;
+        break;
+      case QNN_DATATYPE_FLOAT_16:
+        info.encoding = graphio::Encoding::kFloat16;
+        break;
+      case QNN_DATATYPE_UFIXED_POINT_8:
+        info.encoding = graphio::Encoding::kUfixed8;
+        break;
+      case QNN_DATATYPE_UFIXED_POINT_16:
+        info.encoding = graphio::Encoding::kUfixed16;
+        break;
+      case QNN_DATATYPE_INT_32:
+      case QNN_DATATYPE_UINT_32:
+        info.encoding = graphio::Encoding::kInt32;
+        break;
+      default:
+        info.encoding = graphio::Encoding::kUnsupported;
+        break;
+    }
+    return info;
+  }
+
+  graphio::GraphIO m_graphIO;
+  std::string m_binaryPath;
+
+  using Resources =
+      qnnres::ModelResources<decltype(QnnFunctionPointers::qnnInterface)>;
+  Resources m_resources;
 };
 
 #endif  // QNNMODEL_HPP
\ No newline at end of file
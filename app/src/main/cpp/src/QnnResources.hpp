@@ -0,0 +1,181 @@
+#ifndef QNN_RESOURCES_HPP
+#define QNN_RESOURCES_HPP
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include "MappedFile.hpp"
+
+// Ownership of the QNN handles behind a QnnModel, apart from the SDK types:
+// everything is templated on the interface function table (the SDK's
+// QNN_INTERFACE_VER_TYPE), and handle types are taken from the parameters
+// of its free functions, so the host tests drive it with a fake table.
+namespace qnnres {
+
+// First parameter type of a function pointer type.
+template <typename Fn>
+struct FirstParam;
+
+template <typename R, typename A, typename... Rest>
+struct FirstParam<R (*)(A, Rest...)> {
+  using type = A;
+};
+
+// The backend and device every model of one backend library runs on, with
+// the log handle the backend was created with. Models hold it through a
+// shared_ptr; the last one to let go frees the device, the backend and the
+// log, in that order. There is one registry per interface type.
+template <typename Interface>
+class SharedBackend {
+ public:
+  using Log = typename FirstParam<decltype(Interface::logFree)>::type;
+  using Backend = typename FirstParam<decltype(Interface::backendFree)>::type;
+  using Device = typename FirstParam<decltype(Interface::deviceFree)>::type;
+
+  SharedBackend(const Interface &qnn, Log log, Backend backend, Device device)
+      : qnn_(qnn), log_(log), backend_(backend), device_(device) {}
+
+  ~SharedBackend() {
+    if (device_ && qnn_.deviceFree) qnn_.deviceFree(device_);
+    if (backend_ && qnn_.backendFree) qnn_.backendFree(backend_);
+    if (log_ && qnn_.logFree) qnn_.logFree(log_);
+  }
+
+  SharedBackend(const SharedBackend &) = delete;
+  SharedBackend &operator=(const SharedBackend &) = delete;
+
+  Backend backend() const { return backend_; }
+  Device device() const { return device_; }
+
+  // The shared backend while any model holds it, otherwise the one create()
+  // returns, which later callers then share. create() runs under the
+  // registry lock and returns nullptr on failure, which is passed on.
+  template <typename Create>
+  static std::shared_ptr<SharedBackend> acquire(Create &&create) {
+    std::lock_guard<std::mutex> lock(mutex());
+    std::shared_ptr<SharedBackend> shared = current().lock();
+    if (!shared) {
+      shared = create();
+      current() = shared;
+    }
+    return shared;
+  }
+
+  // Drops one holder's reference under the registry lock, so the last
+  // release and a concurrent acquire() do not race over the handles.
+  static void release(std::shared_ptr<SharedBackend> &shared) {
+    std::lock_guard<std::mutex> lock(mutex());
+    shared.reset();
+  }
+
+  // Runs enable() for the first holder to ask, and again after a failure;
+  // returns whether it has succeeded for this backend.
+  template <typename Enable>
+  bool enableOnce(Enable &&enable) {
+    std::lock_guard<std::mutex> lock(mutex());
+    if (!performance_mode_) performance_mode_ = enable();
+    return performance_mode_;
+  }
+
+ private:
+  static std::mutex &mutex() {
+    static std::mutex mutex;
+    return mutex;
+  }
+
+  static std::weak_ptr<SharedBackend> &current() {
+    static std::weak_ptr<SharedBackend> shared;
+    return shared;
+  }
+
+  const Interface qnn_;
+  Log log_;
+  Backend backend_;
+  Device device_;
+  bool performance_mode_ = false;
+};
+
+// What one model holds on the shared backend: its reference to it and the
+// context binary its context was created from, mapped here or handed in by
+// the caller. The backend may keep reading that buffer for as long as the
+// context lives (HTP does not copy every section of it), so release() frees
+// the context first, then the binary, then drops the reference; the last
+// model's release frees the backend after every context on it.
+template <typename Interface>
+class ModelResources {
+ public:
+  using Shared = SharedBackend<Interface>;
+  using Context = typename FirstParam<decltype(Interface::contextFree)>::type;
+
+  ModelResources() = default;
+  ~ModelResources() { Shared::release(shared_); }
+
+  ModelResources(const ModelResources &) = delete;
+  ModelResources &operator=(const ModelResources &) = delete;
+
+  // Shares the backend, or creates it with create() (see
+  // SharedBackend::acquire). False when create() failed.
+  template <typename Create>
+  bool attach(Create &&create) {
+    shared_ = Shared::acquire(std::forward<Create>(create));
+    return shared_ != nullptr;
+  }
+
+  Shared *shared() const { return shared_.get(); }
+
+  // Maps the context binary read-only and keeps it until release(). Throws
+  // std::runtime_error if the file cannot be mapped.
+  const MappedFile &map(const std::string &path) {
+    binary_ = std::make_unique<MappedFile>(path);
+    return *binary_;
+  }
+
+  // Drops the mapping of a binary no context was created from.
+  void unmap() { binary_.reset(); }
+
+  const MappedFile *binary() const { return binary_.get(); }
+
+  // Keeps a caller's buffer, e.g. a patched binary, until release().
+  void hold(std::shared_ptr<const void> buffer) {
+    held_ = std::move(buffer);
+  }
+
+  bool holding() const { return held_ != nullptr; }
+
+  // contextCreateFromBinary on the shared backend and device. Returns the
+  // interface's error code (0 on success).
+  template <typename Config, typename Profile>
+  auto createContext(const Interface &qnn, Config config, const void *buffer,
+                     uint64_t size, Context *context, Profile profile) {
+    return qnn.contextCreateFromBinary(shared_->backend(), shared_->device(),
+                                       config, buffer, size, context, profile);
+  }
+
+  // Frees context (when set) and nulls it, then the mapped or held binary,
+  // then this model's reference to the backend. Returns false if contextFree failed;
+  // the rest is released regardless.
+  template <typename Profile>
+  bool release(const Interface &qnn, Context &context, Profile profile) {
+    bool freed = true;
+    if (context) {
+      freed = qnn.contextFree(context, profile) == 0;
+      context = nullptr;
+    }
+    binary_.reset();
+    held_.reset();
+    Shared::release(shared_);
+    return freed;
+  }
+
+ private:
+  std::shared_ptr<Shared> shared_;
+  std::unique_ptr<MappedFile> binary_;
+  std::shared_ptr<const void> held_;
+};
+
+}  // namespace qnnres
+
+#endif  // QNN_RESOURCES_HPP
@@ -0,0 +1,240 @@
+#ifndef QUANTIZE_HPP
+#define QUANTIZE_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SD_QUANT_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SD_QUANT_SSE2 1
+#endif
+
+// Affine (TFN) quantization between float and unsigned 8/16-bit tensors, as
+// used by QNN HTP graph inputs and outputs: x = (q + offset) * scale.
+//
+// The kernels produce bit-identical results to the scalar reference below,
+// which mirrors datautil::floatToTfN / tfNToFloat from the QNN SDK:
+// quantization is evaluated in double with round-half-away-from-zero, and
+// dequantization as one correctly rounded float product. NEON (aarch64)
+// and SSE2 versions process four or eight elements per iteration; other
+// targets use the reference.
+namespace quant {
+
+template <typename T>
+struct Params {
+  static constexpr double kMax = (double)std::numeric_limits<T>::max();
+
+  float scale;
+  int32_t offset;
+  double encoding_min;    // offset * scale, evaluated in float first
+  double encoding_range;  // (max + offset) * scale - encoding_min
+
+  Params(float scale, int32_t offset) : scale(scale), offset(offset) {
+    encoding_min = offset * scale;
+    encoding_range = (kMax + offset) * scale - encoding_min;
+  }
+};
+
+// --- Reference ---
+
+template <typename T>
+inline void quantizeReference(const float *src, T *dst, size_t count,
+                              const Params<T> &p) {
+  for (size_t i = 0; i < count; ++i) {
+    double q = std::round(Params<T>::kMax * (src[i] - p.encoding_min) /
+                          p.encoding_range);
+    // Clamped as double so infinities saturate and NaN maps to 0.
+    dst[i] = (T)(!(q > 0.0) ? 0.0 : std::min(q, Params<T>::kMax));
+  }
+}
+
+template <typename T>
+inline void dequantizeReference(const T *src, float *dst, size_t count,
+                                const Params<T> &p) {
+  for (size_t i = 0; i < count; ++i)
+    dst[i] = (float)(((double)src[i] + (double)p.offset) * p.scale);
+}
+
+// --- Kernels ---
+
+namespace detail {
+
+// Quantizes elements [begin, count) with the reference.
+template <typename T>
+inline void quantizeTail(const float *src, T *dst, size_t begin, size_t count,
+                         const Params<T> &p) {
+  quantizeReference(src + begin, dst + begin, count - begin, p);
+}
+
+#if SD_QUANT_NEON
+// Rounds four floats to quantized values in [0, max] as uint32.
+inline uint32x4_t quantize4(float32x4_t x, float64x2_t min, float64x2_t range,
+                            float64x2_t max) {
+  const float64x2_t zero = vdupq_n_f64(0.0);
+  float64x2_t lo = vcvt_f64_f32(vget_low_f32(x));
+  float64x2_t hi = vcvt_high_f64_f32(x);
+  lo = vdivq_f64(vmulq_f64(max, vsubq_f64(lo, min)), range);
+  hi = vdivq_f64(vmulq_f64(max, vsubq_f64(hi, min)), range);
+  // Clamping before rounding gives the same result as after, as in the
+  // reference, since the bounds are integers.
+  lo = vrndaq_f64(vminq_f64(vmaxq_f64(lo, zero), max));
+  hi = vrndaq_f64(vminq_f64(vmaxq_f64(hi, zero), max));
+  return vcombine_u32(vmovn_u64(vcvtq_u64_f64(lo)),
+                      vmovn_u64(vcvtq_u64_f64(hi)));
+}
+#endif
+
+#if SD_QUANT_SSE2
+// Rounds four floats to quantized values in [0, max] as int32. SSE2 has no
+// round-half-away, but for x >= 0 it equals trunc(x + (0.5 - 2^-54)).
+inline __m128i quantize4(__m128 x, __m128d min, __m128d range, __m128d max) {
+  const __m128d zero = _mm_setzero_pd();
+  const __m128d half = _mm_set1_pd(0.49999999999999994);
+  __m128d lo = _mm_cvtps_pd(x);
+  __m128d hi = _mm_cvtps_pd(_mm_movehl_ps(x, x));
+  lo = _mm_div_pd(_mm_mul_pd(max, _mm_sub_pd(lo, min)), range);
+  hi = _mm_div_pd(_mm_mul_pd(max, _mm_sub_pd(hi, min)), range);
+  // _mm_max_pd returns its second operand for NaN, mapping NaN to 0.
+  lo = _mm_add_pd(_mm_min_pd(_mm_max_pd(lo, zero), max), half);
+  hi = _mm_add_pd(_mm_min_pd(_mm_max_pd(hi, zero), max), half);
+  return _mm_unpacklo_epi64(_mm_cvttpd_epi32(lo), _mm_cvttpd_epi32(hi));
+}
+
+// Packs eight int32 in [0, 65535] to uint16 (SSE2 only packs signed).
+inline __m128i packU16(__m128i a, __m128i b) {
+  const __m128i bias = _mm_set1_epi32(32768);
+  __m128i packed =
+      _mm_packs_epi32(_mm_sub_epi32(a, bias), _mm_sub_epi32(b, bias));
+  return _mm_xor_si128(packed, _mm_set1_epi16((short)0x8000));
+}
+#endif
+
+}  // namespace detail
+
+inline void quantize(const float *src, uint16_t *dst, size_t count,
+                     const Params<uint16_t> &p) {
+  size_t i = 0;
+#if SD_QUANT_NEON
+  const float64x2_t min = vdupq_n_f64(p.encoding_min);
+  const float64x2_t range = vdupq_n_f64(p.encoding_range);
+  const float64x2_t max = vdupq_n_f64(Params<uint16_t>::kMax);
+  for (; i + 8 <= count; i += 8) {
+    uint32x4_t a =
+        detail::quantize4(vld1q_f32(src + i), min, range, max);
+    uint32x4_t b =
+        detail::quantize4(vld1q_f32(src + i + 4), min, range, max);
+    vst1q_u16(dst + i, vcombine_u16(vmovn_u32(a), vmovn_u32(b)));
+  }
+#elif SD_QUANT_SSE2
+  const __m128d min = _mm_set1_pd(p.encoding_min);
+  const __m128d range = _mm_set1_pd(p.encoding_range);
+  const __m128d max = _mm_set1_pd(Params<uint16_t>::kMax);
+  for (; i + 8 <= count; i += 8) {
+    __m128i a = detail::quantize4(_mm_loadu_ps(src + i), min, range, max);
+    __m128i b = detail::quantize4(_mm_loadu_ps(src + i + 4), min, range, max);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                     detail::packU16(a, b));
+  }
+#endif
+  detail::quantizeTail(src, dst, i, count, p);
+}
+
+inline void quantize(const float *src, uint8_t *dst, size_t count,
+                     const Params<uint8_t> &p) {
+  size_t i = 0;
+#if SD_QUANT_NEON
+  const float64x2_t min = vdupq_n_f64(p.encoding_min);
+  const float64x2_t range = vdupq_n_f64(p.encoding_range);
+  const float64x2_t max = vdupq_n_f64(Params<uint8_t>::kMax);
+  for (; i + 8 <= count; i += 8) {
+    uint32x4_t a =
+        detail::quantize4(vld1q_f32(src + i), min, range, max);
+    uint32x4_t b =
+        detail::quantize4(vld1q_f32(src + i + 4), min, range, max);
+    vst1_u8(dst + i, vmovn_u16(vcombine_u16(vmovn_u32(a), vmovn_u32(b))));
+  }
+#elif SD_QUANT_SSE2
+  const __m128d min = _mm_set1_pd(p.encoding_min);
+  const __m128d range = _mm_set1_pd(p.encoding_range);
+  const __m128d max = _mm_set1_pd(Params<uint8_t>::kMax);
+  for (; i + 8 <= count; i += 8) {
+    __m128i a = detail::quantize4(_mm_loadu_ps(src + i), min, range, max);
+    __m128i b = detail::quantize4(_mm_loadu_ps(src + i + 4), min, range, max);
+    __m128i words = _mm_packs_epi32(a, b);
+    __m128i packed = _mm_packus_epi16(words, words);
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i), packed);
+  }
+#endif
+  detail::quantizeTail(src, dst, i, count, p);
+}
+
+// (q + offset) is exact in float and the product of two exact floats is
+// correctly rounded, so single precision matches the double reference.
+inline void dequantize(const uint16_t *src, float *dst, size_t count,
+                       const Params<uint16_t> &p) {
+  size_t i = 0;
+#if SD_QUANT_NEON
+  const float32x4_t scale = vdupq_n_f32(p.scale);
+  const int32x4_t offset = vdupq_n_s32(p.offset);
+  for (; i + 8 <= count; i += 8) {
+    uint16x8_t q = vld1q_u16(src + i);
+    int32x4_t lo = vaddq_s32(
+        vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(q))), offset);
+    int32x4_t hi = vaddq_s32(vreinterpretq_s32_u32(vmovl_high_u16(q)), offset);
+    vst1q_f32(dst + i, vmulq_f32(vcvtq_f32_s32(lo), scale));
+    vst1q_f32(dst + i + 4, vmulq_f32(vcvtq_f32_s32(hi), scale));
+  }
+#elif SD_QUANT_SSE2
+  const __m128 scale = _mm_set1_ps(p.scale);
+  const __m128i offset = _mm_set1_epi32(p.offset);
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 8 <= count; i += 8) {
+    __m128i q = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    __m128i lo = _mm_add_epi32(_mm_unpacklo_epi16(q, zero), offset);
+    __m128i hi = _mm_add_epi32(_mm_unpackhi_epi16(q, zero), offset);
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+    _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+  }
+#endif
+  dequantizeReference(src + i, dst + i, count - i, p);
+}
+
+inline void dequantize(const uint8_t *src, float *dst, size_t count,
+                       const Params<uint8_t> &p) {
+  size_t i = 0;
+#if SD_QUANT_NEON
+  const float32x4_t scale = vdupq_n_f32(p.scale);
+  const int32x4_t offset = vdupq_n_s32(p.offset);
+  for (; i + 8 <= count; i += 8) {
+    uint16x8_t q = vmovl_u8(vld1_u8(src + i));
+    int32x4_t lo = vaddq_s32(
+        vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(q))), offset);
+    int32x4_t hi = vaddq_s32(vreinterpretq_s32_u32(vmovl_high_u16(q)), offset);
+    vst1q_f32(dst + i, vmulq_f32(vcvtq_f32_s32(lo), scale));
+    vst1q_f32(dst + i + 4, vmulq_f32(vcvtq_f32_s32(hi), scale));
+  }
+#elif SD_QUANT_SSE2
+  const __m128 scale = _mm_set1_ps(p.scale);
+  const __m128i offset = _mm_set1_epi32(p.offset);
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 8 <= count; i += 8) {
+    __m128i q = _mm_unpacklo_epi8(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(src + i)), zero);
+    __m128i lo = _mm_add_epi32(_mm_unpacklo_epi16(q, zero), offset);
+    __m128i hi = _mm_add_epi32(_mm_unpackhi_epi16(q, zero), offset);
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+    _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+  }
+#endif
+  dequantizeReference(src + i, dst + i, count - i, p);
+}
+
+}  // namespace quant
+
+#endif  // QUANTIZE_HPP
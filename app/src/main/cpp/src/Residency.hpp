@@ -0,0 +1,204 @@
+#ifndef RESIDENCY_HPP
+#define RESIDENCY_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Log.hpp"
+#include "Prefetch.hpp"
+
+// Keeps models loaded between requests within a memory budget. Each model
+// registers how it loads and releases itself and roughly how many bytes it
+// keeps resident; a stage acquires a model while it runs it and releases it
+// afterwards. A released model stays loaded until a model being acquired
+// needs its memory. Victims are picked GreedyDual-Size style: the model
+// with the least reload time per byte goes first, aged so that a model
+// unused for several requests goes before one used a moment ago.
+//
+// A budget of 0 releases every model right after its stage (--lowram); a
+// negative budget keeps everything loaded. Models in use are never evicted,
+// so a stage that needs more than the budget still runs, over budget.
+//
+// With a prefetcher set, prefetch() pages in the files of a model that is
+// not loaded while the current stage still runs, so its load skips most of
+// the storage reads.
+//
+// Loads run outside the manager's lock: a model being loaded counts against
+// the budget and cannot be evicted, and other acquires of it wait for the
+// load to finish.
+class ResidencyManager {
+ public:
+  explicit ResidencyManager(int64_t budget_bytes = -1)
+      : budget_(budget_bytes) {}
+
+  ResidencyManager(const ResidencyManager &) = delete;
+  ResidencyManager &operator=(const ResidencyManager &) = delete;
+
+  void setBudget(int64_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    budget_ = bytes;
+    trim(0);
+  }
+
+  // False when every model may stay loaded.
+  bool limited() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return budget_ >= 0;
+  }
+
+  void setPrefetcher(ModelPrefetcher *prefetcher) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    prefetcher_ = prefetcher;
+  }
+
+  // Returns the id to acquire the model with. bytes may be an estimate,
+  // e.g. the model file size; files are what load() reads, for prefetch().
+  int add(std::string name, int64_t bytes, std::function<void()> load,
+          std::function<void()> release,
+          std::vector<std::string> files = {}) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.push_back({std::move(name), bytes, std::move(load),
+                        std::move(release), std::move(files)});
+    return (int)entries_.size() - 1;
+  }
+
+  // Starts reading the model's files in the background unless it is loaded
+  // (or id is -1), ahead of an acquire() expected soon.
+  void prefetch(int id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (id < 0 || !prefetcher_) return;
+    Entry &entry = at(id);
+    if (!entry.resident) prefetcher_->prefetch(entry.files);
+  }
+
+  // Loads the model unless it is loaded, evicting released models first if
+  // it would not fit, and keeps it loaded until the matching release().
+  // If load() throws, the model stays unloaded and the exception propagates.
+  void acquire(int id) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    Entry &entry = at(id);
+    loaded_.wait(lock, [&entry] { return !entry.loading; });
+    if (!entry.resident) {
+      trim(entry.bytes);
+      if (budget_ > 0 && resident_bytes_ + entry.bytes > budget_)
+        QNN_WARN("Loading %s exceeds the memory budget by %lld MB",
+                 entry.name.c_str(),
+                 (long long)((resident_bytes_ + entry.bytes - budget_) >> 20));
+      if (prefetcher_) prefetcher_->claim(entry.files);
+      entry.loading = true;
+      resident_bytes_ += entry.bytes;
+      lock.unlock();
+      auto start = std::chrono::steady_clock::now();
+      try {
+        entry.load();
+      } catch (...) {
+        lock.lock();
+        entry.loading = false;
+        resident_bytes_ -= entry.bytes;
+        loaded_.notify_all();
+        throw;
+      }
+      const double load_ms = std::chrono::duration<double, std::milli>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count();
+      lock.lock();
+      entry.load_ms = load_ms;
+      entry.loading = false;
+      entry.resident = true;
+      loaded_.notify_all();
+    }
+    ++entry.pins;
+    entry.priority =
+        clock_ + entry.load_ms / std::max<double>(1.0, entry.bytes >> 20);
+  }
+
+  void release(int id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Entry &entry = at(id);
+    if (entry.pins > 0) --entry.pins;
+    trim(0);
+  }
+
+  // Releases the model now if it is loaded and not in use, e.g. when it has
+  // to be loaded again with other settings.
+  void evict(int id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Entry &entry = at(id);
+    if (entry.resident && entry.pins == 0) drop(entry);
+  }
+
+  bool resident(int id) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.at(id).resident;
+  }
+
+  int64_t residentBytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return resident_bytes_;
+  }
+
+ private:
+  struct Entry {
+    std::string name;
+    int64_t bytes;
+    std::function<void()> load;
+    std::function<void()> release;
+    std::vector<std::string> files;
+    bool resident = false;
+    bool loading = false;  // load() runs outside the lock
+    int pins = 0;
+    double load_ms = 0.0;
+    double priority = 0.0;
+  };
+
+  Entry &at(int id) {
+    if (id < 0 || id >= (int)entries_.size())
+      throw std::out_of_range("Unknown model id " + std::to_string(id));
+    return entries_[id];
+  }
+
+  // Evicts released models until incoming more bytes fit in the budget.
+  void trim(int64_t incoming) {
+    if (budget_ < 0) return;
+    while (resident_bytes_ + incoming > budget_) {
+      Entry *victim = nullptr;
+      for (Entry &entry : entries_) {
+        if (!entry.resident || entry.pins > 0) continue;
+        if (!victim || entry.priority < victim->priority) victim = &entry;
+      }
+      if (!victim) return;
+      clock_ = std::max(clock_, victim->priority);
+      drop(*victim);
+    }
+  }
+
+  void drop(Entry &entry) {
+    try {
+      entry.release();
+    } catch (const std::exception &e) {
+      QNN_WARN("Releasing %s failed: %s", entry.name.c_str(), e.what());
+    }
+    entry.resident = false;
+    resident_bytes_ -= entry.bytes;
+    QNN_INFO("Evicted %s (%lld MB, reload %.0f ms)", entry.name.c_str(),
+             (long long)(entry.bytes >> 20), entry.load_ms);
+  }
+
+  mutable std::mutex mutex_;
+  std::condition_variable loaded_;  // a load finished or failed
+  int64_t budget_;
+  int64_t resident_bytes_ = 0;
+  double clock_ = 0.0;  // GreedyDual inflation value
+  std::deque<Entry> entries_;  // stable while a load runs unlocked
+  ModelPrefetcher *prefetcher_ = nullptr;
+};
+
+#endif  // RESIDENCY_HPP
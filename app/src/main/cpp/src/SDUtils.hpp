@@ -32,6 +32,7 @@ struct GenerationResult {
   int channels;
   int generation_time_ms;
   int first_step_time_ms;
+  unsigned seed = 0;
 };
 
 inline std::string base64_encode(const std::string &in) {
@@ -457,4 +458,22 @@ inline std::vector<uint8_t> resizeImageToTarget(
   return resized_image;
 }
 
+// Resizes count consecutive width x height float planes (NCHW latents) to
+// new_width x new_height with a bicubic (Catmull-Rom) filter.
+inline std::vector<float> resizePlanesBicubic(const float *planes, int count,
+                                              int width, int height,
+                                              int new_width, int new_height) {
+  const size_t plane = (size_t)width * height;
+  const size_t new_plane = (size_t)new_width * new_height;
+  std::vector<float> resized(count * new_plane);
+  for (int i = 0; i < count; ++i) {
+    if (!stbir_resize(planes + i * plane, width, height, 0,
+                      resized.data() + i * new_plane, new_width, new_height,
+                      0, STBIR_1CHANNEL, STBIR_TYPE_FLOAT, STBIR_EDGE_CLAMP,
+                      STBIR_FILTER_CATMULLROM))
+      throw std::runtime_error("Plane resize failed");
+  }
+  return resized;
+}
+
 #endif
\ No newline at end of file
@@ -2,9 +2,12 @@
 #ifndef SCHEDULER_HPP
 #define SCHEDULER_HPP
 
+#include <functional>
 #include <optional>
 #include <string>
+#include <vector>
 #include <xtensor/xarray.hpp>
+#include <xtensor/xrandom.hpp>
 
 class Scheduler {
  public:
@@ -13,6 +16,9 @@ class Scheduler {
     xt::xarray<float> pred_original_sample;
   };
 
+  using NoiseFn =
+      std::function<xt::xarray<float>(const std::vector<size_t> &shape)>;
+
   virtual ~Scheduler() = default;
 
   // Set the number of inference steps
@@ -49,5 +55,23 @@ class Scheduler {
 
   // Get initial noise sigma (for scaling initial latents)
   virtual float get_init_noise_sigma() const = 0;
+
+  // Source of N(0, 1) noise for stochastic schedulers. Without one they fall
+  // back to xtensor's global engine.
+  void set_noise_source(NoiseFn noise_source) {
+    noise_source_ = std::move(noise_source);
+  }
+
+ protected:
+  template <class S>
+  xt::xarray<float> sample_noise(const S &shape) {
+    std::vector<size_t> noise_shape(shape.begin(), shape.end());
+    if (noise_source_) return noise_source_(noise_shape);
+    return xt::random::randn<float>(noise_shape, 0.0f, 1.0f,
+                                    xt::random::get_default_random_engine());
+  }
+
+ private:
+  NoiseFn noise_source_;
 };
 #endif  // SCHEDULER_HPP
\ No newline at end of file
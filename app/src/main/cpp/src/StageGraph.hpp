@@ -0,0 +1,104 @@
+#ifndef STAGE_GRAPH_HPP
+#define STAGE_GRAPH_HPP
+
+#include <exception>
+#include <functional>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Runs the pipeline stages that precede denoising. A stage starts once the
+// stages it depends on have finished; stages that are ready together run in
+// parallel, one of them on the calling thread. run() returns when every
+// stage has finished and rethrows the first failure in insertion order.
+// Stages must not touch state another concurrent stage writes, and should
+// leave progress reporting to the caller after run().
+class StageGraph {
+ public:
+  // parallel = false runs the stages one at a time in insertion order, e.g.
+  // when two stages would have their models resident at once.
+  explicit StageGraph(bool parallel = true) : parallel_(parallel) {}
+
+  // Returns the stage id to list as a dependency of later stages.
+  int add(const char *name, std::function<void()> fn,
+          std::vector<int> deps = {}) {
+    for (int dep : deps)
+      if (dep < 0 || dep >= (int)stages_.size())
+        throw std::invalid_argument(std::string("Stage ") + name +
+                                    " depends on an unknown stage");
+    stages_.push_back({std::move(fn), std::move(deps)});
+    return (int)stages_.size() - 1;
+  }
+
+  void run() {
+    std::vector<std::exception_ptr> errors(stages_.size());
+    std::vector<bool> done(stages_.size(), false);
+    size_t remaining = stages_.size();
+    while (remaining > 0) {
+      // Stages whose dependencies finished; a failed dependency skips its
+      // dependents.
+      std::vector<int> ready;
+      for (int i = 0; i < (int)stages_.size(); ++i) {
+        if (done[i] || !depsDone(i, done)) continue;
+        if (std::exception_ptr error = failedDep(i, errors)) {
+          errors[i] = error;
+          done[i] = true;
+          --remaining;
+          continue;
+        }
+        ready.push_back(i);
+        if (!parallel_) break;
+      }
+      if (ready.empty()) break;
+
+      std::vector<std::future<void>> running;
+      for (size_t r = 1; r < ready.size(); ++r)
+        running.push_back(std::async(std::launch::async, [this, &ready, r] {
+          runStage(ready[r]);
+        }));
+      try {
+        runStage(ready[0]);
+      } catch (...) {
+        errors[ready[0]] = std::current_exception();
+      }
+      for (size_t r = 1; r < ready.size(); ++r) {
+        try {
+          running[r - 1].get();
+        } catch (...) {
+          errors[ready[r]] = std::current_exception();
+        }
+      }
+      for (int i : ready) done[i] = true;
+      remaining -= ready.size();
+    }
+    for (const std::exception_ptr &error : errors)
+      if (error) std::rethrow_exception(error);
+  }
+
+ private:
+  struct Stage {
+    std::function<void()> fn;
+    std::vector<int> deps;
+  };
+
+  bool depsDone(int i, const std::vector<bool> &done) const {
+    for (int dep : stages_[i].deps)
+      if (!done[dep]) return false;
+    return true;
+  }
+
+  std::exception_ptr failedDep(
+      int i, const std::vector<std::exception_ptr> &errors) const {
+    for (int dep : stages_[i].deps)
+      if (errors[dep]) return errors[dep];
+    return nullptr;
+  }
+
+  void runStage(int i) { stages_[i].fn(); }
+
+  bool parallel_;
+  std::vector<Stage> stages_;
+};
+
+#endif  // STAGE_GRAPH_HPP
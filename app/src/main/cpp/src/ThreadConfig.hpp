@@ -0,0 +1,298 @@
+#ifndef THREAD_CONFIG_HPP
+#define THREAD_CONFIG_HPP
+
+#include <MNN/Interpreter.hpp>
+#include <sched.h>
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "json.hpp"
+
+// CPU thread counts and core affinity for the MNN sessions, per pipeline
+// stage. A stage without a setting keeps the count its call site always
+// used. Cores are "big", "little", "all" or a list such as "0-3,6"; big and
+// little come from the per-core capacity (or max frequency) in sysfs, so
+// phones can keep the UNet on the performance cluster and hosts can spread
+// it over every core.
+namespace threading {
+
+enum Stage {
+  kClip,
+  kClipG,  // SDXL second text encoder
+  kUnet,
+  kVaeEncoder,
+  kVaeDecoder,
+  kUpscaler,
+  kSafetyChecker,
+  kStageCount
+};
+
+inline constexpr const char *kStageNames[kStageCount] = {
+    "clip",        "clip_g",   "unet",          "vae_encoder",
+    "vae_decoder", "upscaler", "safety_checker"};
+
+// "0-3,6" -> {0, 1, 2, 3, 6}.
+inline std::vector<int> parseCpuList(const std::string &list) {
+  std::vector<int> cpus;
+  size_t pos = 0;
+  while (pos < list.size()) {
+    size_t end = list.find(',', pos);
+    if (end == std::string::npos) end = list.size();
+    const std::string item = list.substr(pos, end - pos);
+    pos = end + 1;
+    if (item.empty() || item == "\n") continue;
+    size_t dash = item.find('-');
+    try {
+      int first = std::stoi(item.substr(0, dash));
+      int last = dash == std::string::npos ? first
+                                           : std::stoi(item.substr(dash + 1));
+      if (first < 0 || last < first) throw std::invalid_argument(item);
+      for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+    } catch (const std::logic_error &) {
+      throw std::invalid_argument("Invalid CPU list: " + list);
+    }
+  }
+  return cpus;
+}
+
+// Online cores grouped by capacity. big holds the fastest cores (every core
+// on a symmetric CPU); little holds the slowest and is empty when all cores
+// are alike.
+struct CpuTopology {
+  std::vector<int> cores;
+  std::vector<int> big;
+  std::vector<int> little;
+
+  static const CpuTopology &get() {
+    static const CpuTopology topology = detect();
+    return topology;
+  }
+
+  static CpuTopology detect() {
+    CpuTopology topology;
+    const std::string root = "/sys/devices/system/cpu/";
+    std::ifstream online(root + "online");
+    std::string list;
+    if (online && std::getline(online, list)) {
+      try {
+        topology.cores = parseCpuList(list);
+      } catch (const std::invalid_argument &) {
+      }
+    }
+    if (topology.cores.empty()) {
+      const int count = (int)std::max(1u, std::thread::hardware_concurrency());
+      for (int cpu = 0; cpu < count; ++cpu) topology.cores.push_back(cpu);
+    }
+
+    // arm64 exposes cpu_capacity; elsewhere the max frequency stands in.
+    std::vector<long> rating;
+    for (int cpu : topology.cores) {
+      const std::string dir = root + "cpu" + std::to_string(cpu) + "/";
+      long value = 0;
+      std::ifstream capacity(dir + "cpu_capacity");
+      if (!(capacity >> value)) {
+        std::ifstream freq(dir + "cpufreq/cpuinfo_max_freq");
+        if (!(freq >> value)) value = 0;
+      }
+      rating.push_back(value);
+    }
+    const long top = *std::max_element(rating.begin(), rating.end());
+    const long bottom = *std::min_element(rating.begin(), rating.end());
+    for (size_t i = 0; i < topology.cores.size(); ++i) {
+      if (rating[i] == top) topology.big.push_back(topology.cores[i]);
+      if (bottom != top && rating[i] == bottom)
+        topology.little.push_back(topology.cores[i]);
+    }
+    return topology;
+  }
+};
+
+struct StageThreads {
+  int threads = 0;    // 0: the call site's default
+  std::string cores;  // empty: not pinned
+};
+
+class ThreadConfig {
+ public:
+  StageThreads stages[kStageCount];
+  // MNN power mode for unpinned stages: "high", "normal" or "low".
+  std::string power = "high";
+
+  static int stageIndex(const std::string &name) {
+    for (int i = 0; i < kStageCount; ++i)
+      if (name == kStageNames[i]) return i;
+    return -1;
+  }
+
+  int threads(Stage stage, int fallback) const {
+    return stages[stage].threads > 0 ? stages[stage].threads : fallback;
+  }
+
+  // Cores the stage is pinned to, or empty when it is not.
+  std::vector<int> cores(Stage stage) const {
+    return resolveCores(stages[stage].cores);
+  }
+
+  // Pinned stages run at normal power so MNN does not rebind its workers
+  // to the cores it picks for Power_High.
+  MNN::BackendConfig::PowerMode powerMode(Stage stage) const {
+    if (!stages[stage].cores.empty() || power == "normal")
+      return MNN::BackendConfig::Power_Normal;
+    return power == "low" ? MNN::BackendConfig::Power_Low
+                          : MNN::BackendConfig::Power_High;
+  }
+
+  // Sets the thread count of a CPU session for stage and its power mode.
+  // GPU sessions keep cfg.mode, which shares storage with numThread.
+  void apply(Stage stage, int fallback, MNN::ScheduleConfig &cfg,
+             MNN::BackendConfig &backend) const {
+    if (cfg.type == MNN_FORWARD_CPU) cfg.numThread = threads(stage, fallback);
+    backend.power = powerMode(stage);
+  }
+
+  // Comma-separated stage=threads[@cores] items, e.g.
+  // "unet=8@big,clip=2,vae_decoder=4@0-3,power=normal". "all" sets every
+  // stage.
+  void parse(const std::string &spec) {
+    size_t pos = 0;
+    while (pos < spec.size()) {
+      size_t end = spec.find(',', pos);
+      if (end == std::string::npos) end = spec.size();
+      const std::string item = spec.substr(pos, end - pos);
+      pos = end + 1;
+      if (item.empty()) continue;
+      size_t eq = item.find('=');
+      if (eq == std::string::npos)
+        throw std::invalid_argument("Invalid thread setting: " + item);
+      const std::string key = item.substr(0, eq);
+      const std::string value = item.substr(eq + 1);
+      if (key == "power") {
+        setPower(value);
+        continue;
+      }
+      size_t at = value.find('@');
+      StageThreads setting;
+      try {
+        setting.threads = std::stoi(value.substr(0, at));
+      } catch (const std::logic_error &) {
+        throw std::invalid_argument("Invalid thread count: " + item);
+      }
+      if (at != std::string::npos) setting.cores = value.substr(at + 1);
+      set(key, setting);
+    }
+  }
+
+  // {"unet": 8, "clip": {"threads": 2, "cores": "little"}, "power":
+  // "normal"}; the same keys as parse().
+  void update(const nlohmann::json &json) {
+    if (!json.is_object())
+      throw std::invalid_argument("threads must be an object");
+    for (const auto &[key, value] : json.items()) {
+      if (key == "power") {
+        if (!value.is_string())
+          throw std::invalid_argument("power must be a string");
+        setPower(value.get<std::string>());
+        continue;
+      }
+      StageThreads setting;
+      if (value.is_number_integer()) {
+        setting.threads = value.get<int>();
+      } else if (value.is_object()) {
+        const nlohmann::json threads =
+            value.value("threads", nlohmann::json(0));
+        const nlohmann::json cores = value.value("cores", nlohmann::json(""));
+        if (!threads.is_number_integer() || !cores.is_string())
+          throw std::invalid_argument("Invalid thread setting for " + key);
+        setting.threads = threads.get<int>();
+        setting.cores = cores.get<std::string>();
+      } else {
+        throw std::invalid_argument("Invalid thread setting for " + key);
+      }
+      set(key, setting);
+    }
+  }
+
+  nlohmann::json toJson() const {
+    nlohmann::json json = {{"power", power}};
+    for (int i = 0; i < kStageCount; ++i) {
+      if (stages[i].threads <= 0 && stages[i].cores.empty()) continue;
+      json[kStageNames[i]] = {{"threads", stages[i].threads},
+                              {"cores", stages[i].cores}};
+    }
+    return json;
+  }
+
+ private:
+  static std::vector<int> resolveCores(const std::string &cores) {
+    if (cores.empty()) return {};
+    const CpuTopology &topology = CpuTopology::get();
+    if (cores == "all") return topology.cores;
+    if (cores == "big") return topology.big;
+    if (cores == "little")
+      return topology.little.empty() ? topology.cores : topology.little;
+    return parseCpuList(cores);
+  }
+
+  void setPower(const std::string &value) {
+    if (value != "high" && value != "normal" && value != "low")
+      throw std::invalid_argument("Invalid power mode: " + value);
+    power = value;
+  }
+
+  void set(const std::string &key, const StageThreads &setting) {
+    if (setting.threads < 0)
+      throw std::invalid_argument("Negative thread count for " + key);
+    resolveCores(setting.cores);  // validates the list
+    if (key == "all") {
+      for (StageThreads &stage : stages) stage = setting;
+      return;
+    }
+    int index = stageIndex(key);
+    if (index < 0) throw std::invalid_argument("Unknown stage: " + key);
+    stages[index] = setting;
+  }
+};
+
+// Pins the calling thread to cores until destruction, then restores its
+// previous mask; a no-op for an empty list. MNN runs part of every
+// operator on the calling thread, and threads started while the mask is
+// set (MNN's worker pool is started by the first multi-threaded session)
+// inherit it.
+class AffinityScope {
+ public:
+  explicit AffinityScope(const std::vector<int> &cores) {
+#ifdef __linux__
+    if (cores.empty() || sched_getaffinity(0, sizeof(saved_), &saved_) != 0)
+      return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cores)
+      if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    pinned_ = sched_setaffinity(0, sizeof(set), &set) == 0;
+#endif
+  }
+
+  ~AffinityScope() {
+#ifdef __linux__
+    if (pinned_) sched_setaffinity(0, sizeof(saved_), &saved_);
+#endif
+  }
+
+  AffinityScope(const AffinityScope &) = delete;
+  AffinityScope &operator=(const AffinityScope &) = delete;
+
+ private:
+#ifdef __linux__
+  cpu_set_t saved_;
+#endif
+  bool pinned_ = false;
+};
+
+}  // namespace threading
+
+#endif  // THREAD_CONFIG_HPP
@@ -0,0 +1,205 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "json.hpp"
+
+// Per-request timeline recording in Chrome trace-event format, viewable in
+// chrome://tracing or ui.perfetto.dev. A request that asks for a trace opens
+// a Session; while it is open every Span on any thread is recorded, and on
+// close the timeline is kept for download under the session id. With no
+// session open a Span costs one atomic load.
+namespace trace {
+
+using Clock = std::chrono::high_resolution_clock;
+
+class Recorder {
+ public:
+  // Finished traces kept for download; older ones are dropped.
+  static constexpr size_t kKeptTraces = 8;
+
+  static Recorder &instance() {
+    static Recorder recorder;
+    return recorder;
+  }
+
+  bool active() const { return active_.load(std::memory_order_relaxed); }
+
+  // Starts recording. Only one trace records at a time; returns false if
+  // another session is open.
+  bool begin(const std::string &id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (active_.load(std::memory_order_relaxed)) return false;
+    id_ = id;
+    epoch_ = Clock::now();
+    events_.clear();
+    active_.store(true, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Stops recording and stores the timeline under the session id.
+  void end() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!active_.load(std::memory_order_relaxed)) return;
+    active_.store(false, std::memory_order_relaxed);
+    finished_.emplace_back(id_, render());
+    if (finished_.size() > kKeptTraces) finished_.pop_front();
+    events_.clear();
+    events_.shrink_to_fit();
+  }
+
+  // name and category must outlive the session (string literals).
+  void complete(const char *name, const char *category, Clock::time_point start,
+                Clock::time_point end, int index) {
+    if (!active()) return;
+    thread_local int tid = next_tid_.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!active_.load(std::memory_order_relaxed) || start < epoch_) return;
+    events_.push_back(
+        {name, category,
+         std::chrono::duration_cast<std::chrono::microseconds>(start - epoch_)
+             .count(),
+         std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+             .count(),
+         tid, index});
+  }
+
+  bool find(const std::string &id, std::string &json) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &[trace_id, trace_json] : finished_) {
+      if (trace_id == id) {
+        json = trace_json;
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  struct Event {
+    const char *name;
+    const char *category;
+    int64_t start_us;
+    int64_t dur_us;
+    int tid;
+    int index;
+  };
+
+  std::string render() const {
+    nlohmann::json events = nlohmann::json::array();
+    for (const Event &e : events_) {
+      nlohmann::json event = {{"name", e.name},   {"cat", e.category},
+                              {"ph", "X"},        {"ts", e.start_us},
+                              {"dur", e.dur_us},  {"pid", 1},
+                              {"tid", e.tid}};
+      if (e.index >= 0) event["args"] = {{"index", e.index}};
+      events.push_back(std::move(event));
+    }
+    return nlohmann::json{{"traceEvents", events},
+                          {"displayTimeUnit", "ms"},
+                          {"otherData", {{"id", id_}}}}
+        .dump();
+  }
+
+  std::atomic<bool> active_{false};
+  std::atomic<int> next_tid_{1};
+  mutable std::mutex mutex_;
+  std::string id_;
+  Clock::time_point epoch_;
+  std::vector<Event> events_;
+  std::deque<std::pair<std::string, std::string>> finished_;
+};
+
+// Records an interval that was already timed by the caller.
+inline void complete(const char *name, const char *category,
+                     Clock::time_point start, Clock::time_point end,
+                     int index = -1) {
+  Recorder &recorder = Recorder::instance();
+  if (recorder.active())
+    recorder.complete(name, category, start, end, index);
+}
+
+// Records the time from construction to end() or destruction. index, when
+// set, tells repeated spans apart (step or tile number).
+class Span {
+ public:
+  explicit Span(const char *name, const char *category = "sd", int index = -1)
+      : name_(name), category_(category), index_(index) {
+    if (Recorder::instance().active()) start_ = Clock::now();
+  }
+  ~Span() { end(); }
+
+  Span(const Span &) = delete;
+  Span &operator=(const Span &) = delete;
+
+  void end() {
+    if (!name_) return;
+    if (start_ != Clock::time_point())
+      complete(name_, category_, start_, Clock::now(), index_);
+    name_ = nullptr;
+  }
+
+ private:
+  const char *name_;
+  const char *category_;
+  int index_;
+  Clock::time_point start_;
+};
+
+// Records everything until end() or destruction under id; a no-op for an
+// empty id.
+class Session {
+ public:
+  explicit Session(const std::string &id) {
+    if (!id.empty()) recording_ = Recorder::instance().begin(id);
+    id_ = recording_ ? id : "";
+  }
+  ~Session() { end(); }
+
+  Session(const Session &) = delete;
+  Session &operator=(const Session &) = delete;
+
+  // Id the trace is stored under, or empty when nothing is recorded
+  // (tracing not requested, or another trace was already recording).
+  const std::string &id() const { return id_; }
+
+  void end() {
+    if (recording_) Recorder::instance().end();
+    recording_ = false;
+  }
+
+ private:
+  bool recording_ = false;
+  std::string id_;
+};
+
+// Unique id for a new trace.
+inline std::string newId() {
+  static std::atomic<uint32_t> counter{0};
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::system_clock::now().time_since_epoch())
+                .count();
+  char id[32];
+  snprintf(id, sizeof(id), "%llx%04x", (unsigned long long)ms,
+           counter.fetch_add(1, std::memory_order_relaxed) & 0xffff);
+  return id;
+}
+
+}  // namespace trace
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+// Span covering the rest of the enclosing scope.
+#define TRACE_SCOPE(...) \
+  trace::Span TRACE_CONCAT(trace_span_, __LINE__)(__VA_ARGS__)
+
+#endif  // TRACE_HPP
@@ -0,0 +1,124 @@
+#ifndef WORKER_POOL_HPP
+#define WORKER_POOL_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace threading {
+
+// Threads kept between calls for CPU work outside the MNN sessions that
+// splits into a few independent tasks, e.g. the channels of an inpainting
+// blend. Workers start on first use and wait for the next run() until the
+// pool is destroyed. One run uses the pool at a time; a run that finds it
+// busy executes its tasks on the calling thread instead of waiting.
+class WorkerPool {
+ public:
+  WorkerPool() = default;
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread &worker : workers_) worker.join();
+  }
+
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+
+  // Calls task(0) .. task(count - 1) on up to threads threads, the calling
+  // one included, and returns when all are done. The first exception a
+  // task throws is rethrown here once the others have finished.
+  void run(int count, int threads, const std::function<void(int)> &task) {
+    std::unique_lock<std::mutex> busy(run_mutex_, std::try_to_lock);
+    const int helpers =
+        busy.owns_lock() ? std::min(count, std::max(threads, 1)) - 1 : 0;
+    if (helpers <= 0) {
+      for (int i = 0; i < count; ++i) task(i);
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      while ((int)workers_.size() < helpers) {
+        const int index = (int)workers_.size();
+        workers_.emplace_back([this, index] { work(index); });
+      }
+      task_ = &task;
+      count_ = count;
+      next_ = 0;
+      pending_ = count;
+      helpers_ = helpers;
+      ++generation_;
+    }
+    wake_.notify_all();
+    drain();
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this] { return pending_ == 0; });
+    task_ = nullptr;
+    count_ = 0;
+    if (error_) std::rethrow_exception(std::exchange(error_, nullptr));
+  }
+
+ private:
+  void work(int index) {
+    unsigned seen = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      wake_.wait(lock, [&] {
+        return stop_ || (generation_ != seen && index < helpers_);
+      });
+      if (stop_) return;
+      seen = generation_;
+      lock.unlock();
+      drain();
+      lock.lock();
+    }
+  }
+
+  // Runs tasks of the current run until none is left to start.
+  void drain() {
+    while (true) {
+      int i;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (next_ >= count_) return;
+        i = next_++;
+      }
+      std::exception_ptr error;
+      try {
+        (*task_)(i);
+      } catch (...) {
+        error = std::current_exception();
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (error && !error_) error_ = error;
+      if (--pending_ == 0) done_.notify_all();
+    }
+  }
+
+  std::mutex run_mutex_;  // held by the run using the workers
+  std::mutex mutex_;
+  std::condition_variable wake_;  // a run started, or the pool stops
+  std::condition_variable done_;  // the last task of a run finished
+  std::vector<std::thread> workers_;
+  const std::function<void(int)> *task_ = nullptr;
+  int count_ = 0;
+  int next_ = 0;
+  int pending_ = 0;
+  int helpers_ = 0;  // workers taking part in the current run
+  unsigned generation_ = 0;
+  std::exception_ptr error_;
+  bool stop_ = false;
+};
+
+}  // namespace threading
+
+#endif  // WORKER_POOL_HPP
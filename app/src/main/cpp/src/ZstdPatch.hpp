@@ -0,0 +1,121 @@
+#ifndef ZSTD_PATCH_HPP
+#define ZSTD_PATCH_HPP
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "MappedFile.hpp"
+
+#define ZSTD_STATIC_LINKING_ONLY  // ZSTD_d_stableOutBuffer, window limits
+#include "zstd.h"
+
+// Applies patches made with `zstd --patch-from=<base>`. The base and patch
+// stay mapped instead of being read into buffers, the base serves as the
+// decompression prefix in place, and the result is decompressed straight
+// into its destination (a mapped file or one buffer) a chunk of patch at a
+// time. Nothing but the destination grows with the model size.
+namespace zstd_patch {
+
+// Bytes decompressed so far out of the patched size.
+using Progress = std::function<void(uint64_t done, uint64_t total)>;
+
+// Size of the patched file, from the patch's frame header.
+inline uint64_t patchedSize(const MappedFile &patch) {
+  const unsigned long long size =
+      ZSTD_getFrameContentSize(patch.data(), patch.size());
+  if (patch.size() == 0 || size == ZSTD_CONTENTSIZE_ERROR)
+    throw std::runtime_error("Patch file (" + patch.path() +
+                             ") is not a valid zstd frame.");
+  if (size == ZSTD_CONTENTSIZE_UNKNOWN)
+    throw std::runtime_error("Patch file (" + patch.path() +
+                             ") does not record its decompressed size.");
+  return size;
+}
+
+// Decompresses patch against base into out, which holds exactly
+// patchedSize(patch) bytes.
+inline void apply(const MappedFile &base, const MappedFile &patch,
+                  uint8_t *out, uint64_t out_size,
+                  const Progress &progress = nullptr) {
+  const size_t kChunkBytes = 16 << 20;
+  std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx *)> dctx(ZSTD_createDCtx(),
+                                                          ZSTD_freeDCtx);
+  if (!dctx) throw std::runtime_error("ZSTD_createDCtx() failed!");
+  auto check = [](size_t ret, const char *call) {
+    if (ZSTD_isError(ret))
+      throw std::runtime_error(std::string(call) +
+                               " failed: " + ZSTD_getErrorName(ret));
+    return ret;
+  };
+  // --patch-from windows span the whole base. The output buffer is stable,
+  // so the decoder matches against it instead of allocating a window.
+  check(ZSTD_DCtx_setParameter(dctx.get(), ZSTD_d_windowLogMax,
+                               ZSTD_WINDOWLOG_MAX),
+        "ZSTD_d_windowLogMax");
+  check(ZSTD_DCtx_setParameter(dctx.get(), ZSTD_d_stableOutBuffer, 1),
+        "ZSTD_d_stableOutBuffer");
+  check(ZSTD_DCtx_refPrefix(dctx.get(), base.data(), base.size()),
+        "ZSTD_DCtx_refPrefix");
+
+  base.advise(MADV_WILLNEED);
+  patch.advise(MADV_SEQUENTIAL);
+  ZSTD_inBuffer input = {patch.data(), 0, 0};
+  ZSTD_outBuffer output = {out, (size_t)out_size, 0};
+  size_t remaining = 1;
+  while (remaining != 0) {
+    input.size = std::min<size_t>(patch.size(), input.pos + kChunkBytes);
+    const size_t in_before = input.pos;
+    const size_t out_before = output.pos;
+    remaining = check(ZSTD_decompressStream(dctx.get(), &output, &input),
+                      "ZSTD_decompressStream");
+    if (remaining != 0 && input.pos == in_before && output.pos == out_before)
+      throw std::runtime_error("Patch file (" + patch.path() +
+                               ") is truncated.");
+    if (progress) progress(output.pos, out_size);
+  }
+  if (output.pos != out_size)
+    throw std::runtime_error("Patch produced " + std::to_string(output.pos) +
+                             " of " + std::to_string(out_size) + " bytes.");
+}
+
+// Names the result of patching base with patch, for caching it: FNV-1a
+// over the whole patch, the base's size, inode and modification time, and
+// its first and last MB. Hashing all of a multi-GB base would cost as much
+// as patching it; the file identity catches a base replaced in place.
+inline std::string cacheKey(const MappedFile &base, const MappedFile &patch) {
+  struct stat st;
+  if (::stat(base.path().c_str(), &st) != 0)
+    throw std::runtime_error("Failed to stat " + base.path() + ": " +
+                             std::strerror(errno));
+  uint64_t hash = 14695981039346656037ull;
+  auto mix = [&hash](const uint8_t *data, uint64_t size) {
+    for (uint64_t i = 0; i < size; ++i) {
+      hash ^= data[i];
+      hash *= 1099511628211ull;
+    }
+  };
+  mix(patch.data(), patch.size());
+  const uint64_t identity[] = {
+      base.size(), (uint64_t)st.st_dev, (uint64_t)st.st_ino,
+      (uint64_t)st.st_mtim.tv_sec, (uint64_t)st.st_mtim.tv_nsec};
+  mix(reinterpret_cast<const uint8_t *>(identity), sizeof(identity));
+  const uint64_t edge = std::min<uint64_t>(base.size(), 1 << 20);
+  mix(base.data(), edge);
+  mix(base.data() + base.size() - edge, edge);
+  char key[17];
+  snprintf(key, sizeof(key), "%016llx", (unsigned long long)hash);
+  return key;
+}
+
+}  // namespace zstd_patch
+
+#endif  // ZSTD_PATCH_HPP
@@ -1,25 +1,58 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <filesystem>
 #include <functional>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <numeric>
 #include <random>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
+#include "Buckets.hpp"
+#include "CancellationToken.hpp"
 #include "Config.hpp"
 #include "DPMSolverMultistepScheduler.hpp"
 #include "EulerAncestralDiscreteScheduler.hpp"
 #include "FloatConversion.hpp"
+#include "InferenceBackend.hpp"
 #include "LCMScheduler.hpp"
 #include "LaplacianBlend.hpp"
+#include "Log.hpp"
+#include "MappedFile.hpp"
+#include "Metrics.hpp"
+#include "MnnBackend.hpp"
+#include "PhiloxRandom.hpp"
+#include "Prefetch.hpp"
+#include "PreviewWorker.hpp"
 #include "PromptProcessor.hpp"
-#include "QnnModel.hpp"
+#include "Residency.hpp"
 #include "SDUtils.hpp"
 #include "SafeTensor2MNN.hpp"
 #include "Scheduler.hpp"
+#include "StageGraph.hpp"
+#include "ThreadConfig.hpp"
+#include "Trace.hpp"
+#include "WorkerPool.hpp"
+#include "ZstdPatch.hpp"
+
+#ifdef SD_BENCH
+#include "Bench.hpp"
+#endif
+
+#ifdef SD_WITH_QNN
+#include "QnnBackend.hpp"
+#include "QnnModel.hpp"
 
 // QNN Headers
 #include "BuildId.hpp"
@@ -28,6 +61,32 @@
 #include "PAL/DynamicLoading.hpp"
 #include "PAL/GetOpt.hpp"
 #include "QnnSampleAppUtils.hpp"
+#else
+#include <getopt.h>
+#undef no_argument
+#undef required_argument
+
+// Host builds without the QNN SampleApp: map its PAL getopt wrapper onto
+// getopt_long_only, which has the same semantics.
+namespace pal {
+struct Option {
+  const char *name;
+  int hasArg;
+  int *flag;
+  int val;
+};
+constexpr int no_argument = 0;
+constexpr int required_argument = 1;
+inline char *&g_optArg = ::optarg;
+inline int getOptLongOnly(int argc, char **argv, const char *shortOpts,
+                          const Option *longOpts, int *longIndex) {
+  static_assert(sizeof(Option) == sizeof(::option), "option layout");
+  return ::getopt_long_only(argc, argv, shortOpts,
+                            reinterpret_cast<const ::option *>(longOpts),
+                            longIndex);
+}
+}  // namespace pal
+#endif
 
 // External Libraries
 #include "httplib.h"
@@ -38,6 +97,7 @@
 #include <MNN/MNNDefine.h>
 
 #include <MNN/Interpreter.hpp>
+#include "MNN_generated.h"  // model schema, for declared input shapes
 
 // Xtensor
 #include <xtensor/xadapt.hpp>
@@ -52,8 +112,6 @@
 #include <xtensor/xrandom.hpp>
 #include <xtensor/xview.hpp>
 
-#include "zstd.h"
-
 int port = 8081;
 std::string listen_address = "127.0.0.1";
 bool use_v_pred = false;
@@ -64,7 +122,34 @@ bool use_clip_v2 = false;
 bool upscaler_mode = false;
 bool sdxl_mode = false;
 bool lowram_mode = false;
+bool autotune_threads = false;
 float nsfw_threshold = 0.5f;
+// MNN thread counts and affinity: <model dir>/threads.json, then --threads.
+// A request's "threads" field overrides it for that request.
+threading::ThreadConfig thread_config;
+// Decides when on-demand models are released. Its budget comes from
+// --memory_budget, or is 0 with --lowram; without either, models load at
+// startup and stay resident.
+ResidencyManager residency;
+// Reads on-demand models into the page cache before their stage, up to
+// --prefetch MB ahead of use (default 1024, 0 disables).
+ModelPrefetcher prefetcher(int64_t(1024) << 20);
+// Blends the channels of inpainted images; started on first use.
+threading::WorkerPool blend_workers;
+// UNet steps left when the VAE decoder starts being read in.
+const int decoder_prefetch_steps = 3;
+// --stream_unet: the MNN UNet parts listed in <model dir>/unet_parts.json,
+// and how many bytes of leading parts stay loaded between steps.
+std::vector<std::string> unet_parts;
+int64_t unet_parts_keep = 0;
+// --deepcache: the full and shallow MNN UNet graphs listed in
+// <model dir>/deepcache.json, and the request's "deepcache_interval" (a
+// full UNet every that many steps, 0 or 1 for every step).
+std::string deepcache_full, deepcache_shallow;
+int deepcache_interval = 0;
+// --buckets: the sizes /generate snaps requests to; on MNN their OpenCL
+// tuning caches are written at startup.
+ResolutionBuckets resolution_buckets;
 std::string clipPath, clip2Path, unetPath, vaeDecoderPath, vaeEncoderPath,
     safetyCheckerPath, tokenizerPath, patchPath, modelDir, upscalerPath;
 std::vector<float> pos_emb;
@@ -73,11 +158,18 @@ std::vector<float> pos_emb_2;
 std::vector<uint16_t> token_emb_2;  // SDXL encoder 2 token embeddings (FP16)
 std::shared_ptr<tokenizers::Tokenizer> tokenizer;
 PromptProcessor promptProcessor;
+#ifdef SD_WITH_QNN
 std::unique_ptr<QnnModel> clipApp = nullptr;
 std::unique_ptr<QnnModel> unetApp = nullptr;
 std::unique_ptr<QnnModel> vaeDecoderApp = nullptr;
 std::unique_ptr<QnnModel> vaeEncoderApp = nullptr;
 std::unique_ptr<QnnModel> upscalerApp = nullptr;
+#endif
+// Model execution: MNN is always available, QNN only in builds with the SDK.
+// --cpu runs everything on mnnBackend; --use_cpu_clip moves only the SD1.5
+// text encoder there.
+std::unique_ptr<MnnBackend> mnnBackend;
+std::unique_ptr<InferenceBackend> qnnBackend;
 MNN::Interpreter *clipInterpreter = nullptr;
 MNN::Interpreter *clip2Interpreter = nullptr;
 MNN::Interpreter *unetInterpreter = nullptr;
@@ -88,6 +180,10 @@ MNN::Interpreter *safetyCheckerInterpreter = nullptr;
 // MNN Session Pointers
 MNN::Session *clipSession = nullptr;
 MNN::Session *clip2Session = nullptr;
+// Prompts per run of the SDXL text encoder sessions: 2 when the negative
+// and positive prompt are encoded as one batch.
+int clipBatch = 1;
+int clip2Batch = 1;
 MNN::Session *unetSession = nullptr;
 MNN::Session *vaeDecoderSession = nullptr;
 MNN::Session *vaeEncoderSession = nullptr;
@@ -115,13 +211,42 @@ std::vector<float> img_data;
 std::vector<float> mask_data;
 std::vector<float> mask_data_full;
 float denoise_strength;
+// Hires fix: the size of a second, short img2img pass over the bicubically
+// upscaled latents of the first one (0 x 0 when off), the steps it runs and
+// the share of the schedule they cover.
+int hires_width = 0;
+int hires_height = 0;
+int hires_steps = 0;
+float hires_denoise = 0.5f;
+// Tiled UNet: "tile_unet" denoises MNN outputs above 512x512 in windows,
+// which the fixed-size QNN UNet always does; "tile_batch" windows share a
+// UNet call, trading memory for throughput.
+bool request_tile_unet = false;
+int unet_tile_batch = 1;
+const int max_unet_tile_batch = 8;
 bool request_img2img;
 bool request_has_mask;
-bool use_opencl;
 
 bool cvt_model = false;
 bool show_diffusion_process = false;
 int show_diffusion_stride = 1;
+// Number of images generated per /generate request. They share the text
+// encoding and run through the UNet as one batch.
+int batch_count = 1;
+const int max_batch_count = 8;
+
+// Cancellation of /generate requests: each gets its own token under its
+// request id when it is accepted, set by /cancel with that id or when its
+// client stops reading the stream.
+CancellationRegistry generation_cancels;
+
+// Served on /metrics.
+metrics::ServerMetrics server_metrics;
+
+// Receives the duration of each pipeline stage as it completes: "clip",
+// "vae_encode", "unet_step", "vae_decode" and "safety_check". Unset in the
+// server; sd_bench collects its statistics here.
+std::function<void(const char *stage, double ms)> stage_observer;
 
 struct PatchedModelBuffer {
   std::shared_ptr<uint8_t> buffer;
@@ -132,6 +257,11 @@ struct PatchedModelBuffer {
   PatchedModelBuffer(uint8_t *buf, uint64_t sz)
       : buffer(buf, std::default_delete<uint8_t[]>()), size(sz) {}
 
+  // Shares the mapping's lifetime with buffer.
+  explicit PatchedModelBuffer(std::shared_ptr<MappedFile> mapping)
+      : buffer(mapping, const_cast<uint8_t *>(mapping->data())),
+        size(mapping->size()) {}
+
   void reset() {
     buffer.reset();
     size = 0;
@@ -142,26 +272,40 @@ std::unique_ptr<PatchedModelBuffer> g_unetPatchedBuffer;
 std::string model_dir;
 bool clip_skip_2 = false;
 
+#ifdef SD_WITH_QNN
 // QNN function pointers and backend path for dynamic model loading
 QnnFunctionPointers g_qnnSystemFuncs;
 std::string g_backendPathCmd;
 
-// Global function to create QNN models dynamically
+// Global function to create QNN models dynamically. The backend library is
+// loaded and its interface resolved by the first call; later models reuse
+// them, as they share the backend itself (QnnModel::initializeSharedBackend).
 std::unique_ptr<QnnModel> createQnnModel(const std::string &modelPath,
                                          const std::string &modelName) {
   using namespace qnn::tools;
-  QnnFunctionPointers funcs = g_qnnSystemFuncs;
-  void *backendHandle = nullptr;
+  static std::mutex backendMutex;
+  static QnnFunctionPointers backendFuncs;
+  static void *backendHandle = nullptr;
   void *modelHandle = nullptr;
-  dynamicloadutil::StatusCode drvStatus =
-      dynamicloadutil::getQnnFunctionPointers(g_backendPathCmd, modelPath,
-                                              &funcs, &backendHandle, false,
-                                              &modelHandle);
-  if (drvStatus != dynamicloadutil::StatusCode::SUCCESS) {
-    QNN_ERROR("Failed get QNN func ptrs for %s.", modelName.c_str());
-    if (modelHandle) dlclose(modelHandle);
-    return nullptr;
+  {
+    std::lock_guard<std::mutex> lock(backendMutex);
+    if (!backendHandle) {
+      QnnFunctionPointers loaded = g_qnnSystemFuncs;
+      void *handle = nullptr;
+      dynamicloadutil::StatusCode drvStatus =
+          dynamicloadutil::getQnnFunctionPointers(g_backendPathCmd, modelPath,
+                                                  &loaded, &handle, false,
+                                                  &modelHandle);
+      if (drvStatus != dynamicloadutil::StatusCode::SUCCESS) {
+        QNN_ERROR("Failed get QNN func ptrs for %s.", modelName.c_str());
+        if (modelHandle) dlclose(modelHandle);
+        return nullptr;
+      }
+      backendFuncs = loaded;
+      backendHandle = handle;
+    }
   }
+  QnnFunctionPointers funcs = backendFuncs;
   std::string inputListPaths, opPackagePaths, outputPath, saveBinaryName;
   bool debug = false;
   bool dumpOutputs = false;
@@ -174,117 +318,30 @@ std::unique_ptr<QnnModel> createQnnModel(const std::string &modelPath,
       outputDataType, inputDataType, profilingLevel, dumpOutputs, modelPath,
       saveBinaryName);
   // Hand off the model library handle so the QnnModel destructor can dlclose
-  // it. Otherwise lowram mode leaks one .so handle per load cycle.
+  // it. Otherwise on-demand loading leaks one .so handle per load cycle.
   if (app) app->m_modelHandle = modelHandle;
   return app;
 }
+#endif
 
 namespace qnn {
 namespace tools {
 namespace sample_app {
 
-std::vector<char> readFileForPatch(const std::string &filePath) {
-  std::ifstream file(filePath, std::ios::binary | std::ios::ate);
-  if (!file.is_open()) {
-    throw std::runtime_error("Failed to open file: " + filePath);
-  }
-  std::streamsize size = file.tellg();
-  file.seekg(0, std::ios::beg);
-  std::vector<char> buffer(size);
-  if (size > 0) {
-    if (!file.read(buffer.data(), size)) {
-      throw std::runtime_error("Failed to read file: " + filePath);
-    }
-  }
-  return buffer;
-}
-
-void writeFileForPatch(const std::string &filePath,
-                       const std::vector<char> &data) {
-  std::ofstream file(filePath, std::ios::binary);
-  if (!file.is_open()) {
-    throw std::runtime_error("Failed to open file for writing: " + filePath);
-  }
-  if (!data.empty()) {
-    if (!file.write(data.data(), data.size())) {
-      throw std::runtime_error("Failed to write file: " + filePath);
-    }
-  }
-}
-
+// Applies the zstd patch at patchFilePath to oldFilePath, writing the result
+// to newFilePath.
 int applyZstdPatch(const std::string &oldFilePath,
                    const std::string &patchFilePath,
                    const std::string &newFilePath) {
   try {
-    std::vector<char> oldFileBuffer = readFileForPatch(oldFilePath);
-    QNN_INFO("Read old file (%s): %zu bytes.", oldFilePath.c_str(),
-             oldFileBuffer.size());
-
-    std::vector<char> patchFileBuffer = readFileForPatch(patchFilePath);
-    QNN_INFO("Read patch file (%s): %zu bytes.", patchFilePath.c_str(),
-             patchFileBuffer.size());
-
-    if (patchFileBuffer.empty()) {
-      throw std::runtime_error("Patch file (" + patchFilePath +
-                               ") is empty or could not be read.");
-    }
-
-    unsigned long long const decompressedSize = ZSTD_getFrameContentSize(
-        patchFileBuffer.data(), patchFileBuffer.size());
-
-    if (decompressedSize == ZSTD_CONTENTSIZE_ERROR) {
-      throw std::runtime_error("Patch file (" + patchFilePath +
-                               ") is not a valid zstd frame.");
-    }
-    if (decompressedSize == ZSTD_CONTENTSIZE_UNKNOWN) {
-      throw std::runtime_error(
-          "Decompressed size is unknown. Cannot proceed with this simple "
-          "implementation.");
-    }
-
-    std::vector<char> newFileBuffer;
-    if (decompressedSize > 0) {
-      newFileBuffer.resize(decompressedSize);
-    } else {
-      writeFileForPatch(newFilePath, newFileBuffer);
-      QNN_INFO(
-          "Successfully applied patch (resulting in an empty file). New file "
-          "saved to: %s",
-          newFilePath.c_str());
-      return 0;
-    }
-
-    ZSTD_DCtx *const dctx = ZSTD_createDCtx();
-    if (dctx == nullptr) {
-      throw std::runtime_error("ZSTD_createDCtx() failed!");
-    }
-
-    size_t const actualDecompressedSize = ZSTD_decompress_usingDict(
-        dctx, newFileBuffer.data(), newFileBuffer.size(),
-        patchFileBuffer.data(), patchFileBuffer.size(), oldFileBuffer.data(),
-        oldFileBuffer.size());
-
-    ZSTD_freeDCtx(dctx);
-
-    if (ZSTD_isError(actualDecompressedSize)) {
-      throw std::runtime_error(
-          "ZSTD_decompress_usingDict() failed: " +
-          std::string(ZSTD_getErrorName(actualDecompressedSize)));
-    }
-
-    if (actualDecompressedSize != decompressedSize) {
-      if (actualDecompressedSize < newFileBuffer.size()) {
-        newFileBuffer.resize(actualDecompressedSize);
-      }
-    }
-
-    QNN_INFO("Decompressed %zu bytes into new file buffer.",
-             actualDecompressedSize);
-
-    writeFileForPatch(newFilePath, newFileBuffer);
+    MappedFile base(oldFilePath);
+    MappedFile patch(patchFilePath);
+    const uint64_t size = zstd_patch::patchedSize(patch);
+    MappedFile out(newFilePath, size);
+    if (size > 0) zstd_patch::apply(base, patch, out.mutableData(), size);
+    out.sync();
     QNN_INFO("Successfully applied patch. New file saved to: %s",
              newFilePath.c_str());
-
   } catch (const std::exception &e) {
     QNN_ERROR("Error applying patch: %s", e.what());
     return 1;
@@ -292,66 +349,92 @@ int applyZstdPatch(const std::string &oldFilePath,
   return 0;
 }
 
+// Patched files are cached next to their patch as
+// unet.patched.<patch stem>.<key>.bin, e.g. unet.patched.512x768.<key>.bin
+// for 512x768.patch, so the caches of several patches coexist.
+static const char *kPatchCachePrefix = "unet.patched.";
+
+// Whether name is prefix followed by a cache key and ".bin".
+static bool isPatchCacheName(const std::string &name,
+                             const std::string &prefix) {
+  const size_t key_size = 16;
+  if (name.size() != prefix.size() + key_size + 4 ||
+      name.compare(0, prefix.size(), prefix) != 0 ||
+      name.compare(prefix.size() + key_size, 4, ".bin") != 0)
+    return false;
+  return std::all_of(name.begin() + prefix.size(),
+                     name.begin() + prefix.size() + key_size,
+                     [](char c) { return std::isxdigit((unsigned char)c); });
+}
+
+// Logs patch progress every 10%.
+static zstd_patch::Progress patchProgress() {
+  auto logged = std::make_shared<int>(0);
+  return [logged](uint64_t done, uint64_t total) {
+    const int percent = total ? (int)(done * 100 / total) : 100;
+    if (percent / 10 == *logged / 10) return;
+    *logged = percent;
+    QNN_INFO("Patching: %d%%", percent);
+  };
+}
+
+// Patches oldFilePath and returns the result mapped read-only. The result
+// is cached next to the patch under a key of both inputs, so later starts
+// only map it; this patch's stale cached results are removed. When the
+// cache cannot be written (e.g. no space), the patch is applied into a heap
+// buffer instead.
 std::unique_ptr<PatchedModelBuffer> applyZstdPatchToBuffer(
     const std::string &oldFilePath, const std::string &patchFilePath) {
+  namespace fs = std::filesystem;
   try {
-    std::vector<char> oldFileBuffer = readFileForPatch(oldFilePath);
-    QNN_INFO("Read old file (%s): %zu bytes.", oldFilePath.c_str(),
-             oldFileBuffer.size());
-
-    std::vector<char> patchFileBuffer = readFileForPatch(patchFilePath);
-    QNN_INFO("Read patch file (%s): %zu bytes.", patchFilePath.c_str(),
-             patchFileBuffer.size());
-
-    if (patchFileBuffer.empty()) {
-      throw std::runtime_error("Patch file (" + patchFilePath +
-                               ") is empty or could not be read.");
-    }
-
-    unsigned long long const decompressedSize = ZSTD_getFrameContentSize(
-        patchFileBuffer.data(), patchFileBuffer.size());
-
-    if (decompressedSize == ZSTD_CONTENTSIZE_ERROR) {
-      throw std::runtime_error("Patch file (" + patchFilePath +
-                               ") is not a valid zstd frame.");
-    }
-    if (decompressedSize == ZSTD_CONTENTSIZE_UNKNOWN) {
-      throw std::runtime_error(
-          "Decompressed size is unknown. Cannot proceed with this simple "
-          "implementation.");
-    }
-
-    if (decompressedSize == 0) {
+    MappedFile base(oldFilePath);
+    MappedFile patch(patchFilePath);
+    const uint64_t size = zstd_patch::patchedSize(patch);
+    if (size == 0) {
       QNN_ERROR("Patch resulted in empty buffer.");
       return nullptr;
     }
 
-    uint8_t *newBuffer = new uint8_t[decompressedSize];
-
-    ZSTD_DCtx *const dctx = ZSTD_createDCtx();
-    if (dctx == nullptr) {
-      delete[] newBuffer;
-      throw std::runtime_error("ZSTD_createDCtx() failed!");
+    fs::path dir = fs::path(patchFilePath).parent_path();
+    if (dir.empty()) dir = ".";
+    const std::string prefix = kPatchCachePrefix +
+                               fs::path(patchFilePath).stem().string() + ".";
+    const fs::path cached =
+        dir / (prefix + zstd_patch::cacheKey(base, patch) + ".bin");
+    // Older versions cached every patch as unet.patched.<key>.bin.
+    std::error_code ec;
+    for (const auto &entry : fs::directory_iterator(dir, ec)) {
+      const std::string name = entry.path().filename().string();
+      if ((isPatchCacheName(name, prefix) ||
+           isPatchCacheName(name, kPatchCachePrefix)) &&
+          entry.path() != cached && fs::remove(entry.path(), ec))
+        QNN_INFO("Removed stale patched file: %s", name.c_str());
     }
 
-    size_t const actualDecompressedSize = ZSTD_decompress_usingDict(
-        dctx, newBuffer, decompressedSize, patchFileBuffer.data(),
-        patchFileBuffer.size(), oldFileBuffer.data(), oldFileBuffer.size());
-
-    ZSTD_freeDCtx(dctx);
-
-    if (ZSTD_isError(actualDecompressedSize)) {
-      delete[] newBuffer;
-      throw std::runtime_error(
-          "ZSTD_decompress_usingDict() failed: " +
-          std::string(ZSTD_getErrorName(actualDecompressedSize)));
+    if (fs::file_size(cached, ec) != size) {
+      const std::string partial = cached.string() + ".tmp";
+      try {
+        MappedFile out(partial, size);
+        zstd_patch::apply(base, patch, out.mutableData(), size,
+                          patchProgress());
+        out.sync();
+        fs::rename(partial, cached);
+      } catch (const std::exception &e) {
+        fs::remove(partial, ec);
+        QNN_WARN("Could not cache the patched file (%s); patching in memory",
+                 e.what());
+        auto result = std::make_unique<PatchedModelBuffer>(new uint8_t[size],
+                                                           size);
+        zstd_patch::apply(base, patch, result->buffer.get(), size,
+                          patchProgress());
+        return result;
+      }
+      QNN_INFO("Applied patch, cached as %s", cached.c_str());
+    } else {
+      QNN_INFO("Using cached patched file %s", cached.c_str());
     }
-
-    QNN_INFO("Successfully applied patch to buffer. Decompressed %zu bytes.",
-             actualDecompressedSize);
-
-    return std::make_unique<PatchedModelBuffer>(newBuffer,
-                                                actualDecompressedSize);
+    return std::make_unique<PatchedModelBuffer>(
+        std::make_shared<MappedFile>(cached.string()));
 
   } catch (const std::exception &e) {
     QNN_ERROR("Error applying patch to buffer: %s", e.what());
@@ -359,11 +442,13 @@ std::unique_ptr<PatchedModelBuffer> applyZstdPatchToBuffer(
   }
 }
 
+#ifdef SD_WITH_QNN
 // QnnModel Initialization
 template <typename AppType>
 int initializeQnnApp(const std::string &modelName,
                      std::unique_ptr<AppType> &app,
-                     const uint8_t *buffer = nullptr, uint64_t bufferSize = 0) {
+                     std::shared_ptr<const uint8_t> buffer = nullptr,
+                     uint64_t bufferSize = 0) {
   if (!app) return EXIT_FAILURE;
 
   if (buffer && bufferSize > 0) {
@@ -375,27 +460,22 @@ int initializeQnnApp(const std::string &modelName,
 
   if (StatusCode::SUCCESS != app->initialize())
     return app->reportError(modelName + " Init failure");
-  if (StatusCode::SUCCESS != app->initializeBackend())
+  if (StatusCode::SUCCESS != app->initializeSharedBackend())
     return app->reportError(modelName + " Backend Init failure");
-  auto devPropStat = app->isDevicePropertySupported();
-  if (StatusCode::FAILURE != devPropStat) {
-    if (StatusCode::SUCCESS != app->createDevice())
-      return app->reportError(modelName + " Device Creation failure");
-  }
   if (StatusCode::SUCCESS != app->initializeProfiling())
     return app->reportError(modelName + " Profiling Init failure");
   if (StatusCode::SUCCESS != app->registerOpPackages())
     return app->reportError(modelName + " Register Op Packages failure");
 
   if (buffer && bufferSize > 0) {
-    if (StatusCode::SUCCESS != app->createFromBuffer(buffer, bufferSize))
+    if (StatusCode::SUCCESS != app->createFromSharedBuffer(buffer, bufferSize))
       return app->reportError(modelName + " Create From Buffer failure");
   } else {
-    if (StatusCode::SUCCESS != app->createFromBinary())
+    if (StatusCode::SUCCESS != app->createFromMappedBinary())
       return app->reportError(modelName + " Create From Binary failure");
   }
 
-  if (StatusCode::SUCCESS != app->enablePerformaceMode())
+  if (StatusCode::SUCCESS != app->enableSharedPerformanceMode())
     return app->reportError(modelName + " Enable Performance Mode failure");
 
   if (buffer && bufferSize > 0) {
@@ -405,6 +485,7 @@ int initializeQnnApp(const std::string &modelName,
   }
   return EXIT_SUCCESS;
 }
+#endif
 
 void showHelp() {}
 
@@ -432,6 +513,13 @@ void processCommandLine(int argc, char **argv) {
     OPT_UPSCALER_MODE = 32,
     OPT_SDXL = 33,
     OPT_LOWRAM = 34,
+    OPT_THREADS = 35,
+    OPT_AUTOTUNE_THREADS = 36,
+    OPT_MEMORY_BUDGET = 37,
+    OPT_PREFETCH = 38,
+    OPT_STREAM_UNET = 39,
+    OPT_BUCKETS = 40,
+    OPT_DEEPCACHE = 41,
     OPT_BACKEND = 3,
     OPT_LOG_LEVEL = 10,
     OPT_VERSION = 13,
@@ -456,17 +544,31 @@ void processCommandLine(int argc, char **argv) {
       {"clip", pal::required_argument, NULL, OPT_CLIP},
       {"unet", pal::required_argument, NULL, OPT_UNET},
       {"vae_decoder", pal::required_argument, NULL, OPT_VAE_DECODER},
+#ifdef SD_WITH_QNN
       {"backend", pal::required_argument, NULL, OPT_BACKEND},
       {"log_level", pal::required_argument, NULL, OPT_LOG_LEVEL},
       {"system_library", pal::required_argument, NULL, OPT_SYSTEM_LIBRARY},
       {"version", pal::no_argument, NULL, OPT_VERSION},
+#endif
       {"patch", pal::required_argument, NULL, OPT_PATCH},
       {"upscaler_mode", pal::no_argument, NULL, OPT_UPSCALER_MODE},
       {"sdxl", pal::no_argument, NULL, OPT_SDXL},
       {"lowram", pal::no_argument, NULL, OPT_LOWRAM},
+      {"threads", pal::required_argument, NULL, OPT_THREADS},
+      {"autotune_threads", pal::no_argument, NULL, OPT_AUTOTUNE_THREADS},
+      {"memory_budget", pal::required_argument, NULL, OPT_MEMORY_BUDGET},
+      {"prefetch", pal::required_argument, NULL, OPT_PREFETCH},
+      {"stream_unet", pal::required_argument, NULL, OPT_STREAM_UNET},
+      {"buckets", pal::required_argument, NULL, OPT_BUCKETS},
+      {"deepcache", pal::no_argument, NULL, OPT_DEEPCACHE},
       {NULL, 0, NULL, 0}};
-  std::string backendPathCmd, systemLibraryPathCmd;
+  std::string backendPathCmd, systemLibraryPathCmd, threadSpec;
+#ifdef SD_WITH_QNN
   QnnLog_Level_t logLevel = QNN_LOG_LEVEL_ERROR;
+#endif
+  int64_t memoryBudgetMb = -1;
+  int64_t streamUnetMb = -1;
+  bool use_deepcache = false;
   int longIndex = 0, opt = 0;
   while ((opt = pal::getOptLongOnly(argc, argv, "", s_longOptions,
                                     &longIndex)) != -1) {
@@ -475,10 +577,12 @@ void processCommandLine(int argc, char **argv) {
         showHelp();
         std::exit(EXIT_SUCCESS);
         break;
+#ifdef SD_WITH_QNN
       case OPT_VERSION:
         std::cout << "QNN SDK " << qnn::tools::getBuildId() << "\n";
         std::exit(EXIT_SUCCESS);
         break;
+#endif
       case OPT_CLIP:
         clipPath = pal::g_optArg;
         modelDir = std::filesystem::path(clipPath).parent_path().string();
@@ -489,9 +593,11 @@ void processCommandLine(int argc, char **argv) {
       case OPT_VAE_DECODER:
         vaeDecoderPath = pal::g_optArg;
         break;
+#ifdef SD_WITH_QNN
       case OPT_BACKEND:
         backendPathCmd = pal::g_optArg;
         break;
+#endif
       case OPT_TEXT_EMBEDDING_SIZE:
         text_embedding_size = std::stoi(pal::g_optArg);
         break;
@@ -518,6 +624,7 @@ void processCommandLine(int argc, char **argv) {
       case OPT_CONVERT_CLIP_SKIP_2:
         clip_skip_2 = true;
         break;
+#ifdef SD_WITH_QNN
       case OPT_LOG_LEVEL:
         logLevel = sample_app::parseLogLevel(pal::g_optArg);
         if (logLevel != QNN_LOG_LEVEL_MAX) {
@@ -528,6 +635,7 @@ void processCommandLine(int argc, char **argv) {
       case OPT_SYSTEM_LIBRARY:
         systemLibraryPathCmd = pal::g_optArg;
         break;
+#endif
       case OPT_PORT:
         port = std::stoi(pal::g_optArg);
         break;
@@ -548,13 +656,114 @@ void processCommandLine(int argc, char **argv) {
       case OPT_LOWRAM:
         lowram_mode = true;
         break;
+      case OPT_THREADS:
+        threadSpec = pal::g_optArg;
+        break;
+      case OPT_AUTOTUNE_THREADS:
+        autotune_threads = true;
+        break;
+      case OPT_MEMORY_BUDGET:
+        memoryBudgetMb = std::stoll(pal::g_optArg);
+        if (memoryBudgetMb < 0)
+          showHelpAndExit("--memory_budget must be at least 0 MB");
+        break;
+      case OPT_PREFETCH: {
+        int64_t prefetchMb = std::stoll(pal::g_optArg);
+        if (prefetchMb < 0) showHelpAndExit("--prefetch must be at least 0 MB");
+        prefetcher.setCeiling(prefetchMb << 20);
+        break;
+      }
+      case OPT_STREAM_UNET:
+        streamUnetMb = std::stoll(pal::g_optArg);
+        if (streamUnetMb < 0)
+          showHelpAndExit("--stream_unet must be at least 0 MB");
+        break;
+      case OPT_BUCKETS:
+        try {
+          resolution_buckets.parse(pal::g_optArg);
+        } catch (const std::invalid_argument &e) {
+          showHelpAndExit(e.what());
+        }
+        break;
+      case OPT_DEEPCACHE:
+        use_deepcache = true;
+        break;
       default:
         showHelpAndExit("Invalid argument passed.");
     }
   }
 
+  // --lowram keeps only the models of the running stage loaded.
+  if (memoryBudgetMb >= 0)
+    residency.setBudget(memoryBudgetMb << 20);
+  else if (lowram_mode)
+    residency.setBudget(0);
+  if (residency.limited()) residency.setPrefetcher(&prefetcher);
+
+  // Settings saved by --autotune_threads, overridden by --threads.
+  try {
+    std::filesystem::path threadsPath =
+        std::filesystem::path(modelDir) / "threads.json";
+    if (!modelDir.empty() && std::filesystem::exists(threadsPath)) {
+      std::ifstream threadsFile(threadsPath);
+      thread_config.update(nlohmann::json::parse(threadsFile));
+      QNN_INFO("Loaded thread settings from %s",
+               threadsPath.string().c_str());
+    }
+    thread_config.parse(threadSpec);
+  } catch (const std::exception &e) {
+    showHelpAndExit(std::string("Invalid thread settings: ") + e.what());
+  }
+
+  // {"parts": ["unet_down.mnn", "unet_mid.mnn", "unet_up.mnn"]}, relative
+  // to the model directory and in execution order.
+  if (streamUnetMb >= 0) {
+    const std::filesystem::path partsPath =
+        std::filesystem::path(modelDir) / "unet_parts.json";
+    try {
+      std::ifstream partsFile(partsPath);
+      if (!partsFile) throw std::runtime_error("cannot open the file");
+      const nlohmann::json parts = nlohmann::json::parse(partsFile);
+      for (const auto &part : parts.at("parts")) {
+        const std::filesystem::path path =
+            std::filesystem::path(modelDir) / part.get<std::string>();
+        if (!std::filesystem::exists(path))
+          throw std::runtime_error(path.string() + " does not exist");
+        unet_parts.push_back(path.string());
+      }
+      if (unet_parts.empty()) throw std::runtime_error("no parts listed");
+    } catch (const std::exception &e) {
+      showHelpAndExit("Invalid " + partsPath.string() + ": " + e.what());
+    }
+    unet_parts_keep = streamUnetMb << 20;
+  }
+
+  // {"full": "unet_full.mnn", "shallow": "unet_shallow.mnn"}, relative to
+  // the model directory.
+  if (use_deepcache) {
+    const std::filesystem::path cachePath =
+        std::filesystem::path(modelDir) / "deepcache.json";
+    try {
+      std::ifstream cacheFile(cachePath);
+      if (!cacheFile) throw std::runtime_error("cannot open the file");
+      const nlohmann::json graphs = nlohmann::json::parse(cacheFile);
+      auto graph = [&](const char *key) {
+        const std::filesystem::path path =
+            std::filesystem::path(modelDir) / graphs.at(key).get<std::string>();
+        if (!std::filesystem::exists(path))
+          throw std::runtime_error(path.string() + " does not exist");
+        return path.string();
+      };
+      deepcache_full = graph("full");
+      deepcache_shallow = graph("shallow");
+    } catch (const std::exception &e) {
+      showHelpAndExit("Invalid " + cachePath.string() + ": " + e.what());
+    }
+  }
+
   if (upscaler_mode) {
     if (use_mnn) return;
+#ifdef SD_WITH_QNN
     if (systemLibraryPathCmd.empty())
       showHelpAndExit("Requires --system_library for QNN");
     if (backendPathCmd.empty()) showHelpAndExit("Requires --backend for QNN");
@@ -566,6 +775,9 @@ void processCommandLine(int argc, char **argv) {
     if (sysStatus != dynamicloadutil::StatusCode::SUCCESS)
       showHelpAndExit("Failed get QNN system func ptrs.");
     return;
+#else
+    showHelpAndExit("Built without QNN: upscaler mode requires --cpu");
+#endif
   }
   if (cvt_model) {
     if (!std::filesystem::exists(model_dir)) {
@@ -712,11 +924,14 @@ void processCommandLine(int argc, char **argv) {
     }
   }
 
-  if (use_safety_checker) {
+  if (use_safety_checker && !residency.limited()) {
     safetyCheckerInterpreter =
         MNN::Interpreter::createFromFile(safetyCheckerPath.c_str());
     if (!safetyCheckerInterpreter)
       showHelpAndExit("Failed load Safety MNN: " + safetyCheckerPath);
+  } else if (use_safety_checker &&
+             !std::filesystem::exists(safetyCheckerPath)) {
+    showHelpAndExit("Safety MNN not found: " + safetyCheckerPath);
   }
 
   if (use_mnn_clip) {
@@ -724,7 +939,7 @@ void processCommandLine(int argc, char **argv) {
     if (!clipInterpreter) showHelpAndExit("Failed load CLIP MNN: " + clipPath);
   }
 
-  if (sdxl_mode && !lowram_mode) {
+  if (sdxl_mode && !residency.limited()) {
     // SDXL text encoders always run on MNN (CPU) regardless of backend.
     if (!clipInterpreter) {
       clipInterpreter = MNN::Interpreter::createFromFile(clipPath.c_str());
@@ -740,6 +955,7 @@ void processCommandLine(int argc, char **argv) {
     return;
   }
 
+#ifdef SD_WITH_QNN
   if (systemLibraryPathCmd.empty())
     showHelpAndExit("Requires --system_library for QNN");
   if (backendPathCmd.empty()) showHelpAndExit("Requires --backend for QNN");
@@ -800,29 +1016,30 @@ void processCommandLine(int argc, char **argv) {
     }
   }
 
+  if (residency.limited()) {
+    QNN_INFO("Memory budget set: loading QNN models on demand");
+    return;
+  }
+
   if (!use_mnn_clip && !sdxl_mode) {
     clipApp = createQnnModel(clipPath, "clip");
     if (!clipApp) showHelpAndExit("Failed create QNN CLIP model.");
   }
 
-  bool sdxl_lowram = sdxl_mode && lowram_mode;
-
-  if (!sdxl_lowram) {
-    unetApp = createQnnModel(unetPath, "unet");
-    if (!unetApp) showHelpAndExit("Failed create QNN UNET model.");
-
-    vaeDecoderApp = createQnnModel(vaeDecoderPath, "vae_decoder");
-    if (!vaeDecoderApp) showHelpAndExit("Failed create QNN VAE Decoder model.");
+  unetApp = createQnnModel(unetPath, "unet");
+  if (!unetApp) showHelpAndExit("Failed create QNN UNET model.");
 
-    if (!vaeEncoderPath.empty()) {
-      vaeEncoderApp = createQnnModel(vaeEncoderPath, "vae_encoder");
-      if (!vaeEncoderApp) QNN_WARN("Failed create QNN VAE Enc model.");
-    } else
-      QNN_WARN("VAE Enc QNN path missing.");
-  } else {
-    QNN_INFO(
-        "[lowram] SDXL low-RAM mode: skipping pre-load of UNET/VAE QNN models");
-  }
+  vaeDecoderApp = createQnnModel(vaeDecoderPath, "vae_decoder");
+  if (!vaeDecoderApp) showHelpAndExit("Failed create QNN VAE Decoder model.");
+
+  if (!vaeEncoderPath.empty()) {
+    vaeEncoderApp = createQnnModel(vaeEncoderPath, "vae_encoder");
+    if (!vaeEncoderApp) QNN_WARN("Failed create QNN VAE Enc model.");
+  } else
+    QNN_WARN("VAE Enc QNN path missing.");
+#else
+  showHelpAndExit("Built without QNN: requires --cpu");
+#endif
 }
 
 }  // namespace sample_app
@@ -830,57 +1047,196 @@ void processCommandLine(int argc, char **argv) {
 }  // namespace qnn
 
 // Generic RAII guard: invokes the stored callable on scope exit unless
-// disarmed. Used in generateImage to ensure lowram-loaded SDXL models are
-// released even if the pipeline throws partway.
+// disarmed. Used in generateImage to end stages even if the pipeline throws
+// partway.
 struct ScopeExit {
   std::function<void()> fn;
   ~ScopeExit() {
     if (fn) fn();
   }
+  // Runs fn now instead of at scope exit.
+  void run() {
+    if (fn) std::exchange(fn, nullptr)();
+  }
+};
+
+static void reportStage(const char *stage,
+                        std::chrono::high_resolution_clock::time_point start,
+                        std::chrono::high_resolution_clock::time_point end) {
+  double ms = std::chrono::duration<double, std::milli>(end - start).count();
+  server_metrics.observeStage(stage, ms);
+  trace::complete(stage, "sd", start, end);
+  if (stage_observer) stage_observer(stage, ms);
+}
+
+static int64_t modelFileSize(const std::string &path) {
+  std::error_code ec;
+  auto size = std::filesystem::file_size(path, ec);
+  return ec ? 0 : (int64_t)size;
+}
+
+// --- SDXL text encoders ---
+// CLIP-L and CLIP-G run concurrently. CLIP-G is about five times larger,
+// so it gets most of the cores: by default CLIP-L takes the little cluster
+// (a quarter of the cores on a CPU without one) and CLIP-G the rest. A
+// stage pinned by --threads defaults to its pinned cores; a count set
+// there wins over both (ThreadConfig::apply).
+static int sdxlClipThreads(bool clip_g) {
+  const threading::Stage stage = clip_g ? threading::kClipG : threading::kClip;
+  const std::vector<int> pinned = thread_config.cores(stage);
+  if (!pinned.empty()) return (int)pinned.size();
+  const threading::CpuTopology &topology = threading::CpuTopology::get();
+  const int cores = std::max<int>(2, topology.cores.size());
+  const int clip_l_threads =
+      topology.little.empty()
+          ? std::max(1, cores / 4)
+          : std::min<int>(topology.little.size(), cores - 1);
+  return clip_g ? cores - clip_l_threads : clip_l_threads;
+}
+
+// Declared dims of the model's input called name, with -1 (or 0) for a
+// dynamic extent. Sessions report dynamic extents as 1, so this reads the
+// model itself and must run before the interpreter releases it.
+static std::vector<int> declaredInputDims(MNN::Interpreter *interpreter,
+                                          const char *name) {
+  const auto buffer = interpreter->getModelBuffer();
+  if (!buffer.first) return {};
+  const MNN::Net *net = MNN::GetNet(buffer.first);
+  if (!net->oplists() || !net->tensorName()) return {};
+  for (const MNN::Op *op : *net->oplists()) {
+    if (op->type() != MNN::OpType_Input || !op->outputIndexes() ||
+        op->outputIndexes()->size() == 0 || !op->main_as_Input())
+      continue;
+    const int index = op->outputIndexes()->Get(0);
+    if (index < 0 || index >= (int)net->tensorName()->size() ||
+        net->tensorName()->Get(index)->str() != name)
+      continue;
+    const auto *dims = op->main_as_Input()->dims();
+    if (!dims) return {};
+    return std::vector<int>(dims->begin(), dims->end());
+  }
+  return {};
+}
+
+// Creates the CPU session of one SDXL text encoder. batch is set to 2 when
+// the graph's input_embedding declares a dynamic batch or a batch of 2,
+// so the negative and positive prompt run as one batch, else 1.
+static MNN::Session *createSdxlClipSession(MNN::Interpreter *interpreter,
+                                           int dim, bool clip_g, int &batch) {
+  const threading::Stage stage = clip_g ? threading::kClipG : threading::kClip;
+  MNN::ScheduleConfig cfg;
+  cfg.type = MNN_FORWARD_CPU;
+  MNN::BackendConfig bk;
+  bk.memory = MNN::BackendConfig::Memory_Low;
+  thread_config.apply(stage, sdxlClipThreads(clip_g), cfg, bk);
+  cfg.backendConfig = &bk;
+  MNN::Session *session;
+  {
+    threading::AffinityScope pin(thread_config.cores(stage));
+    session = interpreter->createSession(cfg);
+  }
+  if (!session) return nullptr;
+
+  const std::vector<int> dims =
+      declaredInputDims(interpreter, "input_embedding");
+  batch = !dims.empty() && (dims[0] <= 0 || dims[0] == 2) ? 2 : 1;
+  auto input = interpreter->getSessionInput(session, "input_embedding");
+  interpreter->resizeTensor(input, {batch, 77, dim});
+  interpreter->resizeSession(session);
+  interpreter->releaseModel();
+  QNN_INFO("SDXL CLIP-%s session: %d threads, batch %d", clip_g ? "G" : "L",
+           cfg.numThread, batch);
+  return session;
+}
+
+// Encodes the negative and positive prompt embeddings [77, dim] into
+// hidden [2, 77, dim] and, if set, the raw pooled_output rows into pooled
+// [2, 77, dim].
+static void runSdxlTextEncoder(MNN::Interpreter *interpreter,
+                               MNN::Session *session, int batch, int dim,
+                               const float *negative, const float *positive,
+                               float *hidden, float *pooled) {
+  threading::AffinityScope pin(
+      thread_config.cores(pooled ? threading::kClipG : threading::kClip));
+  const size_t size = (size_t)77 * dim;
+  auto input = interpreter->getSessionInput(session, "input_embedding");
+  auto hidden_out =
+      interpreter->getSessionOutput(session, "last_hidden_state");
+  auto pooled_out =
+      pooled ? interpreter->getSessionOutput(session, "pooled_output")
+             : nullptr;
+  const float *prompts[2] = {negative, positive};
+  for (int first = 0; first < 2; first += batch) {
+    for (int b = 0; b < batch; ++b)
+      memcpy(input->host<float>() + b * size, prompts[first + b],
+             size * sizeof(float));
+    interpreter->runSession(session);
+    memcpy(hidden + first * size, hidden_out->host<float>(),
+           batch * size * sizeof(float));
+    if (pooled)
+      memcpy(pooled + first * size, pooled_out->host<float>(),
+             batch * size * sizeof(float));
+  }
+}
+
+// --- On-demand models ---
+// With a memory budget (--memory_budget, or 0 with --lowram) these models
+// are registered with residency instead of being loaded at startup, and a
+// stage acquires each one around its use. Released models stay loaded
+// until the budget needs their memory.
+struct ResidentModels {
+  int clip = -1;  // SDXL: both MNN text encoders; else the QNN text encoder
+  int unet = -1;
+  int vae_decoder = -1;
+  int vae_encoder = -1;
+  int safety_checker = -1;
+} resident_models;
+
+// Holds a registered model for the rest of the scope; a no-op for id -1.
+struct ModelLease {
+  int id;
+  explicit ModelLease(int id) : id(id) {
+    if (id >= 0) residency.acquire(id);
+  }
+  ~ModelLease() {
+    if (id >= 0) residency.release(id);
+  }
+  ModelLease(const ModelLease &) = delete;
+  ModelLease &operator=(const ModelLease &) = delete;
 };
 
-// --- SDXL low-RAM lazy load/release helpers ---
-static void loadSdxlClipMnnIfNeeded() {
+static void loadSdxlClipMnn() {
   if (!clipInterpreter) {
     clipInterpreter = MNN::Interpreter::createFromFile(clipPath.c_str());
     if (!clipInterpreter)
-      throw std::runtime_error("[lowram] Failed load SDXL CLIP1 MNN");
+      throw std::runtime_error("Failed load SDXL CLIP1 MNN");
   }
   if (!clip2Interpreter) {
     clip2Interpreter = MNN::Interpreter::createFromFile(clip2Path.c_str());
     if (!clip2Interpreter)
-      throw std::runtime_error("[lowram] Failed load SDXL CLIP2 MNN");
+      throw std::runtime_error("Failed load SDXL CLIP2 MNN");
   }
-  MNN::ScheduleConfig cfg;
-  cfg.type = MNN_FORWARD_CPU;
-  cfg.numThread = 4;
-  MNN::BackendConfig bk;
-  bk.memory = MNN::BackendConfig::Memory_Low;
-  bk.power = MNN::BackendConfig::Power_High;
-  cfg.backendConfig = &bk;
   if (!clipSession) {
-    clipSession = clipInterpreter->createSession(cfg);
+    clipSession = createSdxlClipSession(clipInterpreter, text_embedding_size,
+                                        false, clipBatch);
     if (!clipSession)
-      throw std::runtime_error("[lowram] Failed create SDXL CLIP1 session");
-    auto in1 = clipInterpreter->getSessionInput(clipSession, "input_embedding");
-    clipInterpreter->resizeTensor(in1, {1, 77, text_embedding_size});
-    clipInterpreter->resizeSession(clipSession);
-    clipInterpreter->releaseModel();
+      throw std::runtime_error("Failed create SDXL CLIP1 session");
   }
   if (!clip2Session) {
-    clip2Session = clip2Interpreter->createSession(cfg);
+    clip2Session = createSdxlClipSession(
+        clip2Interpreter, text_embedding_size_2, true, clip2Batch);
     if (!clip2Session)
-      throw std::runtime_error("[lowram] Failed create SDXL CLIP2 session");
-    auto in2 =
-        clip2Interpreter->getSessionInput(clip2Session, "input_embedding");
-    clip2Interpreter->resizeTensor(in2, {1, 77, text_embedding_size_2});
-    clip2Interpreter->resizeSession(clip2Session);
-    clip2Interpreter->releaseModel();
-  }
-  QNN_INFO("[lowram] SDXL CLIP MNN loaded");
+      throw std::runtime_error("Failed create SDXL CLIP2 session");
+  }
+  server_metrics.modelLoaded(
+      metrics::ServerMetrics::kClip,
+      modelFileSize(clipPath) + modelFileSize(clip2Path));
+  QNN_INFO("SDXL CLIP MNN loaded");
 }
 
 static void releaseSdxlClipMnn() {
+  if (clipInterpreter || clip2Interpreter)
+    server_metrics.modelReleased(metrics::ServerMetrics::kClip);
   if (clipSession && clipInterpreter) {
     clipInterpreter->releaseSession(clipSession);
   }
@@ -897,65 +1253,140 @@ static void releaseSdxlClipMnn() {
     delete clip2Interpreter;
     clip2Interpreter = nullptr;
   }
-  QNN_INFO("[lowram] SDXL CLIP MNN released");
+  QNN_INFO("SDXL CLIP MNN released");
 }
 
-static void loadSdxlQnnUnetIfNeeded() {
-  if (unetApp) return;
-  unetApp = createQnnModel(unetPath, "unet");
-  if (!unetApp) throw std::runtime_error("[lowram] Failed create SDXL UNET");
-  if (qnn::tools::sample_app::initializeQnnApp("UNET", unetApp) !=
-      EXIT_SUCCESS) {
-    unetApp.reset();
-    throw std::runtime_error("[lowram] Failed init SDXL UNET");
+// Creates the safety checker's CPU session for one 224x224 RGB image.
+static MNN::Session *createSafetyCheckerSession() {
+  MNN::ScheduleConfig cfg;
+  cfg.type = MNN_FORWARD_CPU;
+  MNN::BackendConfig bk;
+  bk.memory = MNN::BackendConfig::Memory_Low;
+  thread_config.apply(threading::kSafetyChecker, 1, cfg, bk);
+  cfg.backendConfig = &bk;
+  MNN::Session *session;
+  {
+    threading::AffinityScope pin(
+        thread_config.cores(threading::kSafetyChecker));
+    session = safetyCheckerInterpreter->createSession(cfg);
   }
-  QNN_INFO("[lowram] SDXL UNET loaded");
+  if (!session) return nullptr;
+  auto input = safetyCheckerInterpreter->getSessionInput(session, nullptr);
+  safetyCheckerInterpreter->resizeTensor(input, {1, 224, 224, 3});
+  safetyCheckerInterpreter->resizeSession(session);
+  safetyCheckerInterpreter->releaseModel();
+  return session;
 }
 
-static void releaseSdxlQnnUnet() {
-  if (!unetApp) return;
-  unetApp.reset();
-  QNN_INFO("[lowram] SDXL UNET released");
+static void loadSafetyChecker() {
+  safetyCheckerInterpreter =
+      MNN::Interpreter::createFromFile(safetyCheckerPath.c_str());
+  if (!safetyCheckerInterpreter)
+    throw std::runtime_error("Failed load Safety MNN: " + safetyCheckerPath);
+  safetyCheckerSession = createSafetyCheckerSession();
+  if (!safetyCheckerSession) {
+    delete safetyCheckerInterpreter;
+    safetyCheckerInterpreter = nullptr;
+    throw std::runtime_error("Failed create MNN Safety session");
+  }
 }
 
-static void loadSdxlQnnVaeDecoderIfNeeded() {
-  if (vaeDecoderApp) return;
-  vaeDecoderApp = createQnnModel(vaeDecoderPath, "vae_decoder");
-  if (!vaeDecoderApp)
-    throw std::runtime_error("[lowram] Failed create SDXL VAE Decoder");
-  if (qnn::tools::sample_app::initializeQnnApp("VAEDecoder", vaeDecoderApp) !=
-      EXIT_SUCCESS) {
-    vaeDecoderApp.reset();
-    throw std::runtime_error("[lowram] Failed init SDXL VAE Decoder");
-  }
-  QNN_INFO("[lowram] SDXL VAE Decoder loaded");
+static void releaseSafetyChecker() {
+  if (safetyCheckerSession && safetyCheckerInterpreter)
+    safetyCheckerInterpreter->releaseSession(safetyCheckerSession);
+  safetyCheckerSession = nullptr;
+  delete safetyCheckerInterpreter;
+  safetyCheckerInterpreter = nullptr;
 }
 
-static void releaseSdxlQnnVaeDecoder() {
-  if (!vaeDecoderApp) return;
-  vaeDecoderApp.reset();
-  QNN_INFO("[lowram] SDXL VAE Decoder released");
+#ifdef SD_WITH_QNN
+// Creates and initializes app from path, or from buffer when given (the
+// patched UNet, whose buffer then stays allocated for later reloads).
+static void loadQnnModel(std::unique_ptr<QnnModel> &app,
+                         const std::string &path, const char *type,
+                         const char *name, metrics::ServerMetrics::Model model,
+                         std::shared_ptr<const uint8_t> buffer = nullptr,
+                         uint64_t buffer_size = 0) {
+  if (app) return;
+  app = createQnnModel(path, type);
+  if (!app) throw std::runtime_error(std::string("Failed create QNN ") + name);
+  if (qnn::tools::sample_app::initializeQnnApp(name, app, buffer,
+                                               buffer_size) != EXIT_SUCCESS) {
+    app.reset();
+    throw std::runtime_error(std::string("Failed init QNN ") + name);
+  }
+  server_metrics.modelLoaded(model, modelFileSize(path));
+  QNN_INFO("QNN %s loaded", name);
 }
 
-static void loadSdxlQnnVaeEncoderIfNeeded() {
-  if (vaeEncoderApp) return;
-  if (vaeEncoderPath.empty())
-    throw std::runtime_error("[lowram] SDXL VAE Encoder path missing");
-  vaeEncoderApp = createQnnModel(vaeEncoderPath, "vae_encoder");
-  if (!vaeEncoderApp)
-    throw std::runtime_error("[lowram] Failed create SDXL VAE Encoder");
-  if (qnn::tools::sample_app::initializeQnnApp("VAEEncoder", vaeEncoderApp) !=
-      EXIT_SUCCESS) {
-    vaeEncoderApp.reset();
-    throw std::runtime_error("[lowram] Failed init SDXL VAE Encoder");
-  }
-  QNN_INFO("[lowram] SDXL VAE Encoder loaded");
+static void releaseQnnModel(std::unique_ptr<QnnModel> &app, const char *name,
+                            metrics::ServerMetrics::Model model) {
+  if (!app) return;
+  app.reset();
+  server_metrics.modelReleased(model);
+  QNN_INFO("QNN %s released", name);
 }
-
-static void releaseSdxlQnnVaeEncoder() {
-  if (!vaeEncoderApp) return;
-  vaeEncoderApp.reset();
-  QNN_INFO("[lowram] SDXL VAE Encoder released");
+#endif
+
+// Registers the models generateImage acquires on demand. The MNN stage
+// models register through MnnBackend::setResidency.
+static void registerResidentModels() {
+  using metrics::ServerMetrics;
+  if (sdxl_mode)
+    resident_models.clip = residency.add(
+        "SDXL CLIP", modelFileSize(clipPath) + modelFileSize(clip2Path),
+        loadSdxlClipMnn, releaseSdxlClipMnn, {clipPath, clip2Path});
+  if (use_safety_checker)
+    resident_models.safety_checker =
+        residency.add("Safety Checker", modelFileSize(safetyCheckerPath),
+                      loadSafetyChecker, releaseSafetyChecker,
+                      {safetyCheckerPath});
+#ifdef SD_WITH_QNN
+  if (use_mnn) return;
+  if (!sdxl_mode && !use_mnn_clip)
+    resident_models.clip = residency.add(
+        "QNN CLIP", modelFileSize(clipPath),
+        [] {
+          loadQnnModel(clipApp, clipPath, "clip", "CLIP", ServerMetrics::kClip);
+        },
+        [] { releaseQnnModel(clipApp, "CLIP", ServerMetrics::kClip); },
+        {clipPath});
+  resident_models.unet = residency.add(
+      "QNN UNET", modelFileSize(unetPath),
+      [] {
+        const PatchedModelBuffer *patched = g_unetPatchedBuffer.get();
+        loadQnnModel(unetApp, unetPath, "unet", "UNET", ServerMetrics::kUnet,
+                     patched ? patched->buffer : nullptr,
+                     patched ? patched->size : 0);
+      },
+      [] { releaseQnnModel(unetApp, "UNET", ServerMetrics::kUnet); },
+      // A patched UNet loads from its buffer, already in memory.
+      g_unetPatchedBuffer ? std::vector<std::string>()
+                          : std::vector<std::string>{unetPath});
+  resident_models.vae_decoder = residency.add(
+      "QNN VAE Decoder", modelFileSize(vaeDecoderPath),
+      [] {
+        loadQnnModel(vaeDecoderApp, vaeDecoderPath, "vae_decoder",
+                     "VAEDecoder", ServerMetrics::kVaeDecoder);
+      },
+      [] {
+        releaseQnnModel(vaeDecoderApp, "VAEDecoder",
+                        ServerMetrics::kVaeDecoder);
+      },
+      {vaeDecoderPath});
+  if (!vaeEncoderPath.empty())
+    resident_models.vae_encoder = residency.add(
+        "QNN VAE Encoder", modelFileSize(vaeEncoderPath),
+        [] {
+          loadQnnModel(vaeEncoderApp, vaeEncoderPath, "vae_encoder",
+                       "VAEEncoder", ServerMetrics::kVaeEncoder);
+        },
+        [] {
+          releaseQnnModel(vaeEncoderApp, "VAEEncoder",
+                          ServerMetrics::kVaeEncoder);
+        },
+        {vaeEncoderPath});
+#endif
 }
 
 // --- Text Processing ---
@@ -968,6 +1399,7 @@ struct ProcessedPrompt {
 
 ProcessedPrompt processWeightedPrompt(const std::string &prompt_text,
                                       int max_len = 77) {
+  TRACE_SCOPE("processWeightedPrompt");
   ProcessedPrompt result;
 
   auto tokens = promptProcessor.process(prompt_text);
@@ -1143,11 +1575,54 @@ ProcessedPromptPair processPromptPair(const std::string &positive,
 
   return result;
 }
+// Blend weights of a tile_w x tile_h tile at (x, y) of a width x height
+// canvas: 1 inside, fading linearly over half the overlap along each edge
+// shared with a neighbouring tile.
+xt::xarray<float> tile_blend_weight(int x, int y, int tile_w, int tile_h,
+                                    int width, int height, int overlap_x,
+                                    int overlap_y) {
+  xt::xarray<float> tile_weight = xt::ones<float>({tile_h, tile_w});
+  int fade_size_x = overlap_x / 2;
+  int fade_size_y = overlap_y / 2;
+
+  if (fade_size_y > 0) {
+    if (y > 0) {
+      for (int i = 0; i < fade_size_y; ++i) {
+        float alpha = (float)(i + 1) / fade_size_y;
+        xt::view(tile_weight, i, xt::all()) *= alpha;
+      }
+    }
+    if (y + tile_h < height) {
+      for (int i = 0; i < fade_size_y; ++i) {
+        float alpha = (float)(i + 1) / fade_size_y;
+        xt::view(tile_weight, tile_h - 1 - i, xt::all()) *= alpha;
+      }
+    }
+  }
+
+  if (fade_size_x > 0) {
+    if (x > 0) {
+      for (int i = 0; i < fade_size_x; ++i) {
+        float alpha = (float)(i + 1) / fade_size_x;
+        xt::view(tile_weight, xt::all(), i) *= alpha;
+      }
+    }
+    if (x + tile_w < width) {
+      for (int i = 0; i < fade_size_x; ++i) {
+        float alpha = (float)(i + 1) / fade_size_x;
+        xt::view(tile_weight, xt::all(), tile_w - 1 - i) *= alpha;
+      }
+    }
+  }
+  return tile_weight;
+}
+
 xt::xarray<float> blend_vae_encoder_tiles(
     const std::vector<std::pair<xt::xarray<float>, xt::xarray<float>>>
         &tiles_mean_std,
     const std::vector<std::pair<int, int>> &positions, int latent_h,
-    int latent_w, int tile_size, int overlap_x, int overlap_y) {
+    int latent_w, int tile_size, int overlap_x, int overlap_y,
+    const xt::xarray<float> &noise) {
   if (tiles_mean_std.empty()) {
     throw std::runtime_error(
         "Tile list cannot be empty for VAE encoder blending.");
@@ -1158,44 +1633,12 @@ xt::xarray<float> blend_vae_encoder_tiles(
   xt::xarray<float> accumulated_std = xt::zeros<float>(accumulated_shape);
   xt::xarray<float> weight_map = xt::zeros<float>({latent_h, latent_w});
 
-  int fade_size_x = overlap_x / 2;
-  int fade_size_y = overlap_y / 2;
-
   for (size_t idx = 0; idx < tiles_mean_std.size(); ++idx) {
     int x = positions[idx].first;
     int y = positions[idx].second;
 
-    xt::xarray<float> tile_weight = xt::ones<float>({tile_size, tile_size});
-
-    if (fade_size_y > 0) {
-      if (y > 0) {
-        for (int i = 0; i < fade_size_y; ++i) {
-          float alpha = (float)(i + 1) / fade_size_y;
-          xt::view(tile_weight, i, xt::all()) *= alpha;
-        }
-      }
-      if (y + tile_size < latent_h) {
-        for (int i = 0; i < fade_size_y; ++i) {
-          float alpha = (float)(i + 1) / fade_size_y;
-          xt::view(tile_weight, tile_size - 1 - i, xt::all()) *= alpha;
-        }
-      }
-    }
-
-    if (fade_size_x > 0) {
-      if (x > 0) {
-        for (int i = 0; i < fade_size_x; ++i) {
-          float alpha = (float)(i + 1) / fade_size_x;
-          xt::view(tile_weight, xt::all(), i) *= alpha;
-        }
-      }
-      if (x + tile_size < latent_w) {
-        for (int i = 0; i < fade_size_x; ++i) {
-          float alpha = (float)(i + 1) / fade_size_x;
-          xt::view(tile_weight, xt::all(), tile_size - 1 - i) *= alpha;
-        }
-      }
-    }
+    xt::xarray<float> tile_weight = tile_blend_weight(
+        x, y, tile_size, tile_size, latent_w, latent_h, overlap_x, overlap_y);
 
     const auto &mean_tile =
         tiles_mean_std[idx].first;  // (1, 4, tile_size, tile_size)
@@ -1228,8 +1671,6 @@ xt::xarray<float> blend_vae_encoder_tiles(
   xt::xarray<float> final_mean = accumulated_mean / weight_expanded;
   xt::xarray<float> final_std = accumulated_std / weight_expanded;
 
-  xt::xarray<float> noise =
-      xt::random::randn<float>({1, 4, latent_h, latent_w});
   xt::xarray<float> latent = xt::eval(final_mean + final_std * noise);
 
   return latent;
@@ -1247,44 +1688,12 @@ xt::xarray<float> blend_vae_output_tiles(
   xt::xarray<float> accumulated = xt::zeros<float>(accumulated_shape);
   xt::xarray<float> weight_map = xt::zeros<float>({output_h, output_w});
 
-  int fade_size_x = overlap_x / 2;
-  int fade_size_y = overlap_y / 2;
-
   for (size_t idx = 0; idx < tiles.size(); ++idx) {
     int x = positions[idx].first;
     int y = positions[idx].second;
 
-    xt::xarray<float> tile_weight = xt::ones<float>({tile_size, tile_size});
-
-    if (fade_size_y > 0) {
-      if (y > 0) {
-        for (int i = 0; i < fade_size_y; ++i) {
-          float alpha = (float)(i + 1) / fade_size_y;
-          xt::view(tile_weight, i, xt::all()) *= alpha;
-        }
-      }
-      if (y + tile_size < output_h) {
-        for (int i = 0; i < fade_size_y; ++i) {
-          float alpha = (float)(i + 1) / fade_size_y;
-          xt::view(tile_weight, tile_size - 1 - i, xt::all()) *= alpha;
-        }
-      }
-    }
-
-    if (fade_size_x > 0) {
-      if (x > 0) {
-        for (int i = 0; i < fade_size_x; ++i) {
-          float alpha = (float)(i + 1) / fade_size_x;
-          xt::view(tile_weight, xt::all(), i) *= alpha;
-        }
-      }
-      if (x + tile_size < output_w) {
-        for (int i = 0; i < fade_size_x; ++i) {
-          float alpha = (float)(i + 1) / fade_size_x;
-          xt::view(tile_weight, xt::all(), tile_size - 1 - i) *= alpha;
-        }
-      }
-    }
+    xt::xarray<float> tile_weight = tile_blend_weight(
+        x, y, tile_size, tile_size, output_w, output_h, overlap_x, overlap_y);
 
     for (int c = 0; c < 3; ++c) {
       auto acc_slice = xt::view(accumulated, 0, c, xt::range(y, y + tile_size),
@@ -1345,9 +1754,11 @@ std::vector<int> calculate_tile_positions(int dimension, int tile_size,
   return positions;
 }
 
+#ifdef SD_WITH_QNN
 xt::xarray<uint8_t> upscaleImageWithModel(
     const std::vector<uint8_t> &input_image, int width, int height,
     std::unique_ptr<QnnModel> &upscaler) {
+  TRACE_SCOPE("upscaleImageWithModel");
   if (!upscaler) {
     throw std::runtime_error("Upscaler model not provided");
   }
@@ -1398,6 +1809,7 @@ xt::xarray<uint8_t> upscaleImageWithModel(
   int tile_count = 0;
   for (int y : y_coords) {
     for (int x : x_coords) {
+      TRACE_SCOPE("upscale_tile", "sd", tile_count);
       xt::xarray<float> input_tile =
           xt::view(input_chw, 0, xt::all(), xt::range(y, y + tile_size),
                    xt::range(x, x + tile_size));
@@ -1452,6 +1864,7 @@ xt::xarray<uint8_t> upscaleImageWithModel(
 
   return output_uint8;
 }
+#endif
 
 // --- VAE Tiling Helper ---
 // Calculate tile positions and overlaps for VAE encoder/decoder
@@ -1519,18 +1932,21 @@ calculate_vae_tile_positions(int pixel_width, int pixel_height) {
           pixel_overlap_y, latent_overlap_x, latent_overlap_y};
 }
 
-// Upscale image using MNN model
-xt::xarray<uint8_t> upscaleImageWithMNN(const std::vector<uint8_t> &input_image,
-                                        int width, int height,
-                                        const std::string &model_path,
-                                        bool use_opencl) {
-  const int tile_size = 192;
-  const int output_tile_size = 768;
-  const int min_overlap = 12;
-  const float scale_factor = 4.0f;
+// An MNN upscaler's interpreter and its session for 192x192 tiles; the
+// interpreter releases the session.
+struct MnnUpscaler {
+  std::unique_ptr<MNN::Interpreter> interpreter;
+  MNN::Session *session = nullptr;
+  bool use_opencl = false;
+};
 
-  auto interpreter = std::shared_ptr<MNN::Interpreter>(
+std::unique_ptr<MnnUpscaler> createMnnUpscaler(const std::string &model_path,
+                                               bool use_opencl) {
+  auto upscaler = std::make_unique<MnnUpscaler>();
+  upscaler->use_opencl = use_opencl;
+  upscaler->interpreter.reset(
       MNN::Interpreter::createFromFile(model_path.c_str()));
+  auto &interpreter = upscaler->interpreter;
   if (!interpreter) {
     throw std::runtime_error("Failed to create MNN interpreter from: " +
                              model_path);
@@ -1546,16 +1962,32 @@ xt::xarray<uint8_t> upscaleImageWithMNN(const std::vector<uint8_t> &input_image,
     backendConfig.precision = MNN::BackendConfig::Precision_Low;
   } else {
     config.type = MNN_FORWARD_CPU;
-    config.numThread = 4;
     backendConfig.memory = MNN::BackendConfig::Memory_Low;
   }
-  backendConfig.power = MNN::BackendConfig::Power_High;
+  thread_config.apply(threading::kUpscaler, 4, config, backendConfig);
   config.backendConfig = &backendConfig;
 
-  auto session = interpreter->createSession(config);
-  if (!session) {
+  threading::AffinityScope pin(thread_config.cores(threading::kUpscaler));
+  upscaler->session = interpreter->createSession(config);
+  if (!upscaler->session) {
     throw std::runtime_error("Failed to create MNN session");
   }
+  return upscaler;
+}
+
+// Upscale image using MNN model
+xt::xarray<uint8_t> upscaleImageWithMNN(const std::vector<uint8_t> &input_image,
+                                        int width, int height,
+                                        MnnUpscaler &upscaler) {
+  TRACE_SCOPE("upscaleImageWithMNN");
+  const int tile_size = 192;
+  const int output_tile_size = 768;
+  const int min_overlap = 12;
+  const float scale_factor = 4.0f;
+  MNN::Interpreter *interpreter = upscaler.interpreter.get();
+  MNN::Session *session = upscaler.session;
+  const bool use_opencl = upscaler.use_opencl;
+  threading::AffinityScope pin(thread_config.cores(threading::kUpscaler));
 
   auto x_coords = calculate_tile_positions(width, tile_size, min_overlap);
   auto y_coords = calculate_tile_positions(height, tile_size, min_overlap);
@@ -1602,6 +2034,7 @@ xt::xarray<uint8_t> upscaleImageWithMNN(const std::vector<uint8_t> &input_image,
   int tile_count = 0;
   for (int y : y_coords) {
     for (int x : x_coords) {
+      TRACE_SCOPE("upscale_tile", "sd", tile_count);
       xt::xarray<float> input_tile =
           xt::view(input_chw, 0, xt::all(), xt::range(y, y + tile_size),
                    xt::range(x, x + tile_size));
@@ -1671,33 +2104,110 @@ xt::xarray<uint8_t> upscaleImageWithMNN(const std::vector<uint8_t> &input_image,
   return output_uint8;
 }
 
+#ifdef SD_WITH_QNN
+std::unique_ptr<QnnModel> loadQnnUpscaler(const std::string &model_path) {
+  trace::Span load_span("upscaler_load");
+  std::unique_ptr<QnnModel> upscaler = createQnnModel(model_path, "upscaler");
+  if (!upscaler) {
+    throw std::runtime_error("Failed to create upscaler model from: " +
+                             model_path);
+  }
+  auto status =
+      qnn::tools::sample_app::initializeQnnApp("Upscaler", upscaler);
+  if (status != EXIT_SUCCESS) {
+    throw std::runtime_error("Failed to initialize upscaler model");
+  }
+  return upscaler;
+}
+#endif
+
+// Upscalers kept loaded under a memory budget, one per model file (and
+// OpenCL setting for MNN models). Without a budget /upscale loads the
+// model for each request instead.
+struct CachedUpscaler {
+  int id = -1;
+  std::mutex run_mutex;  // one upscale at a time per model
+  std::unique_ptr<MnnUpscaler> mnn;
+#ifdef SD_WITH_QNN
+  std::unique_ptr<QnnModel> qnn;
+#endif
+};
+
+std::mutex upscaler_cache_mutex;
+std::map<std::string, std::unique_ptr<CachedUpscaler>> upscaler_cache;
+
+CachedUpscaler &cachedUpscaler(const std::string &model_path, bool is_mnn,
+                               bool use_opencl) {
+  std::lock_guard<std::mutex> lock(upscaler_cache_mutex);
+  std::unique_ptr<CachedUpscaler> &entry =
+      upscaler_cache[model_path + (is_mnn && use_opencl ? "#opencl" : "")];
+  if (entry) return *entry;
+  entry = std::make_unique<CachedUpscaler>();
+  CachedUpscaler *cached = entry.get();
+  entry->id = residency.add(
+      "Upscaler " + model_path, modelFileSize(model_path),
+      [cached, model_path, is_mnn, use_opencl] {
+        if (is_mnn) {
+          cached->mnn = createMnnUpscaler(model_path, use_opencl);
+          return;
+        }
+#ifdef SD_WITH_QNN
+        cached->qnn = loadQnnUpscaler(model_path);
+#endif
+      },
+      [cached] {
+        cached->mnn.reset();
+#ifdef SD_WITH_QNN
+        cached->qnn.reset();
+#endif
+      });
+  return *entry;
+}
+
 // --- Image Generation ---
-GenerationResult generateImage(
-    std::function<void(int step, int total_steps,
+// progress_callback returns false once the client can no longer be reached,
+// which cancels the generation at the next step or tile boundary.
+// Images of a batch are handed to image_callback as soon as each is decoded.
+// The generation stops with GenerationCancelled once cancel is set. The
+// backends run with the request's options, which no other request sees.
+void generateImage(
+    std::function<bool(int step, int total_steps,
                        const std::string &image_data)>
-        progress_callback) {
+        progress_callback,
+    std::function<void(int index, GenerationResult result)> image_callback,
+    CancellationToken &cancel,
+    const InferenceBackend::RequestOptions &options) {
   using namespace qnn::tools::sample_app;
+  TRACE_SCOPE("generateImage");
   if (prompt.empty()) throw std::invalid_argument("Global prompt empty");
-  if (use_safety_checker && !safetyCheckerInterpreter)
+  // With a memory budget, models load on demand as each stage starts.
+  const bool on_demand = residency.limited();
+  if (use_safety_checker && !on_demand && !safetyCheckerInterpreter)
     throw std::runtime_error("SafetyChecker missing");
-  bool sdxl_lowram = sdxl_mode && lowram_mode;
+  InferenceBackend *backend = use_mnn ? mnnBackend.get() : qnnBackend.get();
+  InferenceBackend *text_backend =
+      (use_mnn || use_mnn_clip) ? mnnBackend.get() : qnnBackend.get();
+  if (!backend || !text_backend)
+    throw std::runtime_error("Inference backend not initialized");
+#ifdef SD_WITH_QNN
   if (!use_mnn) {
     if (!sdxl_mode) {
-      if (!use_mnn_clip && !clipApp)
+      if (!use_mnn_clip && !on_demand && !clipApp)
         throw std::runtime_error("QNN CLIP missing");
       if (use_mnn_clip && !clipInterpreter)
         throw std::runtime_error("MNN CLIP missing(hybrid)");
-    } else if (!sdxl_lowram) {
+    } else if (!on_demand) {
       if (!clipInterpreter || !clip2Interpreter)
         throw std::runtime_error("SDXL MNN CLIP interpreters missing");
     }
-    if (!sdxl_lowram) {
+    if (!on_demand) {
       if (!unetApp) throw std::runtime_error("QNN UNET missing");
       if (!vaeDecoderApp) throw std::runtime_error("QNN VAE Dec missing");
       if (request_img2img && !vaeEncoderApp)
         throw std::runtime_error("QNN VAE Enc missing");
     }
   }
+#endif
   if (request_img2img && img_data.size() != 3 * output_width * output_height)
     throw std::invalid_argument("Invalid global img_data");
   if (request_has_mask &&
@@ -1705,25 +2215,74 @@ GenerationResult generateImage(
        mask_data_full.size() != 3 * output_width * output_height))
     throw std::invalid_argument("Invalid global mask_data*");
 
-  // Catch-all guard: in lowram mode, release any model still loaded when this
-  // function exits (normal return or exception). The explicit release calls
-  // below stay in place to free memory between pipeline stages.
-  ScopeExit lowramReleaseGuard;
-  if (sdxl_lowram) {
-    lowramReleaseGuard.fn = []() {
-      if (clipInterpreter || clip2Interpreter) releaseSdxlClipMnn();
-      if (unetApp) releaseSdxlQnnUnet();
-      if (vaeDecoderApp) releaseSdxlQnnVaeDecoder();
-      if (vaeEncoderApp) releaseSdxlQnnVaeEncoder();
-    };
-  }
+  auto report_progress = [&](int step, int total_steps,
+                             const std::string &image_data) {
+    if (!progress_callback(step, total_steps, image_data)) {
+      QNN_WARN("Client disconnected, cancelling generation");
+      cancel.cancel();
+    }
+  };
 
   try {
     auto start_time = std::chrono::high_resolution_clock::now();
     int first_step_time_ms = 0;
-    int total_run_steps = steps + (request_img2img ? 1 : 0) + 2;
+    int total_run_steps = steps + (request_img2img ? 1 : 0) + 1 +
+                          (hires_width > 0 ? hires_steps + 1 : 0) +
+                          batch_count;
     int current_step = 0;
     const int batch_size = 2;
+    // Edge above which VAE calls are split into tiles; 0 if never.
+    const int vae_tile = backend->vaeTileSize();
+
+    // --- Scheduler & Latents ---
+    // One noise stream per image, keyed by seed + b, so any image of a batch
+    // can be reproduced on its own with batch_count = 1.
+    std::vector<PhiloxRandom> noise_generators;
+    noise_generators.reserve(batch_count);
+    for (int b = 0; b < batch_count; ++b)
+      noise_generators.emplace_back(static_cast<uint64_t>(seed) + b);
+    auto batched_noise = [&](const std::vector<size_t> &noise_shape) {
+      return batchedRandn(noise_generators, noise_shape);
+    };
+
+    // set_timesteps() can only be called once per scheduler, so the hires
+    // pass starts a fresh one.
+    auto make_scheduler = [&]() {
+      std::unique_ptr<Scheduler> scheduler;
+      if (scheduler_type == "euler_a" || scheduler_type == "eulera") {
+        scheduler = std::make_unique<EulerAncestralDiscreteScheduler>(
+            1000, 0.00085f, 0.012f, "scaled_linear", "epsilon", "leading");
+      } else if (scheduler_type == "lcm") {
+        scheduler = std::make_unique<LCMScheduler>(
+            1000, 0.00085f, 0.012f, "scaled_linear", "epsilon", 50, 10.0f,
+            true, false);
+      } else {
+        // Default to DPM solver
+        scheduler = std::make_unique<DPMSolverMultistepScheduler>(
+            1000, 0.00085f, 0.012f, "scaled_linear", 2, "epsilon", "leading");
+      }
+      if (use_v_pred) scheduler->set_prediction_type("v_prediction");
+      scheduler->set_noise_source(batched_noise);
+      return scheduler;
+    };
+    std::unique_ptr<Scheduler> scheduler = make_scheduler();
+    scheduler->set_timesteps(steps);
+    xt::xarray<float> timesteps = scheduler->get_timesteps();
+    const float vae_scale = sdxl_mode ? 0.13025f : 0.18215f;
+    std::vector<int> shape = {1, 4, sample_height, sample_width};
+    std::vector<int> batch_shape = {batch_count, 4, sample_height,
+                                    sample_width};
+    const std::vector<size_t> noise_shape(batch_shape.begin(),
+                                          batch_shape.end());
+    xt::xarray<float> latents = batched_noise(noise_shape);
+    xt::xarray<float> latents_noise = batched_noise(noise_shape);
+
+    // Scale initial latents by init_noise_sigma (required for Euler schedulers)
+    float init_noise_sigma = scheduler->get_init_noise_sigma();
+    latents = latents * init_noise_sigma;
+
+    xt::xarray<float> original_latents, original_image, mask, mask_full;
+    int start_step = 0;
 
     // --- CLIP ---
     // Regular embedding buffer (SD1.5) reused in SDXL as encoder-1 output.
@@ -1751,381 +2310,174 @@ GenerationResult generateImage(
       }
     }
 
-    auto clip_start = std::chrono::high_resolution_clock::now();
-
-    // Try to reuse the previous CLIP outputs when the prompt pair is
-    // unchanged. This also skips lowram CLIP (de)allocation in SDXL.
-    const size_t sd_embed_size = (size_t)batch_size * 77 * text_embedding_size;
-    const size_t sdxl_hidden_size = (size_t)batch_size * 77 * sdxl_concat_dim;
-    const size_t sdxl_pooled_size = (size_t)batch_size * text_embedding_size_2;
-
-    bool clip_cache_hit = false;
-    if (clip_cache_valid && cached_prompt == prompt &&
-        cached_negative_prompt == negative_prompt) {
-      if (sdxl_mode) {
-        if (cached_sdxl_encoder_hidden_states.size() == sdxl_hidden_size &&
-            cached_sdxl_text_embeds.size() == sdxl_pooled_size) {
-          memcpy(sdxl_encoder_hidden_states.data(),
-                 cached_sdxl_encoder_hidden_states.data(),
-                 sdxl_hidden_size * sizeof(float));
-          memcpy(sdxl_text_embeds.data(), cached_sdxl_text_embeds.data(),
-                 sdxl_pooled_size * sizeof(float));
-          clip_cache_hit = true;
-        }
-      } else {
-        if (cached_text_embedding_float.size() == sd_embed_size) {
-          memcpy(text_embedding_float.data(),
-                 cached_text_embedding_float.data(),
-                 sd_embed_size * sizeof(float));
-          clip_cache_hit = true;
+    std::chrono::high_resolution_clock::time_point clip_start, clip_end;
+    auto encode_prompts = [&]() {
+      clip_start = std::chrono::high_resolution_clock::now();
+
+      // Try to reuse the previous CLIP outputs when the prompt pair is
+      // unchanged. This also skips loading an on-demand CLIP.
+      const size_t sd_embed_size =
+          (size_t)batch_size * 77 * text_embedding_size;
+      const size_t sdxl_hidden_size =
+          (size_t)batch_size * 77 * sdxl_concat_dim;
+      const size_t sdxl_pooled_size =
+          (size_t)batch_size * text_embedding_size_2;
+
+      bool clip_cache_hit = false;
+      if (clip_cache_valid && cached_prompt == prompt &&
+          cached_negative_prompt == negative_prompt) {
+        if (sdxl_mode) {
+          if (cached_sdxl_encoder_hidden_states.size() == sdxl_hidden_size &&
+              cached_sdxl_text_embeds.size() == sdxl_pooled_size) {
+            memcpy(sdxl_encoder_hidden_states.data(),
+                   cached_sdxl_encoder_hidden_states.data(),
+                   sdxl_hidden_size * sizeof(float));
+            memcpy(sdxl_text_embeds.data(), cached_sdxl_text_embeds.data(),
+                   sdxl_pooled_size * sizeof(float));
+            clip_cache_hit = true;
+          }
+        } else {
+          if (cached_text_embedding_float.size() == sd_embed_size) {
+            memcpy(text_embedding_float.data(),
+                   cached_text_embedding_float.data(),
+                   sd_embed_size * sizeof(float));
+            clip_cache_hit = true;
+          }
         }
       }
-    }
 
-    if (clip_cache_hit) {
-      QNN_INFO("CLIP cache hit, reusing cached text embeddings");
-    } else {
-      ProcessedPromptPair processed =
-          processPromptPair(prompt, negative_prompt, 77);
+      if (clip_cache_hit) {
+        server_metrics.clip_cache_hits.inc();
+        QNN_INFO("CLIP cache hit, reusing cached text embeddings");
+      } else {
+        server_metrics.clip_cache_misses.inc();
+        ProcessedPromptPair processed =
+            processPromptPair(prompt, negative_prompt, 77);
 
-      std::vector<int> clip_input_ids = processed.ids;  // old (2*77)
-      auto parsed_input_text = tokenizer->Decode(clip_input_ids);
-      QNN_INFO("Parsed Input Text: %s", parsed_input_text.c_str());
+        std::vector<int> clip_input_ids = processed.ids;  // old (2*77)
+        auto parsed_input_text = tokenizer->Decode(clip_input_ids);
+        QNN_INFO("Parsed Input Text: %s", parsed_input_text.c_str());
 
-      int32_t *input_ids_ptr = clip_input_ids.data();
-      float *embed_ptr = text_embedding_float.data();
+        int32_t *input_ids_ptr = clip_input_ids.data();
+        float *embed_ptr = text_embedding_float.data();
 
-      if (sdxl_mode) {
-        if (sdxl_lowram) loadSdxlClipMnnIfNeeded();
-        if (!clipInterpreter || !clip2Interpreter)
-          throw std::runtime_error("SDXL CLIP interpreters not initialized!");
-
-        auto run_sdxl_clip = [&](const std::vector<float> &emb1,
-                                 const std::vector<float> &emb2,
-                                 const int *ids77,
-                                 float *out_hidden_concat /*77*2048*/,
-                                 float *out_pooled /*1280*/) {
-          // Encoder 1 (CLIP-L): 77x768 -> last_hidden_state 77x768
-          auto in1 =
-              clipInterpreter->getSessionInput(clipSession, "input_embedding");
-          memcpy(in1->host<float>(), emb1.data(),
-                 77 * text_embedding_size * sizeof(float));
-          clipInterpreter->runSession(clipSession);
-          auto out1 = clipInterpreter->getSessionOutput(clipSession,
-                                                        "last_hidden_state");
-          const float *out1_data = out1->host<float>();
-
-          // Encoder 2 (CLIP-G): 77x1280 -> last_hidden_state 77x1280 +
-          // pooled_output 77x1280 (exported without pooling; we select
-          // the EOS row here as the true pooled embedding).
-          auto in2 = clip2Interpreter->getSessionInput(clip2Session,
-                                                       "input_embedding");
-          memcpy(in2->host<float>(), emb2.data(),
-                 77 * text_embedding_size_2 * sizeof(float));
-          clip2Interpreter->runSession(clip2Session);
-          auto out2_hidden = clip2Interpreter->getSessionOutput(
-              clip2Session, "last_hidden_state");
-          auto out2_pool =
-              clip2Interpreter->getSessionOutput(clip2Session, "pooled_output");
-          const float *out2_hidden_data = out2_hidden->host<float>();
-          const float *out2_pool_data = out2_pool->host<float>();
-
-          // Concat along feature dim: [77, 768] + [77, 1280] = [77, 2048]
-          for (int t = 0; t < 77; t++) {
-            memcpy(out_hidden_concat + t * sdxl_concat_dim,
-                   out1_data + t * text_embedding_size,
-                   text_embedding_size * sizeof(float));
-            memcpy(
-                out_hidden_concat + t * sdxl_concat_dim + text_embedding_size,
-                out2_hidden_data + t * text_embedding_size_2,
-                text_embedding_size_2 * sizeof(float));
-          }
-          // Pool by picking the EOS (49407) row; fall back to last row (76).
-          int eos_pos = 76;
-          for (int i = 0; i < 77; i++) {
-            if (ids77[i] == 49407) {
-              eos_pos = i;
-              break;
+        if (sdxl_mode) {
+          ModelLease clip_lease(resident_models.clip);
+          if (!clipInterpreter || !clip2Interpreter)
+            throw std::runtime_error("SDXL CLIP interpreters not initialized!");
+
+          // CLIP-L and CLIP-G each encode both prompts, concurrently.
+          const size_t hidden2_size = (size_t)2 * 77 * text_embedding_size_2;
+          std::vector<float> hidden1((size_t)2 * 77 * text_embedding_size);
+          std::vector<float> hidden2(hidden2_size), pooled2(hidden2_size);
+          StageGraph encoders;
+          encoders.add("clip_l", [&]() {
+            runSdxlTextEncoder(clipInterpreter, clipSession, clipBatch,
+                               text_embedding_size,
+                               processed.negative_embeddings.data(),
+                               processed.positive_embeddings.data(),
+                               hidden1.data(), nullptr);
+          });
+          encoders.add("clip_g", [&]() {
+            runSdxlTextEncoder(clip2Interpreter, clip2Session, clip2Batch,
+                               text_embedding_size_2,
+                               processed.negative_embeddings_2.data(),
+                               processed.positive_embeddings_2.data(),
+                               hidden2.data(), pooled2.data());
+          });
+          encoders.run();
+
+          // Batch 0 is the negative prompt, batch 1 the positive one.
+          for (int b = 0; b < batch_size; ++b) {
+            const float *h1 = hidden1.data() + b * 77 * text_embedding_size;
+            const float *h2 = hidden2.data() + b * 77 * text_embedding_size_2;
+            float *concat =
+                sdxl_encoder_hidden_states.data() + b * 77 * sdxl_concat_dim;
+            // Concat along feature dim: [77, 768] + [77, 1280] = [77, 2048]
+            for (int t = 0; t < 77; t++) {
+              memcpy(concat + t * sdxl_concat_dim,
+                     h1 + t * text_embedding_size,
+                     text_embedding_size * sizeof(float));
+              memcpy(concat + t * sdxl_concat_dim + text_embedding_size,
+                     h2 + t * text_embedding_size_2,
+                     text_embedding_size_2 * sizeof(float));
             }
+            // pooled_output is exported without pooling: pick the EOS
+            // (49407) row, falling back to the last row (76).
+            const int *ids77 = processed.ids.data() + b * 77;
+            int eos_pos = 76;
+            for (int i = 0; i < 77; i++) {
+              if (ids77[i] == 49407) {
+                eos_pos = i;
+                break;
+              }
+            }
+            memcpy(sdxl_text_embeds.data() + b * text_embedding_size_2,
+                   pooled2.data() +
+                       ((size_t)b * 77 + eos_pos) * text_embedding_size_2,
+                   text_embedding_size_2 * sizeof(float));
           }
-          memcpy(out_pooled, out2_pool_data + eos_pos * text_embedding_size_2,
-                 text_embedding_size_2 * sizeof(float));
-        };
-
-        // negative (batch idx 0)
-        run_sdxl_clip(processed.negative_embeddings,
-                      processed.negative_embeddings_2, processed.ids.data(),
-                      sdxl_encoder_hidden_states.data(),
-                      sdxl_text_embeds.data());
-        // positive (batch idx 1)
-        run_sdxl_clip(processed.positive_embeddings,
-                      processed.positive_embeddings_2,
-                      processed.ids.data() + 77,
-                      sdxl_encoder_hidden_states.data() + 77 * sdxl_concat_dim,
-                      sdxl_text_embeds.data() + text_embedding_size_2);
-        if (sdxl_lowram) releaseSdxlClipMnn();
-      } else if (use_mnn || use_mnn_clip) {
-        MNN::Interpreter *currentClipInterpreter = nullptr;
-        MNN::Session *currentClipSession = nullptr;
-        bool dynamicCreated = false;
-
-        if (use_mnn_clip) {
-          currentClipInterpreter = clipInterpreter;
-          currentClipSession = clipSession;
-          if (!currentClipInterpreter)
-            throw std::runtime_error(
-                "Global clipInterpreter (hybrid) not initialized!");
         } else {
-          currentClipInterpreter =
-              MNN::Interpreter::createFromFile(clipPath.c_str());
-          if (!currentClipInterpreter)
-            throw std::runtime_error(
-                "Failed to create temporary MNN CLIP interpreter!");
-          dynamicCreated = true;
-        }
-
-        bool sessionCreated = false;
-        if (!currentClipSession) {
-          MNN::ScheduleConfig cfg_clip;
-          cfg_clip.type = MNN_FORWARD_CPU;
-          cfg_clip.numThread = 4;
-          MNN::BackendConfig bkCfg_clip;
-          bkCfg_clip.memory = MNN::BackendConfig::Memory_Low;
-          bkCfg_clip.power = MNN::BackendConfig::Power_High;
-          cfg_clip.backendConfig = &bkCfg_clip;
-          currentClipSession = currentClipInterpreter->createSession(cfg_clip);
-          if (!currentClipSession)
-            throw std::runtime_error(
-                "Failed to create temporary MNN CLIP session!");
-          sessionCreated = true;
+          // clip_v2 graphs take the weighted token embeddings instead of ids.
+          std::vector<float> token_embeddings;
+          if (use_clip_v2) {
+            token_embeddings = processed.negative_embeddings;
+            token_embeddings.insert(token_embeddings.end(),
+                                    processed.positive_embeddings.begin(),
+                                    processed.positive_embeddings.end());
+          }
+          text_backend->encodeText(input_ids_ptr, token_embeddings.data(),
+                                   batch_size, embed_ptr, options);
         }
 
-        if (use_clip_v2) {
-          auto input = currentClipInterpreter->getSessionInput(
-              currentClipSession, "input_embedding");
-          currentClipInterpreter->resizeTensor(input, {1, 77, 768});
-          currentClipInterpreter->resizeSession(currentClipSession);
-
-          if (dynamicCreated) currentClipInterpreter->releaseModel();
-
-          memcpy(input->host<float>(), processed.negative_embeddings.data(),
-                 77 * 768 * sizeof(float));
-          currentClipInterpreter->runSession(currentClipSession);
-          auto out = currentClipInterpreter->getSessionOutput(
-              currentClipSession, "last_hidden_state");
-          memcpy(embed_ptr, out->host<float>(),
-                 77 * text_embedding_size * sizeof(float));
-
-          memcpy(input->host<float>(), processed.positive_embeddings.data(),
-                 77 * 768 * sizeof(float));
-          currentClipInterpreter->runSession(currentClipSession);
-          out = currentClipInterpreter->getSessionOutput(currentClipSession,
-                                                         "last_hidden_state");
-          memcpy(embed_ptr + 77 * text_embedding_size, out->host<float>(),
-                 77 * text_embedding_size * sizeof(float));
-
-          if (sessionCreated)
-            currentClipInterpreter->releaseSession(currentClipSession);
-          if (dynamicCreated) delete currentClipInterpreter;
-
+        // Persist CLIP outputs so the next request with identical prompts can
+        // bypass the text encoder entirely.
+        cached_prompt = prompt;
+        cached_negative_prompt = negative_prompt;
+        if (sdxl_mode) {
+          cached_sdxl_encoder_hidden_states = sdxl_encoder_hidden_states;
+          cached_sdxl_text_embeds = sdxl_text_embeds;
+          cached_text_embedding_float.clear();
+          cached_text_embedding_float.shrink_to_fit();
         } else {
-          auto input = currentClipInterpreter->getSessionInput(
-              currentClipSession, "input_ids");
-          currentClipInterpreter->resizeTensor(input, {1, 77});
-          currentClipInterpreter->resizeSession(currentClipSession);
-
-          if (dynamicCreated) currentClipInterpreter->releaseModel();
-
-          memcpy(input->host<int>(), input_ids_ptr, 77 * sizeof(int32_t));
-          currentClipInterpreter->runSession(currentClipSession);
-          auto out = currentClipInterpreter->getSessionOutput(
-              currentClipSession, "last_hidden_state");
-          memcpy(embed_ptr, out->host<float>(),
-                 77 * text_embedding_size * sizeof(float));
-
-          memcpy(input->host<int>(), input_ids_ptr + 77, 77 * sizeof(int32_t));
-          currentClipInterpreter->runSession(currentClipSession);
-          out = currentClipInterpreter->getSessionOutput(currentClipSession,
-                                                         "last_hidden_state");
-          memcpy(embed_ptr + 77 * text_embedding_size, out->host<float>(),
-                 77 * text_embedding_size * sizeof(float));
-
-          if (sessionCreated)
-            currentClipInterpreter->releaseSession(currentClipSession);
-          if (dynamicCreated) delete currentClipInterpreter;
+          cached_text_embedding_float = text_embedding_float;
+          cached_sdxl_encoder_hidden_states.clear();
+          cached_sdxl_encoder_hidden_states.shrink_to_fit();
+          cached_sdxl_text_embeds.clear();
+          cached_sdxl_text_embeds.shrink_to_fit();
         }
-      } else {
-        if (!clipApp)
-          throw std::runtime_error("Global clipApp not initialized!");
-        if (StatusCode::SUCCESS !=
-            clipApp->executeClipGraphs(input_ids_ptr, embed_ptr))
-          throw std::runtime_error("QNN CLIP exec failed (neg)");
-        if (StatusCode::SUCCESS !=
-            clipApp->executeClipGraphs(input_ids_ptr + 77,
-                                       embed_ptr + 77 * text_embedding_size))
-          throw std::runtime_error("QNN CLIP exec failed (pos)");
+        clip_cache_valid = true;
       }
 
-      // Persist CLIP outputs so the next request with identical prompts can
-      // bypass the text encoder entirely.
-      cached_prompt = prompt;
-      cached_negative_prompt = negative_prompt;
-      if (sdxl_mode) {
-        cached_sdxl_encoder_hidden_states = sdxl_encoder_hidden_states;
-        cached_sdxl_text_embeds = sdxl_text_embeds;
-        cached_text_embedding_float.clear();
-        cached_text_embedding_float.shrink_to_fit();
-      } else {
-        cached_text_embedding_float = text_embedding_float;
-        cached_sdxl_encoder_hidden_states.clear();
-        cached_sdxl_encoder_hidden_states.shrink_to_fit();
-        cached_sdxl_text_embeds.clear();
-        cached_sdxl_text_embeds.shrink_to_fit();
-      }
-      clip_cache_valid = true;
-    }
-
-    auto clip_end = std::chrono::high_resolution_clock::now();
-    std::cout << "CLIP dur: "
-              << std::chrono::duration_cast<std::chrono::milliseconds>(
-                     clip_end - clip_start)
-                     .count()
-              << "ms\n";
-    current_step++;
-    progress_callback(current_step, total_run_steps, "");
-
-    // --- Scheduler & Latents ---
-    std::unique_ptr<Scheduler> scheduler;
-    if (scheduler_type == "euler_a" || scheduler_type == "eulera") {
-      scheduler = std::make_unique<EulerAncestralDiscreteScheduler>(
-          1000, 0.00085f, 0.012f, "scaled_linear", "epsilon", "leading");
-    } else if (scheduler_type == "lcm") {
-      scheduler = std::make_unique<LCMScheduler>(1000, 0.00085f, 0.012f,
-                                                 "scaled_linear", "epsilon", 50,
-                                                 10.0f, true, false);
-    } else {
-      // Default to DPM solver
-      scheduler = std::make_unique<DPMSolverMultistepScheduler>(
-          1000, 0.00085f, 0.012f, "scaled_linear", 2, "epsilon", "leading");
-    }
-    if (use_v_pred) scheduler->set_prediction_type("v_prediction");
-    scheduler->set_timesteps(steps);
-    xt::xarray<float> timesteps = scheduler->get_timesteps();
-    const float vae_scale = sdxl_mode ? 0.13025f : 0.18215f;
-    std::vector<int> shape = {1, 4, sample_height, sample_width};
-    std::vector<int> shape_batch2 = {batch_size, 4, sample_height,
-                                     sample_width};
-    xt::random::seed(seed);
-    xt::xarray<float> latents = xt::random::randn<float>(shape);
-    xt::xarray<float> latents_noise = xt::random::randn<float>(shape);
-
-    // Scale initial latents by init_noise_sigma (required for Euler schedulers)
-    float init_noise_sigma = scheduler->get_init_noise_sigma();
-    latents = latents * init_noise_sigma;
-
-    xt::xarray<float> original_latents, original_image, mask, mask_full;
-    int start_step = 0;
+      clip_end = std::chrono::high_resolution_clock::now();
+      std::cout << "CLIP dur: "
+                << std::chrono::duration_cast<std::chrono::milliseconds>(
+                       clip_end - clip_start)
+                       .count()
+                << "ms\n";
+    };
 
     // --- Img2Img / VAE Encode ---
-    if (request_img2img) {
-      auto vae_enc_start = std::chrono::high_resolution_clock::now();
+    std::chrono::high_resolution_clock::time_point vae_enc_start, vae_enc_end;
+    xt::xarray<float> img_lat_scaled;
+    auto encode_init_image = [&]() {
+      vae_enc_start = std::chrono::high_resolution_clock::now();
       std::vector<int> img_shape = {1, 3, output_height, output_width};
       original_image = xt::adapt(img_data, img_shape);
 
-      bool need_vae_enc_tiling = ((output_width > 512 || output_height > 512) &&
-                                  !use_mnn && vaeEncoderApp && !sdxl_mode);
-
-      xt::xarray<float> img_lat_scaled;
+      bool need_vae_enc_tiling =
+          vae_tile > 0 && (output_width > vae_tile || output_height > vae_tile);
 
       if (!need_vae_enc_tiling) {
         std::vector<float> vae_enc_mean(1 * 4 * sample_width * sample_height);
         std::vector<float> vae_enc_std(1 * 4 * sample_width * sample_height);
 
-        if (use_mnn) {
-          MNN::Interpreter *currentVaeEncoderInterpreter =
-              MNN::Interpreter::createFromFile(vaeEncoderPath.c_str());
-          if (!currentVaeEncoderInterpreter)
-            throw std::runtime_error("Failed MNN VAE Enc create");
-
-          MNN::ScheduleConfig cfg_vae_enc;
-          MNN::BackendConfig bkCfg_vae_enc;
-          if (use_opencl) {
-            auto cache_file = modelDir + "/vae_enc_cache.mnnc." +
-                              std::to_string(output_width);
-            currentVaeEncoderInterpreter->setCacheFile(cache_file.c_str());
-            cfg_vae_enc.type = MNN_FORWARD_OPENCL;
-            cfg_vae_enc.mode = MNN_GPU_MEMORY_BUFFER | MNN_GPU_TUNING_FAST;
-            bkCfg_vae_enc.precision = MNN::BackendConfig::Precision_Low;
-          } else {
-            cfg_vae_enc.type = MNN_FORWARD_CPU;
-            cfg_vae_enc.numThread = 4;
-            bkCfg_vae_enc.memory = MNN::BackendConfig::Memory_Low;
-          }
-          bkCfg_vae_enc.power = MNN::BackendConfig::Power_High;
-          cfg_vae_enc.backendConfig = &bkCfg_vae_enc;
-
-          MNN::Session *currentVaeEncSession =
-              currentVaeEncoderInterpreter->createSession(cfg_vae_enc);
-          if (!currentVaeEncSession)
-            throw std::runtime_error("Failed create temp MNN VAE Enc session!");
-
-          auto input = currentVaeEncoderInterpreter->getSessionInput(
-              currentVaeEncSession, "input");
-          currentVaeEncoderInterpreter->resizeTensor(
-              input, {1, 3, output_height, output_width});
-          currentVaeEncoderInterpreter->resizeSession(currentVaeEncSession);
-          if (use_opencl) {
-            currentVaeEncoderInterpreter->updateCacheFile(currentVaeEncSession);
-          }
-          currentVaeEncoderInterpreter->releaseModel();
-
-          auto input_nchw_tensor = new MNN::Tensor(input, MNN::Tensor::CAFFE);
-          auto mean_t = currentVaeEncoderInterpreter->getSessionOutput(
-              currentVaeEncSession, "mean");
-          auto std_t = currentVaeEncoderInterpreter->getSessionOutput(
-              currentVaeEncSession, "std");
-          auto mean_nchw_tensor = new MNN::Tensor(mean_t, MNN::Tensor::CAFFE);
-          auto std_nchw_tensor = new MNN::Tensor(std_t, MNN::Tensor::CAFFE);
-
-          memcpy(input_nchw_tensor->host<float>(), img_data.data(),
-                 img_data.size() * sizeof(float));
-          input->copyFromHostTensor(input_nchw_tensor);
-          currentVaeEncoderInterpreter->runSession(currentVaeEncSession);
-
-          mean_t->copyToHostTensor(mean_nchw_tensor);
-          std_t->copyToHostTensor(std_nchw_tensor);
-          memcpy(vae_enc_mean.data(), mean_nchw_tensor->host<float>(),
-                 vae_enc_mean.size() * sizeof(float));
-          memcpy(vae_enc_std.data(), std_nchw_tensor->host<float>(),
-                 vae_enc_std.size() * sizeof(float));
-
-          delete input_nchw_tensor;
-          delete mean_nchw_tensor;
-          delete std_nchw_tensor;
-
-          currentVaeEncoderInterpreter->releaseSession(currentVaeEncSession);
-          delete currentVaeEncoderInterpreter;
-        } else {
-          if (sdxl_lowram) loadSdxlQnnVaeEncoderIfNeeded();
-          if (!vaeEncoderApp)
-            throw std::runtime_error("Global vaeEncoderApp not init!");
-          if (sdxl_mode) {
-            if (StatusCode::SUCCESS !=
-                vaeEncoderApp->executeVaeEncoderGraphsSDXL(
-                    img_data.data(), vae_enc_mean.data(), vae_enc_std.data()))
-              throw std::runtime_error("QNN VAE enc SDXL exec failed");
-          } else {
-            if (StatusCode::SUCCESS !=
-                vaeEncoderApp->executeVaeEncoderGraphs(
-                    img_data.data(), vae_enc_mean.data(), vae_enc_std.data()))
-              throw std::runtime_error("QNN VAE enc exec failed");
-          }
-          if (sdxl_lowram) releaseSdxlQnnVaeEncoder();
-        }
+        backend->encodeImage(img_data.data(), output_width, output_height,
+                             vae_enc_mean.data(), vae_enc_std.data(), options);
 
         auto mean = xt::adapt(vae_enc_mean, shape);
         auto std_dev = xt::adapt(vae_enc_std, shape);
-        xt::xarray<float> noise_0 = xt::random::randn<float>(shape);
+        xt::xarray<float> noise_0 = batched_noise(noise_shape);
         xt::xarray<float> img_lat = xt::eval(mean + std_dev * noise_0);
         img_lat_scaled = xt::eval(vae_scale * img_lat);
 
@@ -2152,69 +2504,97 @@ GenerationResult generateImage(
         int original_sample_width = sample_width;
         int original_sample_height = sample_height;
 
-        output_width = vae_enc_tile_size;
-        output_height = vae_enc_tile_size;
-        sample_width = vae_enc_latent_tile_size;
-        sample_height = vae_enc_latent_tile_size;
-
         std::vector<std::pair<xt::xarray<float>, xt::xarray<float>>>
             encoded_tiles_mean_std;
         encoded_tiles_mean_std.reserve(img_positions.size());
 
-        for (size_t i = 0; i < img_positions.size(); ++i) {
-          auto img_pos = img_positions[i];
-          xt::xarray<float> img_tile = xt::view(
-              original_image, 0, xt::all(),
-              xt::range(img_pos.second, img_pos.second + vae_enc_tile_size),
-              xt::range(img_pos.first, img_pos.first + vae_enc_tile_size));
-
-          std::vector<float> tile_img_vec(img_tile.begin(), img_tile.end());
-          std::vector<float> tile_mean_vec(1 * 4 * vae_enc_latent_tile_size *
-                                           vae_enc_latent_tile_size);
-          std::vector<float> tile_std_vec(1 * 4 * vae_enc_latent_tile_size *
-                                          vae_enc_latent_tile_size);
-
-          if (!vaeEncoderApp)
-            throw std::runtime_error("Global vaeEncoderApp not init!");
-
-          if (StatusCode::SUCCESS !=
-              vaeEncoderApp->executeVaeEncoderGraphs(tile_img_vec.data(),
-                                                     tile_mean_vec.data(),
-                                                     tile_std_vec.data()))
-            throw std::runtime_error("QNN VAE enc exec failed for tile");
-
-          std::vector<int> tile_shape = {1, 4, vae_enc_latent_tile_size,
-                                         vae_enc_latent_tile_size};
-          encoded_tiles_mean_std.push_back(
-              {xt::adapt(tile_mean_vec, tile_shape),
-               xt::adapt(tile_std_vec, tile_shape)});
-          std::cout << "Processed VAE encoder tile " << i + 1 << "/"
-                    << img_positions.size() << std::endl;
+        {
+          // Restore the global shape even if a tile fails or is cancelled.
+          ScopeExit restoreShape{[&]() {
+            output_width = original_output_width;
+            output_height = original_output_height;
+            sample_width = original_sample_width;
+            sample_height = original_sample_height;
+          }};
+          output_width = vae_enc_tile_size;
+          output_height = vae_enc_tile_size;
+          sample_width = vae_enc_latent_tile_size;
+          sample_height = vae_enc_latent_tile_size;
+
+          for (size_t i = 0; i < img_positions.size(); ++i) {
+            cancel.throwIfCancelled();
+            TRACE_SCOPE("vae_encode_tile", "sd", (int)i);
+            auto img_pos = img_positions[i];
+            xt::xarray<float> img_tile = xt::view(
+                original_image, 0, xt::all(),
+                xt::range(img_pos.second, img_pos.second + vae_enc_tile_size),
+                xt::range(img_pos.first, img_pos.first + vae_enc_tile_size));
+
+            std::vector<float> tile_img_vec(img_tile.begin(), img_tile.end());
+            std::vector<float> tile_mean_vec(1 * 4 * vae_enc_latent_tile_size *
+                                             vae_enc_latent_tile_size);
+            std::vector<float> tile_std_vec(1 * 4 * vae_enc_latent_tile_size *
+                                            vae_enc_latent_tile_size);
+
+            backend->encodeImage(tile_img_vec.data(), vae_enc_tile_size,
+                                 vae_enc_tile_size, tile_mean_vec.data(),
+                                 tile_std_vec.data(), options);
+
+            std::vector<int> tile_shape = {1, 4, vae_enc_latent_tile_size,
+                                           vae_enc_latent_tile_size};
+            encoded_tiles_mean_std.push_back(
+                {xt::adapt(tile_mean_vec, tile_shape),
+                 xt::adapt(tile_std_vec, tile_shape)});
+            std::cout << "Processed VAE encoder tile " << i + 1 << "/"
+                      << img_positions.size() << std::endl;
+          }
         }
 
-        output_width = original_output_width;
-        output_height = original_output_height;
-        sample_width = original_sample_width;
-        sample_height = original_sample_height;
-
+        trace::Span blend_span("blend_vae_encoder_tiles");
         xt::xarray<float> img_lat = blend_vae_encoder_tiles(
             encoded_tiles_mean_std, latent_positions, sample_height,
             sample_width, vae_enc_latent_tile_size, latent_overlap_x,
-            latent_overlap_y);
+            latent_overlap_y, batched_noise(noise_shape));
 
         img_lat_scaled = xt::eval(vae_scale * img_lat);
+        blend_span.end();
 
         std::cout << "VAE encoder tiling completed: "
                   << encoded_tiles_mean_std.size()
                   << " tiles processed and blended" << std::endl;
       }
 
-      auto vae_enc_end = std::chrono::high_resolution_clock::now();
+      vae_enc_end = std::chrono::high_resolution_clock::now();
       std::cout << "VAE Enc dur: "
                 << std::chrono::duration_cast<std::chrono::milliseconds>(
                        vae_enc_end - vae_enc_start)
                        .count()
                 << "ms\n";
+    };
+
+    // The text encoder and the VAE encoder are independent, so img2img runs
+    // them concurrently: host CLIP overlaps an accelerator VAE encoder, and
+    // two MNN stages share the CPU cores. Only the VAE stage draws noise,
+    // after the scheduler latents above, so seeds still reproduce. Tiled
+    // encoding swaps the global output/sample shape, which text encoding
+    // never reads. Under a memory budget the stages run one at a time, so
+    // the two models need not be resident together.
+    // Models loaded on demand are read in one stage ahead: the UNet while
+    // the encoders run, the VAE decoder during the last UNet steps and the
+    // safety checker while decoding. These are no-ops otherwise.
+    backend->prefetchUnet();
+    StageGraph prepare(!on_demand);
+    prepare.add("clip", encode_prompts);
+    if (request_img2img) prepare.add("vae_encode", encode_init_image);
+    prepare.run();
+
+    reportStage("clip", clip_start, clip_end);
+    current_step++;
+    report_progress(current_step, total_run_steps, "");
+    cancel.throwIfCancelled();
+
+    if (request_img2img) {
+      reportStage("vae_encode", vae_enc_start, vae_enc_end);
 
       original_latents = img_lat_scaled;
       start_step = steps * (1.0f - denoise_strength);
@@ -2230,567 +2610,946 @@ GenerationResult generateImage(
       }
 
       current_step++;
-      progress_callback(current_step, total_run_steps, "");
+      report_progress(current_step, total_run_steps, "");
     }  // --- UNET Denoising Loop ---
-    int single_latent_size = 1 * 4 * sample_width * sample_height;
-
-    MNN::Interpreter *currentUnetInterpreter = nullptr;
-    MNN::Session *currentUnetSession = nullptr;
-
-    if (use_mnn) {
-      currentUnetInterpreter =
-          MNN::Interpreter::createFromFile(unetPath.c_str());
-      if (!currentUnetInterpreter)
-        throw std::runtime_error(
-            "Failed to create temporary MNN UNET interpreter!");
-
-      MNN::ScheduleConfig cfg_unet;
-      MNN::BackendConfig bkCfg_unet;
-      if (use_opencl) {
-        auto cache_file =
-            modelDir + "/unet_cache.mnnc." + std::to_string(output_width);
-        currentUnetInterpreter->setCacheFile(cache_file.c_str());
-        cfg_unet.type = MNN_FORWARD_OPENCL;
-        cfg_unet.mode = MNN_GPU_MEMORY_BUFFER | MNN_GPU_TUNING_FAST;
-        bkCfg_unet.precision = MNN::BackendConfig::Precision_Low;
-      } else {
-        cfg_unet.type = MNN_FORWARD_CPU;
-        cfg_unet.numThread = 4;
-        bkCfg_unet.memory = MNN::BackendConfig::Memory_Low;
-      }
-      bkCfg_unet.power = MNN::BackendConfig::Power_High;
-      cfg_unet.backendConfig = &bkCfg_unet;
-
-      currentUnetSession = currentUnetInterpreter->createSession(cfg_unet);
-      if (!currentUnetSession)
-        throw std::runtime_error(
-            "Failed to create temporary MNN UNET session!");
-
-      auto samp =
-          currentUnetInterpreter->getSessionInput(currentUnetSession, "sample");
-      auto ts = currentUnetInterpreter->getSessionInput(currentUnetSession,
-                                                        "timestep");
-      auto enc = currentUnetInterpreter->getSessionInput(
-          currentUnetSession, "encoder_hidden_states");
-
-      currentUnetInterpreter->resizeTensor(
-          samp, {batch_size, 4, sample_height, sample_width});
-      currentUnetInterpreter->resizeTensor(ts, {1});
-      currentUnetInterpreter->resizeTensor(
-          enc, {batch_size, 77, text_embedding_size});
-      currentUnetInterpreter->resizeSession(currentUnetSession);
-      if (use_opencl) {
-        currentUnetInterpreter->updateCacheFile(currentUnetSession);
+    // Runs timesteps from start_step on at the current output size. The
+    // hires fix runs it twice; only the last pass reads the decoder in.
+    auto denoise = [&](bool last_pass) {
+      // Above the UNet's size (or its 512x512 windows on request), each step
+      // denoises overlapping windows of the latent and blends their noise
+      // predictions with the VAE tile weights (MultiDiffusion), so the graph
+      // shape and memory stay those of one window for any output size.
+      const InferenceBackend::GraphSize unet_graph = backend->unetTileSize();
+      int tile_w = unet_graph.width;
+      int tile_h = unet_graph.height;
+      if (tile_w == 0 && request_tile_unet) tile_w = tile_h = 512;
+      // A fixed-size graph takes its own size or windows of it, never an
+      // image or a window cut short on either side.
+      if (unet_graph.width > 0 &&
+          (output_width < tile_w || output_height < tile_h))
+        throw std::invalid_argument(
+            std::string("The ") + backend->name() + " UNet needs at least " +
+            std::to_string(tile_w) + "x" + std::to_string(tile_h) +
+            " pixels");
+      const bool tiled =
+          tile_w > 0 && (output_width > tile_w || output_height > tile_h);
+      const int window_w =
+          tiled ? std::min(tile_w, output_width) / 8 : sample_width;
+      const int window_h =
+          tiled ? std::min(tile_h, output_height) / 8 : sample_height;
+      std::vector<std::pair<int, int>> windows;  // latent x, y
+      std::vector<xt::xarray<float>> window_weights;
+      if (tiled) {
+        const int min_latent_overlap = 16;
+        std::vector<int> xs = calculate_tile_positions(
+            sample_width, window_w, min_latent_overlap);
+        std::vector<int> ys = calculate_tile_positions(
+            sample_height, window_h, min_latent_overlap);
+        const int overlap_x = xs.size() > 1 ? window_w - (xs[1] - xs[0]) : 0;
+        const int overlap_y = ys.size() > 1 ? window_h - (ys[1] - ys[0]) : 0;
+        for (int y : ys) {
+          for (int x : xs) {
+            windows.push_back({x, y});
+            window_weights.push_back(
+                tile_blend_weight(x, y, window_w, window_h, sample_width,
+                                  sample_height, overlap_x, overlap_y));
+          }
+        }
+        QNN_INFO("Denoising %dx%d in %zu windows of %dx%d", output_width,
+                 output_height, windows.size(), window_w * 8, window_h * 8);
       }
-
-      currentUnetInterpreter->releaseModel();
-    }
-
-    if (sdxl_lowram) loadSdxlQnnUnetIfNeeded();
-
-    for (int i = start_step; i < timesteps.size(); ++i) {
-      if (show_diffusion_process && !use_mnn && !sdxl_lowram &&
-          (i - start_step) % show_diffusion_stride == 0) {
-        try {
-          // Decode current latents for preview
-          xt::xarray<float> preview_latents =
-              xt::eval((1.0 / vae_scale) * latents);
-
-          xt::xarray<float> pixels;
-          bool preview_success = false;
-
-          if ((output_width > 512 || output_height > 512) && !sdxl_mode) {
-            // Use tiling for QNN large resolution preview
-            auto [output_positions, latent_positions, overlap_x, overlap_y,
-                  latent_overlap_x, latent_overlap_y] =
-                calculate_vae_tile_positions(output_width, output_height);
-
-            const int vae_tile_size = 512;
-            const int vae_latent_tile_size = 64;
-
-            int original_output_width = output_width;
-            int original_output_height = output_height;
-            int original_sample_width = sample_width;
-            int original_sample_height = sample_height;
-
-            output_width = vae_tile_size;
-            output_height = vae_tile_size;
-            sample_width = vae_latent_tile_size;
-            sample_height = vae_latent_tile_size;
-
-            std::vector<xt::xarray<float>> decoded_tiles;
-            decoded_tiles.reserve(latent_positions.size());
-
-            bool tile_success = true;
-            for (size_t tile_idx = 0; tile_idx < latent_positions.size();
-                 ++tile_idx) {
-              auto lat_pos = latent_positions[tile_idx];
-              // Extract latent tile
-              xt::xarray<float> latent_tile =
-                  xt::view(preview_latents, 0, xt::all(),
-                           xt::range(lat_pos.second,
-                                     lat_pos.second + vae_latent_tile_size),
-                           xt::range(lat_pos.first,
-                                     lat_pos.first + vae_latent_tile_size));
-
-              std::vector<float> tile_latent_vec(latent_tile.begin(),
-                                                 latent_tile.end());
-              xt::xarray<float> tile_output =
-                  xt::zeros<float>({1, 3, vae_tile_size, vae_tile_size});
-
-              if (StatusCode::SUCCESS !=
-                  vaeDecoderApp->executeVaeDecoderGraphs(tile_latent_vec.data(),
-                                                         tile_output.data())) {
-                tile_success = false;
-                break;
+      // Windows per UNet call. A short last group repeats its last window,
+      // so the graph keeps one shape.
+      const int group =
+          tiled ? std::min<int>(unet_tile_batch, windows.size()) : 1;
+
+      backend->beginUnet(batch_size * batch_count * group, window_w * 8,
+                         window_h * 8, options);
+      // Releases the UNet when the loop exits, including on error or
+      // cancellation.
+      ScopeExit unetGuard{[&]() { backend->endUnet(); }};
+
+      // With cfg = 1.0, noise_pred = uncond + 1*(txt - uncond) = txt, so the
+      // unconditional pass is redundant. QNN runs images one at a time and
+      // skips it to halve UNet time; MNN runs both halves in a single graph
+      // call so the optimization does not apply there.
+      const bool skip_uncond = !use_mnn && cfg == 1.0f;
+
+      // Guided noise prediction for images [n, 4, h, w], with both CFG
+      // halves in one UNet call.
+      auto predict_noise = [&](const xt::xarray<float> &images, int timestep,
+                               bool reuse_features =
+                                   false) -> xt::xarray<float> {
+        const int n = (int)images.shape()[0];
+        std::vector<float> unet_in(images.begin(), images.end());
+        unet_in.insert(unet_in.end(), images.begin(), images.end());
+        std::vector<float> unet_out(unet_in.size());
+
+        InferenceBackend::UnetStep unet_step;
+        unet_step.latents = unet_in.data();
+        unet_step.noise_pred = unet_out.data();
+        unet_step.batch = n;
+        unet_step.timestep = timestep;
+        unet_step.skip_uncond = skip_uncond;
+        unet_step.hidden_states = sdxl_mode ? sdxl_encoder_hidden_states.data()
+                                            : text_embedding_float.data();
+        unet_step.text_embeds = sdxl_mode ? sdxl_text_embeds.data() : nullptr;
+        unet_step.time_ids = sdxl_mode ? sdxl_time_ids.data() : nullptr;
+        unet_step.reuse_features = reuse_features;
+        backend->runUnet(unet_step);
+
+        std::vector<size_t> out_shape(images.shape().begin(),
+                                      images.shape().end());
+        out_shape[0] = 2 * n;
+        xt::xarray<float> out = xt::adapt(unet_out, out_shape);
+        // cfg = 1 path: only the cond half of unet_out was filled.
+        xt::xarray<float> txt = xt::view(out, xt::range(n, 2 * n));
+        if (skip_uncond) return txt;
+        xt::xarray<float> uncond = xt::view(out, xt::range(0, n));
+        return xt::eval(uncond + cfg * (txt - uncond));
+      };
+
+      auto predict_tiled = [&](const xt::xarray<float> &input,
+                               int timestep) -> xt::xarray<float> {
+        xt::xarray<float> accumulated = xt::zeros<float>(input.shape());
+        xt::xarray<float> weight_map =
+            xt::zeros<float>({sample_height, sample_width});
+        for (size_t first = 0; first < windows.size(); first += group) {
+          cancel.throwIfCancelled();
+          TRACE_SCOPE("unet_window", "sd", (int)first);
+          xt::xarray<float> images = xt::empty<float>(
+              {(size_t)group * batch_count, (size_t)4, (size_t)window_h,
+               (size_t)window_w});
+          for (int k = 0; k < group; ++k) {
+            const auto [x, y] =
+                windows[std::min(first + k, windows.size() - 1)];
+            xt::view(images,
+                     xt::range(k * batch_count, (k + 1) * batch_count)) =
+                xt::view(input, xt::all(), xt::all(),
+                         xt::range(y, y + window_h),
+                         xt::range(x, x + window_w));
+          }
+          xt::xarray<float> pred = predict_noise(images, timestep);
+          for (int k = 0; k < group && first + k < windows.size(); ++k) {
+            const auto [x, y] = windows[first + k];
+            const xt::xarray<float> &weight = window_weights[first + k];
+            xt::view(accumulated, xt::all(), xt::all(),
+                     xt::range(y, y + window_h), xt::range(x, x + window_w)) +=
+                xt::view(pred,
+                         xt::range(k * batch_count, (k + 1) * batch_count)) *
+                weight;
+            xt::view(weight_map, xt::range(y, y + window_h),
+                     xt::range(x, x + window_w)) += weight;
+          }
+        }
+        weight_map = xt::maximum(weight_map, 1e-8f);
+        return xt::eval(accumulated /
+                        xt::reshape_view(weight_map, {1, 1, sample_height,
+                                                      sample_width}));
+      };
+
+      // Previews are decoded and encoded on a background worker so the UNet
+      // loop never waits on the VAE, base64 or a slow client. The worker only
+      // reads its captured sizes; the shared output/sample globals stay
+      // untouched until it is stopped after the loop.
+      std::unique_ptr<PreviewWorker> previewWorker;
+      if (show_diffusion_process && !use_mnn && !on_demand) {
+        const int preview_width = output_width;
+        const int preview_height = output_height;
+        auto render_preview =
+            [=](const xt::xarray<float> &step_latents) -> std::string {
+          TRACE_SCOPE("preview");
+          try {
+            xt::xarray<float> preview_latents =
+                xt::eval((1.0 / vae_scale) * step_latents);
+            xt::xarray<float> pixels;
+
+            if (vae_tile > 0 &&
+                (preview_width > vae_tile || preview_height > vae_tile)) {
+              // Use tiling for QNN large resolution preview
+              auto [output_positions, latent_positions, overlap_x, overlap_y,
+                    latent_overlap_x, latent_overlap_y] =
+                  calculate_vae_tile_positions(preview_width, preview_height);
+
+              const int vae_tile_size = 512;
+              const int vae_latent_tile_size = 64;
+
+              std::vector<xt::xarray<float>> decoded_tiles;
+              decoded_tiles.reserve(latent_positions.size());
+
+              for (size_t tile_idx = 0; tile_idx < latent_positions.size();
+                   ++tile_idx) {
+                TRACE_SCOPE("preview_tile", "sd", (int)tile_idx);
+                auto lat_pos = latent_positions[tile_idx];
+                xt::xarray<float> latent_tile =
+                    xt::view(preview_latents, 0, xt::all(),
+                             xt::range(lat_pos.second,
+                                       lat_pos.second + vae_latent_tile_size),
+                             xt::range(lat_pos.first,
+                                       lat_pos.first + vae_latent_tile_size));
+
+                std::vector<float> tile_latent_vec(latent_tile.begin(),
+                                                   latent_tile.end());
+                xt::xarray<float> tile_output =
+                    xt::zeros<float>({1, 3, vae_tile_size, vae_tile_size});
+                backend->decodeLatents(tile_latent_vec.data(), vae_tile_size,
+                                       vae_tile_size, tile_output.data());
+
+                decoded_tiles.push_back(std::move(tile_output));
               }
 
-              decoded_tiles.push_back(std::move(tile_output));
-            }
-
-            output_width = original_output_width;
-            output_height = original_output_height;
-            sample_width = original_sample_width;
-            sample_height = original_sample_height;
-
-            if (tile_success) {
-              pixels = blend_vae_output_tiles(
-                  decoded_tiles, output_positions, output_height, output_width,
-                  vae_tile_size, overlap_x, overlap_y);
-              preview_success = true;
-            }
-          } else {
-            // Single inference for QNN <= 512 (or SDXL @ 1024)
-            std::vector<float> vae_dec_in_vec(preview_latents.begin(),
-                                              preview_latents.end());
-            std::vector<float> vae_dec_out_pixels(1 * 3 * output_width *
-                                                  output_height);
-            StatusCode vae_dec_status =
-                sdxl_mode
-                    ? vaeDecoderApp->executeVaeDecoderGraphsSDXL(
-                          vae_dec_in_vec.data(), vae_dec_out_pixels.data())
-                    : vaeDecoderApp->executeVaeDecoderGraphs(
-                          vae_dec_in_vec.data(), vae_dec_out_pixels.data());
-            if (StatusCode::SUCCESS == vae_dec_status) {
-              std::vector<int> pixel_shape = {1, 3, output_height,
-                                              output_width};
+              pixels = blend_vae_output_tiles(decoded_tiles, output_positions,
+                                              preview_height, preview_width,
+                                              vae_tile_size, overlap_x,
+                                              overlap_y);
+            } else {
+              // Single inference for QNN <= 512 (or SDXL @ 1024)
+              std::vector<float> vae_dec_in_vec(preview_latents.begin(),
+                                                preview_latents.end());
+              std::vector<float> vae_dec_out_pixels(1 * 3 * preview_width *
+                                                    preview_height);
+              backend->decodeLatents(vae_dec_in_vec.data(), preview_width,
+                                     preview_height, vae_dec_out_pixels.data());
+              std::vector<int> pixel_shape = {1, 3, preview_height,
+                                              preview_width};
               pixels = xt::adapt(vae_dec_out_pixels, pixel_shape);
-              preview_success = true;
             }
-          }
 
-          if (preview_success) {
             auto img = xt::view(pixels, 0);
             auto transp = xt::transpose(img, {1, 2, 0});
             auto norm = xt::clip(((transp + 1.0) / 2.0) * 255.0, 0.0, 255.0);
             xt::xarray<uint8_t> u8_img = xt::cast<uint8_t>(norm);
-            std::vector<uint8_t> out_data(u8_img.begin(), u8_img.end());
-            std::string image_str_result(out_data.begin(), out_data.end());
-            std::string enc_img = base64_encode(image_str_result);
-            progress_callback(current_step, total_run_steps, enc_img);
-          } else {
-            progress_callback(current_step, total_run_steps, "");
+            std::string image_str_result(u8_img.begin(), u8_img.end());
+            return base64_encode(image_str_result);
+          } catch (const std::exception &e) {
+            QNN_WARN("Preview generation failed: %s", e.what());
+            return "";
           }
-        } catch (const std::exception &e) {
-          QNN_WARN("Preview generation failed: %s", e.what());
-          progress_callback(current_step, total_run_steps, "");
-        }
-      } else {
-        progress_callback(current_step, total_run_steps, "");
+        };
+        previewWorker =
+            std::make_unique<PreviewWorker>(render_preview, report_progress);
       }
 
-      auto step_start_time = std::chrono::high_resolution_clock::now();
-
-      // Scale model input (required for Euler schedulers)
-      float current_ts = timesteps(i);
-      xt::xarray<float> latents_scaled =
-          scheduler->scale_model_input(latents, current_ts);
-
-      std::vector<float> latents_in_vec;
-      latents_in_vec.reserve(batch_size * single_latent_size);
-      latents_in_vec.insert(latents_in_vec.end(), latents_scaled.begin(),
-                            latents_scaled.end());
-      latents_in_vec.insert(latents_in_vec.end(), latents_scaled.begin(),
-                            latents_scaled.end());
-      std::vector<float> unet_out_latents(batch_size * single_latent_size);
-
-      if (use_mnn) {
-        auto samp = currentUnetInterpreter->getSessionInput(currentUnetSession,
-                                                            "sample");
-        auto ts = currentUnetInterpreter->getSessionInput(currentUnetSession,
-                                                          "timestep");
-        auto enc = currentUnetInterpreter->getSessionInput(
-            currentUnetSession, "encoder_hidden_states");
-
-        int current_ts_int = (int)(current_ts);
-
-        auto samp_nchw_tensor = new MNN::Tensor(samp, MNN::Tensor::CAFFE);
-        auto ts_nchw_tensor = new MNN::Tensor(ts, MNN::Tensor::CAFFE);
-        auto enc_nchw_tensor = new MNN::Tensor(enc, MNN::Tensor::CAFFE);
-
-        // Copy both batches (negative and positive) at once
-        memcpy(samp_nchw_tensor->host<float>(), latents_in_vec.data(),
-               latents_in_vec.size() * sizeof(float));
-        memcpy(ts_nchw_tensor->host<int>(), &current_ts_int, sizeof(int));
-        memcpy(enc_nchw_tensor->host<float>(), text_embedding_float.data(),
-               text_embedding_float.size() * sizeof(float));
-
-        samp->copyFromHostTensor(samp_nchw_tensor);
-        ts->copyFromHostTensor(ts_nchw_tensor);
-        enc->copyFromHostTensor(enc_nchw_tensor);
-
-        // Single batch inference for both negative and positive conditions
-        currentUnetInterpreter->runSession(currentUnetSession);
-
-        auto output = currentUnetInterpreter->getSessionOutput(
-            currentUnetSession, "out_sample");
-        output->copyToHostTensor(samp_nchw_tensor);
-        memcpy(unet_out_latents.data(), samp_nchw_tensor->host<float>(),
-               unet_out_latents.size() * sizeof(float));
-
-        delete samp_nchw_tensor;
-        delete ts_nchw_tensor;
-        delete enc_nchw_tensor;
-      } else {
-        if (!unetApp)
-          throw std::runtime_error("Global unetApp not initialized!");
-
-        float *latents_in_ptr = latents_in_vec.data();
-        float *latents_out_ptr = unet_out_latents.data();
-
-        // With cfg = 1.0, noise_pred = uncond + 1*(txt - uncond) = txt, so the
-        // unconditional pass is redundant. Skip it on QNN to halve UNet time.
-        // MNN runs both batches in a single graph call so the optimization
-        // does not apply there.
-        const bool skip_uncond = (cfg == 1.0f);
-
-        if (sdxl_mode) {
-          float *hidden_ptr = sdxl_encoder_hidden_states.data();
-          float *pooled_ptr = sdxl_text_embeds.data();
-          float *time_ids_ptr = sdxl_time_ids.data();
-          const int hidden_stride = 77 * sdxl_concat_dim;
-          const int pooled_stride = text_embedding_size_2;
-          const int time_ids_stride = 6;
-
-          if (!skip_uncond &&
-              StatusCode::SUCCESS !=
-                  unetApp->executeUnetGraphsSDXL(
-                      latents_in_ptr, static_cast<int>(current_ts), hidden_ptr,
-                      pooled_ptr, time_ids_ptr, latents_out_ptr))
-            throw std::runtime_error("QNN UNET SDXL exec failed (uncond)");
-
-          if (StatusCode::SUCCESS !=
-              unetApp->executeUnetGraphsSDXL(
-                  latents_in_ptr + single_latent_size,
-                  static_cast<int>(current_ts), hidden_ptr + hidden_stride,
-                  pooled_ptr + pooled_stride, time_ids_ptr + time_ids_stride,
-                  latents_out_ptr + single_latent_size))
-            throw std::runtime_error("QNN UNET SDXL exec failed (cond)");
+      const int decoder_prefetch_step =
+          std::max(start_step, (int)timesteps.size() - decoder_prefetch_steps);
+      for (int i = start_step; i < timesteps.size(); ++i) {
+        cancel.throwIfCancelled();
+        TRACE_SCOPE("denoise_step", "sd", i);
+        if (last_pass && i == decoder_prefetch_step) backend->prefetchDecoder();
+        if (previewWorker) {
+          // Only the first image of a batch is previewed.
+          if ((i - start_step) % show_diffusion_stride == 0)
+            previewWorker->post(current_step, total_run_steps,
+                                xt::view(latents, xt::range(0, 1)));
+          else
+            previewWorker->post(current_step, total_run_steps);
         } else {
-          float *embed_ptr = text_embedding_float.data();
-
-          if (!skip_uncond &&
-              StatusCode::SUCCESS !=
-                  unetApp->executeUnetGraphs(latents_in_ptr,
-                                             static_cast<int>(current_ts),
-                                             embed_ptr, latents_out_ptr))
-            throw std::runtime_error("QNN UNET exec failed (uncond)");
-
-          if (StatusCode::SUCCESS !=
-              unetApp->executeUnetGraphs(latents_in_ptr + single_latent_size,
-                                         static_cast<int>(current_ts),
-                                         embed_ptr + 77 * text_embedding_size,
-                                         latents_out_ptr + single_latent_size))
-            throw std::runtime_error("QNN UNET exec failed (cond)");
+          report_progress(current_step, total_run_steps, "");
         }
-      }
 
-      auto step_end_time = std::chrono::high_resolution_clock::now();
-      auto step_dur = std::chrono::duration_cast<std::chrono::milliseconds>(
-          step_end_time - step_start_time);
+        auto step_start_time = std::chrono::high_resolution_clock::now();
+
+        // Scale model input (required for Euler schedulers)
+        float current_ts = timesteps(i);
+        xt::xarray<float> latents_scaled =
+            scheduler->scale_model_input(latents, current_ts);
+
+        // DeepCache: every deepcache_interval-th step runs the full UNet,
+        // the ones between reuse its deep features.
+        const bool reuse_features = deepcache_interval > 1 && !tiled &&
+                                    (i - start_step) % deepcache_interval != 0;
+        xt::xarray<float> noise_pred =
+            tiled ? predict_tiled(latents_scaled, (int)current_ts)
+                  : predict_noise(latents_scaled, (int)current_ts,
+                                  reuse_features);
+
+        auto step_end_time = std::chrono::high_resolution_clock::now();
+        auto step_dur = std::chrono::duration_cast<std::chrono::milliseconds>(
+            step_end_time - step_start_time);
+
+        if (i == start_step && first_step_time_ms == 0)
+          first_step_time_ms = step_dur.count();
+        std::cout << "UNET step " << i << " dur: " << step_dur.count()
+                  << "ms\n";
+        reportStage("unet_step", step_start_time, step_end_time);
+
+        TRACE_SCOPE("scheduler_step", "sd", i);
+        latents =
+            scheduler->step(noise_pred, timesteps(i), latents).prev_sample;
 
-      if (i == start_step) first_step_time_ms = step_dur.count();
-      std::cout << "UNET step " << i << " dur: " << step_dur.count() << "ms\n";
+        if (request_has_mask) {
+          xt::xarray<int> t_xt = {(int)(timesteps(i))};
+          xt::xarray<float> orig_noised =
+              scheduler->add_noise(original_latents, latents_noise, t_xt);
+          latents = xt::eval(orig_noised * (1.0f - mask) + latents * mask);
+        }
 
-      xt::xarray<float> noise_pred;
-      if (!use_mnn && cfg == 1.0f) {
-        // cfg = 1 path: only the cond half of unet_out_latents was filled.
-        std::vector<float> cond_only(
-            unet_out_latents.begin() + single_latent_size,
-            unet_out_latents.end());
-        noise_pred = xt::adapt(cond_only, shape);
-      } else {
-        xt::xarray<float> noise_pred_batch =
-            xt::adapt(unet_out_latents, shape_batch2);
-        xt::xarray<float> uncond = xt::view(noise_pred_batch, 0);
-        xt::xarray<float> txt = xt::view(noise_pred_batch, 1);
-        noise_pred = xt::eval(uncond + cfg * (txt - uncond));
+        current_step++;
       }
-      latents = scheduler->step(noise_pred, timesteps(i), latents).prev_sample;
 
-      if (request_has_mask) {
-        xt::xarray<int> t_xt = {(int)(timesteps(i))};
-        xt::xarray<float> orig_noised =
-            scheduler->add_noise(original_latents, latents_noise, t_xt);
-        latents = xt::eval(orig_noised * (1.0f - mask) + latents * mask);
+      if (previewWorker) {
+        previewWorker->stop();
+        if (previewWorker->dropped() > 0)
+          QNN_INFO("Dropped %d stale preview(s)", previewWorker->dropped());
+        previewWorker.reset();
       }
 
+      unetGuard.run();
+    };
+    denoise(hires_width == 0);
+
+    // --- Hires Fix ---
+    // The first pass settled the composition at the requested size. Its
+    // latents are upscaled bicubically and refined at the hires size by the
+    // last hires_steps steps of a fresh schedule, as in img2img with
+    // hires_denoise strength, so only a few steps run at the large size.
+    if (hires_width > 0) {
+      cancel.throwIfCancelled();
+      TRACE_SCOPE("hires_fix");
+      auto upscale_start = std::chrono::high_resolution_clock::now();
+      const int hires_sample_width = hires_width / 8;
+      const int hires_sample_height = hires_height / 8;
+      std::vector<float> upscaled = resizePlanesBicubic(
+          latents.data(), batch_count * 4, sample_width, sample_height,
+          hires_sample_width, hires_sample_height);
+      output_width = hires_width;
+      output_height = hires_height;
+      sample_width = hires_sample_width;
+      sample_height = hires_sample_height;
+      batch_shape = {batch_count, 4, sample_height, sample_width};
+      xt::xarray<float> hires_latents = xt::adapt(upscaled, batch_shape);
+
+      const int hires_schedule = std::max(
+          hires_steps, (int)std::lround(hires_steps / hires_denoise));
+      scheduler = make_scheduler();
+      scheduler->set_timesteps(hires_schedule);
+      timesteps = scheduler->get_timesteps();
+      start_step = hires_schedule - hires_steps;
+      scheduler->set_begin_index(start_step);
+      xt::xarray<int> t = {(int)(timesteps(start_step))};
+      latents = scheduler->add_noise(
+          hires_latents,
+          batched_noise({(size_t)batch_count, 4, (size_t)sample_height,
+                         (size_t)sample_width}),
+          t);
+      reportStage("hires_upscale", upscale_start,
+                  std::chrono::high_resolution_clock::now());
       current_step++;
+      report_progress(current_step, total_run_steps, "");
+      denoise(true);
     }
 
-    if (use_mnn) {
-      if (currentUnetSession)
-        currentUnetInterpreter->releaseSession(currentUnetSession);
-      if (currentUnetInterpreter) delete currentUnetInterpreter;
-    }
-
-    if (sdxl_lowram) releaseSdxlQnnUnet();
-
     // --- VAE Decode ---
-    auto vae_dec_start = std::chrono::high_resolution_clock::now();
+    cancel.throwIfCancelled();
 
     bool need_vae_tiling =
-        ((output_width > 512 || output_height > 512) && !use_mnn && !sdxl_mode);
+        vae_tile > 0 && (output_width > vae_tile || output_height > vae_tile);
     if (need_vae_tiling) {
       std::cout << "Using VAE decoder tiling for " << output_width << "x"
                 << output_height << " output..." << std::endl;
     }
 
+    // The decoder is set up once and shared by every image of the batch.
+    backend->beginDecode(output_width, output_height, options);
+    ScopeExit decodeGuard{[&]() { backend->endDecode(); }};
+    residency.prefetch(resident_models.safety_checker);
+
     latents = xt::eval((1.0 / vae_scale) * latents);
+    // Pyramids of the inpainting blend, reused by every image of the batch.
+    LaplacianBlendScratch blend_scratch;
 
-    xt::xarray<float> pixels;
-
-    if (!need_vae_tiling) {
-      std::vector<float> vae_dec_in_vec(latents.begin(), latents.end());
-      std::vector<float> vae_dec_out_pixels(1 * 3 * output_width *
-                                            output_height);
-
-      if (use_mnn) {
-        MNN::Interpreter *currentVaeDecoderInterpreter =
-            MNN::Interpreter::createFromFile(vaeDecoderPath.c_str());
-
-        if (!currentVaeDecoderInterpreter)
-          throw std::runtime_error(
-              "Failed to create temporary MNN VAE Decoder interpreter!");
-
-        MNN::ScheduleConfig cfg_vae;
-        MNN::BackendConfig bkCfg_vae;
-        if (use_opencl) {
-          auto cache_file =
-              modelDir + "/vae_dec_cache.mnnc." + std::to_string(output_width);
-          currentVaeDecoderInterpreter->setCacheFile(cache_file.c_str());
-          cfg_vae.type = MNN_FORWARD_OPENCL;
-          cfg_vae.mode = MNN_GPU_MEMORY_BUFFER | MNN_GPU_TUNING_FAST;
-          bkCfg_vae.precision = MNN::BackendConfig::Precision_Low;
-        } else {
-          cfg_vae.type = MNN_FORWARD_CPU;
-          cfg_vae.numThread = 4;
-          bkCfg_vae.memory = MNN::BackendConfig::Memory_Low;
-        }
-        bkCfg_vae.power = MNN::BackendConfig::Power_High;
-        cfg_vae.backendConfig = &bkCfg_vae;
+    for (int image_idx = 0; image_idx < batch_count; ++image_idx) {
+      cancel.throwIfCancelled();
+      TRACE_SCOPE("image", "sd", image_idx);
+      auto vae_dec_start = std::chrono::high_resolution_clock::now();
 
-        MNN::Session *currentVaeDecSession =
-            currentVaeDecoderInterpreter->createSession(cfg_vae);
+      xt::xarray<float> image_latents =
+          xt::view(latents, xt::range(image_idx, image_idx + 1));
+      xt::xarray<float> pixels;
 
-        if (!currentVaeDecSession)
-          throw std::runtime_error("Failed create temp MNN VAE Dec session!");
+      if (!need_vae_tiling) {
+        std::vector<float> vae_dec_in_vec(image_latents.begin(),
+                                          image_latents.end());
+        std::vector<float> vae_dec_out_pixels(1 * 3 * output_width *
+                                              output_height);
 
-        auto input = currentVaeDecoderInterpreter->getSessionInput(
-            currentVaeDecSession, "latent_sample");
+        backend->decodeLatents(vae_dec_in_vec.data(), output_width,
+                               output_height, vae_dec_out_pixels.data());
 
-        currentVaeDecoderInterpreter->resizeTensor(
-            input, {1, 4, sample_height, sample_width});
-        currentVaeDecoderInterpreter->resizeSession(currentVaeDecSession);
-        if (use_opencl) {
-          currentVaeDecoderInterpreter->updateCacheFile(currentVaeDecSession);
-        }
+        std::vector<int> pixel_shape = {1, 3, output_height, output_width};
+        pixels = xt::adapt(vae_dec_out_pixels, pixel_shape);
 
-        currentVaeDecoderInterpreter->releaseModel();
+      } else {
+        const int vae_tile_size = 512;
+        const int vae_latent_tile_size = 64;
 
-        auto input_nchw_tensor = new MNN::Tensor(input, MNN::Tensor::CAFFE);
-        auto output = currentVaeDecoderInterpreter->getSessionOutput(
-            currentVaeDecSession, "sample");
-        auto output_nchw_tensor = new MNN::Tensor(output, MNN::Tensor::CAFFE);
+        // Use generic tile position calculator
+        auto [output_positions, latent_positions, overlap_x, overlap_y,
+              latent_overlap_x, latent_overlap_y] =
+            calculate_vae_tile_positions(output_width, output_height);
 
-        memcpy(input_nchw_tensor->host<float>(), vae_dec_in_vec.data(),
-               vae_dec_in_vec.size() * sizeof(float));
-        input->copyFromHostTensor(input_nchw_tensor);
+        int num_tiles = output_positions.size();
+        std::cout << "VAE decoder will use " << num_tiles
+                  << " tiles with overlap " << overlap_x << "x" << overlap_y
+                  << "px (latent: " << latent_overlap_x << "x"
+                  << latent_overlap_y << ")" << std::endl;
 
-        currentVaeDecoderInterpreter->runSession(currentVaeDecSession);
+        int original_output_width = output_width;
+        int original_output_height = output_height;
+        int original_sample_width = sample_width;
+        int original_sample_height = sample_height;
 
-        output->copyToHostTensor(output_nchw_tensor);
-        memcpy(vae_dec_out_pixels.data(), output_nchw_tensor->host<float>(),
-               vae_dec_out_pixels.size() * sizeof(float));
+        std::vector<xt::xarray<float>> decoded_tiles;
+        decoded_tiles.reserve(latent_positions.size());
 
-        delete input_nchw_tensor;
-        delete output_nchw_tensor;
+        {
+          // Restore the global shape even if a tile fails or is cancelled.
+          ScopeExit restoreShape{[&]() {
+            output_width = original_output_width;
+            output_height = original_output_height;
+            sample_width = original_sample_width;
+            sample_height = original_sample_height;
+          }};
+          output_width = vae_tile_size;
+          output_height = vae_tile_size;
+          sample_width = vae_latent_tile_size;
+          sample_height = vae_latent_tile_size;
+
+          for (size_t i = 0; i < latent_positions.size(); ++i) {
+            cancel.throwIfCancelled();
+            TRACE_SCOPE("vae_decode_tile", "sd", (int)i);
+            auto lat_pos = latent_positions[i];
+            xt::xarray<float> latent_tile = xt::view(
+                image_latents, 0, xt::all(),
+                xt::range(lat_pos.second,
+                          lat_pos.second + vae_latent_tile_size),
+                xt::range(lat_pos.first, lat_pos.first + vae_latent_tile_size));
+
+            std::vector<float> tile_latent_vec(latent_tile.begin(),
+                                               latent_tile.end());
+            xt::xarray<float> tile_output =
+                xt::zeros<float>({1, 3, vae_tile_size, vae_tile_size});
+
+            backend->decodeLatents(tile_latent_vec.data(), vae_tile_size,
+                                   vae_tile_size, tile_output.data());
+
+            decoded_tiles.push_back(std::move(tile_output));
+
+            std::cout << "Processed VAE tile " << i + 1 << "/"
+                      << latent_positions.size() << std::endl;
+          }
+        }
 
-        currentVaeDecoderInterpreter->releaseSession(currentVaeDecSession);
-        delete currentVaeDecoderInterpreter;
-      } else {
-        if (sdxl_lowram) loadSdxlQnnVaeDecoderIfNeeded();
-        if (!vaeDecoderApp)
-          throw std::runtime_error("Global vaeDecoderApp not init!");
+        trace::Span blend_span("blend_vae_output_tiles");
+        pixels = blend_vae_output_tiles(decoded_tiles, output_positions,
+                                        output_height, output_width,
+                                        vae_tile_size, overlap_x, overlap_y);
+        blend_span.end();
 
-        if (sdxl_mode) {
-          if (StatusCode::SUCCESS !=
-              vaeDecoderApp->executeVaeDecoderGraphsSDXL(
-                  vae_dec_in_vec.data(), vae_dec_out_pixels.data()))
-            throw std::runtime_error("QNN VAE dec SDXL exec failed");
-        } else {
-          if (StatusCode::SUCCESS !=
-              vaeDecoderApp->executeVaeDecoderGraphs(vae_dec_in_vec.data(),
-                                                     vae_dec_out_pixels.data()))
-            throw std::runtime_error("QNN VAE dec exec failed");
-        }
-        if (sdxl_lowram) releaseSdxlQnnVaeDecoder();
+        std::cout << "VAE tiling completed: " << decoded_tiles.size()
+                  << " tiles processed and blended" << std::endl;
       }
 
-      std::vector<int> pixel_shape = {1, 3, output_height, output_width};
-      pixels = xt::adapt(vae_dec_out_pixels, pixel_shape);
+      auto vae_dec_end = std::chrono::high_resolution_clock::now();
+      std::cout << "VAE Dec dur: "
+                << std::chrono::duration_cast<std::chrono::milliseconds>(
+                       vae_dec_end - vae_dec_start)
+                       .count()
+                << "ms\n";
+      reportStage("vae_decode", vae_dec_start, vae_dec_end);
 
-    } else {
-      const int vae_tile_size = 512;
-      const int vae_latent_tile_size = 64;
-
-      // Use generic tile position calculator
-      auto [output_positions, latent_positions, overlap_x, overlap_y,
-            latent_overlap_x, latent_overlap_y] =
-          calculate_vae_tile_positions(output_width, output_height);
-
-      int num_tiles = output_positions.size();
-      std::cout << "VAE decoder will use " << num_tiles
-                << " tiles with overlap " << overlap_x << "x" << overlap_y
-                << "px (latent: " << latent_overlap_x << "x" << latent_overlap_y
-                << ")" << std::endl;
-
-      int original_output_width = output_width;
-      int original_output_height = output_height;
-      int original_sample_width = sample_width;
-      int original_sample_height = sample_height;
-
-      output_width = vae_tile_size;
-      output_height = vae_tile_size;
-      sample_width = vae_latent_tile_size;
-      sample_height = vae_latent_tile_size;
-
-      std::vector<xt::xarray<float>> decoded_tiles;
-      decoded_tiles.reserve(latent_positions.size());
-
-      for (size_t i = 0; i < latent_positions.size(); ++i) {
-        auto lat_pos = latent_positions[i];
-        xt::xarray<float> latent_tile = xt::view(
-            latents, 0, xt::all(),
-            xt::range(lat_pos.second, lat_pos.second + vae_latent_tile_size),
-            xt::range(lat_pos.first, lat_pos.first + vae_latent_tile_size));
-
-        std::vector<float> tile_latent_vec(latent_tile.begin(),
-                                           latent_tile.end());
-        xt::xarray<float> tile_output =
-            xt::zeros<float>({1, 3, vae_tile_size, vae_tile_size});
-
-        if (!vaeDecoderApp)
-          throw std::runtime_error("Global vaeDecoderApp not init!");
-
-        if (StatusCode::SUCCESS !=
-            vaeDecoderApp->executeVaeDecoderGraphs(tile_latent_vec.data(),
-                                                   tile_output.data()))
-          throw std::runtime_error("QNN VAE dec exec failed for tile");
-
-        decoded_tiles.push_back(std::move(tile_output));
-
-        std::cout << "Processed VAE tile " << i + 1 << "/"
-                  << latent_positions.size() << std::endl;
+      // --- Post-process Image ---
+      trace::Span postprocess_span("postprocess", "sd", image_idx);
+      if (request_has_mask) {
+        auto orig_img_view = xt::view(original_image, 0);  // (3, H, W)
+        auto gen_img_view = xt::view(pixels, 0);           // (3, H, W)
+        auto mask_view = xt::view(mask_full, 0);           // (1, H, W)
+
+        // The blend follows the decoder and takes its thread count; by
+        // default one thread per channel.
+        auto blended = laplacianPyramidBlend(
+            orig_img_view, gen_img_view, mask_view, blend_scratch,
+            &blend_workers, thread_config.threads(threading::kVaeDecoder, 3));
+        pixels =
+            xt::reshape_view(blended, {1, 3, output_height, output_width});
+      }
+      auto img = xt::view(pixels, 0);
+      auto transp = xt::transpose(img, {1, 2, 0});
+      auto norm = xt::clip(((transp + 1.0) / 2.0) * 255.0, 0.0, 255.0);
+      xt::xarray<uint8_t> u8_img = xt::cast<uint8_t>(norm);
+      std::vector<uint8_t> out_data(u8_img.begin(), u8_img.end());
+      postprocess_span.end();
+
+      // --- Safety Checker ---
+      if (use_safety_checker) {
+        auto safety_start = std::chrono::high_resolution_clock::now();
+        float score = 0.0f;
+        ModelLease safety_lease(resident_models.safety_checker);
+        threading::AffinityScope pin(
+            thread_config.cores(threading::kSafetyChecker));
+
+        if (safety_check(out_data, output_width, output_height, score,
+                         safetyCheckerInterpreter, safetyCheckerSession)) {
+          std::cout << "NSFW Score: " << score << std::endl;
+          if (score > nsfw_threshold) {
+            QNN_WARN("NSFW detected (%.2f>%.2f).", score, nsfw_threshold);
+            std::fill(out_data.begin(), out_data.end(), 255);
+          }
+        } else {
+          QNN_WARN("Safety check failed.");
+        }
+
+        auto safety_end = std::chrono::high_resolution_clock::now();
+        std::cout << "Safety check dur: "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(
+                         safety_end - safety_start)
+                         .count()
+                  << "ms\n";
+        reportStage("safety_check", safety_start, safety_end);
       }
 
-      output_width = original_output_width;
-      output_height = original_output_height;
-      sample_width = original_sample_width;
-      sample_height = original_sample_height;
+      current_step++;
+      report_progress(current_step, total_run_steps, "");
+      auto end_time = std::chrono::high_resolution_clock::now();
+      auto total_time = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            end_time - start_time)
+                            .count();
+
+      image_callback(image_idx, GenerationResult{std::move(out_data),
+                                                 output_width,
+                                                 output_height,
+                                                 3,
+                                                 static_cast<int>(total_time),
+                                                 first_step_time_ms,
+                                                 seed + image_idx});
+    }
 
-      pixels = blend_vae_output_tiles(decoded_tiles, output_positions,
-                                      output_height, output_width,
-                                      vae_tile_size, overlap_x, overlap_y);
+    decodeGuard.run();
+  } catch (const GenerationCancelled &) {
+    throw;
+  } catch (const std::exception &e) {
+    QNN_ERROR("Image generation error: %s", e.what());
+    throw;
+  }
+}
 
-      std::cout << "VAE tiling completed: " << decoded_tiles.size()
-                << " tiles processed and blended" << std::endl;
+#ifdef SD_BENCH
+// --- Benchmark ---
+// sd_bench runs generateImage over a matrix of resolution x steps x
+// scheduler x backend x mode x DeepCache interval and writes per-stage
+// latency percentiles, peak RSS, heap allocations per UNet step and
+// throughput as JSON; DeepCache runs also report how far their image is
+// from the one of interval 0. Without --models it generates tiny synthetic
+// MNN models, so it runs on any host.
+int runBench(int argc, char **argv) {
+  enum OPTIONS {
+    OPT_HELP = 0,
+    OPT_MODELS = 1,
+    OPT_SPEC = 2,
+    OPT_OUT = 3,
+    OPT_UNET_LAYERS = 4,
+    OPT_KERNELS = 5
+  };
+  static struct pal::Option s_longOptions[] = {
+      {"help", pal::no_argument, NULL, OPT_HELP},
+      {"models", pal::required_argument, NULL, OPT_MODELS},
+      {"spec", pal::required_argument, NULL, OPT_SPEC},
+      {"out", pal::required_argument, NULL, OPT_OUT},
+      {"unet_layers", pal::required_argument, NULL, OPT_UNET_LAYERS},
+      {"kernels", pal::no_argument, NULL, OPT_KERNELS},
+      {NULL, 0, NULL, 0}};
+  std::string models_dir, spec_path, out_path = "sd_bench.json";
+  int unet_layers = 8;
+  bool kernels_only = false;
+  int longIndex = 0, opt = 0;
+  while ((opt = pal::getOptLongOnly(argc, argv, "", s_longOptions,
+                                    &longIndex)) != -1) {
+    switch (opt) {
+      case OPT_MODELS:
+        models_dir = pal::g_optArg;
+        break;
+      case OPT_SPEC:
+        spec_path = pal::g_optArg;
+        break;
+      case OPT_OUT:
+        out_path = pal::g_optArg;
+        break;
+      case OPT_UNET_LAYERS:
+        unet_layers = std::stoi(pal::g_optArg);
+        break;
+      case OPT_KERNELS:
+        kernels_only = true;
+        break;
+      case OPT_HELP:
+      default:
+        std::cerr << "Usage: sd_bench [--models DIR] [--spec matrix.json] "
+                     "[--out report.json] [--unet_layers N] [--kernels]\n";
+        return opt == OPT_HELP ? EXIT_SUCCESS : EXIT_FAILURE;
     }
+  }
 
-    auto vae_dec_end = std::chrono::high_resolution_clock::now();
-    std::cout << "VAE Dec dur: "
-              << std::chrono::duration_cast<std::chrono::milliseconds>(
-                     vae_dec_end - vae_dec_start)
-                     .count()
-              << "ms\n";
-
-    // --- Post-process Image ---
-    if (request_has_mask) {
-      auto orig_img_view = xt::view(original_image, 0);  // (3, H, W)
-      auto gen_img_view = xt::view(pixels, 0);           // (3, H, W)
-      auto mask_view = xt::view(mask_full, 0);           // (1, H, W)
-
-      auto blended =
-          laplacianPyramidBlend(orig_img_view, gen_img_view, mask_view);
-      pixels = xt::reshape_view(blended, {1, 3, output_height, output_width});
+  nlohmann::json spec = {
+      {"resolutions", {256, 512}},
+      {"steps", {4, 8}},
+      {"schedulers", {"dpm", "euler_a", "lcm"}},
+      {"backends", {"cpu"}},
+      {"modes", {"txt2img", "img2img", "inpaint"}},
+      // 0 runs the full UNet every step; n > 1 only every n-th step.
+      {"deepcache_intervals", {0, 3}},
+      {"batch_count", 1},
+      {"cfg", 7.5f},
+      {"denoise_strength", 0.6f},
+      {"warmup", 1},
+      {"iterations", 3},
+      {"prompt", "a photo of a cat in the city at night"},
+      {"negative_prompt", "blurry, low quality"}};
+  if (!spec_path.empty()) {
+    std::ifstream spec_file(spec_path);
+    if (!spec_file) {
+      std::cerr << "Failed to open spec: " << spec_path << "\n";
+      return EXIT_FAILURE;
     }
-    auto img = xt::view(pixels, 0);
-    auto transp = xt::transpose(img, {1, 2, 0});
-    auto norm = xt::clip(((transp + 1.0) / 2.0) * 255.0, 0.0, 255.0);
-    xt::xarray<uint8_t> u8_img = xt::cast<uint8_t>(norm);
-    std::vector<uint8_t> out_data(u8_img.begin(), u8_img.end());
-
-    // --- Safety Checker ---
-    if (use_safety_checker) {
-      auto safety_start = std::chrono::high_resolution_clock::now();
-      float score = 0.0f;
-
-      if (safety_check(out_data, output_width, output_height, score,
-                       safetyCheckerInterpreter, safetyCheckerSession)) {
-        std::cout << "NSFW Score: " << score << std::endl;
-        if (score > nsfw_threshold) {
-          QNN_WARN("NSFW detected (%.2f>%.2f).", score, nsfw_threshold);
-          std::fill(out_data.begin(), out_data.end(), 255);
-        }
-      } else {
-        QNN_WARN("Safety check failed.");
-      }
+    spec.update(nlohmann::json::parse(spec_file));
+  }
 
-      auto safety_end = std::chrono::high_resolution_clock::now();
-      std::cout << "Safety check dur: "
-                << std::chrono::duration_cast<std::chrono::milliseconds>(
-                       safety_end - safety_start)
-                       .count()
-                << "ms\n";
+  // --kernels only runs the tensor quantization and Laplacian blend
+  // microbenchmarks, and fails if the blend drifts from its reference.
+  if (kernels_only) {
+    nlohmann::json report = {
+        {"quant_kernels",
+         bench::benchQuantKernels(spec.value("kernel_iterations", 50))},
+        {"laplacian_blend",
+         bench::benchLaplacianBlends(spec.value("blend_iterations", 5))}};
+    std::ofstream(out_path) << report.dump(2) << "\n";
+    std::cout << "Benchmark report written to " << out_path << std::endl;
+    for (const auto &result : report["laplacian_blend"]) {
+      if (result["within_tolerance"].get<bool>()) continue;
+      std::cerr << "Laplacian blend differs from the reference by "
+                << result["max_abs_difference"] << " at " << result["width"]
+                << "x" << result["height"] << "\n";
+      return EXIT_FAILURE;
     }
+    return EXIT_SUCCESS;
+  }
 
-    current_step++;
-    progress_callback(current_step, total_run_steps, "");
-    auto end_time = std::chrono::high_resolution_clock::now();
-    auto total_time = std::chrono::duration_cast<std::chrono::milliseconds>(
-                          end_time - start_time)
+  const bool synthetic = models_dir.empty();
+  if (synthetic) {
+    models_dir =
+        (std::filesystem::temp_directory_path() / "sd_bench_models").string();
+    bench::writeSyntheticModels(models_dir, text_embedding_size, unet_layers);
+  }
+  clipPath = models_dir + "/clip.mnn";
+  unetPath = models_dir + "/unet.mnn";
+  vaeDecoderPath = models_dir + "/vae_decoder.mnn";
+  vaeEncoderPath = models_dir + "/vae_encoder.mnn";
+  tokenizerPath = models_dir + "/tokenizer.json";
+  modelDir = models_dir;
+  use_mnn = true;
+  tokenizer = tokenizers::Tokenizer::FromBlobJSON(
+      LoadBytesFromFile(tokenizerPath));
+  mnnBackend = std::make_unique<MnnBackend>(
+      MnnBackend::Paths{clipPath, unetPath, vaeDecoderPath, vaeEncoderPath,
+                        modelDir},
+      use_clip_v2);
+  // DeepCache graphs as with --deepcache, when the model directory has them.
+  const std::filesystem::path deepcache_json =
+      std::filesystem::path(models_dir) / "deepcache.json";
+  if (std::filesystem::exists(deepcache_json)) {
+    const nlohmann::json graphs =
+        nlohmann::json::parse(std::ifstream(deepcache_json));
+    mnnBackend->setDeepCache(
+        models_dir + "/" + graphs.at("full").get<std::string>(),
+        models_dir + "/" + graphs.at("shallow").get<std::string>());
+  }
+
+  prompt = spec["prompt"].get<std::string>();
+  negative_prompt = spec["negative_prompt"].get<std::string>();
+  cfg = spec["cfg"].get<float>();
+  denoise_strength = spec["denoise_strength"].get<float>();
+  batch_count = spec["batch_count"].get<int>();
+  seed = 42;
+  const int warmup = spec["warmup"].get<int>();
+  const int iterations = spec["iterations"].get<int>();
+
+  bench::StageStats stats;
+  std::vector<double> step_allocations;
+  long long last_step_allocations = -1;
+  bool measuring = false;
+  stage_observer = [&](const char *stage, double ms) {
+    if (!measuring) return;
+    stats.add(stage, ms);
+    if (std::strcmp(stage, "unet_step") != 0) return;
+    long long now = bench::allocationCount();
+    if (now >= 0 && last_step_allocations >= 0)
+      step_allocations.push_back(double(now - last_step_allocations));
+    last_step_allocations = now;
+  };
+
+  nlohmann::json results = nlohmann::json::array();
+  for (const auto &resolution : spec["resolutions"]) {
+    // Either an edge length or [width, height].
+    const int width = resolution.is_array() ? resolution[0].get<int>()
+                                            : resolution.get<int>();
+    const int height = resolution.is_array() ? resolution[1].get<int>()
+                                             : resolution.get<int>();
+    for (int step_count : spec["steps"]) {
+      for (const std::string scheduler : spec["schedulers"]) {
+        for (const std::string backend : spec["backends"]) {
+          for (const std::string mode : spec["modes"]) {
+            // The first image of interval 0 (or 1), to compare DeepCache
+            // runs of the same configuration against.
+            std::vector<uint8_t> reference;
+            for (int interval : spec["deepcache_intervals"]) {
+              nlohmann::json config = {{"width", width},
+                                       {"height", height},
+                                       {"steps", step_count},
+                                       {"scheduler", scheduler},
+                                       {"backend", backend},
+                                       {"mode", mode},
+                                       {"deepcache_interval", interval},
+                                       {"batch_count", batch_count}};
+              steps = step_count;
+              scheduler_type = scheduler;
+              InferenceBackend::RequestOptions options;
+              options.use_opencl = backend == "opencl";
+              options.deep_cache = interval > 1;
+              output_width = width;
+              output_height = height;
+              sample_width = width / 8;
+              sample_height = height / 8;
+              deepcache_interval = interval;
+              if (interval > 1 && !mnnBackend->hasDeepCache()) {
+                config["error"] = "no deepcache.json in the model directory";
+                results.push_back(config);
+                continue;
+              }
+
+              request_img2img = mode != "txt2img";
+              request_has_mask = mode == "inpaint";
+              img_data.clear();
+              mask_data.clear();
+              mask_data_full.clear();
+              if (request_img2img) {
+                // Smooth synthetic image in [-1, 1].
+                img_data.resize((size_t)3 * width * height);
+                for (size_t i = 0; i < img_data.size(); ++i)
+                  img_data[i] = std::sin(0.01f * (float)i);
+              }
+              if (request_has_mask) {
+                // Repaint the right half.
+                mask_data.resize((size_t)4 * sample_width * sample_height);
+                for (size_t i = 0; i < mask_data.size(); ++i)
+                  mask_data[i] =
+                      (i % sample_width) >= (size_t)sample_width / 2;
+                mask_data_full.resize((size_t)3 * width * height);
+                for (size_t i = 0; i < mask_data_full.size(); ++i)
+                  mask_data_full[i] = (i % width) >= (size_t)width / 2;
+              }
+
+              stats = bench::StageStats();
+              step_allocations.clear();
+              double measured_ms = 0.0;
+              std::vector<uint8_t> image;
+              try {
+                for (int it = 0; it < warmup + iterations; ++it) {
+                  measuring = it >= warmup;
+                  last_step_allocations = -1;
+                  clip_cache_valid = false;
+                  CancellationToken cancel;
+                  auto start = std::chrono::high_resolution_clock::now();
+                  generateImage(
+                      [](int, int, const std::string &) { return true; },
+                      [&image](int index, GenerationResult result) {
+                        if (index == 0) image = std::move(result.image_data);
+                      },
+                      cancel, options);
+                  auto end = std::chrono::high_resolution_clock::now();
+                  if (!measuring) continue;
+                  double ms =
+                      std::chrono::duration<double, std::milli>(end - start)
                           .count();
+                  stats.add("total", ms);
+                  measured_ms += ms;
+                }
+              } catch (const std::exception &e) {
+                config["error"] = e.what();
+                results.push_back(config);
+                continue;
+              }
 
-    return GenerationResult{out_data,
-                            output_width,
-                            output_height,
-                            3,
-                            static_cast<int>(total_time),
-                            first_step_time_ms};
-  } catch (const std::exception &e) {
-    QNN_ERROR("Image generation error: %s", e.what());
-    throw;
+              config["latency_ms"] = stats.toJson();
+              double allocations = 0.0;
+              for (double a : step_allocations) allocations += a;
+              config["allocations_per_step"] =
+                  step_allocations.empty()
+                      ? nlohmann::json(nullptr)
+                      : nlohmann::json(allocations / step_allocations.size());
+              const double seconds = measured_ms / 1000.0;
+              config["images_per_second"] =
+                  seconds > 0 ? iterations * batch_count / seconds : 0.0;
+              config["peak_rss_kb"] = bench::peakRssKb();
+              // Mean absolute difference per 8-bit channel value.
+              if (interval <= 1) {
+                if (reference.empty()) reference = image;
+              } else if (!reference.empty() &&
+                         reference.size() == image.size()) {
+                double difference = 0.0;
+                for (size_t i = 0; i < image.size(); ++i)
+                  difference += std::abs((int)image[i] - (int)reference[i]);
+                config["pixel_mae_vs_interval_0"] =
+                    difference / std::max<size_t>(1, image.size());
+              }
+              results.push_back(config);
+            }
+          }
+        }
+      }
+    }
   }
+  stage_observer = nullptr;
+  mnnBackend.reset();
+
+  nlohmann::json report = {{"synthetic_models", synthetic},
+                           {"models", models_dir},
+                           {"warmup", warmup},
+                           {"iterations", iterations},
+                           {"peak_rss_kb", bench::peakRssKb()},
+                           {"results", results}};
+  std::ofstream(out_path) << report.dump(2) << "\n";
+  std::cout << "Benchmark report written to " << out_path << std::endl;
+  return EXIT_SUCCESS;
+}
+#endif
+
+// --- Thread auto-tuning ---
+// Times the MNN stages over thread counts and core sets on this machine and
+// writes the fastest setting of each to <model dir>/threads.json, which the
+// server loads at startup. Stages start from the loaded settings, so a
+// --threads power mode or a stage the search skips carries over.
+static int autotuneThreads() {
+  const threading::CpuTopology &topology = threading::CpuTopology::get();
+  const int cores = (int)topology.cores.size();
+  std::vector<int> counts;
+  for (int n = 1; n < cores; n *= 2) counts.push_back(n);
+  counts.push_back(cores);
+  counts.push_back((int)topology.big.size());
+  std::sort(counts.begin(), counts.end());
+  counts.erase(std::unique(counts.begin(), counts.end()), counts.end());
+  std::vector<std::string> core_sets = {""};
+  if (!topology.little.empty()) core_sets.push_back("big");
+  QNN_INFO("Auto-tuning threads: %d cores, %zu big", cores,
+           topology.big.size());
+
+  const int size = sdxl_mode ? 1024 : 512;
+  const size_t latent_size = (size_t)4 * (size / 8) * (size / 8);
+  const size_t embed_size = (size_t)77 * text_embedding_size;
+  std::vector<float> latents(2 * latent_size), noise(2 * latent_size);
+  std::vector<float> pixels((size_t)3 * size * size), mean(latent_size),
+      std_dev(latent_size);
+  std::vector<float> hidden(2 * embed_size);
+  std::vector<int32_t> ids(2 * 77);
+  std::vector<float> token_embeddings((size_t)2 * 77 * 768);
+  // Keeps each stage's session between the runs of a trial, so only the
+  // runs are timed; a trial with other thread settings reloads it during
+  // its warm-up run.
+  ResidencyManager tuner_residency;
+  MnnBackend tuner(MnnBackend::Paths{clipPath, unetPath, vaeDecoderPath,
+                                     vaeEncoderPath, modelDir},
+                   use_clip_v2);
+  tuner.setResidency(&tuner_residency);
+  threading::ThreadConfig tuned = thread_config;
+
+  const int kRuns = 2;
+  auto tune = [&](threading::Stage stage, const std::function<void()> &begin,
+                  const std::function<void()> &run,
+                  const std::function<void()> &end) {
+    const char *name = threading::kStageNames[stage];
+    threading::StageThreads best;
+    double best_ms = 0.0;
+    try {
+      for (const std::string &core_set : core_sets) {
+        for (int threads : counts) {
+          threading::ThreadConfig trial = tuned;
+          trial.stages[stage] = {threads, core_set};
+          tuner.setThreadConfig(trial);
+          begin();
+          run();  // warm-up
+          auto start = std::chrono::high_resolution_clock::now();
+          for (int i = 0; i < kRuns; ++i) run();
+          auto stop = std::chrono::high_resolution_clock::now();
+          end();
+          double ms =
+              std::chrono::duration<double, std::milli>(stop - start).count() /
+              kRuns;
+          QNN_INFO("%s: %d threads on %s cores: %.1f ms", name, threads,
+                   core_set.empty() ? "any" : core_set.c_str(), ms);
+          if (best.threads == 0 || ms < best_ms) {
+            best = {threads, core_set};
+            best_ms = ms;
+          }
+        }
+      }
+    } catch (const std::exception &e) {
+      end();
+      QNN_WARN("Skipping %s: %s", name, e.what());
+      return;
+    }
+    tuned.stages[stage] = best;
+  };
+  auto none = [] {};
+
+  // The SDXL text encoders and UNet do not run on MnnBackend.
+  if (!sdxl_mode) {
+    tune(threading::kClip, none,
+         [&] {
+           tuner.encodeText(ids.data(), token_embeddings.data(), 2,
+                            hidden.data(), {});
+         },
+         none);
+    tune(threading::kUnet, [&] { tuner.beginUnet(2, size, size, {}); },
+         [&] {
+           tuner.runUnet({latents.data(), noise.data(), 1, 999, false,
+                          hidden.data(), nullptr, nullptr});
+         },
+         [&] { tuner.endUnet(); });
+  }
+  tune(threading::kVaeDecoder, [&] { tuner.beginDecode(size, size, {}); },
+       [&] { tuner.decodeLatents(latents.data(), size, size, pixels.data()); },
+       [&] { tuner.endDecode(); });
+  if (!vaeEncoderPath.empty())
+    tune(threading::kVaeEncoder, none,
+         [&] {
+           tuner.encodeImage(pixels.data(), size, size, mean.data(),
+                             std_dev.data(), {});
+         },
+         none);
+
+  const std::string path =
+      (std::filesystem::path(modelDir) / "threads.json").string();
+  std::ofstream out(path);
+  out << tuned.toJson().dump(2) << "\n";
+  if (!out) {
+    QNN_ERROR("Failed to write %s", path.c_str());
+    return EXIT_FAILURE;
+  }
+  QNN_INFO("Thread settings written to %s", path.c_str());
+  return EXIT_SUCCESS;
 }
 
 // --- Main Function ---
 int main(int argc, char **argv) {
   using namespace qnn::tools;
+#ifdef SD_WITH_QNN
   if (!qnn::log::initializeLogging()) {
     std::cerr << "ERROR: Init logging failed!\n";
     return EXIT_FAILURE;
   }
+#endif
+#ifdef SD_BENCH
+  return runBench(argc, argv);
+#endif
   sample_app::processCommandLine(argc, argv);
+  if (autotune_threads) return autotuneThreads();
 
   if (!upscaler_mode) {
     try {
@@ -2822,17 +3581,15 @@ int main(int argc, char **argv) {
       }
     }
 
-    MNN::ScheduleConfig cfg_common;
-    cfg_common.type = MNN_FORWARD_CPU;
-    cfg_common.numThread = 1;
-    MNN::BackendConfig bkCfg_common;
-    bkCfg_common.memory = MNN::BackendConfig::Memory_Low;
-    bkCfg_common.power = MNN::BackendConfig::Power_High;
-    cfg_common.backendConfig = &bkCfg_common;
-    MNN::ScheduleConfig cfg_mnn_clip = cfg_common;
-    cfg_mnn_clip.numThread = 4;
+    MNN::ScheduleConfig cfg_mnn_clip;
+    cfg_mnn_clip.type = MNN_FORWARD_CPU;
+    MNN::BackendConfig bkCfg_mnn_clip;
+    bkCfg_mnn_clip.memory = MNN::BackendConfig::Memory_Low;
+    thread_config.apply(threading::kClip, 4, cfg_mnn_clip, bkCfg_mnn_clip);
+    cfg_mnn_clip.backendConfig = &bkCfg_mnn_clip;
 
     if (use_mnn_clip && clipInterpreter && !sdxl_mode) {
+      threading::AffinityScope pin(thread_config.cores(threading::kClip));
       clipSession = clipInterpreter->createSession(cfg_mnn_clip);
       if (!clipSession)
         QNN_ERROR("Failed create persistent MNN CLIP session (hybrid)!");
@@ -2852,42 +3609,28 @@ int main(int argc, char **argv) {
       }
     }
 
-    if (sdxl_mode && !lowram_mode && clipInterpreter && clip2Interpreter) {
-      clipSession = clipInterpreter->createSession(cfg_mnn_clip);
-      clip2Session = clip2Interpreter->createSession(cfg_mnn_clip);
-      if (!clipSession || !clip2Session) {
+    if (sdxl_mode && clipInterpreter && clip2Interpreter) {
+      clipSession = createSdxlClipSession(clipInterpreter, text_embedding_size,
+                                          false, clipBatch);
+      clip2Session = createSdxlClipSession(
+          clip2Interpreter, text_embedding_size_2, true, clip2Batch);
+      if (!clipSession || !clip2Session)
         QNN_ERROR("Failed create persistent SDXL MNN CLIP sessions!");
-      } else {
+      else
         QNN_INFO("Persistent SDXL MNN CLIP1/CLIP2 sessions created.");
-        auto input1 =
-            clipInterpreter->getSessionInput(clipSession, "input_embedding");
-        clipInterpreter->resizeTensor(input1, {1, 77, text_embedding_size});
-        clipInterpreter->resizeSession(clipSession);
-        clipInterpreter->releaseModel();
-
-        auto input2 =
-            clip2Interpreter->getSessionInput(clip2Session, "input_embedding");
-        clip2Interpreter->resizeTensor(input2, {1, 77, text_embedding_size_2});
-        clip2Interpreter->resizeSession(clip2Session);
-        clip2Interpreter->releaseModel();
-      }
     }
 
     if (safetyCheckerInterpreter) {
-      safetyCheckerSession =
-          safetyCheckerInterpreter->createSession(cfg_common);
+      safetyCheckerSession = createSafetyCheckerSession();
       if (!safetyCheckerSession)
         QNN_ERROR("Failed create persistent MNN Safety session!");
-      else {
+      else
         QNN_INFO("Persistent MNN Safety session created.");
-        auto input = safetyCheckerInterpreter->getSessionInput(
-            safetyCheckerSession, nullptr);
-        safetyCheckerInterpreter->resizeTensor(input, {1, 224, 224, 3});
-        safetyCheckerInterpreter->resizeSession(safetyCheckerSession);
-        safetyCheckerInterpreter->releaseModel();
-      }
     }
 
+    if (residency.limited()) registerResidentModels();
+
+#ifdef SD_WITH_QNN
     // --- Initialize QNN Models ---
     if (!use_mnn) {
       int status = EXIT_SUCCESS;
@@ -2898,17 +3641,17 @@ int main(int argc, char **argv) {
       if (unetApp) {
         if (g_unetPatchedBuffer && g_unetPatchedBuffer->buffer) {
           status = sample_app::initializeQnnApp(
-              "UNET", unetApp, g_unetPatchedBuffer->buffer.get(),
+              "UNET", unetApp, g_unetPatchedBuffer->buffer,
               g_unetPatchedBuffer->size);
         } else {
           status = sample_app::initializeQnnApp("UNET", unetApp);
         }
         if (status != EXIT_SUCCESS) return status;
 
-        if (g_unetPatchedBuffer) {
-          QNN_INFO("Releasing unet patch buffer to free memory");
-          g_unetPatchedBuffer.reset();
-        }
+        // The UNet keeps the patched buffer until its context is freed.
+        // Without a memory budget nothing reloads it, so this reference
+        // goes.
+        g_unetPatchedBuffer.reset();
       }
       if (vaeDecoderApp) {
         status = sample_app::initializeQnnApp("VAEDecoder", vaeDecoderApp);
@@ -2922,7 +3665,88 @@ int main(int argc, char **argv) {
         status = sample_app::initializeQnnApp("Upscaler", upscalerApp);
         if (status != EXIT_SUCCESS) return status;
       }
+
+      QnnBackend::StageHooks hooks;
+      auto acquire = [](int id) -> std::function<void()> {
+        if (id < 0) return nullptr;
+        return [id] { residency.acquire(id); };
+      };
+      auto release = [](int id) -> std::function<void()> {
+        if (id < 0) return nullptr;
+        return [id] { residency.release(id); };
+      };
+      if (!sdxl_mode) {
+        hooks.acquire_clip = acquire(resident_models.clip);
+        hooks.release_clip = release(resident_models.clip);
+      }
+      hooks.acquire_unet = acquire(resident_models.unet);
+      hooks.release_unet = release(resident_models.unet);
+      hooks.acquire_vae_decoder = acquire(resident_models.vae_decoder);
+      hooks.release_vae_decoder = release(resident_models.vae_decoder);
+      hooks.acquire_vae_encoder = acquire(resident_models.vae_encoder);
+      hooks.release_vae_encoder = release(resident_models.vae_encoder);
+      const int unet_id = resident_models.unet;
+      const int vae_decoder_id = resident_models.vae_decoder;
+      if (unet_id >= 0)
+        hooks.prefetch_unet = [unet_id] { residency.prefetch(unet_id); };
+      if (vae_decoder_id >= 0)
+        hooks.prefetch_vae_decoder = [vae_decoder_id] {
+          residency.prefetch(vae_decoder_id);
+        };
+      qnnBackend = std::make_unique<QnnBackend>(
+          QnnBackend::Models{clipApp, unetApp, vaeDecoderApp, vaeEncoderApp},
+          sdxl_mode, std::move(hooks));
     }
+#endif
+
+    mnnBackend = std::make_unique<MnnBackend>(
+        MnnBackend::Paths{clipPath, unetPath, vaeDecoderPath, vaeEncoderPath,
+                          modelDir},
+        use_clip_v2);
+    mnnBackend->setThreadConfig(thread_config);
+    if (residency.limited()) mnnBackend->setResidency(&residency);
+    if (!unet_parts.empty())
+      mnnBackend->setUnetParts(unet_parts, unet_parts_keep);
+    if (!deepcache_full.empty())
+      mnnBackend->setDeepCache(deepcache_full, deepcache_shallow);
+    // Requests choose OpenCL per call, so --cpu servers tune every bucket
+    // for it up front (single-image batches); existing caches are kept.
+    if (use_mnn && !sdxl_mode) {
+      for (const Resolution &size : resolution_buckets.sizes()) {
+        QNN_INFO("Preparing OpenCL sessions for %dx%d", size.width,
+                 size.height);
+        try {
+          mnnBackend->tuneOpenCL(2, size.width, size.height);
+        } catch (const std::exception &e) {
+          QNN_WARN("OpenCL tuning for %dx%d failed: %s", size.width,
+                   size.height, e.what());
+        }
+      }
+    }
+    if (use_mnn_clip && !sdxl_mode)
+      mnnBackend->setTextEncoderSession(clipInterpreter, clipSession);
+
+    // Models resident for the server's lifetime; on-demand models report
+    // their loads from the helpers above.
+    if (clipSession)
+      server_metrics.modelLoaded(
+          metrics::ServerMetrics::kClip,
+          modelFileSize(clipPath) +
+              (clip2Session ? modelFileSize(clip2Path) : 0));
+#ifdef SD_WITH_QNN
+    else if (clipApp)
+      server_metrics.modelLoaded(metrics::ServerMetrics::kClip,
+                                 modelFileSize(clipPath));
+    if (unetApp)
+      server_metrics.modelLoaded(metrics::ServerMetrics::kUnet,
+                                 modelFileSize(unetPath));
+    if (vaeDecoderApp)
+      server_metrics.modelLoaded(metrics::ServerMetrics::kVaeDecoder,
+                                 modelFileSize(vaeDecoderPath));
+    if (vaeEncoderApp)
+      server_metrics.modelLoaded(metrics::ServerMetrics::kVaeEncoder,
+                                 modelFileSize(vaeEncoderPath));
+#endif
   } else {
     QNN_INFO("Upscaler mode - skipping MNN and QNN model initialization");
   }
@@ -2932,6 +3756,23 @@ int main(int argc, char **argv) {
   svr.Get("/health", [](const httplib::Request &, httplib::Response &res) {
     res.status = 200;
   });
+  svr.Get("/metrics", [](const httplib::Request &, httplib::Response &res) {
+    res.set_content(server_metrics.render(), "text/plain; version=0.0.4");
+  });
+  // Chrome trace-event JSON of a request made with tracing on; open it in
+  // ui.perfetto.dev or chrome://tracing.
+  svr.Get(R"(/trace/([0-9a-f]+))",
+          [](const httplib::Request &req, httplib::Response &res) {
+            std::string json;
+            if (!trace::Recorder::instance().find(req.matches[1], json)) {
+              res.status = 404;
+              return;
+            }
+            res.set_content(json, "application/json");
+            res.set_header("Content-Disposition",
+                           "attachment; filename=\"trace.json\"");
+            res.set_header("Access-Control-Allow-Origin", "*");
+          });
   svr.Post("/generate", [&](const httplib::Request &req,
                             httplib::Response &res) {
     try {
@@ -2943,9 +3784,22 @@ int main(int argc, char **argv) {
       steps = json.value("steps", 20);
       cfg = json.value("cfg", 7.5f);
       scheduler_type = json.value("scheduler", "dpm");
-      use_opencl = json.value("use_opencl", false);
+      // Handed to the backends with this request's calls only.
+      InferenceBackend::RequestOptions options;
+      options.use_opencl = json.value("use_opencl", false);
+      threading::ThreadConfig request_threads = thread_config;
+      if (json.contains("threads")) request_threads.update(json["threads"]);
       show_diffusion_process = json.value("show_diffusion_process", false);
       show_diffusion_stride = json.value("show_diffusion_stride", 1);
+      batch_count = json.value("batch_count", json.value("num_images", 1));
+      // Sent in the first event; /cancel takes it, and /trace/{id} serves
+      // the request's timeline once done if one was asked for.
+      const std::string request_id = trace::newId();
+      const std::string trace_id =
+          json.value("trace", false) ? request_id : "";
+      if (batch_count < 1 || batch_count > max_batch_count)
+        throw std::invalid_argument("batch_count must be between 1 and " +
+                                    std::to_string(max_batch_count));
       seed = json.value(
           "seed",
           (unsigned)hashSeed(
@@ -2960,8 +3814,62 @@ int main(int argc, char **argv) {
       if (sdxl_mode) {
         req_width = 1024;
         req_height = 1024;
+      } else if (!resolution_buckets.empty()) {
+        // An input image is resized to the snapped size when decoded.
+        const Resolution size = resolution_buckets.snap(req_width, req_height);
+        if (size.width != req_width || size.height != req_height)
+          QNN_INFO("Snapped %dx%d to bucket %dx%d", req_width, req_height,
+                   size.width, size.height);
+        req_width = size.width;
+        req_height = size.height;
       }
       denoise_strength = json.value("denoise_strength", 0.6f);
+      // Hires fix: generate at width x height, then refine at hires_scale
+      // times that size.
+      hires_width = hires_height = 0;
+      const float hires_scale = json.value("hires_scale", 0.0f);
+      if (hires_scale != 0.0f) {
+        if (hires_scale <= 1.0f || hires_scale > 4.0f)
+          throw std::invalid_argument("hires_scale must be in (1, 4]");
+        // The SDXL UNet only runs at its compiled size; SD1.5 QNN graphs
+        // denoise the larger pass in windows.
+        if (sdxl_mode)
+          throw std::invalid_argument("hires_scale requires SD1.5");
+        if (json.contains("image"))
+          throw std::invalid_argument("hires_scale does not apply to img2img");
+        const Resolution hires = resolution_buckets.snap(
+            (int)std::lround(req_width * hires_scale / 64) * 64,
+            (int)std::lround(req_height * hires_scale / 64) * 64);
+        // A bucket may snap the pass back to the base size or below it.
+        if (hires.width < req_width || hires.height < req_height ||
+            hires.width * hires.height <= req_width * req_height)
+          throw std::invalid_argument(
+              "hires_scale: " + std::to_string(hires.width) + "x" +
+              std::to_string(hires.height) + " is not larger than " +
+              std::to_string(req_width) + "x" + std::to_string(req_height));
+        hires_width = hires.width;
+        hires_height = hires.height;
+        hires_denoise = json.value("hires_denoise", 0.5f);
+        if (hires_denoise <= 0.0f || hires_denoise > 1.0f)
+          throw std::invalid_argument("hires_denoise must be in (0, 1]");
+        hires_steps =
+            json.value("hires_steps",
+                       std::max(1, (int)std::lround(steps * hires_denoise)));
+        if (hires_steps < 1)
+          throw std::invalid_argument("hires_steps must be at least 1");
+      }
+      request_tile_unet = json.value("tile_unet", false);
+      unet_tile_batch = json.value("tile_batch", 1);
+      if (unet_tile_batch < 1 || unet_tile_batch > max_unet_tile_batch)
+        throw std::invalid_argument("tile_batch must be between 1 and " +
+                                    std::to_string(max_unet_tile_batch));
+      deepcache_interval = json.value("deepcache_interval", 0);
+      if (deepcache_interval < 0)
+        throw std::invalid_argument("deepcache_interval must be at least 0");
+      if (deepcache_interval > 1 && !(mnnBackend && mnnBackend->hasDeepCache()))
+        throw std::invalid_argument(
+            "deepcache_interval requires --cpu with --deepcache");
+      options.deep_cache = deepcache_interval > 1;
       request_img2img = false;
       request_has_mask = false;
       img_data.clear();
@@ -3033,20 +3941,90 @@ int main(int argc, char **argv) {
       std::cout << "Req Rcvd (globals): P:" << prompt
                 << " NP:" << negative_prompt << " S:" << steps << " CFG:" << cfg
                 << " Seed:" << seed << " Size:" << output_width << "x"
-                << output_height << " Img2Img:" << request_img2img
+                << output_height << " Hires:" << hires_width << "x"
+                << hires_height << " Img2Img:" << request_img2img
                 << " Mask:" << request_has_mask
                 << " Denoise:" << denoise_strength
                 << " ShowProcess:" << show_diffusion_process
-                << " Stride:" << show_diffusion_stride << std::endl;
+                << " Stride:" << show_diffusion_stride
+                << " Batch:" << batch_count << std::endl;
+      // Registered until the releaser runs, so /cancel reaches the request
+      // before its stream starts as well.
+      std::shared_ptr<CancellationToken> cancel =
+          generation_cancels.add(request_id);
       res.set_header("Content-Type", "text/event-stream");
       res.set_header("Cache-Control", "no-cache");
       res.set_header("Connection", "keep-alive");
       res.set_header("Access-Control-Allow-Origin", "*");
+      // Released by the provider's releaser, which httplib calls whether or
+      // not the stream ever started.
+      server_metrics.queue_depth.add(1);
       res.set_chunked_content_provider(
-          "text/event-stream", [&](intptr_t, httplib::DataSink &sink) -> bool {
+          "text/event-stream",
+          [&, request_id, trace_id, cancel, options, request_threads](
+              intptr_t, httplib::DataSink &sink) -> bool {
+            trace::Session trace_session(trace_id);
             try {
-              auto result =
-                  generateImage([&sink](int s, int t, const std::string &img) {
+              // Sent before the generation waits for the pipeline, so the
+              // client can cancel a queued request too.
+              nlohmann::json a = {{"type", "accepted"}, {"id", request_id}};
+              std::string accepted =
+                  "event: accepted\ndata: " + a.dump() + "\n\n";
+              sink.write(accepted.c_str(), accepted.size());
+              cancel->throwIfCancelled();
+              // With the provider's own copy of the thread settings.
+              InferenceBackend::RequestOptions request_options = options;
+              request_options.threads = &request_threads;
+              auto send_image = [&sink, &trace_session, &cancel](
+                                    int index, GenerationResult result) {
+                auto enc_start = std::chrono::high_resolution_clock::now();
+                std::string image_str_result(result.image_data.begin(),
+                                             result.image_data.end());
+                std::string enc_img = base64_encode(image_str_result);
+                auto enc_end = std::chrono::high_resolution_clock::now();
+                reportStage("image_encode", enc_start, enc_end);
+                std::cout
+                    << "Enc time: "
+                    << std::chrono::duration_cast<std::chrono::milliseconds>(
+                           enc_end - enc_start)
+                           .count()
+                    << "ms\n";
+                // Every image but the last goes out as an "image" event; the
+                // last one is the usual "complete" event that ends the stream.
+                const bool last = index == batch_count - 1;
+                const std::string type = last ? "complete" : "image";
+                nlohmann::json c = {
+                    {"type", type},
+                    {"image", enc_img},
+                    {"seed", result.seed},
+                    {"index", index},
+                    {"batch_count", batch_count},
+                    {"width", result.width},
+                    {"height", result.height},
+                    {"channels", result.channels},
+                    {"generation_time_ms", result.generation_time_ms},
+                    {"first_step_time_ms", result.first_step_time_ms}};
+                if (!trace_session.id().empty())
+                  c["trace_id"] = trace_session.id();
+                std::string ev =
+                    "event: " + type + "\ndata: " + c.dump() + "\n\n";
+                auto send_start = std::chrono::high_resolution_clock::now();
+                if (!sink.write(ev.c_str(), ev.size()) && !last) {
+                  QNN_WARN("Client disconnected, cancelling generation");
+                  cancel->cancel();
+                }
+                auto send_end = std::chrono::high_resolution_clock::now();
+                reportStage("sse_send", send_start, send_end);
+                std::cout
+                    << "Image send time: "
+                    << std::chrono::duration_cast<std::chrono::milliseconds>(
+                           send_end - send_start)
+                           .count()
+                    << "ms, size: " << ev.size() << " bytes\n";
+              };
+              generateImage(
+                  [&sink](int s, int t, const std::string &img) {
+                    if (!sink.is_writable()) return false;
                     nlohmann::json p = {
                         {"type", "progress"}, {"step", s}, {"total_steps", t}};
                     if (!img.empty()) {
@@ -3054,47 +4032,36 @@ int main(int argc, char **argv) {
                     }
                     std::string ev =
                         "event: progress\ndata: " + p.dump() + "\n\n";
-                    sink.write(ev.c_str(), ev.size());
-                  });
-              auto enc_start = std::chrono::high_resolution_clock::now();
-              std::string image_str_result(result.image_data.begin(),
-                                           result.image_data.end());
-              std::string enc_img = base64_encode(image_str_result);
-              auto enc_end = std::chrono::high_resolution_clock::now();
-              std::cout
-                  << "Enc time: "
-                  << std::chrono::duration_cast<std::chrono::milliseconds>(
-                         enc_end - enc_start)
-                         .count()
-                  << "ms\n";
-              nlohmann::json c = {
-                  {"type", "complete"},
-                  {"image", enc_img},
-                  {"seed", seed},
-                  {"width", result.width},
-                  {"height", result.height},
-                  {"channels", result.channels},
-                  {"generation_time_ms", result.generation_time_ms},
-                  {"first_step_time_ms", result.first_step_time_ms}};
-              std::string ev = "event: complete\ndata: " + c.dump() + "\n\n";
-              auto send_start = std::chrono::high_resolution_clock::now();
-              sink.write(ev.c_str(), ev.size());
-              auto send_end = std::chrono::high_resolution_clock::now();
-              std::cout
-                  << "Image send time: "
-                  << std::chrono::duration_cast<std::chrono::milliseconds>(
-                         send_end - send_start)
-                         .count()
-                  << "ms, size: " << ev.size() << " bytes\n";
+                    return sink.write(ev.c_str(), ev.size());
+                  },
+                  send_image, *cancel, request_options);
+              server_metrics.generations_completed.inc();
+              // Store the trace before the client sees the stream end.
+              trace_session.end();
               sink.done();
               return true;
+            } catch (const GenerationCancelled &e) {
+              QNN_INFO("Generation cancelled");
+              server_metrics.generations_cancelled.inc();
+              if (sink.is_writable()) {
+                nlohmann::json c = {{"type", "cancelled"}};
+                std::string ev = "event: cancelled\ndata: " + c.dump() + "\n\n";
+                sink.write(ev.c_str(), ev.size());
+              }
+              sink.done();
+              return false;
             } catch (const std::exception &e) {
+              server_metrics.generations_failed.inc();
               nlohmann::json err = {{"type", "error"}, {"message", e.what()}};
               std::string ev = "event: error\ndata: " + err.dump() + "\n\n";
               sink.write(ev.c_str(), ev.size());
               sink.done();
               return false;
             }
+          },
+          [request_id](bool) {
+            generation_cancels.remove(request_id);
+            server_metrics.queue_depth.add(-1);
           });
     } catch (const nlohmann::json::parse_error &e) {
       nlohmann::json err = {
@@ -3126,8 +4093,6 @@ int main(int argc, char **argv) {
   // Binary protocol upscale endpoint - optimized for performance
   svr.Post("/upscale", [&](const httplib::Request &req,
                            httplib::Response &res) {
-    std::unique_ptr<QnnModel> tempUpscalerApp = nullptr;
-
     try {
       // Read parameters from headers
       if (!req.has_header("X-Image-Width")) {
@@ -3143,6 +4108,8 @@ int main(int argc, char **argv) {
       int original_width = std::stoi(req.get_header_value("X-Image-Width"));
       int original_height = std::stoi(req.get_header_value("X-Image-Height"));
       std::string upscaler_path = req.get_header_value("X-Upscaler-Path");
+      trace::Session trace_session(
+          req.get_header_value("X-Trace") == "1" ? trace::newId() : "");
 
       // Check if use_opencl header is present (for MNN models)
       bool use_opencl = false;
@@ -3193,26 +4160,45 @@ int main(int argc, char **argv) {
 
       xt::xarray<uint8_t> upscaled;
 
-      if (is_mnn_model) {
+#ifndef SD_WITH_QNN
+      if (!is_mnn_model)
+        throw std::invalid_argument(
+            "QNN upscaler models are not supported by this build");
+#endif
+      if (residency.limited()) {
+        // Keep the upscaler loaded for later requests while it fits.
+        CachedUpscaler &cached =
+            cachedUpscaler(upscaler_path, is_mnn_model, use_opencl);
+        std::lock_guard<std::mutex> run_lock(cached.run_mutex);
+        ModelLease lease(cached.id);
+        if (is_mnn_model) {
+          upscaled = upscaleImageWithMNN(process_image, process_width,
+                                         process_height, *cached.mnn);
+        } else {
+#ifdef SD_WITH_QNN
+          upscaled = upscaleImageWithModel(process_image, process_width,
+                                           process_height, cached.qnn);
+#endif
+        }
+      } else if (is_mnn_model) {
         // Use MNN model
-        upscaled =
-            upscaleImageWithMNN(process_image, process_width, process_height,
-                                upscaler_path, use_opencl);
+        std::unique_ptr<MnnUpscaler> upscaler =
+            createMnnUpscaler(upscaler_path, use_opencl);
+        upscaled = upscaleImageWithMNN(process_image, process_width,
+                                       process_height, *upscaler);
       } else {
+#ifdef SD_WITH_QNN
         // Use QNN model
-        tempUpscalerApp = createQnnModel(upscaler_path, "upscaler");
-        if (!tempUpscalerApp) {
-          throw std::runtime_error("Failed to create upscaler model from: " +
-                                   upscaler_path);
-        }
-
-        auto status = sample_app::initializeQnnApp("Upscaler", tempUpscalerApp);
-        if (status != EXIT_SUCCESS) {
-          throw std::runtime_error("Failed to initialize upscaler model");
-        }
+        std::unique_ptr<QnnModel> tempUpscalerApp =
+            loadQnnUpscaler(upscaler_path);
 
         upscaled = upscaleImageWithModel(process_image, process_width,
                                          process_height, tempUpscalerApp);
+
+        // Release the temporary upscaler model
+        tempUpscalerApp.reset();
+        QNN_INFO("Upscaler model released");
+#endif
       }
 
       auto end_time = std::chrono::high_resolution_clock::now();
@@ -3240,6 +4226,7 @@ int main(int argc, char **argv) {
       std::vector<uint8_t> output_jpeg =
           encodeJPEG(final_rgb, final_width, final_height, 95);
       auto encode_end = std::chrono::high_resolution_clock::now();
+      trace::complete("jpeg_encode", "sd", encode_start, encode_end);
       int encode_duration =
           std::chrono::duration_cast<std::chrono::milliseconds>(encode_end -
                                                                 encode_start)
@@ -3258,16 +4245,10 @@ int main(int argc, char **argv) {
       res.set_header("X-Duration-Ms", std::to_string(duration));
       res.set_header("Access-Control-Allow-Origin", "*");
       res.set_header("Access-Control-Expose-Headers",
-                     "X-Output-Width,X-Output-Height,X-Duration-Ms");
-
-      // Release the temporary upscaler model
-      if (tempUpscalerApp) {
-        tempUpscalerApp.reset();
-        QNN_INFO("Upscaler model released");
-      }
-
+                     "X-Output-Width,X-Output-Height,X-Duration-Ms,X-Trace-Id");
+      if (!trace_session.id().empty())
+        res.set_header("X-Trace-Id", trace_session.id());
     } catch (const std::invalid_argument &e) {
-      tempUpscalerApp.reset();
       nlohmann::json err = {
           {"error",
            {{"message", "Invalid Arg: " + std::string(e.what())},
@@ -3276,7 +4257,6 @@ int main(int argc, char **argv) {
       res.set_content(err.dump(), "application/json");
       res.set_header("Access-Control-Allow-Origin", "*");
     } catch (const std::exception &e) {
-      tempUpscalerApp.reset();
       nlohmann::json err = {
           {"error",
            {{"message", "Server Err: " + std::string(e.what())},
@@ -3287,6 +4267,28 @@ int main(int argc, char **argv) {
     }
   });
 
+  // Cancels the /generate request whose "accepted" event carried this id.
+  svr.Post("/cancel", [&](const httplib::Request &req,
+                          httplib::Response &res) {
+    res.set_header("Access-Control-Allow-Origin", "*");
+    auto json = nlohmann::json::parse(req.body, nullptr, false);
+    if (json.is_discarded() || !json.is_object() || !json.contains("id") ||
+        !json["id"].is_string()) {
+      nlohmann::json err = {
+          {"error",
+           {{"message", "Expected {\"id\": \"<request id>\"}"},
+            {"type", "request_error"}}}};
+      res.status = 400;
+      res.set_content(err.dump(), "application/json");
+      return;
+    }
+    const bool cancelled =
+        generation_cancels.cancel(json["id"].get<std::string>());
+    nlohmann::json resp = {{"cancelled", cancelled}};
+    res.status = 200;
+    res.set_content(resp.dump(), "application/json");
+  });
+
   svr.Post("/tokenize", [&](const httplib::Request &req,
                             httplib::Response &res) {
     res.set_header("Access-Control-Allow-Origin", "*");
@@ -3349,11 +4351,16 @@ int main(int argc, char **argv) {
   delete vaeDecoderInterpreter;
   delete vaeEncoderInterpreter;
   delete safetyCheckerInterpreter;
+  upscaler_cache.clear();
+  mnnBackend.reset();
+  qnnBackend.reset();
+#ifdef SD_WITH_QNN
   clipApp.reset();
   unetApp.reset();
   vaeDecoderApp.reset();
   vaeEncoderApp.reset();
   upscalerApp.reset();
+#endif
 
   return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,32 @@
+#ifndef CHECK_HPP
+#define CHECK_HPP
+
+#include <cstdio>
+#include <cstdlib>
+
+// Minimal assertions for the host tests, which have no framework to link
+// against: a failed CHECK prints its location and the test exits non-zero
+// at the end of main (TEST_RESULT), so one run reports every failure.
+inline int g_check_failures = 0;
+
+#define CHECK(cond)                                                           \
+  do {                                                                        \
+    if (!(cond)) {                                                            \
+      std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,             \
+                   __LINE__, #cond);                                          \
+      ++g_check_failures;                                                     \
+    }                                                                         \
+  } while (0)
+
+#define CHECK_EQ(a, b) CHECK((a) == (b))
+
+// Runs a test function, naming it in the output.
+#define RUN_TEST(fn)                                                          \
+  do {                                                                        \
+    std::fprintf(stderr, "%s\n", #fn);                                        \
+    fn();                                                                     \
+  } while (0)
+
+#define TEST_RESULT() (g_check_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE)
+
+#endif  // CHECK_HPP
@@ -0,0 +1,277 @@
+// graphio::GraphIO against host buffers standing in for a graph's client
+// buffers: conversion per encoding, tensor lookup, the resident-input cache
+// and the error paths.
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "Check.hpp"
+#include "FloatConversion.hpp"
+#include "GraphIO.hpp"
+
+using graphio::Encoding;
+using graphio::GraphIO;
+using graphio::TensorInfo;
+
+namespace {
+
+// Exact in every encoding below: multiples of 1/8 within the ufixed ranges.
+const std::vector<float> kValues = {0.0f, 1.0f, -2.5f, 3.125f};
+
+TensorInfo tensor(const char *name, Encoding encoding, void *data,
+                  float scale = 1.0f, int32_t offset = 0) {
+  TensorInfo info;
+  info.name = name;
+  info.encoding = encoding;
+  info.scale = scale;
+  info.offset = offset;
+  info.elements = kValues.size();
+  info.data = data;
+  return info;
+}
+
+// Writes kValues into a one-tensor graph and reads them back.
+std::vector<float> roundTrip(const TensorInfo &info) {
+  GraphIO io;
+  io.bind({info}, {info});
+  std::string error;
+  CHECK(io.writeInputs({graphio::in("x", 0, kValues.data())}, &error));
+  std::vector<float> out(kValues.size(), -1.0f);
+  CHECK(io.readOutputs({graphio::out("x", 0, out.data())}, &error));
+  CHECK(error.empty());
+  return out;
+}
+
+void testFloat32() {
+  float buffer[4] = {};
+  CHECK(roundTrip(tensor("x", Encoding::kFloat32, buffer)) == kValues);
+  CHECK_EQ(buffer[3], 3.125f);
+}
+
+void testFloat16() {
+  uint16_t buffer[4] = {};
+  CHECK(roundTrip(tensor("x", Encoding::kFloat16, buffer)) == kValues);
+  CHECK_EQ(buffer[1], 0x3C00);  // 1.0
+}
+
+void testUfixed8() {
+  // x = (q - 128) / 8
+  uint8_t buffer[4] = {};
+  CHECK(roundTrip(tensor("x", Encoding::kUfixed8, buffer, 0.125f, -128)) ==
+        kValues);
+  CHECK_EQ(buffer[0], 128);
+  CHECK_EQ(buffer[1], 136);
+
+  // Values outside the encoding saturate.
+  GraphIO io;
+  io.bind({tensor("x", Encoding::kUfixed8, buffer, 0.125f, -128)}, {});
+  const float wide[4] = {100.0f, -100.0f, 15.875f, -16.0f};
+  CHECK(io.writeInputs({graphio::in("x", 0, wide)}, nullptr));
+  CHECK_EQ(buffer[0], 255);
+  CHECK_EQ(buffer[1], 0);
+  CHECK_EQ(buffer[2], 255);
+  CHECK_EQ(buffer[3], 0);
+}
+
+void testUfixed16() {
+  // x = (q - 32768) / 16
+  uint16_t buffer[4] = {};
+  CHECK(roundTrip(tensor("x", Encoding::kUfixed16, buffer, 0.0625f,
+                         -32768)) == kValues);
+  CHECK_EQ(buffer[0], 32768);
+  CHECK_EQ(buffer[1], 32784);
+}
+
+void testInt32() {
+  int32_t buffer[4] = {};
+  GraphIO io;
+  io.bind({tensor("timestep", Encoding::kInt32, buffer)},
+          {tensor("timestep", Encoding::kInt32, buffer)});
+  const int32_t ids[4] = {49406, 320, -7, 49407};
+  CHECK(io.writeInputs({graphio::in("timestep", 0, ids)}, nullptr));
+  CHECK(std::memcmp(buffer, ids, sizeof(ids)) == 0);
+  std::vector<float> out(4);
+  CHECK(io.readOutputs({graphio::out("timestep", 0, out.data())}, nullptr));
+  CHECK_EQ(out[0], 49406.0f);
+  CHECK_EQ(out[2], -7.0f);
+
+  // Float callers feeding an int32 tensor are truncated.
+  const float steps[4] = {981.0f, 1.0f, -2.0f, 3.0f};
+  CHECK(io.writeInputs({graphio::in("timestep", 0, steps)}, nullptr));
+  CHECK_EQ(buffer[0], 981);
+
+  // int32 callers feeding a float32 tensor are converted.
+  float floats[4] = {};
+  io.bind({tensor("timestep", Encoding::kFloat32, floats)}, {});
+  CHECK(io.writeInputs({graphio::in("timestep", 0, ids)}, nullptr));
+  CHECK_EQ(floats[1], 320.0f);
+}
+
+void testLookup() {
+  float a[4] = {}, b[4] = {};
+  GraphIO io;
+  io.bind({tensor("sample", Encoding::kFloat32, a),
+           tensor("timestep", Encoding::kFloat32, b)},
+          {});
+  const float twos[4] = {2.0f, 2.0f, 2.0f, 2.0f};
+  // The name wins over the index.
+  CHECK(io.writeInputs({graphio::in("timestep", 0, kValues.data()),
+                        graphio::in("sample", 1, twos)},
+                       nullptr));
+  CHECK_EQ(b[3], 3.125f);
+  CHECK_EQ(a[3], 2.0f);
+  // A name the graph does not carry falls back to the index, and so does a
+  // missing name.
+  CHECK(io.writeInputs({graphio::in("input_0", 0, kValues.data()),
+                        graphio::in(nullptr, 1, twos)},
+                       nullptr));
+  CHECK_EQ(a[3], 3.125f);
+  CHECK_EQ(b[0], 2.0f);
+}
+
+// Every graph input must be written on every call; one left out would
+// execute on whatever the previous call put there.
+void testUnwrittenInput() {
+  float a[4] = {}, b[4] = {};
+  GraphIO io;
+  io.bind({tensor("sample", Encoding::kFloat32, a),
+           tensor("timestep", Encoding::kFloat32, b)},
+          {});
+  std::string error;
+  CHECK(!io.writeInputs({graphio::in("sample", 0, kValues.data())}, &error));
+  CHECK_EQ(error, "no binding for graph input 'timestep'");
+
+  // Writing one tensor twice does not stand in for another.
+  error.clear();
+  CHECK(!io.writeInputs({graphio::in("timestep", 1, kValues.data()),
+                         graphio::in("timestep", 1, kValues.data())},
+                        &error));
+  CHECK_EQ(error, "no binding for graph input 'sample'");
+
+  // Resident inputs count as written when their cached bytes are reused.
+  io.beginResident();
+  for (int i = 0; i < 2; ++i) {
+    CHECK(io.writeInputs({graphio::in("sample", 0, kValues.data()),
+                          graphio::resident("timestep", 1, kValues.data())},
+                         nullptr));
+  }
+  io.endResident();
+}
+
+void testErrors() {
+  float a[4] = {};
+  uint16_t half[4] = {};
+  GraphIO io;
+  CHECK(!io.bound());
+  io.bind({tensor("sample", Encoding::kFloat32, a),
+           tensor("ids", Encoding::kFloat16, half),
+           tensor("odd", Encoding::kUnsupported, a)},
+          {tensor("out_sample", Encoding::kUnsupported, a)});
+  CHECK(io.bound());
+
+  std::string error;
+  CHECK(!io.writeInputs({graphio::in("missing", 5, kValues.data())}, &error));
+  CHECK_EQ(error, "no graph input 'missing'");
+
+  error.clear();
+  CHECK(!io.writeInputs({graphio::in("odd", -1, kValues.data())}, &error));
+  CHECK_EQ(error, "unsupported encoding for input 'odd'");
+
+  // int32 data only goes to int32 or float32 tensors.
+  const int32_t ids[4] = {1, 2, 3, 4};
+  error.clear();
+  CHECK(!io.writeInputs({graphio::in("ids", -1, ids)}, &error));
+  CHECK_EQ(error, "unsupported encoding for input 'ids'");
+
+  std::vector<float> out(4);
+  error.clear();
+  CHECK(!io.readOutputs({graphio::out("latent", 3, out.data())}, &error));
+  CHECK_EQ(error, "no graph output 'latent'");
+  error.clear();
+  CHECK(!io.readOutputs({graphio::out("out_sample", -1, out.data())},
+                        &error));
+  CHECK_EQ(error, "unsupported encoding for output 'out_sample'");
+
+  // A null error pointer is allowed.
+  CHECK(!io.writeInputs({graphio::in("missing", 5, kValues.data())},
+                        nullptr));
+}
+
+// The cache is keyed by the caller's buffer, so rewriting a buffer inside a
+// scope (which callers must not do) shows whether it was converted again.
+void testResident() {
+  uint8_t graph[4] = {};
+  GraphIO io;
+  io.bind({tensor("encoder_hidden_states", Encoding::kUfixed8, graph, 0.125f,
+                  -128)},
+          {});
+  float cond[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+  float uncond[4] = {-1.0f, -1.0f, -1.0f, -1.0f};
+  auto write = [&](const float *data) {
+    CHECK(io.writeInputs(
+        {graphio::resident("encoder_hidden_states", 0, data)}, nullptr));
+  };
+
+  io.beginResident();
+  write(cond);
+  CHECK_EQ(graph[0], 136);
+
+  // Same buffer still in the graph: nothing is converted or copied.
+  cond[0] = 2.0f;
+  graph[1] = 7;
+  write(cond);
+  CHECK_EQ(graph[0], 136);
+  CHECK_EQ(graph[1], 7);
+
+  // Alternating buffers copy the cached conversion back.
+  write(uncond);
+  CHECK_EQ(graph[0], 120);
+  write(cond);
+  CHECK_EQ(graph[0], 136);
+  CHECK_EQ(graph[1], 136);
+
+  // A plain write to the tensor means the graph no longer holds cond.
+  const float zeros[4] = {};
+  CHECK(io.writeInputs({graphio::in("encoder_hidden_states", 0, zeros)},
+                       nullptr));
+  CHECK_EQ(graph[0], 128);
+  write(cond);
+  CHECK_EQ(graph[0], 136);
+
+  // endResident drops the cache: the buffer is converted afresh.
+  io.endResident();
+  write(cond);
+  CHECK_EQ(graph[0], 144);
+
+  // Outside a scope resident inputs convert on every call.
+  cond[0] = 3.0f;
+  write(cond);
+  CHECK_EQ(graph[0], 152);
+
+  // bind() ends the scope as well.
+  io.beginResident();
+  write(cond);
+  cond[0] = 0.0f;
+  io.bind({tensor("encoder_hidden_states", Encoding::kUfixed8, graph, 0.125f,
+                  -128)},
+          {});
+  write(cond);
+  CHECK_EQ(graph[0], 128);
+}
+
+}  // namespace
+
+int main() {
+  RUN_TEST(testFloat32);
+  RUN_TEST(testFloat16);
+  RUN_TEST(testUfixed8);
+  RUN_TEST(testUfixed16);
+  RUN_TEST(testInt32);
+  RUN_TEST(testLookup);
+  RUN_TEST(testUnwrittenInput);
+  RUN_TEST(testErrors);
+  RUN_TEST(testResident);
+  return TEST_RESULT();
+}
@@ -0,0 +1,41 @@
+// Philox4x32-10 against the known-answer vectors shipped with Random123
+// (kat_vectors, philox4x32 with 10 rounds).
+
+#include <cstdint>
+
+#include "Check.hpp"
+#include "Philox.hpp"
+
+namespace {
+
+struct KnownAnswer {
+  uint32_t counter[4];
+  uint32_t key[2];
+  uint32_t expected[4];
+};
+
+void testKnownAnswers() {
+  const KnownAnswer answers[] = {
+      {{0x00000000, 0x00000000, 0x00000000, 0x00000000},
+       {0x00000000, 0x00000000},
+       {0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8}},
+      {{0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff},
+       {0xffffffff, 0xffffffff},
+       {0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd}},
+      {{0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344},
+       {0xa4093822, 0x299f31d0},
+       {0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1}},
+  };
+  for (const KnownAnswer &answer : answers) {
+    uint32_t out[4] = {};
+    philox::block(answer.counter, answer.key, out);
+    for (int i = 0; i < 4; ++i) CHECK_EQ(out[i], answer.expected[i]);
+  }
+}
+
+}  // namespace
+
+int main() {
+  RUN_TEST(testKnownAnswers);
+  return TEST_RESULT();
+}
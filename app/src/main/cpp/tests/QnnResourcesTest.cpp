@@ -0,0 +1,309 @@
+// qnnres::SharedBackend and qnnres::ModelResources against a fake interface
+// table that records the calls QnnModel's teardown makes, so the order the
+// SDK needs (contexts before the backend, the binary after its context) is
+// checked without a device.
+
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Check.hpp"
+#include "QnnResources.hpp"
+
+namespace {
+
+// Distinct handle types, as the SDK's are, to check they are deduced.
+struct FakeLog {};
+struct FakeBackend {};
+struct FakeDevice {};
+struct FakeContext {
+  const char *name;
+};
+
+using Error = uint64_t;
+
+struct FakeInterface {
+  Error (*logFree)(FakeLog *);
+  Error (*backendFree)(FakeBackend *);
+  Error (*deviceFree)(FakeDevice *);
+  Error (*contextCreateFromBinary)(FakeBackend *, FakeDevice *,
+                                   const void **config, const void *buffer,
+                                   uint64_t size, FakeContext **context,
+                                   void *profile);
+  Error (*contextFree)(FakeContext *, void *profile);
+};
+
+using Shared = qnnres::SharedBackend<FakeInterface>;
+using Resources = qnnres::ModelResources<FakeInterface>;
+
+FakeLog g_log;
+FakeBackend g_backend;
+FakeDevice g_device;
+FakeContext g_context_a{"a"}, g_context_b{"b"};
+
+std::vector<std::string> g_calls;
+Error g_context_free_result = 0;
+
+// What contextCreateFromBinary was given, and what contextFree found.
+const void *g_created_from = nullptr;
+uint64_t g_created_size = 0;
+const Resources *g_model = nullptr;  // whose context is being freed
+bool g_binary_alive_at_free = false;
+
+const FakeInterface kFake = {
+    [](FakeLog *log) -> Error {
+      CHECK(log == &g_log);
+      g_calls.push_back("logFree");
+      return 0;
+    },
+    [](FakeBackend *backend) -> Error {
+      CHECK(backend == &g_backend);
+      g_calls.push_back("backendFree");
+      return 0;
+    },
+    [](FakeDevice *device) -> Error {
+      CHECK(device == &g_device);
+      g_calls.push_back("deviceFree");
+      return 0;
+    },
+    [](FakeBackend *backend, FakeDevice *device, const void **,
+       const void *buffer, uint64_t size, FakeContext **context,
+       void *) -> Error {
+      CHECK(backend == &g_backend);
+      CHECK(device == &g_device);
+      g_created_from = buffer;
+      g_created_size = size;
+      *context = &g_context_a;
+      g_calls.push_back("contextCreateFromBinary");
+      return 0;
+    },
+    [](FakeContext *context, void *) -> Error {
+      g_calls.push_back(std::string("contextFree ") + context->name);
+      if (g_model && g_model->binary()) {
+        const MappedFile *binary = g_model->binary();
+        g_binary_alive_at_free =
+            binary->data() == g_created_from &&
+            std::memcmp(binary->data(), "QNNCTX", 6) == 0;
+      }
+      return g_context_free_result;
+    },
+};
+
+int g_creates = 0;
+
+std::shared_ptr<Shared> createShared() {
+  ++g_creates;
+  return std::make_shared<Shared>(kFake, &g_log, &g_backend, &g_device);
+}
+
+void reset() {
+  g_calls.clear();
+  g_creates = 0;
+  g_context_free_result = 0;
+  g_created_from = nullptr;
+  g_created_size = 0;
+  g_model = nullptr;
+  g_binary_alive_at_free = false;
+}
+
+void testShareAndLastRelease() {
+  reset();
+  Resources a, b;
+  CHECK(a.attach(createShared));
+  CHECK(b.attach([] {
+    CHECK(!"a live backend is shared, not created again");
+    return std::shared_ptr<Shared>();
+  }));
+  CHECK_EQ(g_creates, 1);
+  CHECK(a.shared() == b.shared());
+  CHECK(b.shared()->backend() == &g_backend);
+  CHECK(b.shared()->device() == &g_device);
+
+  FakeContext *context_a = &g_context_a, *context_b = &g_context_b;
+  CHECK(a.release(kFake, context_a, nullptr));
+  CHECK(context_a == nullptr);
+  CHECK(a.shared() == nullptr);
+  CHECK(g_calls == std::vector<std::string>{"contextFree a"});
+
+  // The last model frees its context before the device, backend and log.
+  CHECK(b.release(kFake, context_b, nullptr));
+  CHECK((g_calls == std::vector<std::string>{"contextFree a", "contextFree b",
+                                             "deviceFree", "backendFree",
+                                             "logFree"}));
+
+  // Once everything is released, the next model creates a new backend.
+  Resources c;
+  CHECK(c.attach(createShared));
+  CHECK_EQ(g_creates, 2);
+  FakeContext *none = nullptr;
+  CHECK(c.release(kFake, none, nullptr));
+  CHECK_EQ(g_calls.back(), "logFree");
+}
+
+void testCreateFailure() {
+  reset();
+  Resources failed;
+  CHECK(!failed.attach([] { return std::shared_ptr<Shared>(); }));
+  CHECK(failed.shared() == nullptr);
+
+  // Nothing was registered, so the next model tries again.
+  Resources retried;
+  CHECK(retried.attach(createShared));
+  CHECK_EQ(g_creates, 1);
+  FakeContext *none = nullptr;
+  CHECK(retried.release(kFake, none, nullptr));
+  CHECK((g_calls ==
+         std::vector<std::string>{"deviceFree", "backendFree", "logFree"}));
+}
+
+void testFailedContextFree() {
+  reset();
+  Resources model;
+  CHECK(model.attach(createShared));
+  g_context_free_result = 1;
+  FakeContext *context = &g_context_a;
+  CHECK(!model.release(kFake, context, nullptr));
+  // The backend is released all the same.
+  CHECK(context == nullptr);
+  CHECK((g_calls == std::vector<std::string>{"contextFree a", "deviceFree",
+                                             "backendFree", "logFree"}));
+}
+
+void testDestructorReleases() {
+  reset();
+  {
+    Resources model;
+    CHECK(model.attach(createShared));
+  }
+  CHECK((g_calls ==
+         std::vector<std::string>{"deviceFree", "backendFree", "logFree"}));
+}
+
+void testEnableOnce() {
+  reset();
+  Resources a, b;
+  CHECK(a.attach(createShared));
+  CHECK(b.attach(createShared));
+  int enables = 0;
+  CHECK(!a.shared()->enableOnce([&] { return ++enables > 1; }));
+  CHECK(b.shared()->enableOnce([&] { return ++enables > 1; }));
+  CHECK(a.shared()->enableOnce([&] { return ++enables > 1; }));
+  CHECK_EQ(enables, 2);
+}
+
+void testConcurrentAttach() {
+  reset();
+  std::atomic<int> creates{0};
+  std::vector<std::unique_ptr<Resources>> models;
+  for (int i = 0; i < 8; ++i) models.push_back(std::make_unique<Resources>());
+  std::vector<std::thread> threads;
+  for (auto &model : models) {
+    threads.emplace_back([&creates, &model] {
+      CHECK(model->attach([&creates] {
+        ++creates;
+        return std::make_shared<Shared>(kFake, &g_log, &g_backend, &g_device);
+      }));
+    });
+  }
+  for (std::thread &thread : threads) thread.join();
+  CHECK_EQ(creates.load(), 1);
+  for (auto &model : models) CHECK(model->shared() == models[0]->shared());
+  models.clear();
+  CHECK_EQ(g_calls.size(), 3u);
+}
+
+// A context created from a mapped binary is given the mapping itself, and
+// the mapping outlives the context.
+void testMappedBinaryOutlivesContext() {
+  reset();
+  char path[] = "/tmp/qnn_resources_test_XXXXXX";
+  const int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  close(fd);
+  std::ofstream(path, std::ios::binary) << "QNNCTX context binary";
+
+  Resources model;
+  CHECK(model.attach(createShared));
+  const MappedFile &binary = model.map(path);
+  CHECK(model.binary() == &binary);
+  FakeContext *context = nullptr;
+  CHECK_EQ(model.createContext(kFake, (const void **)nullptr, binary.data(),
+                               binary.size(), &context, (void *)nullptr),
+           0u);
+  CHECK(context == &g_context_a);
+  CHECK(g_created_from == binary.data());
+  CHECK_EQ(g_created_size, binary.size());
+
+  g_model = &model;
+  CHECK(model.release(kFake, context, nullptr));
+  CHECK(g_binary_alive_at_free);
+  CHECK(model.binary() == nullptr);
+  CHECK_EQ(g_calls.back(), "logFree");
+
+  // unmap() drops a binary no context came from.
+  Resources unused;
+  CHECK(unused.attach(createShared));
+  unused.map(path);
+  unused.unmap();
+  CHECK(unused.binary() == nullptr);
+
+  // A binary that cannot be mapped throws, leaving nothing mapped.
+  bool threw = false;
+  try {
+    unused.map(std::string(path) + ".missing");
+  } catch (const std::runtime_error &) {
+    threw = true;
+  }
+  CHECK(threw);
+  CHECK(unused.binary() == nullptr);
+  unlink(path);
+}
+
+// A caller's buffer handed to hold(), like the patched UNet, is kept after
+// the caller lets go and freed only once the context is.
+void testHeldBufferOutlivesContext() {
+  reset();
+  Resources model;
+  CHECK(model.attach(createShared));
+  {
+    std::shared_ptr<const char> buffer(new char[16](), [](const char *data) {
+      g_calls.push_back("buffer freed");
+      delete[] data;
+    });
+    FakeContext *context = nullptr;
+    CHECK_EQ(model.createContext(kFake, (const void **)nullptr, buffer.get(),
+                                 16, &context, (void *)nullptr),
+             0u);
+    model.hold(buffer);
+  }
+  CHECK(model.holding());
+  FakeContext *context = &g_context_a;
+  CHECK(model.release(kFake, context, nullptr));
+  CHECK(!model.holding());
+  CHECK((g_calls == std::vector<std::string>{"contextCreateFromBinary",
+                                             "contextFree a", "buffer freed",
+                                             "deviceFree", "backendFree",
+                                             "logFree"}));
+}
+
+}  // namespace
+
+int main() {
+  RUN_TEST(testShareAndLastRelease);
+  RUN_TEST(testCreateFailure);
+  RUN_TEST(testFailedContextFree);
+  RUN_TEST(testDestructorReleases);
+  RUN_TEST(testEnableOnce);
+  RUN_TEST(testConcurrentAttach);
+  RUN_TEST(testMappedBinaryOutlivesContext);
+  RUN_TEST(testHeldBufferOutlivesContext);
+  return TEST_RESULT();
+}
@@ -0,0 +1,228 @@
+// ResidencyManager with models whose load and release callbacks only count
+// calls (and sleep, to give loads a cost): GreedyDual-Size eviction order,
+// the 0 and unlimited budgets, a failed load, and acquires racing a load.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "Check.hpp"
+#include "Residency.hpp"
+
+namespace {
+
+constexpr int64_t kMB = 1 << 20;
+
+// A registered model and what its callbacks saw.
+struct Model {
+  int id = -1;
+  int loads = 0;
+  int releases = 0;
+};
+
+// Registers model with a load that takes about load_ms.
+void add(ResidencyManager &residency, Model &model, const char *name,
+         int64_t bytes, int load_ms = 0) {
+  model.id = residency.add(
+      name, bytes,
+      [&model, load_ms] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(load_ms));
+        ++model.loads;
+      },
+      [&model] { ++model.releases; });
+}
+
+void use(ResidencyManager &residency, const Model &model) {
+  residency.acquire(model.id);
+  residency.release(model.id);
+}
+
+// The released model with the least load time per byte goes first; models
+// in use are never evicted, even over budget.
+void testEvictionOrder() {
+  ResidencyManager residency(3 * kMB);
+  Model big, small, next, extra;
+  add(residency, big, "big", 2 * kMB, 20);      // 10 ms per MB
+  add(residency, small, "small", 1 * kMB, 20);  // 20 ms per MB
+  add(residency, next, "next", 1 * kMB);
+  add(residency, extra, "extra", 2 * kMB);
+  use(residency, big);
+  use(residency, small);
+  CHECK_EQ(residency.residentBytes(), 3 * kMB);
+
+  residency.acquire(next.id);
+  CHECK(!residency.resident(big.id));
+  CHECK_EQ(big.releases, 1);
+  CHECK(residency.resident(small.id));
+  CHECK_EQ(residency.residentBytes(), 2 * kMB);
+
+  // small and next are both in use: extra loads over budget.
+  residency.acquire(small.id);
+  residency.acquire(extra.id);
+  CHECK(residency.resident(small.id));
+  CHECK(residency.resident(next.id));
+  CHECK(residency.resident(extra.id));
+  CHECK_EQ(residency.residentBytes(), 4 * kMB);
+  CHECK_EQ(small.loads, 1);
+
+  // Releasing trims back to the budget.
+  residency.release(extra.id);
+  residency.release(next.id);
+  residency.release(small.id);
+  CHECK(residency.residentBytes() <= 3 * kMB);
+
+  // An evicted model loads again on its next use.
+  use(residency, big);
+  CHECK_EQ(big.loads, 2);
+}
+
+// Budget 0 releases each model after its stage; a negative budget keeps
+// every model until it is evicted explicitly.
+void testBudgets() {
+  ResidencyManager lowram(0);
+  CHECK(lowram.limited());
+  Model a;
+  add(lowram, a, "a", 1 * kMB);
+  lowram.acquire(a.id);
+  CHECK(lowram.resident(a.id));
+  lowram.release(a.id);
+  CHECK(!lowram.resident(a.id));
+  CHECK_EQ(lowram.residentBytes(), 0);
+  use(lowram, a);
+  CHECK_EQ(a.loads, 2);
+  CHECK_EQ(a.releases, 2);
+
+  ResidencyManager unlimited(-1);
+  CHECK(!unlimited.limited());
+  Model b, c;
+  add(unlimited, b, "b", 1000 * kMB);
+  add(unlimited, c, "c", 1000 * kMB);
+  use(unlimited, b);
+  use(unlimited, c);
+  use(unlimited, b);
+  CHECK(unlimited.resident(b.id));
+  CHECK(unlimited.resident(c.id));
+  CHECK_EQ(b.loads, 1);
+  CHECK_EQ(unlimited.residentBytes(), 2000 * kMB);
+
+  // evict() drops a released model only.
+  unlimited.acquire(b.id);
+  unlimited.evict(b.id);
+  unlimited.evict(c.id);
+  CHECK(unlimited.resident(b.id));
+  CHECK(!unlimited.resident(c.id));
+  unlimited.release(b.id);
+
+  // A budget set later trims released models to it.
+  unlimited.setBudget(0);
+  CHECK(!unlimited.resident(b.id));
+  CHECK_EQ(unlimited.residentBytes(), 0);
+
+  bool threw = false;
+  try {
+    unlimited.acquire(7);
+  } catch (const std::out_of_range &) {
+    threw = true;
+  }
+  CHECK(threw);
+}
+
+// A load that throws leaves the model unloaded and uncounted; the next
+// acquire tries again.
+void testFailedLoad() {
+  ResidencyManager residency(10 * kMB);
+  int attempts = 0;
+  const int id = residency.add(
+      "flaky", 4 * kMB,
+      [&attempts] {
+        if (++attempts == 1) throw std::runtime_error("out of memory");
+      },
+      [] {});
+  bool threw = false;
+  try {
+    residency.acquire(id);
+  } catch (const std::runtime_error &) {
+    threw = true;
+  }
+  CHECK(threw);
+  CHECK(!residency.resident(id));
+  CHECK_EQ(residency.residentBytes(), 0);
+
+  residency.acquire(id);
+  CHECK_EQ(attempts, 2);
+  CHECK(residency.resident(id));
+  residency.release(id);
+}
+
+// A second acquire of a model being loaded waits for that load instead of
+// starting another, while other models can be acquired meanwhile.
+void testConcurrentAcquire() {
+  ResidencyManager residency(10 * kMB);
+  std::mutex mutex;
+  std::condition_variable changed;
+  bool loading = false, finish = false;
+  std::atomic<int> loads{0};
+  const int slow = residency.add(
+      "slow", 4 * kMB,
+      [&] {
+        ++loads;
+        std::unique_lock<std::mutex> lock(mutex);
+        loading = true;
+        changed.notify_all();
+        changed.wait(lock, [&] { return finish; });
+      },
+      [] {});
+  Model other;
+  add(residency, other, "other", 1 * kMB);
+
+  std::atomic<bool> second_done{false};
+  std::thread first([&] { residency.acquire(slow); });
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&] { return loading; });
+  }
+  std::thread second([&] {
+    residency.acquire(slow);
+    second_done = true;
+  });
+
+  // The load runs outside the manager's lock and counts against the budget.
+  use(residency, other);
+  CHECK(residency.resident(other.id));
+  CHECK(!residency.resident(slow));
+  CHECK_EQ(residency.residentBytes(), 5 * kMB);
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  CHECK(!second_done);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    finish = true;
+  }
+  changed.notify_all();
+  first.join();
+  second.join();
+  CHECK_EQ(loads.load(), 1);
+  CHECK(residency.resident(slow));
+
+  // Both acquires pinned it.
+  residency.release(slow);
+  residency.evict(slow);
+  CHECK(residency.resident(slow));
+  residency.release(slow);
+  residency.evict(slow);
+  CHECK(!residency.resident(slow));
+}
+
+}  // namespace
+
+int main() {
+  RUN_TEST(testEvictionOrder);
+  RUN_TEST(testBudgets);
+  RUN_TEST(testFailedLoad);
+  RUN_TEST(testConcurrentAcquire);
+  return TEST_RESULT();
+}